@@ -45,11 +45,13 @@ namespace DCB
 {
     static rptr<ARM::word_t> const DHCSR(0xE000EDF0);
     static ARM::word_t const DHCSR_update_mask = 0xFFFF;
-    static ARM::word_t const DHCSR_DBGKEY    = 0xA05F << 16;
-    static ARM::word_t const DHCSR_S_REGRDY  =      1 << 16;
-    static ARM::word_t const DHCSR_S_HALT    =      1 << 17;
-    static ARM::word_t const DHCSR_C_HALT    =      1 <<  1;
-    static ARM::word_t const DHCSR_C_DEBUGEN =      1 <<  0;
+    static ARM::word_t const DHCSR_DBGKEY     = 0xA05F << 16;
+    static ARM::word_t const DHCSR_S_REGRDY   =      1 << 16;
+    static ARM::word_t const DHCSR_S_HALT     =      1 << 17;
+    static ARM::word_t const DHCSR_C_MASKINTS =      1 <<  3;
+    static ARM::word_t const DHCSR_C_STEP     =      1 <<  2;
+    static ARM::word_t const DHCSR_C_HALT     =      1 <<  1;
+    static ARM::word_t const DHCSR_C_DEBUGEN  =      1 <<  0;
 
     static rptr<ARM::word_t> const DCRSR(0xE000EDF4);
     static ARM::word_t const DCRSR_READ  = 0 << 16;
@@ -105,6 +107,79 @@ namespace DWT
     static ARM::word_t      const DWT_CTRL_NOEXTTRIG = 1 << 26;
     static ARM::word_t      const DWT_CTRL_NOCYCCNT  = 1 << 25;
     static ARM::word_t      const DWT_CTRL_NOPRFCNT  = 1 << 24;
+
+    /*
+     * The Program Counter Sample Register holds the address of a recently
+     * executed instruction, and can be read without disturbing the processor.
+     * It reads as all ones while the processor is halted.  It's optional on
+     * ARMv6-M, where it may read as zero.
+     */
+    static rptr<ARM::word_t> const DWT_PCSR(0xE000101C);
+    static ARM::word_t const DWT_PCSR_no_sample = 0xFFFFFFFF;
+
+    /*
+     * Each comparator has a COMP, MASK, and FUNCTION register, with the sets
+     * laid out every 16 bytes from these.
+     */
+    static rptr<ARM::word_t> const DWT_COMP0    (0xE0001020);
+    static rptr<ARM::word_t> const DWT_MASK0    (0xE0001024);
+    static rptr<ARM::word_t> const DWT_FUNCTION0(0xE0001028);
+    static unsigned const DWT_comparator_stride_words = 4;
+
+    static ARM::word_t const DWT_FUNCTION_MATCHED = 1 << 24;
+
+    static ARM::word_t const DWT_FUNCTION_DISABLED    = 0;
+    static ARM::word_t const DWT_FUNCTION_WATCH_READ  = 5;
+    static ARM::word_t const DWT_FUNCTION_WATCH_WRITE = 6;
+    static ARM::word_t const DWT_FUNCTION_WATCH_RW    = 7;
+}
+
+/*******************************************************************************
+ * The Instrumentation Trace Macrocell (ARMv7-M only).  Like the DWT, it only
+ * answers with DEMCR.DWTENA (TRCENA in ARMv7-M) set.
+ */
+namespace ITM
+{
+    // Stimulus ports, one word each; firmware writes to them to trace.
+    static rptr<ARM::word_t> const ITM_STIM0(0xE0000000);
+    static unsigned const ITM_port_count = 32;
+
+    static rptr<ARM::word_t> const ITM_TER(0xE0000E00);
+    static rptr<ARM::word_t> const ITM_TPR(0xE0000E40);
+
+    static rptr<ARM::word_t> const ITM_TCR(0xE0000E80);
+    static ARM::word_t const ITM_TCR_BUSY      = 1 << 23;
+    static ARM::word_t const ITM_TCR_BUSID_1   = 1 << 16;
+    static ARM::word_t const ITM_TCR_SWOENA    = 1 <<  4;
+    static ARM::word_t const ITM_TCR_TXENA     = 1 <<  3;
+    static ARM::word_t const ITM_TCR_SYNCENA   = 1 <<  2;
+    static ARM::word_t const ITM_TCR_TSENA     = 1 <<  1;
+    static ARM::word_t const ITM_TCR_ITMENA    = 1 <<  0;
+
+    // The other registers ignore writes until this is unlocked.
+    static rptr<ARM::word_t> const ITM_LAR(0xE0000FB0);
+    static ARM::word_t const ITM_LAR_KEY = 0xC5ACCE55;
+}
+
+/*******************************************************************************
+ * The Trace Port Interface Unit (ARMv7-M only), in its SWO-only form.
+ */
+namespace TPIU
+{
+    static rptr<ARM::word_t> const TPIU_CSPSR(0xE0040004);
+
+    // SWO runs at the reference clock divided by ACPR + 1.
+    static rptr<ARM::word_t> const TPIU_ACPR(0xE0040010);
+    static ARM::word_t const TPIU_ACPR_max = 0xFFFF;
+
+    static rptr<ARM::word_t> const TPIU_SPPR(0xE00400F0);
+    static ARM::word_t const TPIU_SPPR_MANCHESTER = 1;
+    static ARM::word_t const TPIU_SPPR_NRZ        = 2;
+
+    // Clearing EnFCont bypasses the formatter, leaving bare ITM packets.
+    static rptr<ARM::word_t> const TPIU_FFCR(0xE0040304);
+    static ARM::word_t const TPIU_FFCR_TRIGIN  = 1 << 8;
+    static ARM::word_t const TPIU_FFCR_ENFCONT = 1 << 1;
 }
 
 
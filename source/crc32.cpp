@@ -0,0 +1,179 @@
+#include "crc32.h"
+
+#include "target.h"
+#include "poll.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+using Err::Error;
+using namespace Log;
+using namespace ARM;
+
+
+/*******************************************************************************
+ * Host implementation
+ */
+
+// The reflected form of the CRC-32 polynomial.
+static uint32_t const polynomial = 0xEDB88320;
+
+uint32_t CRC32::update(uint32_t crc, void const * data, size_t length)
+{
+    static uint32_t table[256];
+    static bool table_ready = false;
+
+    if (!table_ready)
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t entry = i;
+            for (unsigned bit = 0; bit < 8; ++bit)
+            {
+                entry = (entry >> 1) ^ ((entry & 1) ? polynomial : 0);
+            }
+            table[i] = entry;
+        }
+        table_ready = true;
+    }
+
+    uint8_t const * bytes = static_cast<uint8_t const *>(data);
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i)
+    {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+
+/*******************************************************************************
+ * Target implementation
+ */
+
+/*
+ * Hand-assembled Thumb-1, bitwise rather than table-driven so that it needs no
+ * RAM beyond its own 32 bytes.  It is entered with:
+ *   r0 - address of the first byte
+ *   r1 - number of bytes (nonzero)
+ *   r2 - CRC so far, inverted
+ * and halts with the updated (still inverted) CRC in r2.
+ */
+static thumb_code_t const stub_code[] =
+{
+    0x4B06,  //        ldr  r3, poly
+    0x7804,  // byte:  ldrb r4, [r0]
+    0x3001,  //        adds r0, #1
+    0x4062,  //        eors r2, r4
+    0x2508,  //        movs r5, #8
+    0x0852,  // bit:   lsrs r2, r2, #1
+    0xD300,  //        bcc  skip
+    0x405A,  //        eors r2, r3
+    0x3D01,  // skip:  subs r5, #1
+    0xD1FA,  //        bne  bit
+    0x3901,  //        subs r1, #1
+    0xD1F4,  //        bne  byte
+    0xBE00,  //        bkpt #0
+    0x46C0,  //        nop              ; align literal
+
+    0x8320,  // poly:  .word 0xEDB88320
+    0xEDB8,
+};
+
+static size_t const stub_halfwords = sizeof(stub_code) / sizeof(stub_code[0]);
+static size_t const stub_words     = stub_halfwords / 2;
+static size_t const stub_bkpt_index = 12;
+
+size_t const CRC32::work_area_bytes = sizeof(stub_code);
+
+/*
+ * The stub takes around 50 cycles a byte.  Allow for the core running as
+ * slowly as 1MHz.
+ */
+static int timeout_ms_for(size_t length)
+{
+    return 100 + length / 16;
+}
+
+Error CRC32::compute_on_target(Target & target,
+                               rptr<word_t> work_area,
+                               rptr_const<byte_t> address,
+                               size_t length,
+                               uint32_t * crc)
+{
+    debug(2, "CRC32::compute_on_target(%08X, %zu) using %08X",
+          address.bits(),
+          length,
+          work_area.bits());
+
+    if (length == 0)
+    {
+        *crc = 0;
+        return Err::success;
+    }
+
+    word_t code_words[stub_words];
+    for (size_t i = 0; i < stub_words; ++i)
+    {
+        code_words[i] = stub_code[2 * i] | (stub_code[2 * i + 1] << 16);
+    }
+
+    Check(target.write_words(code_words, work_area, stub_words));
+
+    word_t registers[Target::register_count];
+    registers[Register::R0] = address.bits();
+    registers[Register::R1] = length;
+    registers[Register::R2] = 0xFFFFFFFF;
+    registers[Register::PC] = work_area.bits();
+
+    Check(target.write_registers((1 << Register::R0)
+                               | (1 << Register::R1)
+                               | (1 << Register::R2)
+                               | (1 << Register::PC),
+                                 registers));
+
+    Check(target.reset_halt_state());
+    Check(target.resume());
+
+    int const timeout_ms = timeout_ms_for(length);
+
+    timeval start;
+    gettimeofday(&start, 0);
+
+    PollScheduler poll;
+    poll.set_timeout_ms(timeout_ms);
+
+    bool halted = false;
+    do
+    {
+        Check(target.is_halted(&halted));
+    }
+    while (!halted && poll.wait());
+
+    if (!halted)
+    {
+        warning("CRC stub did not finish within %dms.", timeout_ms);
+        Check(target.halt());
+        return Err::timeout;
+    }
+
+    Check(target.read_registers((1 << Register::PC) | (1 << Register::R2),
+                                registers));
+    word_t const pc = registers[Register::PC];
+
+    rptr<thumb_code_t> const bkpt(rptr<thumb_code_t>(work_area)
+                                  + stub_bkpt_index);
+    if (pc != bkpt.bits())
+    {
+        warning("CRC stub stopped at %08X, not %08X.", pc, bkpt.bits());
+        return Err::failure;
+    }
+
+    *crc = ~registers[Register::R2];
+
+    debug(2, "CRC32 is %08X after %dms", *crc, milliseconds_since(start));
+
+    return Err::success;
+}
@@ -0,0 +1,49 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+/*
+ * The common CRC-32 (as used by zlib and Ethernet), computed either on the host
+ * or by a small stub running on the target itself -- which lets us check large
+ * regions of target memory without reading them back over SWD.
+ */
+
+#include "arm.h"
+#include "rptr.h"
+
+#include "libs/error/error_stack.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Target;
+
+
+namespace CRC32
+{
+    /*
+     * Extends crc, the CRC of some earlier data (or zero to start), with the
+     * given bytes.  update(0, data, length) is the CRC of data.
+     */
+    uint32_t update(uint32_t crc, void const * data, size_t length);
+
+    /*
+     * Amount of target RAM used by compute_on_target.
+     */
+    extern size_t const work_area_bytes;
+
+    /*
+     * Computes the CRC of length bytes of target memory starting at address,
+     * by downloading a stub into work_area and running it.  The result matches
+     * update(0, ...) over the same bytes.
+     *
+     * The processor must be halted, and is left halted.  Its registers are not
+     * preserved.
+     */
+    Err::Error compute_on_target(Target &,
+                                 rptr<ARM::word_t> work_area,
+                                 rptr_const<ARM::byte_t> address,
+                                 size_t length,
+                                 uint32_t * crc);
+}
+
+#endif  // CRC32_H
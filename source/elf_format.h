@@ -0,0 +1,70 @@
+#ifndef ELF_FORMAT_H
+#define ELF_FORMAT_H
+
+/*
+ * Just enough of the ELF format to find the loadable segments and the symbols
+ * of a 32-bit, little-endian executable.  Fields are read by hand, since not
+ * every host has an <elf.h>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+inline uint32_t read_le16(uint8_t const * bytes)
+{
+    return bytes[0] | (bytes[1] << 8);
+}
+
+inline uint32_t read_le32(uint8_t const * bytes)
+{
+    return bytes[0]
+        | (bytes[1] << 8)
+        | (bytes[2] << 16)
+        | (uint32_t(bytes[3]) << 24);
+}
+
+namespace ELF
+{
+    static uint8_t const magic[] = { 0x7F, 'E', 'L', 'F' };
+
+    static size_t const ident_class   = 4;
+    static size_t const ident_data    = 5;
+    static uint8_t const class_32     = 1;
+    static uint8_t const data_lsb     = 1;
+
+    static size_t const header_bytes  = 52;
+    static size_t const e_machine     = 18;
+    static size_t const e_phoff       = 28;
+    static size_t const e_shoff       = 32;
+    static size_t const e_phentsize   = 42;
+    static size_t const e_phnum       = 44;
+    static size_t const e_shentsize   = 46;
+    static size_t const e_shnum       = 48;
+    static uint32_t const machine_arm = 40;
+
+    static size_t const phdr_bytes    = 32;
+    static size_t const p_type        = 0;
+    static size_t const p_offset      = 4;
+    static size_t const p_paddr       = 12;
+    static size_t const p_filesz      = 16;
+    static uint32_t const type_load   = 1;
+
+    static size_t const shdr_bytes    = 40;
+    static size_t const sh_type       = 4;
+    static size_t const sh_offset     = 16;
+    static size_t const sh_size       = 20;
+    static size_t const sh_link       = 24;
+    static size_t const sh_entsize    = 36;
+    static uint32_t const type_symtab = 2;
+
+    static size_t const sym_bytes     = 16;
+    static size_t const st_name       = 0;
+    static size_t const st_value      = 4;
+    static size_t const st_size       = 8;
+    static size_t const st_info       = 12;
+    static uint8_t const stt_mask     = 0xF;
+    static uint8_t const stt_func     = 2;
+}
+
+#endif  // ELF_FORMAT_H
@@ -0,0 +1,429 @@
+#include "flash_loader.h"
+
+#include "target.h"
+#include "poll.h"
+#include "armv6m_v7m.h"
+#include "lpc11xx_13xx.h"
+#include "iap.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+#include <algorithm>
+
+#define __STDC_FORMAT_MACROS
+
+#include <sys/time.h>
+#include <inttypes.h>
+
+using Err::Error;
+using namespace Log;
+using namespace ARM;
+using namespace ARMv6M_v7M;
+using namespace LPC11xx_13xx;
+
+
+/*******************************************************************************
+ * The stub
+ */
+
+/*
+ * The stub is hand-assembled Thumb-1, so it runs on both the Cortex-M0 and
+ * Cortex-M3.  It is entered with:
+ *   r4 - header of the slot to program next
+ *   r5 - header of the other slot
+ *   r6 - IAP command table (reused for the response)
+ *   r7 - core clock in kHz
+ *   sp - top of a stack large enough for IAP
+ *
+ * It waits for its current slot to be marked full, unprotects the slot's
+ * sector, copies the slot's buffer into Flash, marks the slot empty, and
+ * moves on to the other slot.  If IAP fails, it marks the slot as failed
+ * (leaving the IAP status in the command table) and halts.  Marking a slot
+ * for exit halts it cleanly.
+ *
+ * The word at the end is the IAP entry point, filled in by start.
+ */
+static thumb_code_t const stub_code[] =
+{
+    0x68A0,  // loop:    ldr  r0, [r4, #8]     ; slot state
+    0x2801,  //          cmp  r0, #1           ; full?
+    0xD002,  //          beq  program
+    0x2803,  //          cmp  r0, #3           ; exit?
+    0xD1FA,  //          bne  loop
+    0xBE00,  //          bkpt #0
+
+    0x2032,  // program: movs r0, #50          ; unprotect_sectors
+    0x6030,  //          str  r0, [r6, #0]
+    0x6820,  //          ldr  r0, [r4, #0]     ; sector
+    0x6070,  //          str  r0, [r6, #4]
+    0x60B0,  //          str  r0, [r6, #8]
+    0x4630,  //          mov  r0, r6
+    0x4631,  //          mov  r1, r6
+    0x4A0F,  //          ldr  r2, iap_entry
+    0x4790,  //          blx  r2
+    0x6830,  //          ldr  r0, [r6, #0]     ; IAP status
+    0x2800,  //          cmp  r0, #0
+    0xD115,  //          bne  fail
+
+    0x2033,  //          movs r0, #51          ; copy_ram_to_flash
+    0x6030,  //          str  r0, [r6, #0]
+    0x6860,  //          ldr  r0, [r4, #4]     ; destination
+    0x6070,  //          str  r0, [r6, #4]
+    0x6920,  //          ldr  r0, [r4, #16]    ; source
+    0x60B0,  //          str  r0, [r6, #8]
+    0x68E0,  //          ldr  r0, [r4, #12]    ; size
+    0x60F0,  //          str  r0, [r6, #12]
+    0x6137,  //          str  r7, [r6, #16]    ; clock
+    0x4630,  //          mov  r0, r6
+    0x4631,  //          mov  r1, r6
+    0x4A07,  //          ldr  r2, iap_entry
+    0x4790,  //          blx  r2
+    0x6830,  //          ldr  r0, [r6, #0]     ; IAP status
+    0x2800,  //          cmp  r0, #0
+    0xD105,  //          bne  fail
+
+    0x2000,  //          movs r0, #0           ; empty
+    0x60A0,  //          str  r0, [r4, #8]
+    0x4620,  //          mov  r0, r4           ; swap slots
+    0x462C,  //          mov  r4, r5
+    0x4605,  //          mov  r5, r0
+    0xE7D7,  //          b    loop
+
+    0x2002,  // fail:    movs r0, #2           ; failed
+    0x60A0,  //          str  r0, [r4, #8]
+    0xBE01,  //          bkpt #1
+    0x46C0,  //          nop                   ; align literal
+
+    0x0000,  // iap_entry: .word 0
+    0x0000,
+};
+
+static size_t const stub_halfwords = sizeof(stub_code) / sizeof(stub_code[0]);
+static size_t const stub_words     = stub_halfwords / 2;
+
+
+/*******************************************************************************
+ * RAM layout
+ */
+
+/*
+ * Each slot is a block buffer followed by a header.  The header's state word
+ * follows the fields the host changes for each block, so the host can write
+ * the block, its header, and finally its state in a single write_words call.
+ */
+namespace Header
+{
+    static size_t const sector = 0;
+    static size_t const dest   = 1;
+    static size_t const state  = 2;
+    static size_t const size   = 3;  // Written once, by start.
+    static size_t const src    = 4;  // Written once, by start.
+
+    static size_t const words_changed_per_block = state + 1;
+    static size_t const words = src + 1;
+}
+
+namespace SlotState
+{
+    static word_t const empty  = 0;
+    static word_t const full   = 1;
+    static word_t const failed = 2;
+    static word_t const exit   = 3;
+}
+
+/*
+ * The stub, its command table and its stack follow the two slots.  Offsets
+ * are in words from ram_base.
+ */
+static size_t slot_words(size_t block_words)
+{
+    return block_words + 8;
+}
+
+static size_t code_offset(size_t block_words)
+{
+    return 2 * slot_words(block_words);
+}
+
+static size_t table_offset(size_t block_words)
+{
+    return code_offset(block_words) + stub_words;
+}
+
+static size_t stack_top_offset(size_t block_words)
+{
+    size_t const stack_offset = table_offset(block_words)
+                              + IAP::max_command_response_words
+                              + IAP::min_stack_words;
+
+    // Keep the stack pointer doubleword-aligned, as the procedure call
+    // standard expects of IAP's callers.
+    return (stack_offset + 1) & ~size_t(1);
+}
+
+
+/*******************************************************************************
+ * FlashLoader implementation
+ */
+
+size_t FlashLoader::ram_bytes(size_t bytes_per_block)
+{
+    return stack_top_offset(bytes_per_block / sizeof(word_t)) * sizeof(word_t);
+}
+
+size_t FlashLoader::largest_block(size_t ram_bytes, size_t max_bytes)
+{
+    size_t bytes = largest_copy_size(max_bytes);
+
+    while (bytes && FlashLoader::ram_bytes(bytes) > ram_bytes)
+    {
+        bytes = largest_copy_size(bytes - 1);
+    }
+
+    return bytes;
+}
+
+FlashLoader::FlashLoader(Target & target,
+                         rptr<word_t> ram_base,
+                         size_t bytes_per_block) :
+    _target(target),
+    _ram_base(ram_base),
+    _block_words(bytes_per_block / sizeof(word_t)),
+    _next_slot(0),
+    _staging(_block_words + Header::words_changed_per_block) {}
+
+size_t FlashLoader::bytes_per_block() const
+{
+    return _block_words * sizeof(word_t);
+}
+
+size_t FlashLoader::words_per_block() const
+{
+    return _block_words;
+}
+
+rptr<word_t> FlashLoader::slot_buffer(unsigned slot) const
+{
+    return _ram_base + slot * slot_words(_block_words);
+}
+
+rptr<word_t> FlashLoader::slot_header(unsigned slot) const
+{
+    return slot_buffer(slot) + _block_words;
+}
+
+rptr<word_t> FlashLoader::command_table() const
+{
+    return _ram_base + table_offset(_block_words);
+}
+
+rptr<word_t> FlashLoader::code() const
+{
+    return _ram_base + code_offset(_block_words);
+}
+
+rptr<word_t> FlashLoader::stack_top() const
+{
+    return _ram_base + stack_top_offset(_block_words);
+}
+
+/*
+ * How long we'll wait for a slot to empty before giving up.  The stub may
+ * still be working on the other slot first, so allow for two blocks.
+ */
+unsigned FlashLoader::block_timeout_ms() const
+{
+    return 2 * (IAP::timeout_ms(IAP::Command::unprotect_sectors)
+              + IAP::timeout_ms(IAP::Command::copy_ram_to_flash,
+                                (bytes_per_block() + 255) / 256));
+}
+
+Error FlashLoader::start(unsigned cclk_khz)
+{
+    debug(1, "Starting flash loader at %08X (%zu bytes, %zu-byte blocks), "
+             "cclk=%u kHz",
+          _ram_base.bits(),
+          ram_bytes(bytes_per_block()),
+          bytes_per_block(),
+          cclk_khz);
+
+    word_t code_words[stub_words];
+    for (size_t i = 0; i < stub_words; ++i)
+    {
+        code_words[i] = stub_code[2 * i] | (stub_code[2 * i + 1] << 16);
+    }
+    code_words[stub_words - 1] = IAP::entry.bits() | 1;  // Thumb bit
+
+    Check(_target.write_words(code_words, code(), stub_words));
+
+    for (unsigned slot = 0; slot < 2; ++slot)
+    {
+        word_t header[Header::words] = { 0 };
+        header[Header::state] = SlotState::empty;
+        header[Header::size]  = bytes_per_block();
+        header[Header::src]   = slot_buffer(slot).bits();
+
+        Check(_target.write_words(header, slot_header(slot), Header::words));
+    }
+
+    word_t registers[Target::register_count];
+    registers[Register::R4] = slot_header(0).bits();
+    registers[Register::R5] = slot_header(1).bits();
+    registers[Register::R6] = command_table().bits();
+    registers[Register::R7] = cclk_khz;
+    registers[Register::SP] = stack_top().bits();
+    registers[Register::PC] = code().bits();
+
+    Check(_target.write_registers((1 << Register::R4)
+                                | (1 << Register::R5)
+                                | (1 << Register::R6)
+                                | (1 << Register::R7)
+                                | (1 << Register::SP)
+                                | (1 << Register::PC),
+                                  registers));
+
+    _next_slot = 0;
+
+    Check(_target.reset_halt_state());
+    Check(_target.resume());
+
+    return Err::success;
+}
+
+Error FlashLoader::program_block(word_t const * data,
+                                 size_t word_count,
+                                 rptr<word_t> flash_addr,
+                                 unsigned sector)
+{
+    if (word_count > _block_words) return Err::argument_error;
+
+    debug(2, "Flash loader: %zu words to %08X (sector %u) via slot %u",
+          word_count,
+          flash_addr.bits(),
+          sector,
+          _next_slot);
+
+    Check(wait_for_slot(_next_slot));
+
+    std::copy(data, data + word_count, _staging.begin());
+    std::fill(_staging.begin() + word_count,
+              _staging.begin() + _block_words,
+              0xFFFFFFFF);
+
+    word_t * header = &_staging[_block_words];
+    header[Header::sector] = sector;
+    header[Header::dest]   = flash_addr.bits();
+    header[Header::state]  = SlotState::full;
+
+    Check(_target.write_words(&_staging[0],
+                              slot_buffer(_next_slot),
+                              _staging.size()));
+
+    _next_slot ^= 1;
+
+    return Err::success;
+}
+
+Error FlashLoader::finish()
+{
+    debug(1, "Waiting for flash loader to finish");
+
+    // The stub works through the slots in the order we filled them.
+    Check(wait_for_slot(_next_slot));
+    Check(wait_for_slot(_next_slot ^ 1));
+
+    // ...and is now waiting on this one.
+    Check(_target.write_word(slot_header(_next_slot) + Header::state,
+                             SlotState::exit));
+
+    PollScheduler poll;
+    poll.set_timeout_ms(block_timeout_ms());
+
+    bool halted = false;
+    do
+    {
+        Check(_target.is_halted(&halted));
+    }
+    while (!halted && poll.wait());
+
+    if (!halted)
+    {
+        warning("Flash loader did not stop when asked.");
+        Check(report_stub_state());
+        return Err::failure;
+    }
+
+    return Err::success;
+}
+
+Error FlashLoader::wait_for_slot(unsigned slot)
+{
+    rptr<word_t> const state_addr(slot_header(slot) + Header::state);
+
+    timeval start;
+    gettimeofday(&start, 0);
+
+    /*
+     * Each read is a USB round trip, which is about as often as it's useful to
+     * look -- so there's no sleep here.
+     */
+    word_t state;
+    do
+    {
+        Check(_target.read_word(state_addr, &state));
+
+        if (state == SlotState::empty) return Err::success;
+
+        if (state == SlotState::failed)
+        {
+            word_t iap_result;
+            Check(_target.read_word(command_table(), &iap_result));
+
+            rptr<word_t> const header(slot_header(slot));
+            word_t sector;
+            Check(_target.read_word(header + Header::sector, &sector));
+
+            warning("Flash loader: IAP failed with status %"PRIu32
+                    " in sector %"PRIu32".",
+                    iap_result,
+                    sector);
+            return Err::failure;
+        }
+    }
+    while (state == SlotState::full &&
+           milliseconds_since(start) < int(block_timeout_ms()));
+
+    if (state == SlotState::full)
+    {
+        warning("Flash loader did not program a block within %ums.",
+                block_timeout_ms());
+    }
+    else
+    {
+        warning("Flash loader slot %u has unexpected state %08"PRIX32".",
+                slot,
+                state);
+    }
+
+    Check(report_stub_state());
+    return Err::failure;
+}
+
+Error FlashLoader::report_stub_state()
+{
+    bool halted;
+    Check(_target.is_halted(&halted));
+
+    if (!halted) Check(_target.halt());
+
+    word_t pc;
+    Check(_target.read_register(Register::PC, &pc));
+
+    warning("Flash loader %s at %08"PRIX32" (stub at %08X).",
+            halted ? "stopped" : "forcibly halted",
+            pc,
+            code().bits());
+
+    return Err::success;
+}
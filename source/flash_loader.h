@@ -0,0 +1,110 @@
+#ifndef FLASH_LOADER_H
+#define FLASH_LOADER_H
+
+/*
+ * A small resident program that writes Flash on NXP LPC11xx/13xx parts.
+ *
+ * Driving the IAP ROM from the host costs a register setup, a resume, and a
+ * round of halt polling for every IAP command -- and programming Flash takes
+ * two commands per block.  FlashLoader instead downloads a short Thumb stub
+ * into target RAM once and leaves it running.  The stub watches two block
+ * slots in RAM and programs each one as the host fills it, so the host can
+ * transfer the next block over SWD while the target programs the current one.
+ */
+
+#include "arm.h"
+#include "rptr.h"
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Target;
+
+
+class FlashLoader
+{
+public:
+    /*
+     * Total RAM used by a loader handing IAP blocks of bytes_per_block,
+     * starting at the address passed to the constructor: two block slots, the
+     * stub itself, the IAP command table, and the IAP stack.
+     */
+    static size_t ram_bytes(size_t bytes_per_block);
+
+    /*
+     * The largest block copy_ram_to_flash accepts, no larger than max_bytes,
+     * with which the loader fits in ram_bytes of RAM -- or zero, if not even
+     * the smallest does.
+     */
+    static size_t largest_block(size_t ram_bytes, size_t max_bytes);
+
+    /*
+     * Creates a loader that will live in target RAM starting at ram_base,
+     * which must be word-aligned, and program blocks of bytes_per_block at a
+     * time (256, 512, 1024 or 4096, as IAP allows).  Does not touch the
+     * target.
+     */
+    FlashLoader(Target &, rptr<ARM::word_t> ram_base, size_t bytes_per_block);
+
+    size_t bytes_per_block() const;
+    size_t words_per_block() const;
+
+    /*
+     * Downloads the stub into RAM and starts it.  The processor must be halted
+     * with the boot ROM unmapped; cclk_khz is the core clock rate passed to
+     * IAP.
+     *
+     * The Flash sectors to be written must already be erased.  The stub
+     * unprotects each block's sector itself, as IAP requires before every
+     * copy.
+     */
+    Err::Error start(unsigned cclk_khz);
+
+    /*
+     * Hands one block to the loader for programming at flash_addr, which must
+     * be block-aligned and lie within the given sector.  Blocks shorter than
+     * words_per_block() are padded with erased (all ones) words.
+     *
+     * This only waits for a free slot; programming happens in the background.
+     * An IAP failure is reported by a later call, or by finish.
+     */
+    Err::Error program_block(ARM::word_t const * data,
+                             size_t word_count,
+                             rptr<ARM::word_t> flash_addr,
+                             unsigned sector);
+
+    /*
+     * Waits for all handed-over blocks to be programmed, then stops the stub,
+     * leaving the processor halted.
+     */
+    Err::Error finish();
+
+private:
+    Target &_target;
+    rptr<ARM::word_t> _ram_base;
+    size_t _block_words;
+
+    unsigned _next_slot;               // Slot the next block goes to.
+    std::vector<ARM::word_t> _staging; // Block image plus slot header.
+
+    rptr<ARM::word_t> slot_buffer(unsigned slot) const;
+    rptr<ARM::word_t> slot_header(unsigned slot) const;
+    rptr<ARM::word_t> command_table() const;
+    rptr<ARM::word_t> code() const;
+    rptr<ARM::word_t> stack_top() const;
+
+    // How long to wait for a slot to empty.
+    unsigned block_timeout_ms() const;
+
+    // Waits for a slot to be emptied by the stub.
+    Err::Error wait_for_slot(unsigned slot);
+
+    // Explains to the user where the stub stopped, after a failure.
+    Err::Error report_stub_state();
+};
+
+#endif  // FLASH_LOADER_H
@@ -0,0 +1,263 @@
+#include "iap.h"
+#include "target.h"
+#include "poll.h"
+#include "lpc11xx_13xx.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+#define __STDC_FORMAT_MACROS
+
+#include <inttypes.h>
+#include <sys/time.h>
+
+using Err::Error;
+
+using namespace Log;
+using namespace ARM;
+using namespace LPC11xx_13xx;
+
+size_t const iap_work_area_bytes =
+    (IAP::max_command_response_words + IAP::min_stack_words) * sizeof(word_t);
+
+size_t largest_copy_size(size_t max_bytes)
+{
+    static size_t const sizes[] = {4096, 1024, 512, 256};  // Largest first.
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        if (sizes[i] <= max_bytes) return sizes[i];
+    }
+
+    return 0;
+}
+
+/*
+ * Waits up to timeout_ms for the target to halt.  Most IAP commands finish
+ * within a USB round trip or two, which the PollScheduler's first, tight
+ * polls catch; slow ones, like an erase, get polled less often.
+ */
+Error wait_for_halt(Target & target, unsigned timeout_ms, bool * halted)
+{
+    timeval start;
+    gettimeofday(&start, 0);
+
+    PollScheduler poll;
+    poll.set_timeout_ms(timeout_ms);
+
+    do
+    {
+        Check(target.is_halted(halted));
+    }
+    while (!*halted && poll.wait());
+
+    if (*halted) poll.activity();
+
+    debug(2, "Target %s after %lu polls, %dms",
+          *halted ? "halted" : "still running",
+          poll.stats().polls,
+          milliseconds_since(start));
+
+    return Err::success;
+}
+
+/*
+ * Invokes a routine within In-Application Programming ROM of an LPC part,
+ * waiting up to timeout_ms for it to return.
+ */
+Error invoke_iap(Target & target,
+                 rptr<word_t> param_table,
+                 rptr<word_t> result_table,
+                 rptr<word_t> stack,
+                 unsigned timeout_ms)
+{
+    debug(2, "invoke_iap: param_table=%08X, result_table=%08X, stack=%08X",
+          param_table.bits(),
+          result_table.bits(),
+          stack.bits());
+
+    // Tell the CPU to return into RAM, and catch it there with a breakpoint.
+    rptr_const<thumb_code_t> trap(param_table.bits() | 1);
+
+    word_t registers[Target::register_count];
+    registers[Register::R0] = param_table.bits();
+    registers[Register::R1] = result_table.bits();
+    registers[Register::SP] = stack.bits();
+    registers[Register::PC] = IAP::entry.bits();
+    registers[Register::LR] = trap.bits();
+
+    Check(target.write_registers((1 << Register::R0)
+                               | (1 << Register::R1)
+                               | (1 << Register::SP)
+                               | (1 << Register::PC)
+                               | (1 << Register::LR),
+                                 registers));
+    Check(target.enable_breakpoint(0, trap));
+
+    Check(target.reset_halt_state());
+
+    Check(target.resume());
+
+    bool halted = false;
+    Check(wait_for_halt(target, timeout_ms, &halted));
+
+    if (!halted)
+    {
+        warning("Target did not halt within %ums of IAP execution!",
+                timeout_ms);
+        Check(target.halt());
+
+        Check(target.read_registers((1 << Register::R0)
+                                  | (1 << Register::R1)
+                                  | (1 << Register::SP)
+                                  | (1 << Register::LR)
+                                  | (1 << Register::PC)
+                                  | (1 << Register::xPSR),
+                                    registers));
+        warning("Target forcibly halted at %08X", registers[Register::PC]);
+        warning("  r0=%08X r1=%08X sp=%08X lr=%08X xpsr=%08X",
+                registers[Register::R0],
+                registers[Register::R1],
+                registers[Register::SP],
+                registers[Register::LR],
+                registers[Register::xPSR]);
+
+        return Err::failure;
+    }
+
+    return Err::success;
+}
+
+/*
+ * Unmaps the bootloader ROM from address 0 in an LPC part, revealing user flash
+ * sector 0 beneath.
+ *
+ * This operation is valid for at least the following micros:
+ *  - LPC111x / LPC11Cxx
+ *  - LPC13xx
+ *
+ * The current implementation won't work on the LPC17xx.
+ */
+Error unmap_boot_sector(Target & target)
+{
+    return target.write_word(SYSCON::SYSMEMREMAP,
+                             SYSCON::SYSMEMREMAP_MAP_USER_FLASH);
+}
+
+Error unprotect_flash(Target & target,
+                      rptr<word_t> work_addr,
+                      uint32_t first_sector,
+                      uint32_t last_sector)
+{
+    debug(1, "Unprotecting Flash sectors %"PRIu32"-%"PRIu32"...",
+          first_sector,
+          last_sector);
+
+    rptr<word_t> const cmd_addr (work_addr);
+    rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
+    rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
+                                          + IAP::min_stack_words);
+
+    // Build command table
+    Check(target.write_word(cmd_addr + 0, IAP::Command::unprotect_sectors));
+    Check(target.write_word(cmd_addr + 1, first_sector));
+    Check(target.write_word(cmd_addr + 2, last_sector));
+
+    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top,
+                     IAP::timeout_ms(IAP::Command::unprotect_sectors)));
+
+    uint32_t iap_result;
+    Check(target.read_word(resp_addr + 0, &iap_result));
+    CheckEQ(iap_result, 0);
+
+    return Err::success;
+}
+
+Error erase_flash(Target & target,
+                  rptr<word_t> work_addr,
+                  uint32_t first_sector,
+                  uint32_t last_sector,
+                  unsigned cclk_khz)
+{
+    debug(1, "Erasing Flash sectors %"PRIu32"-%"PRIu32"...",
+          first_sector,
+          last_sector);
+
+    rptr<word_t> const cmd_addr (work_addr);
+    rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
+    rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
+                                          + IAP::min_stack_words);
+
+    Check(target.write_word(cmd_addr + 0, IAP::Command::erase_sectors));
+    Check(target.write_word(cmd_addr + 1, first_sector));
+    Check(target.write_word(cmd_addr + 2, last_sector));
+    Check(target.write_word(cmd_addr + 3, cclk_khz));
+
+    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top,
+                     IAP::timeout_ms(IAP::Command::erase_sectors,
+                                     last_sector - first_sector + 1)));
+
+    uint32_t iap_result;
+    Check(target.read_word(resp_addr + 0, &iap_result));
+    CheckEQ(iap_result, 0);
+
+    return Err::success;
+}
+
+Error copy_ram_to_flash(Target & target,
+                        rptr<word_t> work_addr,
+                        rptr<word_t> src_addr,
+                        rptr<word_t> dest_addr,
+                        size_t num_bytes,
+                        unsigned cclk_khz)
+{
+    rptr<word_t> const cmd_addr (work_addr);
+    rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
+    rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
+                                          + IAP::min_stack_words);
+
+    debug(1, "Writing Flash: %zu bytes at %"PRIx32,
+          num_bytes,
+          dest_addr.bits());
+
+    Check(target.write_word(cmd_addr + 0, IAP::Command::copy_ram_to_flash));
+    Check(target.write_word(cmd_addr + 1, dest_addr.bits()));
+    Check(target.write_word(cmd_addr + 2, src_addr.bits()));
+    Check(target.write_word(cmd_addr + 3, num_bytes));
+    Check(target.write_word(cmd_addr + 4, cclk_khz));
+
+    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top,
+                     IAP::timeout_ms(IAP::Command::copy_ram_to_flash,
+                                     (num_bytes + 255) / 256)));
+
+    uint32_t iap_result;
+    Check(target.read_word(resp_addr + 0, &iap_result));
+    CheckEQ(iap_result, 0);
+
+    return Err::success;
+}
+
+Error read_part_id(Target & target,
+                   rptr<word_t> work_addr,
+                   uint32_t * part_id)
+{
+    rptr<word_t> const cmd_addr (work_addr);
+    rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
+    rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
+                                          + IAP::min_stack_words);
+
+    Check(target.write_word(cmd_addr + 0, IAP::Command::read_part_id));
+
+    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top,
+                     IAP::timeout_ms(IAP::Command::read_part_id)));
+
+    uint32_t iap_result;
+    Check(target.read_word(resp_addr + 0, &iap_result));
+    CheckEQ(iap_result, 0);
+
+    Check(target.read_word(resp_addr + 1, part_id));
+
+    debug(1, "Part ID: %08"PRIX32, *part_id);
+
+    return Err::success;
+}
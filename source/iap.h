@@ -0,0 +1,97 @@
+#ifndef IAP_H
+#define IAP_H
+
+/*
+ * Calls into the In-Application Programming ROM of NXP LPC11xx/13xx parts,
+ * made from the host.  Each borrows the core: it sets up the registers, lets
+ * the processor run into the ROM with a breakpoint waiting on the return
+ * address, and polls for it to halt there.  The processor must be halted with
+ * breakpoints enabled, and is left halted; breakpoint 0 and the registers are
+ * not preserved.
+ *
+ * The work area holds the command and response tables and the ROM's stack;
+ * it must have room for IAP::max_command_response_words plus
+ * IAP::min_stack_words.
+ */
+
+#include "arm.h"
+#include "rptr.h"
+
+#include "libs/error/error_stack.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Target;
+
+
+/*
+ * Amount of target RAM used by the functions here, in their work area.
+ */
+extern size_t const iap_work_area_bytes;
+
+/*
+ * The largest num_bytes copy_ram_to_flash accepts that is no more than
+ * max_bytes, or zero if even the smallest is more.
+ */
+size_t largest_copy_size(size_t max_bytes);
+
+/*
+ * Waits up to timeout_ms for the target to halt, reporting whether it did.
+ */
+Err::Error wait_for_halt(Target &, unsigned timeout_ms, bool * halted);
+
+/*
+ * Invokes the IAP ROM with the given command and result tables, waiting up
+ * to timeout_ms for it to return.
+ */
+Err::Error invoke_iap(Target &,
+                      rptr<ARM::word_t> param_table,
+                      rptr<ARM::word_t> result_table,
+                      rptr<ARM::word_t> stack,
+                      unsigned timeout_ms);
+
+/*
+ * Unmaps the boot ROM from address 0, revealing user Flash sector 0.
+ */
+Err::Error unmap_boot_sector(Target &);
+
+/*
+ * Prepares the given sectors for writing ("unprotects" them), as IAP needs
+ * before every erase or copy.
+ */
+Err::Error unprotect_flash(Target &,
+                           rptr<ARM::word_t> work_addr,
+                           uint32_t first_sector,
+                           uint32_t last_sector);
+
+/*
+ * Erases the given sectors, which must have been unprotected.  cclk_khz is the
+ * core clock rate, which IAP times the erase by.
+ */
+Err::Error erase_flash(Target &,
+                       rptr<ARM::word_t> work_addr,
+                       uint32_t first_sector,
+                       uint32_t last_sector,
+                       unsigned cclk_khz);
+
+/*
+ * Copies num_bytes (256, 512, 1024 or 4096) from RAM at src_addr to Flash at
+ * dest_addr, whose sector must have been unprotected.  cclk_khz is as for
+ * erase_flash.
+ */
+Err::Error copy_ram_to_flash(Target &,
+                             rptr<ARM::word_t> work_addr,
+                             rptr<ARM::word_t> src_addr,
+                             rptr<ARM::word_t> dest_addr,
+                             size_t num_bytes,
+                             unsigned cclk_khz);
+
+/*
+ * Reads the part identification number.
+ */
+Err::Error read_part_id(Target &,
+                        rptr<ARM::word_t> work_addr,
+                        uint32_t * part_id);
+
+#endif  // IAP_H
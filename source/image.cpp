@@ -0,0 +1,557 @@
+#include "image.h"
+#include "elf_format.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+#include <algorithm>
+#include <string>
+
+#define __STDC_FORMAT_MACROS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using Err::Error;
+using namespace Log;
+using namespace ARM;
+
+/*
+ * The LPC boot ROM checks that the first eight vectors sum to zero; the
+ * eighth is reserved for making that so.
+ */
+static size_t const checked_vectors = 7;
+
+static size_t const not_stored = size_t(-1);
+
+/*******************************************************************************
+ * Intel HEX parsing
+ */
+
+/*
+ * A data record from an Intel HEX file: length bytes at address, stored at
+ * offset in the decoded data.
+ */
+struct HexRecord
+{
+    uint32_t address;
+    size_t   offset;
+    size_t   length;
+    unsigned line;  // In the file, for errors.
+
+    bool operator<(HexRecord const & other) const
+    {
+        return address < other.address;
+    }
+};
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+
+/*******************************************************************************
+ * Image implementation
+ */
+
+Image::Image() :
+    _fd(-1),
+    _owns_fd(false),
+    _stream(false),
+    _map(0),
+    _map_bytes(0),
+    _segment(0),
+    _position(0),
+    _fix_checksum(false),
+    _stored_end(0) {}
+
+Image::~Image()
+{
+    if (_map) munmap(const_cast<uint8_t *>(_map), _map_bytes);
+    if (_owns_fd && _fd >= 0) close(_fd);
+}
+
+Error Image::open(char const * path)
+{
+    if (strcmp(path, "-") == 0)
+    {
+        _fd = 0;
+        _owns_fd = false;
+    }
+    else
+    {
+        _fd = ::open(path, O_RDONLY);
+        CheckStringB(_fd >= 0,
+                     "Can't open %s: %s", path, strerror(errno));
+        _owns_fd = true;
+    }
+
+    struct stat info;
+    CheckStringB(fstat(_fd, &info) == 0,
+                 "Can't examine %s: %s", path, strerror(errno));
+
+    if (!S_ISREG(info.st_mode))
+    {
+        debug(1, "Streaming program from %s", path);
+        _stream = true;
+        return Err::success;
+    }
+
+    _map_bytes = info.st_size;
+
+    CheckStringB(_map_bytes > 0, "Program %s is empty", path);
+
+    void * map = mmap(0, _map_bytes, PROT_READ, MAP_PRIVATE, _fd, 0);
+    CheckStringB(map != MAP_FAILED,
+                 "Can't map %s: %s", path, strerror(errno));
+    _map = static_cast<uint8_t const *>(map);
+
+    if (_map_bytes >= sizeof(ELF::magic)
+        && std::equal(ELF::magic, ELF::magic + sizeof(ELF::magic), _map))
+    {
+        CheckString(open_elf(), "Can't load ELF program %s", path);
+    }
+    else if (_map[0] == ':')
+    {
+        CheckString(open_hex(), "Can't load Intel HEX program %s", path);
+    }
+    else
+    {
+        CheckString(open_binary(), "Can't load program %s", path);
+    }
+
+    Check(finish_segments());
+
+    return Err::success;
+}
+
+Error Image::open_binary()
+{
+    CheckStringB(_map_bytes % sizeof(word_t) == 0,
+                 "Program is not a whole number of words long");
+
+    Segment segment;
+    segment.address   = 0;
+    segment.words     = _map_bytes / sizeof(word_t);
+    segment.data      = reinterpret_cast<word_t const *>(_map);
+    segment.stored_at = not_stored;
+    _segments.push_back(segment);
+
+    debug(1, "Mapped program of %zu bytes", _map_bytes);
+
+    return Err::success;
+}
+
+Error Image::open_elf()
+{
+    CheckStringB(_map_bytes >= ELF::header_bytes, "Truncated ELF header");
+
+    CheckStringB(_map[ELF::ident_class] == ELF::class_32
+              && _map[ELF::ident_data]  == ELF::data_lsb,
+                 "Not a 32-bit little-endian ELF file");
+
+    if (read_le16(_map + ELF::e_machine) != ELF::machine_arm)
+    {
+        warning("ELF file is not for ARM; loading it anyway.");
+    }
+
+    uint32_t const phoff     = read_le32(_map + ELF::e_phoff);
+    uint32_t const phentsize = read_le16(_map + ELF::e_phentsize);
+    uint32_t const phnum     = read_le16(_map + ELF::e_phnum);
+
+    CheckStringB(phentsize >= ELF::phdr_bytes
+              && phoff <= _map_bytes
+              && phnum <= (_map_bytes - phoff) / phentsize,
+                 "Bad ELF program header table");
+
+    /*
+     * Take the loadable segments in address order, so that any that need
+     * converting and abut one another are merged by add_bytes.
+     */
+    std::vector<std::pair<uint32_t, uint8_t const *> > loads;
+
+    for (uint32_t i = 0; i < phnum; ++i)
+    {
+        uint8_t const * phdr = _map + phoff + i * phentsize;
+
+        if (read_le32(phdr + ELF::p_type) != ELF::type_load) continue;
+        if (read_le32(phdr + ELF::p_filesz) == 0) continue;  // e.g. .bss
+
+        loads.push_back(std::make_pair(read_le32(phdr + ELF::p_paddr), phdr));
+    }
+
+    std::sort(loads.begin(), loads.end());
+
+    size_t total_bytes = 0;
+
+    for (size_t i = 0; i < loads.size(); ++i)
+    {
+        uint8_t const * phdr = loads[i].second;
+
+        // Programs are loaded at their physical (load) address, which is
+        // where initialized data lives before startup code copies it to RAM.
+        uint32_t const address = loads[i].first;
+        uint32_t const offset  = read_le32(phdr + ELF::p_offset);
+        uint32_t const bytes   = read_le32(phdr + ELF::p_filesz);
+
+        CheckStringB(offset <= _map_bytes && bytes <= _map_bytes - offset,
+                     "ELF segment at %08"PRIX32" runs off the end of the file",
+                     address);
+
+        debug(2, "ELF segment: %"PRIu32" bytes at %08"PRIX32,
+              bytes,
+              address);
+
+        total_bytes += bytes;
+
+        if ((address | offset | bytes) % sizeof(word_t) == 0)
+        {
+            Segment segment;
+            segment.address   = address;
+            segment.words     = bytes / sizeof(word_t);
+            segment.data      = reinterpret_cast<word_t const *>(_map + offset);
+            segment.stored_at = not_stored;
+            _segments.push_back(segment);
+        }
+        else
+        {
+            CheckStringB(add_bytes(address, _map + offset, bytes),
+                         "ELF segment at %08"PRIX32" overlaps another",
+                         address);
+        }
+    }
+
+    CheckStringB(!_segments.empty(), "ELF file has nothing to load");
+
+    debug(1, "Mapped ELF program of %zu bytes in %zu segments",
+          total_bytes,
+          loads.size());
+
+    return Err::success;
+}
+
+Error Image::open_hex()
+{
+    std::vector<uint8_t>   data;
+    std::vector<HexRecord> records;
+
+    uint32_t base = 0;
+    bool     ended = false;
+    unsigned line = 0;
+    size_t   i = 0;
+
+    while (i < _map_bytes && !ended)
+    {
+        ++line;
+
+        // Skip the line ending, and any blank lines.
+        if (_map[i] == '\r' || _map[i] == '\n')
+        {
+            ++i;
+            continue;
+        }
+
+        CheckStringB(_map[i] == ':',
+                     "Line %u does not start with ':'", line);
+        ++i;
+
+        // Decode the record's bytes up to the end of the line.
+        std::vector<uint8_t> record;
+        while (i < _map_bytes && _map[i] != '\r' && _map[i] != '\n')
+        {
+            int high = hex_digit(_map[i]);
+            int low  = i + 1 < _map_bytes ? hex_digit(_map[i + 1]) : -1;
+
+            CheckStringB(high >= 0 && low >= 0,
+                         "Bad hex digits on line %u", line);
+
+            record.push_back((high << 4) | low);
+            i += 2;
+        }
+
+        CheckStringB(record.size() >= 5 && record.size() == record[0] + 5u,
+                     "Bad record length on line %u", line);
+
+        uint8_t sum = 0;
+        for (size_t j = 0; j < record.size(); ++j) sum += record[j];
+
+        CheckStringB(sum == 0, "Bad checksum on line %u", line);
+
+        size_t const   length = record[0];
+        uint32_t const offset = (record[1] << 8) | record[2];
+        uint8_t const  type   = record[3];
+        uint8_t const * value = &record[4];
+
+        switch (type)
+        {
+          case 0x00:  // Data
+            {
+                HexRecord data_record;
+                data_record.address = base + offset;
+                data_record.offset  = data.size();
+                data_record.length  = length;
+                data_record.line    = line;
+                records.push_back(data_record);
+
+                data.insert(data.end(), value, value + length);
+            }
+            break;
+
+          case 0x01:  // End of file
+            ended = true;
+            break;
+
+          case 0x02:  // Extended segment address
+            CheckStringB(length == 2, "Bad segment address on line %u", line);
+            base = ((value[0] << 8) | value[1]) << 4;
+            break;
+
+          case 0x04:  // Extended linear address
+            CheckStringB(length == 2, "Bad linear address on line %u", line);
+            base = uint32_t((value[0] << 8) | value[1]) << 16;
+            break;
+
+          case 0x03:  // Start segment address
+          case 0x05:  // Start linear address
+            break;    // We don't start the program; ignore.
+
+          default:
+            CheckStringB(false,
+                         "Unknown record type %02X on line %u",
+                         type,
+                         line);
+        }
+    }
+
+    if (!ended) warning("Intel HEX file has no end-of-file record.");
+
+    CheckStringB(!records.empty(), "Intel HEX file has no data");
+
+    std::stable_sort(records.begin(), records.end());
+
+    for (size_t j = 0; j < records.size(); ++j)
+    {
+        CheckStringB(add_bytes(records[j].address,
+                               &data[records[j].offset],
+                               records[j].length),
+                     "Data on line %u overlaps earlier data at %08"PRIX32,
+                     records[j].line,
+                     records[j].address);
+    }
+
+    debug(1, "Loaded Intel HEX program of %zu bytes in %zu segments",
+          data.size(),
+          _segments.size());
+
+    return Err::success;
+}
+
+bool Image::add_bytes(uint32_t address, uint8_t const * bytes, size_t length)
+{
+    if (length == 0) return true;
+
+    uint32_t const first_word = address & ~uint32_t(sizeof(word_t) - 1);
+    uint32_t const end = address + length;
+    uint32_t const end_word = (end + sizeof(word_t) - 1)
+                            & ~uint32_t(sizeof(word_t) - 1);
+
+    Segment * last = _segments.empty() ? 0 : &_segments.back();
+
+    if (!(last
+          && last->stored_at != not_stored
+          && address >= last->address
+          && first_word <= last->address + last->words * sizeof(word_t)))
+    {
+        Segment segment;
+        segment.address   = first_word;
+        segment.words     = 0;
+        segment.data      = 0;
+        segment.stored_at = _storage.size();
+        _segments.push_back(segment);
+
+        last = &_segments.back();
+    }
+    else if (address < _stored_end)
+    {
+        return false;
+    }
+
+    _stored_end = end;
+
+    size_t const words = (end_word - last->address) / sizeof(word_t);
+    if (words > last->words)
+    {
+        _storage.resize(last->stored_at + words, 0xFFFFFFFF);
+        last->words = words;
+    }
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        uint32_t const byte_address = address + i;
+        word_t & word = _storage[last->stored_at
+                                 + (byte_address - last->address)
+                                   / sizeof(word_t)];
+        unsigned const shift = (byte_address % sizeof(word_t)) * 8;
+
+        word = (word & ~(word_t(0xFF) << shift)) | (word_t(bytes[i]) << shift);
+    }
+
+    return true;
+}
+
+Error Image::finish_segments()
+{
+    for (size_t i = 0; i < _segments.size(); ++i)
+    {
+        if (_segments[i].stored_at != not_stored)
+        {
+            _segments[i].data = &_storage[_segments[i].stored_at];
+        }
+    }
+
+    std::sort(_segments.begin(), _segments.end());
+
+    for (size_t i = 1; i < _segments.size(); ++i)
+    {
+        Segment const & previous = _segments[i - 1];
+
+        CheckStringB(previous.address + previous.words * sizeof(word_t)
+                     <= _segments[i].address,
+                     "Program segments at %08"PRIX32" and %08"PRIX32
+                     " overlap",
+                     previous.address,
+                     _segments[i].address);
+    }
+
+    return Err::success;
+}
+
+void Image::fix_lpc_checksum(bool enabled)
+{
+    _fix_checksum = enabled;
+}
+
+bool Image::is_stream() const
+{
+    return _stream;
+}
+
+Error Image::read_stream(size_t max_words, size_t * count)
+{
+    _buffer.resize(max_words);
+
+    uint8_t * bytes = reinterpret_cast<uint8_t *>(&_buffer[0]);
+    size_t const wanted = max_words * sizeof(word_t);
+    size_t got = 0;
+
+    while (got < wanted)
+    {
+        ssize_t result = read(_fd, bytes + got, wanted - got);
+
+        if (result < 0 && errno == EINTR) continue;
+
+        CheckStringB(result >= 0,
+                     "Can't read program: %s", strerror(errno));
+
+        if (result == 0) break;
+
+        got += result;
+    }
+
+    CheckStringB(got % sizeof(word_t) == 0,
+                 "Program is not a whole number of words long");
+
+    *count = got / sizeof(word_t);
+    return Err::success;
+}
+
+Error Image::next(size_t boundary,
+                  rptr<word_t> * address,
+                  word_t const ** data,
+                  size_t * count)
+{
+    if (boundary == 0 || boundary % sizeof(word_t)) return Err::argument_error;
+
+    if (_stream)
+    {
+        size_t const max_words = (boundary - _position % boundary)
+                               / sizeof(word_t);
+
+        *address = rptr<word_t>(_position);
+        Check(read_stream(max_words, count));
+        *data = &_buffer[0];
+    }
+    else
+    {
+        if (_segment == _segments.size())
+        {
+            *count = 0;
+            return Err::success;
+        }
+
+        Segment const & segment = _segments[_segment];
+        uint32_t const start = segment.address + _position;
+
+        size_t const max_words = (boundary - start % boundary)
+                               / sizeof(word_t);
+        size_t const remaining = segment.words - _position / sizeof(word_t);
+
+        *address = rptr<word_t>(start);
+        *count   = std::min(max_words, remaining);
+        *data    = segment.data + _position / sizeof(word_t);
+    }
+
+    if (_fix_checksum && address->bits() == 0 && *count > 0)
+    {
+        if (*count <= checked_vectors)
+        {
+            warning("Program too short to write LPC checksum.");
+        }
+        else
+        {
+            // Patch a copy, leaving the image alone.
+            if (!_stream) _buffer.assign(*data, *data + *count);
+
+            word_t sum = 0;
+            for (size_t i = 0; i < checked_vectors; ++i)
+            {
+                sum += _buffer[i];
+            }
+            sum = 0 - sum;
+
+            debug(1, "Repairing LPC checksum: %"PRIX32, sum);
+
+            _buffer[checked_vectors] = sum;
+            *data = &_buffer[0];
+        }
+    }
+
+    _position += *count * sizeof(word_t);
+
+    if (!_stream && _position == _segments[_segment].words * sizeof(word_t))
+    {
+        ++_segment;
+        _position = 0;
+    }
+
+    return Err::success;
+}
+
+Error Image::rewind()
+{
+    CheckStringB(!_stream, "A streamed image can't be read twice");
+
+    _segment  = 0;
+    _position = 0;
+
+    return Err::success;
+}
@@ -0,0 +1,134 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+/*
+ * A program image to be written to a target, read a piece at a time.
+ *
+ * Images in regular files are memory-mapped read-only, so they cost little
+ * heap and are shared between processes that fork after opening them.  Flat
+ * binaries from anything else -- a pipe, or standard input -- are streamed, so
+ * only the piece being worked on is ever held in memory.
+ *
+ * ELF executables and Intel HEX files may leave gaps between the parts of
+ * memory they fill; those parts are handed out as separate pieces, and the
+ * gaps are never mentioned.
+ */
+
+#include "arm.h"
+#include "rptr.h"
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+class Image
+{
+public:
+    Image();
+    ~Image();
+
+    /*
+     * Opens a program image.  ELF executables and Intel HEX files are
+     * recognized by their contents; anything else is taken to be a flat
+     * binary, loaded at address zero.  A path of "-" streams a flat binary
+     * from standard input.
+     */
+    Err::Error open(char const * path);
+
+    /*
+     * Arranges for the vector table checksum expected by the NXP LPC series to
+     * be filled in as the image is read.  The image itself isn't changed; the
+     * checksum is patched into the copy of the piece at address zero handed
+     * out.
+     */
+    void fix_lpc_checksum(bool);
+
+    /*
+     * Whether the image is streamed, rather than held in memory.  Only images
+     * held in memory can be read by several forked processes at once.
+     */
+    bool is_stream() const;
+
+    /*
+     * Hands out the next piece of the image, in address order: count words
+     * starting at address, left at data.  Pieces never cross a multiple of
+     * boundary (a byte count, which must be a multiple of the word size), so
+     * callers can work a sector at a time.  data stays valid until the next
+     * call.  At the end of the image, count is zero.
+     */
+    Err::Error next(size_t boundary,
+                    rptr<ARM::word_t> * address,
+                    ARM::word_t const ** data,
+                    size_t * count);
+
+    /*
+     * Goes back to the first piece, so the image can be read again.  Streamed
+     * images can't be.
+     */
+    Err::Error rewind();
+
+private:
+    /*
+     * A contiguous, word-aligned part of the image.  Its words are either in
+     * the mapped file, or -- for formats that need converting, or data that
+     * isn't aligned -- in _storage, starting at stored_at.
+     */
+    struct Segment
+    {
+        uint32_t            address;
+        size_t              words;
+        ARM::word_t const * data;
+        size_t              stored_at;
+
+        bool operator<(Segment const & other) const
+        {
+            return address < other.address;
+        }
+    };
+
+    int _fd;
+    bool _owns_fd;
+    bool _stream;
+
+    uint8_t const * _map;  // Whole file, unless streaming.
+    size_t _map_bytes;
+
+    std::vector<Segment> _segments;
+    std::vector<ARM::word_t> _storage;  // Converted segments.
+
+    size_t _segment;   // Segment of the next piece.
+    size_t _position;  // Byte offset of the next piece, in the segment.
+    bool _fix_checksum;
+
+    std::vector<ARM::word_t> _buffer;  // Current piece, when not in memory.
+
+    uint32_t _stored_end;  // End of the bytes add_bytes last added.
+
+    Err::Error open_binary();
+    Err::Error open_elf();
+    Err::Error open_hex();
+
+    /*
+     * Adds bytes at address to _storage, padding to whole words with ones (as
+     * erased Flash reads), and extending the last segment if the bytes follow
+     * on from it.  Bytes must be added in address order; returns false if
+     * they overlap those added before.
+     */
+    bool add_bytes(uint32_t address, uint8_t const * bytes, size_t length);
+
+    // Sorts the segments and points stored ones into _storage.
+    Err::Error finish_segments();
+
+    // Reads up to max_words from the stream into _buffer.
+    Err::Error read_stream(size_t max_words, size_t * count);
+
+    // Not copyable: we own the file and the mapping.
+    Image(Image const &);
+    Image & operator=(Image const &);
+};
+
+#endif  // IMAGE_H
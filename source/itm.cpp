@@ -0,0 +1,120 @@
+#include "itm.h"
+
+/*
+ * A synchronization packet is at least 47 zero bits and then a one: five zero
+ * bytes and an 0x80, at the least.
+ */
+static unsigned const sync_zero_bytes = 5;
+static uint8_t const sync_end = 0x80;
+
+static uint8_t const overflow = 0x70;
+
+ITMDecoder::Stats::Stats() :
+    software(0),
+    hardware(0),
+    timestamps(0),
+    overflows(0),
+    syncs(0),
+    reserved(0) {}
+
+ITMDecoder::ITMDecoder(Sink & sink) :
+    _sink(sink),
+    _state(header),
+    _software(false),
+    _port(0),
+    _size(0),
+    _collected(0),
+    _zeros(0) {}
+
+ITMDecoder::Stats const & ITMDecoder::stats() const
+{
+    return _stats;
+}
+
+void ITMDecoder::decode(uint8_t const * data, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t const byte = data[i];
+
+        switch (_state)
+        {
+            case header:
+                decode_header(byte);
+                break;
+
+            case payload:
+                _payload[_collected++] = byte;
+                if (_collected < _size) break;
+
+                if (_software) _sink.stimulus(_port, _payload, _size);
+                _state = header;
+                break;
+
+            case continuation:
+                if (!(byte & 0x80)) _state = header;
+                break;
+        }
+    }
+}
+
+void ITMDecoder::decode_header(uint8_t byte)
+{
+    if (byte == 0)
+    {
+        ++_zeros;
+        return;
+    }
+
+    bool const after_zeros = _zeros >= sync_zero_bytes;
+    _zeros = 0;
+
+    if (byte == sync_end && after_zeros)
+    {
+        ++_stats.syncs;
+    }
+    else if (byte == overflow)
+    {
+        ++_stats.overflows;
+    }
+    else if (byte & 0x03)
+    {
+        // A source packet; the low bits give its size, 1, 2, or 4 bytes.
+        static size_t const sizes[] = {0, 1, 2, 4};
+
+        _software  = !(byte & 0x04);
+        _port      = byte >> 3;
+        _size      = sizes[byte & 0x03];
+        _collected = 0;
+        _state     = payload;
+
+        if (_software) ++_stats.software;
+        else           ++_stats.hardware;
+    }
+    else if ((byte & 0x0F) == 0 && (byte & 0xC0) == 0xC0)
+    {
+        // A local timestamp, with more to come.
+        ++_stats.timestamps;
+        _state = continuation;
+    }
+    else if ((byte & 0x0F) == 0 && !(byte & 0x80))
+    {
+        // A local timestamp in the header alone.
+        ++_stats.timestamps;
+    }
+    else if ((byte & 0xDF) == 0x94)
+    {
+        // A global timestamp, always followed by more.
+        ++_stats.timestamps;
+        _state = continuation;
+    }
+    else if ((byte & 0x0B) == 0x08)
+    {
+        // An extension packet, which we have no use for.
+        if (byte & 0x80) _state = continuation;
+    }
+    else
+    {
+        ++_stats.reserved;
+    }
+}
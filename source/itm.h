@@ -0,0 +1,83 @@
+#ifndef ITM_H
+#define ITM_H
+
+/*
+ * Decoding the packets the ITM sends out of the SWO pin.
+ *
+ * With the TPIU's formatter bypassed, SWO carries the ITM's packets back to
+ * back: a header byte, then up to four bytes of payload.  Software packets
+ * carry what firmware wrote to a stimulus port; the rest -- DWT hardware
+ * packets, timestamps, overflow notices and synchronization -- are counted
+ * and skipped.  The decoder keeps its place across calls, so the stream can be
+ * fed in whatever pieces it arrives in.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+class ITMDecoder
+{
+public:
+    /*
+     * Receives the decoded stream.
+     */
+    class Sink
+    {
+    public:
+        virtual ~Sink() {}
+
+        /*
+         * Called with the payload of each software packet: the bytes the
+         * firmware wrote to stimulus port port, in target (little-endian)
+         * order.  size is 1, 2, or 4.
+         */
+        virtual void stimulus(unsigned port, uint8_t const * data, size_t size)
+            = 0;
+    };
+
+    /*
+     * Running totals, from construction.
+     */
+    struct Stats
+    {
+        uint64_t software;    // Software packets passed to the sink.
+        uint64_t hardware;    // DWT packets, skipped.
+        uint64_t timestamps;  // Local and global timestamps, skipped.
+        uint64_t overflows;   // Packets the ITM reports having dropped.
+        uint64_t syncs;       // Synchronization packets.
+        uint64_t reserved;    // Headers that mean nothing; usually noise.
+
+        Stats();
+    };
+
+    explicit ITMDecoder(Sink &);
+
+    /*
+     * Decodes count more bytes of the stream.
+     */
+    void decode(uint8_t const * data, size_t count);
+
+    Stats const & stats() const;
+
+private:
+    enum State
+    {
+        header,        // Expecting a header.
+        payload,       // Collecting a source packet's payload.
+        continuation   // Skipping bytes until one without bit 7 set.
+    };
+
+    Sink &   _sink;
+    Stats    _stats;
+    State    _state;
+    bool     _software;  // Whether the packet being collected is software.
+    unsigned _port;
+    size_t   _size;
+    size_t   _collected;
+    uint8_t  _payload[4];
+    unsigned _zeros;     // Zero bytes seen in a row, toward a sync.
+
+    void decode_header(uint8_t);
+};
+
+#endif  // ITM_H
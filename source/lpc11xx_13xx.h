@@ -49,6 +49,23 @@ namespace IAP
         };
     }
 
+    /*
+     * Worst-case time for a command to complete, in milliseconds -- the
+     * datasheet figures (100ms per sector erased, 1ms per 256 bytes written)
+     * with a healthy margin.  Erase and blank-check scale with the number of
+     * sectors; copy_ram_to_flash with the number of 256-byte blocks.
+     */
+    inline unsigned timeout_ms(Command::Index command, unsigned count = 1)
+    {
+        switch (command)
+        {
+            case Command::erase_sectors:       return 20 + 200 * count;
+            case Command::blank_check_sectors: return 20 + 10 * count;
+            case Command::copy_ram_to_flash:   return 20 + 5 * count;
+            default:                           return 20;
+        }
+    }
+
 }  // namespace LPC11xx_13xx::IAP
 
 /*******************************************************************************
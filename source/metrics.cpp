@@ -0,0 +1,304 @@
+#define __STDC_FORMAT_MACROS
+
+#include "metrics.h"
+
+#include "libs/log/log_default.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace Log;
+
+namespace Metrics
+{
+
+/*
+ * Heads of the lists of everything registered.  Being constant-initialized,
+ * they're ready before any file-scope Counter or Histogram is constructed.
+ */
+static Counter *   first_counter   = 0;
+static Histogram * first_histogram = 0;
+
+
+/*******************************************************************************
+ * Counter implementation
+ */
+
+Counter::Counter(char const * name) :
+    _name(name),
+    _value(0),
+    _next(first_counter)
+{
+    first_counter = this;
+}
+
+void Counter::add(uint64_t n)
+{
+    _value += n;
+}
+
+char const * Counter::name() const
+{
+    return _name;
+}
+
+uint64_t Counter::value() const
+{
+    return _value;
+}
+
+Counter const * Counter::next() const
+{
+    return _next;
+}
+
+
+/*******************************************************************************
+ * Histogram implementation
+ */
+
+unsigned const Histogram::bucket_count;
+
+Histogram::Histogram(char const * name) :
+    _name(name),
+    _count(0),
+    _total_us(0),
+    _max_us(0),
+    _next(first_histogram)
+{
+    std::fill(_buckets, _buckets + bucket_count, 0);
+    first_histogram = this;
+}
+
+void Histogram::record(uint64_t microseconds)
+{
+    unsigned index = 0;
+    while (index < bucket_count - 1 && (microseconds >> index))
+    {
+        ++index;
+    }
+
+    ++_buckets[index];
+    ++_count;
+    _total_us += microseconds;
+    _max_us = std::max(_max_us, microseconds);
+}
+
+char const * Histogram::name() const
+{
+    return _name;
+}
+
+uint64_t Histogram::count() const
+{
+    return _count;
+}
+
+uint64_t Histogram::total_us() const
+{
+    return _total_us;
+}
+
+uint64_t Histogram::max_us() const
+{
+    return _max_us;
+}
+
+uint64_t Histogram::bucket(unsigned index) const
+{
+    return _buckets[index];
+}
+
+uint64_t Histogram::bucket_floor_us(unsigned index)
+{
+    return index ? uint64_t(1) << (index - 1) : 0;
+}
+
+uint64_t Histogram::percentile_us(unsigned percent) const
+{
+    uint64_t const wanted = (_count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < bucket_count - 1; ++i)
+    {
+        seen += _buckets[i];
+        if (seen >= wanted && seen) return std::min(uint64_t(1) << i, _max_us);
+    }
+
+    return _max_us;
+}
+
+Histogram const * Histogram::next() const
+{
+    return _next;
+}
+
+
+/*******************************************************************************
+ * Timer implementation
+ */
+
+Timer::Timer(Histogram & histogram) :
+    _histogram(histogram)
+{
+    gettimeofday(&_start, 0);
+}
+
+Timer::~Timer()
+{
+    timeval now;
+    gettimeofday(&now, 0);
+
+    int64_t const elapsed_us = int64_t(now.tv_sec  - _start.tv_sec) * 1000000
+                             + (now.tv_usec - _start.tv_usec);
+
+    _histogram.record(elapsed_us > 0 ? uint64_t(elapsed_us) : 0);
+}
+
+
+/*******************************************************************************
+ * Reporting
+ */
+
+template <typename T>
+static bool by_name(T const * a, T const * b)
+{
+    return strcmp(a->name(), b->name()) < 0;
+}
+
+static void sorted_counters(std::vector<Counter const *> * out)
+{
+    for (Counter const * c = first_counter; c; c = c->next())
+    {
+        out->push_back(c);
+    }
+
+    std::sort(out->begin(), out->end(), by_name<Counter>);
+}
+
+static void sorted_histograms(std::vector<Histogram const *> * out)
+{
+    for (Histogram const * h = first_histogram; h; h = h->next())
+    {
+        out->push_back(h);
+    }
+
+    std::sort(out->begin(), out->end(), by_name<Histogram>);
+}
+
+static void print_summary(std::vector<Counter const *> const & counters,
+                          std::vector<Histogram const *> const & histograms)
+{
+    notice("Statistics:");
+
+    for (size_t i = 0; i < counters.size(); ++i)
+    {
+        notice("  %-28s %12"PRIu64, counters[i]->name(), counters[i]->value());
+    }
+
+    notice("  %-28s %8s %9s %9s %9s %9s",
+           "latency (us)", "calls", "mean", "p50", "p99", "max");
+
+    for (size_t i = 0; i < histograms.size(); ++i)
+    {
+        Histogram const & h = *histograms[i];
+        if (h.count() == 0) continue;
+
+        notice("  %-28s %8"PRIu64" %9"PRIu64" %9"PRIu64" %9"PRIu64" %9"PRIu64,
+               h.name(),
+               h.count(),
+               h.total_us() / h.count(),
+               h.percentile_us(50),
+               h.percentile_us(99),
+               h.max_us());
+    }
+}
+
+static void write_json(FILE * out,
+                       std::vector<Counter const *> const & counters,
+                       std::vector<Histogram const *> const & histograms)
+{
+    fprintf(out, "{\n  \"counters\": {");
+
+    for (size_t i = 0; i < counters.size(); ++i)
+    {
+        fprintf(out, "%s\n    \"%s\": %"PRIu64,
+                i ? "," : "",
+                counters[i]->name(),
+                counters[i]->value());
+    }
+
+    fprintf(out, "\n  },\n  \"histograms\": {");
+
+    for (size_t i = 0; i < histograms.size(); ++i)
+    {
+        Histogram const & h = *histograms[i];
+
+        fprintf(out,
+                "%s\n    \"%s\": {\"count\": %"PRIu64", \"total_us\": %"PRIu64
+                ", \"max_us\": %"PRIu64", \"buckets\": [",
+                i ? "," : "",
+                h.name(),
+                h.count(),
+                h.total_us(),
+                h.max_us());
+
+        // Only the buckets that recorded anything, as [floor_us, count].
+        bool first = true;
+        for (unsigned b = 0; b < Histogram::bucket_count; ++b)
+        {
+            if (h.bucket(b) == 0) continue;
+
+            fprintf(out, "%s[%"PRIu64", %"PRIu64"]",
+                    first ? "" : ", ",
+                    Histogram::bucket_floor_us(b),
+                    h.bucket(b));
+            first = false;
+        }
+
+        fprintf(out, "]}");
+    }
+
+    fprintf(out, "\n  }\n}\n");
+}
+
+void report(bool print, char const * json_path)
+{
+    bool const save = json_path && json_path[0];
+    if (!print && !save) return;
+
+    std::vector<Counter const *>   counters;
+    std::vector<Histogram const *> histograms;
+
+    sorted_counters(&counters);
+    sorted_histograms(&histograms);
+
+    if (print) print_summary(counters, histograms);
+
+    if (!save) return;
+
+    bool const to_stdout = strcmp(json_path, "-") == 0;
+    FILE * out = to_stdout ? stdout : fopen(json_path, "w");
+
+    if (out == 0)
+    {
+        warning("Could not write statistics to %s: %s",
+                json_path, strerror(errno));
+        return;
+    }
+
+    write_json(out, counters, histograms);
+
+    if (to_stdout ? fflush(out) != 0 : fclose(out) != 0)
+    {
+        warning("Could not write statistics to %s: %s",
+                json_path, strerror(errno));
+    }
+}
+
+}  // namespace Metrics
@@ -0,0 +1,115 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * Process-wide counters and latency histograms, for finding out where a slow
+ * session spends its time: in USB round trips, in clocking bits, or in the
+ * target responding WAIT.
+ *
+ * Counters and histograms register themselves by name when constructed, and
+ * are meant to be defined at file scope next to the code they measure.  They
+ * cost an addition (and, for a Timer, two calls to gettimeofday) each, so they
+ * are always on; report prints or saves them when a tool exits.
+ */
+
+#include <sys/time.h>
+
+#include <stdint.h>
+
+namespace Metrics
+{
+
+/*
+ * A running total, such as a count of USB transfers or bytes moved.
+ */
+class Counter
+{
+public:
+    explicit Counter(char const * name);
+
+    void add(uint64_t n = 1);
+
+    char const * name() const;
+    uint64_t value() const;
+
+    Counter const * next() const;  // In the list of all counters.
+
+private:
+    char const * _name;
+    uint64_t     _value;
+    Counter *    _next;
+};
+
+
+/*
+ * A distribution of durations, in power-of-two buckets of microseconds:
+ * bucket 0 holds durations under 1us, and bucket i durations from 2^(i-1)us
+ * up to 2^i us.  The last bucket also holds anything longer.
+ */
+class Histogram
+{
+public:
+    static unsigned const bucket_count = 32;
+
+    explicit Histogram(char const * name);
+
+    void record(uint64_t microseconds);
+
+    char const * name() const;
+    uint64_t count() const;
+    uint64_t total_us() const;
+    uint64_t max_us() const;
+    uint64_t bucket(unsigned) const;
+
+    // Smallest duration in each bucket.
+    static uint64_t bucket_floor_us(unsigned);
+
+    /*
+     * Upper bound of the bucket holding the given percentile -- or, when that
+     * bucket holds the longest duration, the longest duration itself.
+     */
+    uint64_t percentile_us(unsigned percent) const;
+
+    Histogram const * next() const;  // In the list of all histograms.
+
+private:
+    char const * _name;
+    uint64_t     _count;
+    uint64_t     _total_us;
+    uint64_t     _max_us;
+    uint64_t     _buckets[bucket_count];
+    Histogram *  _next;
+};
+
+
+/*
+ * Records the time from its construction to its destruction in a histogram.
+ * Declare one at the top of the function being measured.
+ */
+class Timer
+{
+public:
+    explicit Timer(Histogram &);
+    ~Timer();
+
+private:
+    Histogram & _histogram;
+    timeval     _start;
+
+    Timer(Timer const &);
+    Timer & operator=(Timer const &);
+};
+
+
+/*
+ * Logs a summary of every counter and every histogram that recorded anything,
+ * if print is set, and saves them all as JSON to json_path, unless it is null
+ * or empty.  A json_path of "-" means standard output.  Problems writing the
+ * file are logged as warnings, since this is usually the last thing a tool
+ * does and it shouldn't change the outcome.
+ */
+void report(bool print, char const * json_path);
+
+}  // namespace Metrics
+
+#endif  // METRICS_H
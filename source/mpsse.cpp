@@ -30,9 +30,81 @@
 #include "libs/error/error.h"
 #include "libs/log/log_default.h"
 
+#include <string.h>
+#include <stdio.h>
+
 using namespace Err;
 using namespace Log;
 
+/******************************************************************************/
+/*
+ * Describes the USB location of a device the way Linux sysfs does: the bus
+ * number, then the port number at each hub along the way.
+ */
+static void device_path(libusb_device * device, char * path, size_t size)
+{
+    uint8_t     ports[7];
+    int         depth  = libusb_get_port_numbers(device, ports, sizeof(ports));
+    size_t      length = snprintf(path, size, "%u",
+                                  libusb_get_bus_number(device));
+
+    for (int i = 0; i < depth && length < size; ++i)
+    {
+        length += snprintf(path + length, size - length, "%c%u",
+                           i == 0 ? '-' : '.', ports[i]);
+    }
+}
+/******************************************************************************/
+/*
+ * Opens the device with the given VID:PID at a location, which may be either
+ * its serial number or its bus path.  Returns zero if there is no such device.
+ */
+static libusb_device_handle * open_device_at(libusb_context * libusb,
+                                             uint16_t vid,
+                                             uint16_t pid,
+                                             char const * location)
+{
+    libusb_device **        list;
+    libusb_device_handle *  found = 0;
+    ssize_t                 count = libusb_get_device_list(libusb, &list);
+
+    for (ssize_t i = 0; i < count && !found; ++i)
+    {
+        libusb_device_descriptor    descriptor;
+        libusb_device_handle *      handle;
+        char                        path[32];
+        unsigned char               serial[64];
+
+        if (libusb_get_device_descriptor(list[i], &descriptor) < 0) continue;
+        if (descriptor.idVendor != vid || descriptor.idProduct != pid) continue;
+        if (libusb_open(list[i], &handle) < 0) continue;
+
+        device_path(list[i], path, sizeof(path));
+
+        if (strcmp(path, location) == 0)
+        {
+            found = handle;
+        }
+        else if (descriptor.iSerialNumber &&
+                 libusb_get_string_descriptor_ascii(handle,
+                                                    descriptor.iSerialNumber,
+                                                    serial,
+                                                    sizeof(serial)) > 0 &&
+                 strcmp((char const *) serial, location) == 0)
+        {
+            found = handle;
+        }
+        else
+        {
+            libusb_close(handle);
+        }
+    }
+
+    if (count >= 0) libusb_free_device_list(list, 1);
+
+    return found;
+}
+
 /******************************************************************************/
 MPSSE::MPSSE() :
     _libusb(NULL),
@@ -49,7 +121,7 @@ MPSSE::~MPSSE()
     if (_libusb) libusb_exit(_libusb);
 }
 /******************************************************************************/
-Error MPSSE::open(MPSSEConfig const & config)
+Error MPSSE::open(MPSSEConfig const & config, char const * location)
 {
     Error           check_error = Err::success;
     libusb_device * device;
@@ -58,15 +130,29 @@ Error MPSSE::open(MPSSEConfig const & config)
     CheckCleanupP(libusb_init(&_libusb), libusb_init_failed);
     CheckCleanupP(ftdi_init(&_ftdi), ftdi_init_failed);
 
-    /*
-     * Locate FTDI chip using it's VID:PID pair.  This doesn't uniquely identify
-     * the programmer so this will need to be improved.
-     */
-    _handle = libusb_open_device_with_vid_pid(_libusb, config.vid, config.pid);
-
-    CheckCleanupStringB(_handle, libusb_open_failed,
-                        "No device found with VID:PID = 0x%04x:0x%04x\n",
-                        config.vid, config.pid);
+    if (location && location[0])
+    {
+        _handle = open_device_at(_libusb, config.vid, config.pid, location);
+
+        CheckCleanupStringB(_handle, libusb_open_failed,
+                            "No device found with VID:PID = 0x%04x:0x%04x "
+                            "at %s\n",
+                            config.vid, config.pid, location);
+    }
+    else
+    {
+        /*
+         * Locate FTDI chip using it's VID:PID pair.  This doesn't uniquely
+         * identify the programmer if there are several attached.
+         */
+        _handle = libusb_open_device_with_vid_pid(_libusb,
+                                                  config.vid,
+                                                  config.pid);
+
+        CheckCleanupStringB(_handle, libusb_open_failed,
+                            "No device found with VID:PID = 0x%04x:0x%04x\n",
+                            config.vid, config.pid);
+    }
 
     CheckCleanupB(device = libusb_get_device(_handle), get_failed);
 
@@ -46,7 +46,13 @@ public:
     MPSSE();
     virtual ~MPSSE();
 
-    Err::Error open(MPSSEConfig const & config);
+    /*
+     * Opens the programmer described by config.  If location is given, it
+     * picks out one of several identical programmers, either by USB serial
+     * number or by bus path (as in Linux sysfs, like "1-4.2").  Otherwise the
+     * first device with the right VID:PID is used.
+     */
+    Err::Error open(MPSSEConfig const & config, char const * location = 0);
 
     ftdi_context * ftdi(void);
 };
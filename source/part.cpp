@@ -0,0 +1,237 @@
+#include "part.h"
+#include "iap.h"
+#include "target.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+#include <algorithm>
+
+#define __STDC_FORMAT_MACROS
+
+#include <inttypes.h>
+
+using Err::Error;
+
+using namespace Log;
+using namespace ARM;
+
+/*
+ * IDCODE bits 31:28 give the DP's revision, which doesn't change what's behind
+ * it.
+ */
+static uint32_t const idcode_mask = 0x0FFFFFFF;
+
+static uint32_t const cortex_m0 = 0x0BB11477;
+static uint32_t const cortex_m3 = 0x0BA01477;
+
+/*
+ * Common to the LPC11xx and LPC13xx: 4 KiB sectors from address 0, RAM at
+ * 0x10000000 with its top 32 bytes kept for IAP, copies of up to 4 KiB, and
+ * the 12 MHz internal oscillator after reset.
+ */
+static uint32_t const lpc_ram  = 0x10000000;
+static size_t   const lpc_iap  = 32;
+static size_t   const lpc_copy = 4096;
+static unsigned const lpc_irc  = 12000;
+
+#define KB(n) ((n) * 1024)
+
+/*
+ * Families, which have no part ID, come first.  Their descriptions are those
+ * of the smallest part in both RAM and Flash, so that nothing we do with one
+ * -- a mass erase included -- reaches past what its smallest part has.
+ */
+static PartDescription const parts[] =
+{
+    {"LPC11xx", cortex_m0, 0,
+     0, {{KB(4), 2}}, lpc_ram, KB(2) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC13xx", cortex_m3, 0,
+     0, {{KB(4), 2}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+
+    {"LPC1111/101", cortex_m0, 0x041E502B,
+     0, {{KB(4), 2}}, lpc_ram, KB(2) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1111/102", cortex_m0, 0x2516D02B,
+     0, {{KB(4), 2}}, lpc_ram, KB(2) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1111/201", cortex_m0, 0x0416502B,
+     0, {{KB(4), 2}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1111/202", cortex_m0, 0x2516902B,
+     0, {{KB(4), 2}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1112/101", cortex_m0, 0x042D502B,
+     0, {{KB(4), 4}}, lpc_ram, KB(2) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1112/102", cortex_m0, 0x2524D02B,
+     0, {{KB(4), 4}}, lpc_ram, KB(2) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1112/201", cortex_m0, 0x0425502B,
+     0, {{KB(4), 4}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1112/202", cortex_m0, 0x2524902B,
+     0, {{KB(4), 4}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1113/201", cortex_m0, 0x0434502B,
+     0, {{KB(4), 6}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1113/202", cortex_m0, 0x2532902B,
+     0, {{KB(4), 6}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1113/301", cortex_m0, 0x0434102B,
+     0, {{KB(4), 6}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1113/302", cortex_m0, 0x2532102B,
+     0, {{KB(4), 6}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1114/201", cortex_m0, 0x0444502B,
+     0, {{KB(4), 8}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1114/202", cortex_m0, 0x2540902B,
+     0, {{KB(4), 8}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1114/301", cortex_m0, 0x0444102B,
+     0, {{KB(4), 8}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1114/302", cortex_m0, 0x2540102B,
+     0, {{KB(4), 8}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC11C12/301", cortex_m0, 0x1421102B,
+     0, {{KB(4), 4}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC11C14/301", cortex_m0, 0x1440102B,
+     0, {{KB(4), 8}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC11C22/301", cortex_m0, 0x1431102B,
+     0, {{KB(4), 4}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC11C24/301", cortex_m0, 0x1430102B,
+     0, {{KB(4), 8}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+
+    {"LPC1311",      cortex_m3, 0x2C42502B,
+     0, {{KB(4), 2}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1311/01",   cortex_m3, 0x1816902B,
+     0, {{KB(4), 2}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1313",      cortex_m3, 0x2C40102B,
+     0, {{KB(4), 8}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1313/01",   cortex_m3, 0x1830102B,
+     0, {{KB(4), 8}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1342",      cortex_m3, 0x3D01402B,
+     0, {{KB(4), 4}}, lpc_ram, KB(4) - lpc_iap, lpc_copy, lpc_irc},
+    {"LPC1343",      cortex_m3, 0x3D00002B,
+     0, {{KB(4), 8}}, lpc_ram, KB(8) - lpc_iap, lpc_copy, lpc_irc},
+};
+
+#undef KB
+
+static size_t const part_count = sizeof(parts) / sizeof(parts[0]);
+
+/******************************************************************************/
+size_t PartDescription::flash_bytes() const
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < max_sector_runs && sectors[i].count; ++i)
+    {
+        total += sectors[i].bytes * sectors[i].count;
+    }
+
+    return total;
+}
+/******************************************************************************/
+unsigned PartDescription::sector_count() const
+{
+    unsigned count = 0;
+
+    for (size_t i = 0; i < max_sector_runs && sectors[i].count; ++i)
+    {
+        count += sectors[i].count;
+    }
+
+    return count;
+}
+/******************************************************************************/
+size_t PartDescription::smallest_sector_bytes() const
+{
+    size_t smallest = sectors[0].bytes;
+
+    for (size_t i = 1; i < max_sector_runs && sectors[i].count; ++i)
+    {
+        smallest = std::min(smallest, sectors[i].bytes);
+    }
+
+    return smallest;
+}
+/******************************************************************************/
+bool PartDescription::find_sector(uint32_t address, FlashSector * sector) const
+{
+    uint32_t base  = flash_base;
+    unsigned index = 0;
+
+    if (address < base) return false;
+
+    for (size_t i = 0; i < max_sector_runs && sectors[i].count; ++i)
+    {
+        SectorRun const & run = sectors[i];
+        uint32_t const run_bytes = run.bytes * run.count;
+
+        if (address - base < run_bytes)
+        {
+            unsigned const n = (address - base) / run.bytes;
+
+            sector->index = index + n;
+            sector->base  = base + n * run.bytes;
+            sector->bytes = run.bytes;
+            return true;
+        }
+
+        base  += run_bytes;
+        index += run.count;
+    }
+
+    return false;
+}
+/******************************************************************************/
+rptr<word_t> PartDescription::work_area() const
+{
+    return rptr<word_t>(ram_base);
+}
+/******************************************************************************/
+PartDescription const * find_part(uint32_t idcode, uint32_t part_id)
+{
+    for (size_t i = 0; i < part_count; ++i)
+    {
+        if (parts[i].idcode == (idcode & idcode_mask)
+            && parts[i].part_id == part_id
+            && part_id != 0) return &parts[i];
+    }
+
+    return 0;
+}
+/******************************************************************************/
+PartDescription const * find_family(uint32_t idcode)
+{
+    for (size_t i = 0; i < part_count; ++i)
+    {
+        if (parts[i].idcode == (idcode & idcode_mask)
+            && parts[i].part_id == 0) return &parts[i];
+    }
+
+    return 0;
+}
+/******************************************************************************/
+Error identify_part(Target & target,
+                    uint32_t idcode,
+                    PartDescription const ** part)
+{
+    PartDescription const * family = find_family(idcode);
+
+    CheckStringB(family,
+                 "No description for a target with IDCODE %08"PRIX32,
+                 idcode);
+
+    uint32_t part_id;
+    Check(read_part_id(target, family->work_area(), &part_id));
+
+    *part = find_part(idcode, part_id);
+
+    if (*part == 0)
+    {
+        warning("Unknown %s part ID %08"PRIX32"; assuming %zu KiB of Flash "
+                "and %zu bytes of RAM.",
+                family->name,
+                part_id,
+                family->flash_bytes() / 1024,
+                family->ram_bytes);
+        *part = family;
+    }
+
+    notice("Target is %s (%zu KiB Flash).",
+           (*part)->name,
+           (*part)->flash_bytes() / 1024);
+
+    return Err::success;
+}
+/******************************************************************************/
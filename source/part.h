@@ -0,0 +1,118 @@
+#ifndef PART_H
+#define PART_H
+
+/*
+ * Descriptions of the parts we can program: where their Flash and RAM are,
+ * how the Flash divides into sectors, and what their IAP ROM can do.  Each
+ * part is an entry in a table in part.cpp, so supporting another is a matter
+ * of adding a line there rather than changing the programming code.
+ *
+ * A part is recognized in two steps: the DP IDCODE names the core, and so the
+ * family, whose IAP ROM then reports the part ID.
+ */
+
+#include "arm.h"
+#include "rptr.h"
+
+#include "libs/error/error_stack.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Target;
+
+
+/*
+ * A run of equal-sized Flash sectors.
+ */
+struct SectorRun
+{
+    size_t   bytes;  // Size of each sector.
+    unsigned count;  // Number of them, or zero at the end of a sector map.
+};
+
+/*
+ * One sector, found in a sector map.
+ */
+struct FlashSector
+{
+    unsigned index;   // As IAP numbers it.
+    uint32_t base;
+    size_t   bytes;
+};
+
+struct PartDescription
+{
+    static size_t const max_sector_runs = 4;
+
+    char const * name;
+
+    uint32_t     idcode;   // DP IDCODE of its core, less the revision.
+    uint32_t     part_id;  // As IAP reports it, or zero for a whole family.
+
+    uint32_t     flash_base;
+    SectorRun    sectors[max_sector_runs];  // In address order.
+
+    /*
+     * RAM we may use as a work area, starting at ram_base: all there is, less
+     * what IAP keeps for itself at the top.
+     */
+    uint32_t     ram_base;
+    size_t       ram_bytes;
+
+    size_t       max_copy_bytes;  // Largest copy_ram_to_flash allows.
+    unsigned     cclk_khz;        // Core clock after reset, as IAP wants it.
+
+    /*
+     * Total size of the Flash.
+     */
+    size_t flash_bytes() const;
+
+    /*
+     * Number of sectors in the Flash.
+     */
+    unsigned sector_count() const;
+
+    /*
+     * Size of the smallest sector -- the most that can be written without
+     * regard for where sectors begin and end.
+     */
+    size_t smallest_sector_bytes() const;
+
+    /*
+     * Finds the sector holding address, returning false if it isn't Flash.
+     */
+    bool find_sector(uint32_t address, FlashSector *) const;
+
+    /*
+     * Start of the work area, as a word pointer.
+     */
+    rptr<ARM::word_t> work_area() const;
+};
+
+/*
+ * Finds the description of the part with the given DP IDCODE and IAP part ID,
+ * or returns zero if there isn't one.
+ */
+PartDescription const * find_part(uint32_t idcode, uint32_t part_id);
+
+/*
+ * Finds the description of the family whose core has the given DP IDCODE --
+ * a conservative one, that fits every part in it -- or returns zero if there
+ * isn't one.
+ */
+PartDescription const * find_family(uint32_t idcode);
+
+/*
+ * Works out which part the target is, given its DP IDCODE, by asking its IAP
+ * ROM.  A part the family's ROM reports but we don't know gets the family's
+ * description, with a warning.  A family we don't know is an error.
+ *
+ * Asking IAP borrows the core, so the processor must be halted with
+ * breakpoints enabled, as for the functions in iap.h.
+ */
+Err::Error identify_part(Target &,
+                         uint32_t idcode,
+                         PartDescription const ** part);
+
+#endif  // PART_H
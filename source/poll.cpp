@@ -0,0 +1,154 @@
+#include "poll.h"
+#include "metrics.h"
+
+#include <algorithm>
+
+#include <unistd.h>
+
+
+static int64_t microseconds_between(timeval const & start, timeval const & end)
+{
+    return int64_t(end.tv_sec  - start.tv_sec) * 1000000
+         + (end.tv_usec - start.tv_usec);
+}
+
+/*
+ * Totals over every PollScheduler, for -stats; each instance's own figures are
+ * available from stats().
+ */
+static Metrics::Counter total_polls("poll.polls");
+static Metrics::Counter total_events("poll.events");
+static Metrics::Counter total_sleep_us("poll.sleep_us");
+
+static Metrics::Histogram event_latency("poll.event_latency");
+
+
+int milliseconds_since(timeval const & start)
+{
+    timeval     now;
+
+    gettimeofday(&now, 0);
+
+    return (now.tv_sec  - start.tv_sec)  * 1000
+         + (now.tv_usec - start.tv_usec) / 1000;
+}
+
+
+/*******************************************************************************
+ * PollScheduler implementation
+ */
+
+unsigned const PollScheduler::tight_polls;
+unsigned const PollScheduler::first_sleep_us;
+unsigned const PollScheduler::default_idle_us;
+
+PollScheduler::PollScheduler(unsigned idle_us) :
+    _idle_us(std::max(idle_us, first_sleep_us)),
+    _quiet_polls(0),
+    _sleep_us(first_sleep_us),
+    _has_deadline(false)
+{
+    reset_stats();
+}
+
+void PollScheduler::set_timeout_ms(unsigned timeout_ms)
+{
+    gettimeofday(&_deadline, 0);
+
+    _deadline.tv_sec  += timeout_ms / 1000;
+    _deadline.tv_usec += (timeout_ms % 1000) * 1000;
+
+    if (_deadline.tv_usec >= 1000000)
+    {
+        _deadline.tv_sec  += 1;
+        _deadline.tv_usec -= 1000000;
+    }
+
+    _has_deadline = true;
+}
+
+bool PollScheduler::wait()
+{
+    gettimeofday(&_last_poll, 0);
+    ++_polls;
+    ++_quiet_polls;
+    total_polls.add();
+
+    int64_t sleep_us = 0;
+
+    if (_quiet_polls > tight_polls)
+    {
+        sleep_us = _sleep_us;
+        _sleep_us = std::min(_sleep_us * 2, _idle_us);
+    }
+
+    if (_has_deadline)
+    {
+        int64_t remaining_us = microseconds_between(_last_poll, _deadline);
+        if (remaining_us <= 0) return false;
+
+        sleep_us = std::min(sleep_us, remaining_us);
+    }
+
+    if (sleep_us)
+    {
+        total_sleep_us.add(sleep_us);
+        usleep(sleep_us);
+    }
+
+    return true;
+}
+
+void PollScheduler::activity()
+{
+    timeval now;
+    gettimeofday(&now, 0);
+
+    ++_polls;
+    ++_events;
+    total_polls.add();
+    total_events.add();
+
+    unsigned latency_us = microseconds_between(_last_poll, now);
+    event_latency.record(latency_us);
+
+    _total_latency_us += latency_us;
+    _max_latency_us = std::max(_max_latency_us, latency_us);
+
+    _last_poll   = now;
+    _quiet_polls = 0;
+    _sleep_us    = first_sleep_us;
+}
+
+PollScheduler::Stats PollScheduler::stats() const
+{
+    timeval now;
+    gettimeofday(&now, 0);
+
+    int64_t const elapsed_us = microseconds_between(_stats_start, now);
+
+    Stats result;
+    result.polls        = _polls;
+    result.events       = _events;
+    result.interval_us  = _quiet_polls > tight_polls ? _sleep_us : 0;
+    result.poll_rate_hz = elapsed_us > 0
+                        ? unsigned(_polls * 1000000 / elapsed_us)
+                        : 0;
+    result.mean_latency_us = _events
+                           ? unsigned(_total_latency_us / _events)
+                           : 0;
+    result.max_latency_us = _max_latency_us;
+
+    return result;
+}
+
+void PollScheduler::reset_stats()
+{
+    gettimeofday(&_stats_start, 0);
+    _last_poll = _stats_start;
+
+    _polls  = 0;
+    _events = 0;
+    _total_latency_us = 0;
+    _max_latency_us   = 0;
+}
@@ -0,0 +1,93 @@
+#ifndef POLL_H
+#define POLL_H
+
+/*
+ * Pacing for loops that poll the target, waiting for something to happen.
+ *
+ * Each poll is a USB round trip, so polling back-to-back notices events
+ * quickly but keeps a host core and the USB host controller busy -- which
+ * slows down any other probes sharing it.  A PollScheduler polls tightly at
+ * first, and after anything happens, then sleeps for exponentially longer
+ * between polls, up to an idle interval.
+ */
+
+#include <sys/time.h>
+
+#include <stdint.h>
+
+
+/*
+ * Milliseconds elapsed since start, which was filled in by gettimeofday.
+ */
+int milliseconds_since(timeval const & start);
+
+
+class PollScheduler
+{
+public:
+    // Back-to-back polls before the first sleep.
+    static unsigned const tight_polls = 8;
+
+    // The first sleep, which doubles each poll after that.
+    static unsigned const first_sleep_us = 100;
+
+    // The default idle interval.
+    static unsigned const default_idle_us = 10000;
+
+    explicit PollScheduler(unsigned idle_us = default_idle_us);
+
+    /*
+     * Sets a deadline timeout_ms from now.  Without one, wait never gives up.
+     */
+    void set_timeout_ms(unsigned timeout_ms);
+
+    /*
+     * Call after each poll that found nothing.  Sleeps for as long as the
+     * schedule calls for -- but not past the deadline -- and returns true; or,
+     * if the deadline has passed, returns false at once.
+     */
+    bool wait();
+
+    /*
+     * Call when a poll finds what it was looking for.  Polling goes back to
+     * being tight.
+     */
+    void activity();
+
+    struct Stats
+    {
+        unsigned long polls;          // Including the ones that found events.
+        unsigned long events;
+        unsigned      interval_us;    // Current sleep between polls.
+        unsigned      poll_rate_hz;   // Since creation or reset_stats.
+
+        /*
+         * Time from the poll before each event to the poll that noticed it,
+         * which bounds how late the event was noticed.
+         */
+        unsigned      mean_latency_us;
+        unsigned      max_latency_us;
+    };
+
+    Stats stats() const;
+    void reset_stats();
+
+private:
+    unsigned _idle_us;
+
+    unsigned _quiet_polls;  // Polls since the last event.
+    unsigned _sleep_us;
+
+    bool     _has_deadline;
+    timeval  _deadline;
+
+    timeval  _last_poll;
+    timeval  _stats_start;
+
+    unsigned long _polls;
+    unsigned long _events;
+    uint64_t      _total_latency_us;
+    unsigned      _max_latency_us;
+};
+
+#endif  // POLL_H
@@ -0,0 +1,70 @@
+#include "retry.h"
+#include "metrics.h"
+
+#include <algorithm>
+
+#include <unistd.h>
+
+
+static Metrics::Counter total_retries("retry.retries");
+static Metrics::Counter total_exhausted("retry.exhausted");
+static Metrics::Counter total_backoff_us("retry.backoff_us");
+
+
+unsigned const RetryPolicy::default_attempts;
+unsigned const RetryPolicy::tight_retries;
+unsigned const RetryPolicy::first_backoff_us;
+unsigned const RetryPolicy::default_max_backoff_us;
+
+RetryPolicy::RetryPolicy() :
+    _attempts(default_attempts),
+    _max_backoff_us(default_max_backoff_us) {}
+
+void RetryPolicy::set_attempts(unsigned attempts)
+{
+    _attempts = std::max(attempts, 1u);
+}
+
+void RetryPolicy::set_max_backoff_us(unsigned max_backoff_us)
+{
+    _max_backoff_us = max_backoff_us;
+}
+
+unsigned RetryPolicy::attempts() const
+{
+    return _attempts;
+}
+
+unsigned RetryPolicy::max_backoff_us() const
+{
+    return _max_backoff_us;
+}
+
+bool RetryPolicy::retry(unsigned attempt) const
+{
+    if (attempt >= _attempts)
+    {
+        total_exhausted.add();
+        return false;
+    }
+
+    total_retries.add();
+
+    if (attempt > tight_retries && _max_backoff_us)
+    {
+        unsigned const doublings = std::min(attempt - tight_retries - 1, 16u);
+        unsigned const sleep_us  = std::min(first_backoff_us << doublings,
+                                            _max_backoff_us);
+
+        total_backoff_us.add(sleep_us);
+        usleep(sleep_us);
+    }
+
+    return true;
+}
+
+RetryPolicy & RetryPolicy::standard()
+{
+    static RetryPolicy policy;
+    return policy;
+}
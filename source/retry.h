@@ -0,0 +1,90 @@
+#ifndef RETRY_H
+#define RETRY_H
+
+/*
+ * What to do when the target answers SWD WAIT: try again, a limited number of
+ * times, backing off if it keeps saying WAIT.
+ *
+ * A WAIT usually clears by the time another USB round trip has gone by, so
+ * the first few retries are immediate.  Targets with slow Flash wait states,
+ * or busy AHB masters, can keep a MEM-AP stalled for longer; sleeping between
+ * later retries lets them catch up without burning through the retry limit in
+ * a few milliseconds.
+ *
+ * One policy, RetryPolicy::standard(), is shared by the whole process, and
+ * the tools configure it from the command line.
+ */
+
+#include "libs/error/error_stack.h"
+
+
+class RetryPolicy
+{
+public:
+    // Attempts before giving up, including the first.
+    static unsigned const default_attempts = 100;
+
+    // Retries made without sleeping.
+    static unsigned const tight_retries = 4;
+
+    // The first sleep, which doubles each retry after that.
+    static unsigned const first_backoff_us = 10;
+
+    // The default longest sleep.
+    static unsigned const default_max_backoff_us = 1000;
+
+    RetryPolicy();
+
+    /*
+     * Sets the number of attempts allowed, including the first.  Zero is taken
+     * as one: no retries.
+     */
+    void set_attempts(unsigned);
+
+    /*
+     * Sets the longest sleep between retries.  Zero never sleeps.
+     */
+    void set_max_backoff_us(unsigned);
+
+    unsigned attempts() const;
+    unsigned max_backoff_us() const;
+
+    /*
+     * Call when attempt number attempt (counting from one) has returned
+     * Err::try_again.  Sleeps for as long as the schedule calls for and
+     * returns true; or, if that was the last attempt allowed, returns false at
+     * once.
+     */
+    bool retry(unsigned attempt) const;
+
+    /*
+     * The policy used by CheckWait.
+     */
+    static RetryPolicy & standard();
+
+private:
+    unsigned _attempts;
+    unsigned _max_backoff_us;
+};
+
+
+/*
+ * Like Check, but repeats expression while it returns Err::try_again, for as
+ * long as RetryPolicy::standard() allows.
+ */
+#define CheckWait(expression)                                               \
+    do                                                                      \
+    {                                                                       \
+        Err::Error _wait_error;                                             \
+        unsigned   _wait_attempt = 1;                                       \
+                                                                            \
+        while ((_wait_error = (expression)) == Err::try_again &&            \
+               RetryPolicy::standard().retry(_wait_attempt))                \
+        {                                                                   \
+            ++_wait_attempt;                                                \
+        }                                                                   \
+                                                                            \
+        Check(_wait_error);                                                 \
+    } while (0)
+
+#endif  // RETRY_H
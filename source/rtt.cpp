@@ -0,0 +1,166 @@
+#include "rtt.h"
+
+#include "target.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+#include <string.h>
+
+using Err::Error;
+using namespace Log;
+using namespace ARM;
+
+
+/*******************************************************************************
+ * Control block layout
+ */
+
+/*
+ * The control block starts with a 16-byte identifier, then the number of up
+ * and down buffers, then a descriptor for each.
+ */
+namespace Control
+{
+    static char const id[] = "SEGGER RTT";
+
+    static size_t const max_up_buffers   = 16;  // Bytes from the start.
+    static size_t const max_down_buffers = 20;
+    static size_t const descriptors      = 24;
+
+    // Sanity limit on the buffer counts, to reject false matches.
+    static unsigned const buffer_limit = 32;
+}
+
+namespace Descriptor
+{
+    static size_t const name   = 0;  // In words.
+    static size_t const buffer = 1;
+    static size_t const size   = 2;
+    static size_t const write  = 3;
+    static size_t const read   = 4;
+    static size_t const flags  = 5;
+
+    static size_t const words  = flags + 1;
+}
+
+
+/*******************************************************************************
+ * RTT implementation
+ */
+
+RTT::RTT(Target & target) :
+    _target(target),
+    _control(0),
+    _up_count(0) {}
+
+Error RTT::find(rptr_const<word_t> start, size_t length, bool * found)
+{
+    *found = false;
+
+    size_t const word_count = length / sizeof(word_t);
+    std::vector<word_t> words(word_count);
+
+    if (word_count == 0) return Err::success;
+
+    Check(_target.read_words(start, &words[0], word_count));
+
+    size_t const header_words = Control::descriptors / sizeof(word_t);
+
+    // The control block is a C structure of words, so it's word-aligned.
+    for (size_t i = 0; i + header_words <= word_count; ++i)
+    {
+        byte_t bytes[sizeof(Control::id)];
+        for (size_t j = 0; j < sizeof(bytes); ++j)
+        {
+            bytes[j] = words[i + j / sizeof(word_t)]
+                     >> (8 * (j % sizeof(word_t)));
+        }
+
+        if (memcmp(bytes, Control::id, sizeof(Control::id)) != 0) continue;
+
+        word_t const up   = words[i + Control::max_up_buffers
+                                    / sizeof(word_t)];
+        word_t const down = words[i + Control::max_down_buffers
+                                    / sizeof(word_t)];
+
+        if (up == 0 || up > Control::buffer_limit
+                    || down > Control::buffer_limit) continue;
+
+        _control  = (start + i).bits();
+        _up_count = up;
+        *found    = true;
+
+        debug(1, "RTT control block at %08X: %u up, %u down buffers",
+              _control,
+              up,
+              down);
+
+        return Err::success;
+    }
+
+    return Err::success;
+}
+
+bool RTT::is_found() const
+{
+    return _control != 0;
+}
+
+unsigned RTT::up_buffer_count() const
+{
+    return _up_count;
+}
+
+Error RTT::read(unsigned channel, std::vector<byte_t> * data)
+{
+    if (!is_found() || channel >= _up_count) return Err::argument_error;
+
+    rptr<word_t> const descriptor(_control
+                                  + Control::descriptors
+                                  + channel * Descriptor::words
+                                            * sizeof(word_t));
+
+    word_t fields[Descriptor::words];
+    Check(_target.read_words(descriptor, fields, Descriptor::words));
+
+    word_t const buffer = fields[Descriptor::buffer];
+    word_t const size   = fields[Descriptor::size];
+    word_t const write  = fields[Descriptor::write];
+    word_t const read   = fields[Descriptor::read];
+
+    if (write == read) return Err::success;
+
+    CheckStringB(write < size && read < size,
+                 "RTT up buffer %u is corrupt (size %u, write %u, read %u)",
+                 channel,
+                 size,
+                 write,
+                 read);
+
+    size_t const old_size = data->size();
+
+    // The waiting bytes may wrap around the end of the buffer.
+    size_t const first  = write > read ? write - read : size - read;
+    size_t const second = write > read ? 0 : write;
+
+    data->resize(old_size + first + second);
+
+    Check(_target.read_bytes(rptr_const<byte_t>(buffer + read),
+                             &(*data)[old_size],
+                             first));
+
+    if (second)
+    {
+        Check(_target.read_bytes(rptr_const<byte_t>(buffer),
+                                 &(*data)[old_size + first],
+                                 second));
+    }
+
+    // Only the firmware writes the write offset, and only we write this.
+    Check(_target.write_word(descriptor + Descriptor::read, write));
+
+    debug(3, "RTT up buffer %u: %zu bytes", channel, first + second);
+
+    return Err::success;
+}
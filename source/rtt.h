@@ -0,0 +1,63 @@
+#ifndef RTT_H
+#define RTT_H
+
+/*
+ * A log channel through ring buffers in target RAM, laid out as SEGGER's
+ * Real-Time Transfer (RTT) does, so firmware can use their target code
+ * unchanged.  The firmware writes into an "up" buffer and advances its write
+ * offset; we read from it over the MEM-AP, while the processor keeps running,
+ * and advance the read offset.  Nothing halts, so logging costs the firmware
+ * a memcpy rather than a semihosting round trip.
+ *
+ * The control block that describes the buffers is found by searching RAM for
+ * its identifying string.
+ */
+
+#include "arm.h"
+#include "rptr.h"
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Target;
+
+
+class RTT
+{
+public:
+    explicit RTT(Target &);
+
+    /*
+     * Searches length bytes of target memory starting at start for the
+     * control block.  found reports whether it was there; the firmware may
+     * not have set it up yet, so it's fine to call this again later.
+     */
+    Err::Error find(rptr_const<ARM::word_t> start, size_t length, bool * found);
+
+    /*
+     * Whether find has found the control block.
+     */
+    bool is_found() const;
+
+    /*
+     * Number of up (target to host) buffers described by the control block.
+     */
+    unsigned up_buffer_count() const;
+
+    /*
+     * Appends any bytes waiting in up buffer channel to data, and tells the
+     * firmware they've been consumed.
+     */
+    Err::Error read(unsigned channel, std::vector<ARM::byte_t> * data);
+
+private:
+    Target & _target;
+    uint32_t _control;  // Address of the control block, or zero.
+    unsigned _up_count;
+};
+
+#endif  // RTT_H
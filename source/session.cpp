@@ -0,0 +1,839 @@
+#include "source/session.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace Log;
+
+using Err::Error;
+
+/*
+ * The protocol.  Both ends are on the same machine, so words go in host
+ * order.  Each request is a header and count transfers; each reply a header
+ * and count results, one per transfer.  Errors travel as wire_status codes.
+ */
+enum
+{
+    op_initialize = 1,
+    op_enter_reset,
+    op_leave_reset,
+    op_read,
+    op_write,
+    op_batch,
+    op_overrun_detection,  // arg is whether it's enabled.
+};
+
+struct RequestHeader
+{
+    uint32_t op;
+    uint32_t arg;
+    uint32_t count;
+};
+
+struct WireTransfer
+{
+    uint8_t  read;
+    uint8_t  address;
+    uint8_t  debug_port;
+    uint8_t  reserved;
+    uint32_t data;
+};
+
+struct ReplyHeader
+{
+    uint32_t result;
+    uint32_t value;
+    uint32_t count;
+};
+
+struct WireResult
+{
+    uint32_t status;
+    uint32_t data;
+};
+
+enum
+{
+    wire_success,
+    wire_try_again,
+    wire_timeout,
+    wire_failure,
+};
+
+static uint32_t encode(Error error)
+{
+    if (error == Err::success)   return wire_success;
+    if (error == Err::try_again) return wire_try_again;
+    if (error == Err::timeout)   return wire_timeout;
+
+    return wire_failure;
+}
+
+static Error decode(uint32_t status)
+{
+    switch (status)
+    {
+        case wire_success:   return Err::success;
+        case wire_try_again: return Err::try_again;
+        case wire_timeout:   return Err::timeout;
+        default:             return Err::failure;
+    }
+}
+
+/******************************************************************************/
+static Error send_all(int fd, void const * data, size_t bytes)
+{
+    uint8_t const * cursor = static_cast<uint8_t const *>(data);
+
+    while (bytes)
+    {
+        // A peer that has gone away should give us EPIPE, not SIGPIPE.
+        ssize_t sent = send(fd, cursor, bytes, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) continue;
+
+        CheckStringB(sent > 0, "Session write failed: %s", strerror(errno));
+
+        cursor += sent;
+        bytes  -= sent;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Reads exactly bytes.  closed reports the peer closing the connection before
+ * the first byte, which isn't an error.  If interrupted is given, a signal
+ * stops the read and sets it; otherwise the read carries on.
+ */
+static Error receive_all(int    fd,
+                         void * data,
+                         size_t bytes,
+                         bool * closed,
+                         bool * interrupted = 0)
+{
+    uint8_t *   cursor = static_cast<uint8_t *>(data);
+    size_t      total  = bytes;
+
+    *closed = false;
+
+    while (bytes)
+    {
+        ssize_t got = recv(fd, cursor, bytes, 0);
+
+        if (got < 0 && errno == EINTR)
+        {
+            if (!interrupted) continue;
+
+            *interrupted = true;
+            return Err::success;
+        }
+
+        if (got == 0 && bytes == total)
+        {
+            *closed = true;
+            return Err::success;
+        }
+
+        CheckStringB(got > 0,
+                     "Session read failed: %s",
+                     got == 0 ? "connection closed" : strerror(errno));
+
+        cursor += got;
+        bytes  -= got;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+static Error make_address(char const * path, sockaddr_un * address)
+{
+    CheckStringB(strlen(path) < sizeof(address->sun_path),
+                 "Session socket path too long: %s", path);
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Where the socket goes when there's neither $SWD_SESSION nor
+ * $XDG_RUNTIME_DIR: a directory of our own in /tmp, which the server makes
+ * private before listening in it.
+ */
+static std::string private_directory()
+{
+    char            buffer[64];
+
+    snprintf(buffer, sizeof(buffer), "/tmp/swdsession-%u", unsigned(getuid()));
+
+    return buffer;
+}
+/******************************************************************************/
+std::string Session::default_path()
+{
+    char const *    path = getenv("SWD_SESSION");
+
+    if (path && *path) return path;
+
+    char const *    runtime = getenv("XDG_RUNTIME_DIR");
+
+    if (runtime && *runtime) return std::string(runtime) + "/swdsession";
+
+    return private_directory() + "/socket";
+}
+/******************************************************************************/
+/*
+ * Whether info is that of a socket we own.  Nobody else can make one that we
+ * own, so a tool won't settle for a socket someone else has put in its way,
+ * and the server won't remove anything but a session of ours.
+ */
+static bool owned_socket(struct stat const & info)
+{
+    return S_ISSOCK(info.st_mode) && info.st_uid == getuid();
+}
+/******************************************************************************/
+/*
+ * Checks that the process at the other end of a connected socket runs as us.
+ * The socket on disk could have been swapped since we looked; its peer can't.
+ */
+static Error check_peer(int fd, char const * path)
+{
+#ifdef SO_PEERCRED
+    ucred       peer;
+    socklen_t   length = sizeof(peer);
+
+    CheckStringB(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0,
+                 "Can't tell whose session is at %s: %s",
+                 path, strerror(errno));
+
+    uid_t       uid = peer.uid;
+#else
+    uid_t       uid;
+    gid_t       gid;
+
+    CheckStringB(getpeereid(fd, &uid, &gid) == 0,
+                 "Can't tell whose session is at %s: %s",
+                 path, strerror(errno));
+#endif
+
+    CheckStringB(uid == getuid(),
+                 "The session at %s belongs to user %u", path, unsigned(uid));
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Makes the directory that private_directory() names, if it isn't there, and
+ * checks that it's ours and that nobody else can get into it.
+ */
+static Error make_private_directory(std::string const & directory)
+{
+    char const *    path = directory.c_str();
+
+    CheckStringB(mkdir(path, 0700) == 0 || errno == EEXIST,
+                 "Can't create %s: %s", path, strerror(errno));
+
+    struct stat     info;
+
+    CheckStringB(lstat(path, &info) == 0,
+                 "Can't look at %s: %s", path, strerror(errno));
+    CheckStringB(S_ISDIR(info.st_mode) &&
+                 info.st_uid == getuid() &&
+                 (info.st_mode & 077) == 0,
+                 "%s isn't a private directory of ours", path);
+
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * SessionDriver
+ */
+
+SessionDriver::SessionDriver() :
+    _socket(-1)
+{
+}
+/******************************************************************************/
+SessionDriver::~SessionDriver()
+{
+    if (_socket >= 0) close(_socket);
+}
+/******************************************************************************/
+Error SessionDriver::connect(char const * path)
+{
+    sockaddr_un address;
+    struct stat info;
+
+    Check(make_address(path, &address));
+
+    CheckStringB(lstat(path, &info) == 0,
+                 "No session at %s: %s", path, strerror(errno));
+    CheckStringB(owned_socket(info),
+                 "%s isn't a session socket of ours", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CheckStringB(fd >= 0, "Can't create socket: %s", strerror(errno));
+
+    if (::connect(fd, (sockaddr *) &address, sizeof(address)) != 0)
+    {
+        int error = errno;
+
+        close(fd);
+        CheckStringB(false,
+                     "No session at %s: %s", path, strerror(error));
+    }
+
+    Error   owner = check_peer(fd, path);
+
+    if (owner != Err::success)
+    {
+        close(fd);
+        return owner;
+    }
+
+    if (_socket >= 0) close(_socket);
+    _socket = fd;
+    _queue.clear();
+
+    debug(1, "Using the session at %s", path);
+
+    return Err::success;
+}
+/******************************************************************************/
+Error SessionDriver::attach(char const * path, bool * attached)
+{
+    *attached = false;
+
+    if (strcmp(path, "none") == 0) return Err::success;
+
+    if (*path)
+    {
+        Check(connect(path));
+        *attached = true;
+        return Err::success;
+    }
+
+    std::string     fallback = Session::default_path();
+    sockaddr_un     address;
+    struct stat     info;
+
+    /*
+     * Look before connecting, so that the usual case -- no session -- doesn't
+     * leave an error on the stack.
+     */
+    if (make_address(fallback.c_str(), &address) != Err::success ||
+        lstat(fallback.c_str(), &info) != 0)
+    {
+        return Err::success;
+    }
+
+    if (!owned_socket(info))
+    {
+        warning("Ignoring %s, which isn't a session socket of ours",
+                fallback.c_str());
+        return Err::success;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CheckStringB(fd >= 0, "Can't create socket: %s", strerror(errno));
+
+    if (::connect(fd, (sockaddr *) &address, sizeof(address)) != 0)
+    {
+        debug(1, "No session at %s: %s", fallback.c_str(), strerror(errno));
+        close(fd);
+        return Err::success;
+    }
+
+    Error   owner = check_peer(fd, fallback.c_str());
+
+    if (owner != Err::success)
+    {
+        close(fd);
+        return owner;
+    }
+
+    if (_socket >= 0) close(_socket);
+    _socket = fd;
+    _queue.clear();
+    *attached = true;
+
+    notice("Using the session at %s", fallback.c_str());
+
+    return Err::success;
+}
+/******************************************************************************/
+Error SessionDriver::call(unsigned                      op,
+                          unsigned                      arg,
+                          QueuedTransfer const *        transfers,
+                          size_t                        count,
+                          Error *                       result,
+                          uint32_t *                    value,
+                          std::vector<Error> *          statuses,
+                          std::vector<uint32_t> *       data)
+{
+    CheckStringB(_socket >= 0, "Not connected to a session");
+
+    RequestHeader               header = {op, arg, uint32_t(count)};
+    std::vector<uint8_t>        request(sizeof(header) +
+                                        count * sizeof(WireTransfer));
+
+    memcpy(&request[0], &header, sizeof(header));
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        WireTransfer    wire = {transfers[i].read,
+                                uint8_t(transfers[i].address),
+                                transfers[i].debug_port,
+                                0,
+                                transfers[i].write_data};
+
+        memcpy(&request[sizeof(header) + i * sizeof(wire)],
+               &wire,
+               sizeof(wire));
+    }
+
+    Check(send_all(_socket, &request[0], request.size()));
+
+    ReplyHeader reply;
+    bool        closed;
+
+    Check(receive_all(_socket, &reply, sizeof(reply), &closed));
+    CheckStringB(!closed, "The session closed the connection");
+    CheckStringB(reply.count == count,
+                 "Session sent %u results for %zu transfers",
+                 reply.count, count);
+
+    std::vector<WireResult>     results(count);
+
+    if (count)
+    {
+        Check(receive_all(_socket,
+                          &results[0],
+                          count * sizeof(WireResult),
+                          &closed));
+        CheckStringB(!closed, "The session closed the connection");
+    }
+
+    *result = decode(reply.result);
+
+    if (value) *value = reply.value;
+
+    if (statuses) statuses->resize(count);
+    if (data)     data->resize(count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (statuses) (*statuses)[i] = decode(results[i].status);
+        if (data)     (*data)[i]     = results[i].data;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+Error SessionDriver::initialize(uint32_t * idcode_out)
+{
+    Error       result;
+    uint32_t    idcode;
+
+    debug(4, "SessionDriver::initialize");
+
+    // Anything still queued belongs to a link that's about to be reset.
+    _queue.clear();
+
+    Check(call(op_initialize, 0, 0, 0, &result, &idcode));
+    Check(result);
+
+    if (idcode_out) *idcode_out = idcode;
+
+    return Err::success;
+}
+/******************************************************************************/
+Error SessionDriver::enter_reset()
+{
+    Error       result;
+
+    Check(call(op_enter_reset, 0, 0, 0, &result));
+
+    return result;
+}
+/******************************************************************************/
+Error SessionDriver::leave_reset()
+{
+    Error       result;
+
+    Check(call(op_leave_reset, 0, 0, 0, &result));
+
+    return result;
+}
+/******************************************************************************/
+Error SessionDriver::read(unsigned address, bool debug_port, uint32_t * data)
+{
+    QueuedTransfer      transfer = {true, address, debug_port, 0, data, 0};
+    Error               result;
+    uint32_t            value;
+
+    Check(call(op_read, 0, &transfer, 1, &result, &value));
+
+    if (result == Err::success && data) *data = value;
+
+    return result;
+}
+/******************************************************************************/
+Error SessionDriver::write(unsigned address, bool debug_port, uint32_t data)
+{
+    QueuedTransfer      transfer = {false, address, debug_port, data, 0, 0};
+    Error               result;
+
+    Check(call(op_write, 0, &transfer, 1, &result));
+
+    return result;
+}
+/******************************************************************************/
+Error SessionDriver::queue_transfer(QueuedTransfer const & transfer)
+{
+    if (_queue.size() >= Session::max_batch) Check(flush());
+
+    _queue.push_back(transfer);
+
+    return Err::success;
+}
+/******************************************************************************/
+Error SessionDriver::queue_read(unsigned     address,
+                                bool         debug_port,
+                                uint32_t *   data,
+                                Error *      status)
+{
+    QueuedTransfer      transfer = {true, address, debug_port,
+                                    0, data, status};
+
+    return queue_transfer(transfer);
+}
+/******************************************************************************/
+Error SessionDriver::queue_write(unsigned     address,
+                                 bool         debug_port,
+                                 uint32_t     data,
+                                 Error *      status)
+{
+    QueuedTransfer      transfer = {false, address, debug_port,
+                                    data, 0, status};
+
+    return queue_transfer(transfer);
+}
+/******************************************************************************/
+Error SessionDriver::flush()
+{
+    if (_queue.empty()) return Err::success;
+
+    /*
+     * Take the batch out of the queue before doing anything that can fail, so
+     * that a failed flush never leaves stale transfers behind.
+     */
+    std::vector<QueuedTransfer> transfers;
+    std::vector<Error>          statuses;
+    std::vector<uint32_t>       data;
+    Error                       result;
+
+    transfers.swap(_queue);
+
+    Check(call(op_batch,
+               0,
+               &transfers[0],
+               transfers.size(),
+               &result,
+               0,
+               &statuses,
+               &data));
+
+    for (size_t i = 0; i < transfers.size(); ++i)
+    {
+        QueuedTransfer const &  transfer = transfers[i];
+
+        if (transfer.status) *transfer.status = statuses[i];
+
+        if (transfer.read && transfer.data && statuses[i] == Err::success)
+            *transfer.data = data[i];
+    }
+
+    return result;
+}
+/******************************************************************************/
+void SessionDriver::set_overrun_detection(bool enabled)
+{
+    Error       result;
+
+    debug(4, "SessionDriver::set_overrun_detection(%d)", enabled);
+
+    /*
+     * There's no way to report failure from here; if the session has gone,
+     * the next transfer will say so.
+     */
+    if (call(op_overrun_detection, enabled, 0, 0, &result) != Err::success)
+        warning("Couldn't pass Overrun Detection setting to the session");
+}
+
+
+/*******************************************************************************
+ * SessionServer
+ */
+
+SessionServer::SessionServer(SWDDriver & swd) :
+    _swd(swd),
+    _socket(-1)
+{
+}
+/******************************************************************************/
+SessionServer::~SessionServer()
+{
+    if (_socket < 0) return;
+
+    close(_socket);
+    unlink(_path.c_str());
+}
+/******************************************************************************/
+Error SessionServer::listen(char const * path)
+{
+    sockaddr_un address;
+    struct stat info;
+
+    Check(make_address(path, &address));
+
+    std::string directory = private_directory();
+
+    if (path == directory + "/socket") Check(make_private_directory(directory));
+
+    /*
+     * A socket of ours that nothing answers at is left over from a session
+     * that has exited, and is replaced.  Anything else is left alone.
+     */
+    if (lstat(path, &info) == 0)
+    {
+        CheckStringB(owned_socket(info),
+                     "%s is in the way, and isn't a session socket of ours",
+                     path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        CheckStringB(fd >= 0, "Can't create socket: %s", strerror(errno));
+
+        if (::connect(fd, (sockaddr *) &address, sizeof(address)) == 0)
+        {
+            close(fd);
+            CheckStringB(false, "A session is already running at %s", path);
+        }
+
+        close(fd);
+        CheckStringB(unlink(path) == 0 || errno == ENOENT,
+                     "Can't remove %s: %s", path, strerror(errno));
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CheckStringB(fd >= 0, "Can't create socket: %s", strerror(errno));
+
+    // Only we may connect, whatever directory the socket is in.
+    mode_t      mask  = umask(077);
+    int         bound = bind(fd, (sockaddr *) &address, sizeof(address));
+    int         error = errno;
+
+    umask(mask);
+
+    if (bound != 0 || ::listen(fd, 16) != 0)
+    {
+        if (bound == 0) error = errno;
+
+        close(fd);
+        CheckStringB(false,
+                     "Can't listen at %s: %s", path, strerror(error));
+    }
+
+    _socket = fd;
+    _path   = path;
+
+    return Err::success;
+}
+/******************************************************************************/
+Error SessionServer::serve()
+{
+    CheckStringB(_socket >= 0, "Session isn't listening");
+
+    for (;;)
+    {
+        int client = accept(_socket, 0, 0);
+
+        if (client < 0)
+        {
+            if (errno == EINTR) return Err::success;
+
+            CheckStringB(false, "Can't accept: %s", strerror(errno));
+        }
+
+        if (check_peer(client, _path.c_str()) != Err::success)
+        {
+            warning("Turned away a tool:");
+            Err::stack()->print();
+            close(client);
+            continue;
+        }
+
+        debug(1, "Tool connected");
+
+        // Each tool starts with the DAP as DebugAccessPort expects to find it.
+        _swd.set_overrun_detection(false);
+
+        bool    interrupted = false;
+        Error   error = serve_client(client, &interrupted);
+
+        close(client);
+
+        /*
+         * A tool that goes wrong mid-request takes nothing else with it: say
+         * what happened, and wait for the next one.
+         */
+        if (error != Err::success)
+        {
+            warning("Dropped a tool after an error:");
+            Err::stack()->print();
+        }
+
+        if (interrupted) return Err::success;
+
+        debug(1, "Tool disconnected");
+    }
+}
+/******************************************************************************/
+Error SessionServer::serve_client(int client, bool * interrupted)
+{
+    std::vector<WireTransfer>   transfers;
+    std::vector<WireResult>     results;
+    std::vector<uint32_t>       data;
+    std::vector<Error>          statuses;
+
+    for (;;)
+    {
+        RequestHeader   request;
+        bool            closed;
+
+        Check(receive_all(client,
+                          &request,
+                          sizeof(request),
+                          &closed,
+                          interrupted));
+
+        if (closed || *interrupted) return Err::success;
+
+        CheckStringB(request.count <= Session::max_batch,
+                     "Request for %u transfers", request.count);
+
+        transfers.resize(request.count);
+
+        if (request.count)
+        {
+            Check(receive_all(client,
+                              &transfers[0],
+                              request.count * sizeof(WireTransfer),
+                              &closed));
+            CheckStringB(!closed, "Tool closed the connection mid-request");
+        }
+
+        ReplyHeader     reply  = {wire_success, 0, request.count};
+        Error           result = Err::success;
+
+        results.assign(request.count, WireResult());
+        statuses.assign(request.count, Err::try_again);
+        data.assign(request.count, 0);
+
+        switch (request.op)
+        {
+            case op_initialize:
+                result = _swd.initialize(&reply.value);
+                break;
+
+            case op_enter_reset:
+                result = _swd.enter_reset();
+                break;
+
+            case op_leave_reset:
+                result = _swd.leave_reset();
+                break;
+
+            case op_read:
+                CheckStringB(request.count == 1, "Bad read request");
+                result = _swd.read(transfers[0].address,
+                                   transfers[0].debug_port,
+                                   &reply.value);
+                break;
+
+            case op_write:
+                CheckStringB(request.count == 1, "Bad write request");
+                result = _swd.write(transfers[0].address,
+                                    transfers[0].debug_port,
+                                    transfers[0].data);
+                break;
+
+            case op_batch:
+                /*
+                 * An early flush inside the driver can fail part-way; the
+                 * transfers not yet queued then count as not performed, as
+                 * the ones after a failure in the batch itself would.
+                 */
+                for (size_t i = 0; i < transfers.size(); ++i)
+                {
+                    WireTransfer const &    transfer = transfers[i];
+
+                    if (transfer.read)
+                        result = _swd.queue_read(transfer.address,
+                                                 transfer.debug_port,
+                                                 &data[i],
+                                                 &statuses[i]);
+                    else
+                        result = _swd.queue_write(transfer.address,
+                                                  transfer.debug_port,
+                                                  transfer.data,
+                                                  &statuses[i]);
+
+                    if (result != Err::success) break;
+                }
+
+                if (result == Err::success) result = _swd.flush();
+
+                for (size_t i = 0; i < transfers.size(); ++i)
+                {
+                    results[i].status = encode(statuses[i]);
+                    results[i].data   = data[i];
+                }
+                break;
+
+            case op_overrun_detection:
+                _swd.set_overrun_detection(request.arg != 0);
+                break;
+
+            default:
+                CheckStringB(false, "Unknown session request %u", request.op);
+        }
+
+        /*
+         * Failures here are the target's or the programmer's, and belong to
+         * the tool; it will report them.
+         */
+        reply.result = encode(result);
+
+        Check(send_all(client, &reply, sizeof(reply)));
+
+        if (request.count)
+            Check(send_all(client,
+                           &results[0],
+                           request.count * sizeof(WireResult)));
+    }
+}
+/******************************************************************************/
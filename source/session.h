@@ -0,0 +1,155 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+/*
+ * Sharing one open programmer between many runs of the tools.
+ *
+ * Opening an FTDI programmer, resetting it, and setting up and synchronizing
+ * the MPSSE takes far longer than most of what the tools then do with it.
+ * swdsession does it once, and serves its SWDDriver on a UNIX socket; each
+ * tool, finding a session there, talks to it through a SessionDriver instead
+ * of opening the programmer itself.  Everything above SWDDriver -- the DAP and
+ * Target layers, retries, batching -- runs in the tool as it always does, so
+ * the tools behave the same either way.  A queued batch crosses the socket
+ * once per flush.
+ *
+ * The session serves one tool at a time; others wait in line to connect.
+ */
+
+#include "source/swd.h"
+
+#include "libs/error/error_stack.h"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+namespace Session
+{
+
+/*
+ * The socket a session listens on unless told otherwise: $SWD_SESSION if
+ * set, otherwise swdsession in $XDG_RUNTIME_DIR, otherwise one in a private
+ * directory per user in /tmp.  Tools only use a socket that we own, served
+ * by a process running as us.
+ */
+std::string default_path();
+
+/*
+ * Most transfers a single request may carry.  A SessionDriver flushes early
+ * to keep its batches within it.
+ */
+size_t const max_batch = 1024;
+
+}
+
+
+/*
+ * A SWDDriver that forwards everything to a running swdsession.
+ */
+class SessionDriver : public SWDDriver
+{
+public:
+    SessionDriver();
+    virtual ~SessionDriver();
+
+    /*
+     * Connects to the session at path.
+     */
+    Err::Error connect(char const * path);
+
+    /*
+     * Connects as the tools' -session flag asks: to the session at path; or,
+     * if path is empty, to the one at the default path, if there is one there;
+     * or, if path is "none", to nothing.  attached reports whether this driver
+     * is now connected.  Failing to find a session at the default path isn't
+     * an error; failing to find one at a path given is.
+     */
+    Err::Error attach(char const * path, bool * attached);
+
+    /*
+     * See SWDDriver for documentation of these functions.
+     */
+    virtual Err::Error initialize(uint32_t * idcode_out = 0);
+    virtual Err::Error enter_reset();
+    virtual Err::Error leave_reset();
+    virtual Err::Error read(unsigned address, bool debug_port, uint32_t *data);
+    virtual Err::Error write(unsigned address, bool debug_port, uint32_t data);
+
+    virtual Err::Error queue_read(unsigned     address,
+                                  bool         debug_port,
+                                  uint32_t *   data,
+                                  Err::Error * status = 0);
+    virtual Err::Error queue_write(unsigned     address,
+                                   bool         debug_port,
+                                   uint32_t     data,
+                                   Err::Error * status = 0);
+    virtual Err::Error flush();
+    virtual void set_overrun_detection(bool enabled);
+
+private:
+    struct QueuedTransfer
+    {
+        bool         read;
+        unsigned     address;
+        bool         debug_port;
+        uint32_t     write_data;
+        uint32_t *   data;
+        Err::Error * status;
+    };
+
+    int                         _socket;
+    std::vector<QueuedTransfer> _queue;
+
+    Err::Error queue_transfer(QueuedTransfer const &);
+
+    /*
+     * Sends a request carrying the given transfers, and waits for the reply.
+     * result is what the session's driver returned; value, any word that
+     * came with it; and statuses and data, one per transfer.
+     */
+    Err::Error call(unsigned                      op,
+                    unsigned                      arg,
+                    QueuedTransfer const *        transfers,
+                    size_t                        count,
+                    Err::Error *                  result,
+                    uint32_t *                    value = 0,
+                    std::vector<Err::Error> *     statuses = 0,
+                    std::vector<uint32_t> *       data = 0);
+};
+
+
+/*
+ * Serves a SWDDriver on a UNIX socket, for SessionDrivers to use.
+ */
+class SessionServer
+{
+public:
+    explicit SessionServer(SWDDriver &);
+    ~SessionServer();
+
+    /*
+     * Creates the socket at path, which only we may connect to.  A socket of
+     * ours left behind by a session that has exited is replaced; one that a
+     * live session is listening on, or anything else, is not.
+     */
+    Err::Error listen(char const * path);
+
+    /*
+     * Serves tools, one after another, until a signal interrupts it.
+     */
+    Err::Error serve();
+
+private:
+    SWDDriver & _swd;
+    int         _socket;
+    std::string _path;
+
+    // Serves one tool until it disconnects, or a signal interrupts.
+    Err::Error serve_client(int client, bool * interrupted);
+};
+
+#endif  // SESSION_H
@@ -0,0 +1,566 @@
+#include "source/sim_swd.h"
+#include "source/swd_dp.h"
+#include "source/armv6m_v7m.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+#include <algorithm>
+
+using namespace Log;
+
+using Err::Error;
+
+/*
+ * Wire cost of one SWD transfer: request, turnaround, ACK, turnaround, and 32
+ * data bits plus parity.  A line reset adds 50 clocks and a few idle ones.
+ */
+static unsigned const bits_per_transfer   = 46;
+static unsigned const line_reset_bits     = 58;
+
+/*
+ * These mirror MPSSESWDDriver: a batch is limited by the response bytes it
+ * produces, and each queued read returns six bytes, each write one (none
+ * with Overrun Detection, which also adds a CTRL/STAT read to every batch).
+ */
+static size_t const max_queued_response_bytes   = 512;
+static size_t const queued_read_response_bytes  = 6;
+static size_t const queued_write_response_bytes = 1;
+
+/*
+ * Real time between exchanges beyond this is cut short, which only matters to
+ * firmware that is spinning anyway.
+ */
+static uint64_t const max_idle_us = 100000;
+
+static unsigned const default_usb_latency_us = 250;
+static int      const default_clock_hz       = 6667000;
+
+/*
+ * The SW-DP and AHB-AP we pretend to be.
+ */
+static uint32_t const idcode_m0 = 0x0BB11477;  // SW-DP v1, Cortex-M0
+static uint32_t const idcode_m3 = 0x1BA01477;  // SW-DP, Cortex-M3
+
+static uint32_t const ap_idr_m0 = 0x04770031;
+static uint32_t const ap_idr_m3 = 0x04770021;
+static uint32_t const ap_base   = 0xE00FF003;  // ROM table, present.
+
+static uint32_t const ctrlstat_sticky = DebugAccessPort::kCTRLSTAT_STICKYORUN
+                                      | DebugAccessPort::kCTRLSTAT_STICKYERR
+                                      | DebugAccessPort::kCTRLSTAT_WDATAERR;
+static uint32_t const ctrlstat_cdbgpwrupack = 1u << 29;
+static uint32_t const ctrlstat_csyspwrupack = 1u << 31;
+
+namespace CSW
+{
+    static uint32_t const size_mask      = 7 << 0;
+    static uint32_t const addrinc_mask   = 3 << 4;
+    static uint32_t const addrinc_single = 1 << 4;
+    static uint32_t const device_enabled = 1 << 6;
+    static uint32_t const reset_value    = 0x23000002;
+}
+
+static uint32_t const autoincrement_boundary = 1024;
+
+/******************************************************************************/
+SimSWDDriver::Config::Config() :
+    usb_latency_us(default_usb_latency_us),
+    clock_hz(default_clock_hz),
+    wait_every(0) {}
+
+SimSWDDriver::Stats::Stats() :
+    transfers(0),
+    round_trips(0),
+    waits(0),
+    modelled_us(0),
+    idle_us(0) {}
+/******************************************************************************/
+SimSWDDriver::SimSWDDriver(SimTarget & target, Config const & config) :
+    _target(target),
+    _config(config),
+    _unrun_ns(0),
+    _overrun_detection(false),
+    _queue_response_bytes(0),
+    _select(0),
+    _ctrlstat(0),
+    _wcr(0),
+    _rdbuff(0),
+    _ap_exchanges(0),
+    _csw(CSW::reset_value),
+    _tar(0)
+{
+    gettimeofday(&_last_exchange, 0);
+}
+/******************************************************************************/
+SimSWDDriver::Stats const & SimSWDDriver::stats() const
+{
+    return _stats;
+}
+/******************************************************************************/
+void SimSWDDriver::charge(unsigned round_trips,
+                          size_t transfers,
+                          unsigned extra_bits)
+{
+    uint64_t const bits = uint64_t(transfers) * bits_per_transfer + extra_bits;
+    uint64_t const ns   = uint64_t(round_trips) * _config.usb_latency_us * 1000
+                        + bits * 1000000000 / _config.clock_hz;
+
+    _stats.round_trips += round_trips;
+    _stats.transfers   += transfers;
+
+    /*
+     * Whole microseconds go to the core and the total; the remainder carries
+     * over, so many short operations add up correctly.
+     */
+    _unrun_ns += ns;
+    unsigned const us = _unrun_ns / 1000;
+    _unrun_ns %= 1000;
+
+    _stats.modelled_us += us;
+
+    timeval now;
+    gettimeofday(&now, 0);
+
+    uint64_t const idle = uint64_t(now.tv_sec - _last_exchange.tv_sec) * 1000000
+                        + now.tv_usec - _last_exchange.tv_usec;
+    _last_exchange = now;
+    _stats.idle_us += idle;
+
+    _target.run_for(us + std::min(idle, max_idle_us));
+}
+/******************************************************************************/
+size_t SimSWDDriver::response_bytes_for(bool read) const
+{
+    if (read) return queued_read_response_bytes;
+    return _overrun_detection ? 0 : queued_write_response_bytes;
+}
+/******************************************************************************/
+Error SimSWDDriver::initialize(uint32_t * idcode_out)
+{
+    debug(4, "SimSWDDriver::initialize");
+
+    charge(1, 1, line_reset_bits);
+
+    uint32_t idcode;
+    Check(transfer(true, DebugAccessPort::kRegIDCODE, true, 0, &idcode));
+
+    if (idcode_out) *idcode_out = idcode;
+
+    return Err::success;
+}
+/******************************************************************************/
+Error SimSWDDriver::enter_reset()
+{
+    debug(4, "SimSWDDriver::enter_reset");
+
+    charge(1, 0);
+    _target.write(ARMv6M_v7M::SCB::AIRCR.bits(),
+                  ARMv6M_v7M::SCB::AIRCR_VECTKEY
+                | ARMv6M_v7M::SCB::AIRCR_SYSRESETREQ);
+    return Err::success;
+}
+/******************************************************************************/
+Error SimSWDDriver::leave_reset()
+{
+    debug(4, "SimSWDDriver::leave_reset");
+
+    charge(1, 0);
+    return Err::success;
+}
+/******************************************************************************/
+Error SimSWDDriver::read(unsigned address, bool debug_port, uint32_t * data)
+{
+    debug(4, "SimSWDDriver::read(%08X, %d)", address, debug_port);
+
+    uint32_t value;
+    bool const wait = !debug_port && wait_due();
+    Error const ack = transfer(true, address, debug_port, 0, &value, wait);
+
+    // MPSSESWDDriver fetches the data phase separately, when there is one.
+    charge(ack == Err::success || _overrun_detection ? 2 : 1, 1);
+
+    if (ack == Err::try_again && _overrun_detection) clear_overrun();
+
+    if (ack == Err::success && data) *data = value;
+
+    return ack;
+}
+/******************************************************************************/
+Error SimSWDDriver::write(unsigned address, bool debug_port, uint32_t data)
+{
+    debug(4, "SimSWDDriver::write(%08X, %d, %08X)", address, debug_port, data);
+
+    bool const wait = !debug_port && wait_due();
+    Error const ack = transfer(false, address, debug_port, data, 0, wait);
+    charge(1, 1);
+
+    if (ack == Err::try_again && _overrun_detection) clear_overrun();
+
+    return ack;
+}
+/******************************************************************************/
+void SimSWDDriver::clear_overrun()
+{
+    transfer(false,
+             DebugAccessPort::kRegABORT,
+             true,
+             DebugAccessPort::kABORT_ORUNERRCLR,
+             0);
+    charge(1, 1);
+}
+/******************************************************************************/
+void SimSWDDriver::set_overrun_detection(bool enabled)
+{
+    debug(4, "SimSWDDriver::set_overrun_detection(%d)", enabled);
+
+    _overrun_detection = enabled;
+}
+/******************************************************************************/
+Error SimSWDDriver::queue_read(unsigned     address,
+                               bool         debug_port,
+                               uint32_t *   data,
+                               Err::Error * status)
+{
+    debug(4, "SimSWDDriver::queue_read(%08X, %d)", address, debug_port);
+
+    size_t const reserved = _overrun_detection ? queued_read_response_bytes : 0;
+
+    if (_queue_response_bytes + response_bytes_for(true) + reserved
+        > max_queued_response_bytes)
+    {
+        Check(flush());
+    }
+
+    QueuedTransfer const transfer = { true, address, debug_port, 0,
+                                      data, status };
+    _queue.push_back(transfer);
+    _queue_response_bytes += response_bytes_for(true);
+
+    return Err::success;
+}
+/******************************************************************************/
+Error SimSWDDriver::queue_write(unsigned     address,
+                                bool         debug_port,
+                                uint32_t     data,
+                                Err::Error * status)
+{
+    debug(4, "SimSWDDriver::queue_write(%08X, %d, %08X)",
+          address, debug_port, data);
+
+    size_t const reserved = _overrun_detection ? queued_read_response_bytes : 0;
+
+    if (_queue_response_bytes + response_bytes_for(false) + reserved
+        > max_queued_response_bytes)
+    {
+        Check(flush());
+    }
+
+    QueuedTransfer const transfer = { false, address, debug_port, data,
+                                      0, status };
+    _queue.push_back(transfer);
+    _queue_response_bytes += response_bytes_for(false);
+
+    return Err::success;
+}
+/******************************************************************************/
+Error SimSWDDriver::flush()
+{
+    if (_queue.empty()) return Err::success;
+
+    debug(4, "SimSWDDriver::flush: %zu transfers", _queue.size());
+
+    std::vector<QueuedTransfer> batch;
+    batch.swap(_queue);
+    _queue_response_bytes = 0;
+
+    /*
+     * The round trip is charged up front, and each transfer's clocks as it
+     * happens, so that the core runs between the transfers in a batch -- and
+     * a batch that reads something the core changes, like DWT_PCSR, sees it
+     * change.  Without Overrun Detection MPSSESWDDriver doesn't batch at all,
+     * but performs each transfer as read or write would, so each is charged
+     * as they are.
+     */
+    if (_overrun_detection) charge(1, 1);
+
+    // If this batch is to meet a WAIT, it's at the middle AP access.
+    size_t ap_transfers = 0;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        if (!batch[i].debug_port) ++ap_transfers;
+    }
+
+    size_t wait_at = ap_transfers;
+    if (ap_transfers && wait_due()) wait_at = ap_transfers / 2;
+
+    Error result = Err::success;
+    size_t ap_index = 0;
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        QueuedTransfer const & queued = batch[i];
+        bool const wait = !queued.debug_port && ap_index++ == wait_at;
+
+        if (_overrun_detection) charge(0, 1);
+
+        if (result != Err::success)
+        {
+            if (queued.status) *queued.status = Err::try_again;
+            continue;
+        }
+
+        uint32_t value;
+        Error const ack = transfer(queued.read,
+                                   queued.address,
+                                   queued.debug_port,
+                                   queued.write_data,
+                                   &value,
+                                   wait);
+
+        if (!_overrun_detection)
+            charge(queued.read && ack == Err::success ? 2 : 1, 1);
+
+        if (ack == Err::success && queued.read && queued.data)
+        {
+            *queued.data = value;
+        }
+        if (queued.status) *queued.status = ack;
+        if (ack != Err::success) result = ack;
+    }
+
+    if (result != Err::success && _overrun_detection)
+    {
+        /*
+         * MPSSESWDDriver clears the overrun flag it found in CTRL/STAT after a
+         * WAIT, and resynchronizes after anything else.  Either costs another
+         * exchange.
+         */
+        if (result == Err::try_again) clear_overrun();
+        else                          charge(1, 1);
+    }
+
+    return result;
+}
+/******************************************************************************/
+bool SimSWDDriver::wait_due()
+{
+    ++_ap_exchanges;
+    return _config.wait_every && _ap_exchanges % _config.wait_every == 0;
+}
+/******************************************************************************/
+Error SimSWDDriver::transfer(bool       read,
+                             unsigned   address,
+                             bool       debug_port,
+                             uint32_t   write_data,
+                             uint32_t * read_data,
+                             bool       wait)
+{
+    bool const always_accepted =
+        debug_port
+        && ((read && address == DebugAccessPort::kRegIDCODE)
+            || (read && address == DebugAccessPort::kRegCTRLSTAT
+                && !(_select & 1))
+            || (!read && address == DebugAccessPort::kRegABORT));
+
+    // With Overrun Detection, a sticky flag makes the DP refuse the rest.
+    if ((_ctrlstat & DebugAccessPort::kCTRLSTAT_ORUNDETECT)
+        && (_ctrlstat & ctrlstat_sticky)
+        && !always_accepted)
+    {
+        return Err::failure;
+    }
+
+    if (wait)
+    {
+        ++_stats.waits;
+        if (_ctrlstat & DebugAccessPort::kCTRLSTAT_ORUNDETECT)
+        {
+            _ctrlstat |= DebugAccessPort::kCTRLSTAT_STICKYORUN;
+        }
+        return Err::try_again;
+    }
+
+    if (debug_port)
+    {
+        if (read) *read_data = read_dp(address);
+        else      write_dp(address, write_data);
+        return Err::success;
+    }
+
+    if (read)
+    {
+        // AP reads are posted: the result arrives with the next one.
+        *read_data = _rdbuff;
+        _rdbuff = read_ap((_select & 0xF0) | (address << 2));
+    }
+    else
+    {
+        write_ap((_select & 0xF0) | (address << 2), write_data);
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+uint32_t SimSWDDriver::read_dp(unsigned address)
+{
+    switch (address)
+    {
+        case DebugAccessPort::kRegIDCODE:
+            return _target.config().core == SimTarget::cortex_m0 ? idcode_m0
+                                                                 : idcode_m3;
+
+        case DebugAccessPort::kRegCTRLSTAT:
+        {
+            if (_select & 1) return _wcr;
+
+            uint32_t ctrlstat = _ctrlstat;
+            if (ctrlstat & DebugAccessPort::kCTRLSTAT_CDBGPWRUPREQ)
+            {
+                ctrlstat |= ctrlstat_cdbgpwrupack;
+            }
+            if (ctrlstat & DebugAccessPort::kCTRLSTAT_CSYSPWRUPREQ)
+            {
+                ctrlstat |= ctrlstat_csyspwrupack;
+            }
+            return ctrlstat;
+        }
+
+        case DebugAccessPort::kRegRESEND:
+            return _rdbuff;
+
+        case DebugAccessPort::kRegRDBUFF:
+        default:
+            return _rdbuff;
+    }
+}
+/******************************************************************************/
+void SimSWDDriver::write_dp(unsigned address, uint32_t data)
+{
+    switch (address)
+    {
+        case DebugAccessPort::kRegABORT:
+            if (data & DebugAccessPort::kABORT_STKERRCLR)
+            {
+                _ctrlstat &= ~DebugAccessPort::kCTRLSTAT_STICKYERR;
+            }
+            if (data & DebugAccessPort::kABORT_WDERRCLR)
+            {
+                _ctrlstat &= ~DebugAccessPort::kCTRLSTAT_WDATAERR;
+            }
+            if (data & DebugAccessPort::kABORT_ORUNERRCLR)
+            {
+                _ctrlstat &= ~DebugAccessPort::kCTRLSTAT_STICKYORUN;
+            }
+            break;
+
+        case DebugAccessPort::kRegCTRLSTAT:
+            if (_select & 1)
+            {
+                _wcr = data;
+            }
+            else
+            {
+                _ctrlstat = (data & ~ctrlstat_sticky)
+                          | (_ctrlstat & ctrlstat_sticky);
+            }
+            break;
+
+        case DebugAccessPort::kRegSELECT:
+            _select = data;
+            break;
+
+        default:  // RDBUFF ignores writes.
+            break;
+    }
+}
+/******************************************************************************/
+uint32_t SimSWDDriver::read_ap(uint8_t address)
+{
+    // Only AP 0 exists; the rest read as zero, IDR included.
+    if (_select >> 24) return 0;
+
+    switch (address)
+    {
+        case 0x00: return _csw | CSW::device_enabled;
+        case 0x04: return _tar;
+
+        case 0x0C:
+        {
+            uint32_t const data = read_memory(_tar);
+            increment_tar();
+            return data;
+        }
+
+        case 0x10: case 0x14: case 0x18: case 0x1C:
+            return _target.read((_tar & ~0xF) | (address & 0xC));
+
+        case 0xF4: return 0;
+        case 0xF8: return ap_base;
+        case 0xFC:
+            return _target.config().core == SimTarget::cortex_m0 ? ap_idr_m0
+                                                                 : ap_idr_m3;
+        default:   return 0;
+    }
+}
+/******************************************************************************/
+void SimSWDDriver::write_ap(uint8_t address, uint32_t data)
+{
+    if (_select >> 24) return;
+
+    switch (address)
+    {
+        case 0x00:
+            // Packed transfers aren't supported; that field reads back as off.
+            _csw = data & ~(CSW::device_enabled | (1 << 7));
+            if ((_csw & CSW::addrinc_mask) > CSW::addrinc_single)
+            {
+                _csw &= ~CSW::addrinc_mask;
+            }
+            break;
+
+        case 0x04:
+            _tar = data;
+            break;
+
+        case 0x0C:
+            write_memory(_tar, data);
+            increment_tar();
+            break;
+
+        case 0x10: case 0x14: case 0x18: case 0x1C:
+            _target.write((_tar & ~0xF) | (address & 0xC), data);
+            break;
+
+        default:
+            break;
+    }
+}
+/******************************************************************************/
+uint32_t SimSWDDriver::read_memory(uint32_t address)
+{
+    // Narrow reads return the whole word; the data is in its byte lanes.
+    return _target.read(address);
+}
+/******************************************************************************/
+void SimSWDDriver::write_memory(uint32_t address, uint32_t data)
+{
+    unsigned const lane = address & 3;
+
+    switch (_csw & CSW::size_mask)
+    {
+        case 0:  _target.write(address, data, 1 << lane); break;
+        case 1:  _target.write(address, data, 3 << (lane & 2)); break;
+        default: _target.write(address, data); break;
+    }
+}
+/******************************************************************************/
+void SimSWDDriver::increment_tar()
+{
+    if ((_csw & CSW::addrinc_mask) != CSW::addrinc_single) return;
+
+    // Auto-increment wraps within the bottom ten bits.
+    uint32_t const step = 1 << std::min(_csw & CSW::size_mask, 2u);
+    _tar = (_tar & ~(autoincrement_boundary - 1))
+         | ((_tar + step) & (autoincrement_boundary - 1));
+}
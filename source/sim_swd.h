@@ -0,0 +1,153 @@
+#ifndef SIM_SWD_H
+#define SIM_SWD_H
+
+/*
+ * A SWDDriver that talks to a SimTarget instead of hardware, for measuring the
+ * rest of the stack without a probe or a board.
+ *
+ * It plays the part of both the interface and the target's SW-DP: it keeps the
+ * DP registers and a single AHB-AP (AP 0), and forwards memory accesses to the
+ * SimTarget.  Instead of taking real time, it keeps a model of the time each
+ * operation would take on an MPSSE probe -- a USB round trip per exchange
+ * with the interface, plus the bits clocked on the wire -- and lets the
+ * simulated core run for that long.  The round trips are charged the way
+ * MPSSESWDDriver makes them, so code that makes fewer of them there makes
+ * fewer here.  The core also runs for the real time that passes between
+ * exchanges, so that the tools' polling loops, which sleep in real time, see
+ * it make progress.
+ *
+ * Every Nth exchange that reaches an AP can be made to meet a WAIT part-way
+ * through, to exercise retry paths.  Counting exchanges rather than transfers
+ * means a retried batch can get through, however long it is.
+ */
+
+#include "source/swd.h"
+#include "source/sim_target.h"
+
+#include "libs/error/error_stack.h"
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <vector>
+
+class SimSWDDriver : public SWDDriver
+{
+public:
+    struct Config
+    {
+        unsigned usb_latency_us;  // Cost of each exchange with the interface.
+        int      clock_hz;        // SWD clock rate.
+        unsigned wait_every;      // Put a WAIT in every Nth exchange, or 0.
+
+        Config();
+    };
+
+    /*
+     * Running totals, from construction.
+     */
+    struct Stats
+    {
+        uint64_t transfers;    // SWD transfers, including overhead ones.
+        uint64_t round_trips;  // Exchanges with the interface.
+        uint64_t waits;        // WAIT responses.
+        uint64_t modelled_us;  // Modelled time for all of the above.
+        uint64_t idle_us;      // Real time between exchanges.
+
+        Stats();
+    };
+
+    SimSWDDriver(SimTarget &, Config const &);
+
+    Stats const & stats() const;
+
+    /*
+     * See SWDDriver for documentation of these functions.
+     */
+    virtual Err::Error initialize(uint32_t *);
+    virtual Err::Error enter_reset();
+    virtual Err::Error leave_reset();
+    virtual Err::Error read(unsigned address, bool debug_port, uint32_t *data);
+    virtual Err::Error write(unsigned address, bool debug_port, uint32_t data);
+
+    virtual Err::Error queue_read(unsigned     address,
+                                  bool         debug_port,
+                                  uint32_t *   data,
+                                  Err::Error * status = 0);
+    virtual Err::Error queue_write(unsigned     address,
+                                   bool         debug_port,
+                                   uint32_t     data,
+                                   Err::Error * status = 0);
+    virtual Err::Error flush();
+    virtual void set_overrun_detection(bool enabled);
+
+private:
+    struct QueuedTransfer
+    {
+        bool         read;
+        unsigned     address;
+        bool         debug_port;
+        uint32_t     write_data;
+        uint32_t *   data;
+        Err::Error * status;
+    };
+
+    SimTarget & _target;
+    Config      _config;
+    Stats       _stats;
+    uint64_t    _unrun_ns;  // Modelled time the core hasn't yet run for.
+    timeval     _last_exchange;
+    bool        _overrun_detection;
+
+    std::vector<QueuedTransfer> _queue;
+    size_t                      _queue_response_bytes;
+
+    // SW-DP state.
+    uint32_t _select;
+    uint32_t _ctrlstat;  // As written, plus the sticky flags.
+    uint32_t _wcr;
+    uint32_t _rdbuff;
+    uint64_t _ap_exchanges;
+
+    // MEM-AP state.
+    uint32_t _csw;
+    uint32_t _tar;
+
+    // Accounts for round_trips exchanges carrying transfers SWD transfers
+    // (and extra_bits other clocks), and lets the core run for that long.
+    void charge(unsigned round_trips,
+                size_t transfers,
+                unsigned extra_bits = 0);
+
+    // Bytes of response a queued transfer would take on an MPSSE.
+    size_t response_bytes_for(bool read) const;
+
+    // Counts an exchange reaching an AP; returns whether it meets a WAIT.
+    bool wait_due();
+
+    /*
+     * Performs one transfer against the DP model, returning its ACK.  With
+     * wait set, an AP access answers WAIT instead.
+     */
+    Err::Error transfer(bool       read,
+                        unsigned   address,
+                        bool       debug_port,
+                        uint32_t   write_data,
+                        uint32_t * read_data,
+                        bool       wait = false);
+
+    uint32_t read_dp(unsigned address);
+    void write_dp(unsigned address, uint32_t data);
+    uint32_t read_ap(uint8_t address);
+    void write_ap(uint8_t address, uint32_t data);
+
+    // Performs a MEM-AP access at address, with the size in CSW.
+    uint32_t read_memory(uint32_t address);
+    void write_memory(uint32_t address, uint32_t data);
+    void increment_tar();
+
+    // Clears STICKYORUN after a WAIT, as MPSSESWDDriver does.
+    void clear_overrun();
+};
+
+#endif  // SIM_SWD_H
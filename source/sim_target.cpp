@@ -0,0 +1,1136 @@
+#include "sim_target.h"
+
+#include "armv6m_v7m.h"
+#include "lpc11xx_13xx.h"
+
+#include <algorithm>
+
+using namespace ARM;
+using namespace ARMv6M_v7M;
+using namespace LPC11xx_13xx;
+
+
+/*******************************************************************************
+ * Constants
+ */
+
+static uint32_t const ram_bytes_default   = 8 * 1024;
+static uint32_t const flash_bytes_default = 32 * 1024;
+static unsigned const core_mhz_default    = 12;
+
+// The System Control Space, holding the SCB and DCB.
+static uint32_t const scs_base = 0xE000E000;
+static uint32_t const scs_end  = 0xE000F000;
+
+static uint32_t const CPUID = 0xE000ED00;
+static word_t const cpuid_m0 = 0x410CC200;  // Cortex-M0 r0p0
+static word_t const cpuid_m3 = 0x412FC230;  // Cortex-M3 r2p0
+
+// DHCSR bits not named in armv6m_v7m.h.
+static word_t const DHCSR_S_LOCKUP    = 1 << 19;
+static word_t const DHCSR_S_RESET_ST  = 1 << 25;
+static word_t const DHCSR_control_mask = DCB::DHCSR_C_DEBUGEN
+                                       | DCB::DHCSR_C_HALT
+                                       | DCB::DHCSR_C_STEP
+                                       | DCB::DHCSR_C_MASKINTS;
+
+static word_t const DCRSR_REGSEL_mask = 0x1F;
+
+static size_t const breakpoint_count = 4;
+
+// xPSR flags.
+static word_t const xPSR_N = 1u << 31;
+static word_t const xPSR_Z = 1u << 30;
+static word_t const xPSR_C = 1u << 29;
+static word_t const xPSR_V = 1u << 28;
+static word_t const xPSR_T = 1u << 24;
+
+// IAP status codes, as in the LPC user manuals.
+namespace IAPStatus
+{
+    static word_t const success             = 0;
+    static word_t const invalid_command     = 1;
+    static word_t const src_addr_error      = 2;
+    static word_t const dst_addr_error      = 3;
+    static word_t const src_addr_not_mapped = 4;
+    static word_t const dst_addr_not_mapped = 5;
+    static word_t const count_error         = 6;
+    static word_t const invalid_sector      = 7;
+    static word_t const sector_not_blank    = 8;
+    static word_t const sector_not_prepared = 9;
+    static word_t const compare_error       = 10;
+}
+
+static word_t const part_id_lpc1114 = 0x0444102B;
+static word_t const part_id_lpc1343 = 0x3D00002B;
+static word_t const boot_code_version = 0x00000102;
+
+
+/*******************************************************************************
+ * Construction and the bus
+ */
+
+SimTarget::Config::Config() :
+    core(cortex_m0),
+    flash_bytes(flash_bytes_default),
+    ram_bytes(ram_bytes_default),
+    core_mhz(core_mhz_default) {}
+
+uint32_t const SimTarget::flash_base;
+uint32_t const SimTarget::ram_base;
+size_t   const SimTarget::sector_bytes;
+
+SimTarget::SimTarget(Config const & config) :
+    _config(config),
+    _flash(config.flash_bytes / sizeof(word_t), 0xFFFFFFFF),
+    _ram(config.ram_bytes / sizeof(word_t), 0),
+    _xpsr(xPSR_T),
+    _psp(0),
+    _control(0),
+    _halted(false),
+    _locked_up(false),
+    _instructions(0),
+    _dhcsr(0),
+    _dcrdr(0),
+    _demcr(0),
+    _dfsr(0),
+    _reset_seen(false),
+    _bp_ctrl(0),
+    _prepared(sector_count(), false)
+{
+    std::fill(_r, _r + 16, 0);
+    std::fill(_bp_comp, _bp_comp + breakpoint_count, 0);
+
+    // Power on.  With Flash erased, the core soon locks up, like a blank part.
+    reset();
+}
+
+SimTarget::Config const & SimTarget::config() const
+{
+    return _config;
+}
+
+std::vector<word_t> & SimTarget::flash()
+{
+    return _flash;
+}
+
+bool SimTarget::is_halted() const
+{
+    return _halted;
+}
+
+uint64_t SimTarget::instructions() const
+{
+    return _instructions;
+}
+
+size_t SimTarget::sector_count() const
+{
+    return _config.flash_bytes / sector_bytes;
+}
+
+word_t * SimTarget::memory_word(uint32_t address)
+{
+    if (address - flash_base < _flash.size() * sizeof(word_t))
+    {
+        return &_flash[(address - flash_base) / sizeof(word_t)];
+    }
+
+    if (address - ram_base < _ram.size() * sizeof(word_t))
+    {
+        return &_ram[(address - ram_base) / sizeof(word_t)];
+    }
+
+    return 0;
+}
+
+word_t SimTarget::read(uint32_t address)
+{
+    address &= ~uint32_t(sizeof(word_t) - 1);
+
+    if (word_t * word = memory_word(address)) return *word;
+
+    if ((address >= scs_base && address < scs_end)
+        || (address >= BPU::BP_CTRL.bits()
+            && address < (BPU::BP_COMP0 + breakpoint_count).bits())
+        || address == DWT::DWT_PCSR.bits())
+    {
+        return read_scs(address);
+    }
+
+    std::map<uint32_t, word_t>::const_iterator i = _other.find(address);
+    return i == _other.end() ? 0 : i->second;
+}
+
+void SimTarget::write(uint32_t address, word_t data, unsigned lanes)
+{
+    address &= ~uint32_t(sizeof(word_t) - 1);
+
+    word_t lane_mask = 0;
+    for (unsigned lane = 0; lane < sizeof(word_t); ++lane)
+    {
+        if (lanes & (1 << lane)) lane_mask |= 0xFF << (8 * lane);
+    }
+
+    if (address - flash_base < _flash.size() * sizeof(word_t))
+    {
+        return;  // Flash is only written through IAP.
+    }
+
+    if (word_t * word = memory_word(address))
+    {
+        *word = (*word & ~lane_mask) | (data & lane_mask);
+        return;
+    }
+
+    if ((address >= scs_base && address < scs_end)
+        || (address >= BPU::BP_CTRL.bits()
+            && address < (BPU::BP_COMP0 + breakpoint_count).bits()))
+    {
+        write_scs(address, data);
+        return;
+    }
+
+    word_t & word = _other[address];
+    word = (word & ~lane_mask) | (data & lane_mask);
+}
+
+uint8_t SimTarget::read8(uint32_t address)
+{
+    return read(address) >> (8 * (address & 3));
+}
+
+uint16_t SimTarget::read16(uint32_t address)
+{
+    return read(address) >> (8 * (address & 2));
+}
+
+void SimTarget::write8(uint32_t address, uint8_t data)
+{
+    unsigned const shift = address & 3;
+    write(address, word_t(data) << (8 * shift), 1 << shift);
+}
+
+void SimTarget::write16(uint32_t address, uint16_t data)
+{
+    unsigned const shift = address & 2;
+    write(address, word_t(data) << (8 * shift), 3 << shift);
+}
+
+
+/*******************************************************************************
+ * Debug registers
+ */
+
+word_t SimTarget::read_scs(uint32_t address)
+{
+    if (address == CPUID)
+    {
+        return _config.core == cortex_m0 ? cpuid_m0 : cpuid_m3;
+    }
+
+    if (address == SCB::AIRCR.bits()) return 0xFA050000;
+
+    if (address == SCB::DFSR.bits()) return _dfsr;
+
+    if (address == DCB::DHCSR.bits())
+    {
+        word_t dhcsr = _dhcsr | DCB::DHCSR_S_REGRDY;
+        if (_halted)     dhcsr |= DCB::DHCSR_S_HALT;
+        if (_locked_up)  dhcsr |= DHCSR_S_LOCKUP;
+        if (_reset_seen) dhcsr |= DHCSR_S_RESET_ST;
+
+        _reset_seen = false;  // Cleared by reading.
+        return dhcsr;
+    }
+
+    if (address == DCB::DCRDR.bits()) return _dcrdr;
+    if (address == DCB::DEMCR.bits()) return _demcr;
+
+    if (address == DWT::DWT_PCSR.bits())
+    {
+        return _halted ? DWT::DWT_PCSR_no_sample : _r[Register::PC];
+    }
+
+    if (address == BPU::BP_CTRL.bits())
+    {
+        return (_bp_ctrl & BPU::BP_CTRL_ENABLE) | (breakpoint_count << 4);
+    }
+
+    if (address >= BPU::BP_COMP0.bits())
+    {
+        size_t const n = (address - BPU::BP_COMP0.bits()) / sizeof(word_t);
+        if (n < breakpoint_count) return _bp_comp[n];
+    }
+
+    return 0;
+}
+
+void SimTarget::write_scs(uint32_t address, word_t data)
+{
+    if (address == SCB::AIRCR.bits())
+    {
+        if ((data & 0xFFFF0000) == SCB::AIRCR_VECTKEY
+            && (data & SCB::AIRCR_SYSRESETREQ))
+        {
+            reset();
+        }
+        return;
+    }
+
+    if (address == SCB::DFSR.bits())
+    {
+        _dfsr &= ~data;  // Write one to clear.
+        return;
+    }
+
+    if (address == DCB::DHCSR.bits())
+    {
+        if ((data & 0xFFFF0000) != DCB::DHCSR_DBGKEY) return;
+
+        _dhcsr = data & DHCSR_control_mask;
+
+        if (!(_dhcsr & DCB::DHCSR_C_DEBUGEN))
+        {
+            _dhcsr = 0;
+            _halted = false;
+        }
+        else if (_dhcsr & DCB::DHCSR_C_HALT)
+        {
+            if (!_halted) halt(SCB::DFSR_HALTED);
+        }
+        else if (_halted)
+        {
+            _halted = false;
+
+            if (_dhcsr & DCB::DHCSR_C_STEP)
+            {
+                step();
+                if (!_halted) halt(SCB::DFSR_HALTED);
+            }
+        }
+        return;
+    }
+
+    if (address == DCB::DCRSR.bits())
+    {
+        unsigned const n = data & DCRSR_REGSEL_mask;
+        bool const writing = data & DCB::DCRSR_WRITE;
+
+        word_t * reg = 0;
+        if (n <= Register::PC)                        reg = &_r[n];
+        else if (n == Register::xPSR)                 reg = &_xpsr;
+        else if (n == Register::MSP)                  reg = &_r[Register::SP];
+        else if (n == Register::PSP)                  reg = &_psp;
+        else if (n == Register::CONTROL_and_masks)    reg = &_control;
+
+        if (reg == 0) return;
+
+        if (writing)
+        {
+            *reg = _dcrdr;
+            if (n == Register::PC) *reg &= ~word_t(1);
+        }
+        else
+        {
+            _dcrdr = *reg;
+        }
+        return;
+    }
+
+    if (address == DCB::DCRDR.bits())
+    {
+        _dcrdr = data;
+        return;
+    }
+
+    if (address == DCB::DEMCR.bits())
+    {
+        _demcr = data;
+        return;
+    }
+
+    if (address == BPU::BP_CTRL.bits())
+    {
+        if (data & BPU::BP_CTRL_KEY) _bp_ctrl = data & BPU::BP_CTRL_ENABLE;
+        return;
+    }
+
+    if (address >= BPU::BP_COMP0.bits())
+    {
+        size_t const n = (address - BPU::BP_COMP0.bits()) / sizeof(word_t);
+        if (n < breakpoint_count) _bp_comp[n] = data;
+    }
+}
+
+void SimTarget::halt(word_t reason)
+{
+    if (!(_dhcsr & DCB::DHCSR_C_DEBUGEN))
+    {
+        // Without debug, a BKPT is a HardFault, which we don't model further.
+        _locked_up = true;
+        return;
+    }
+
+    _halted = true;
+    _dhcsr |= DCB::DHCSR_C_HALT;
+    _dfsr |= reason;
+}
+
+void SimTarget::reset()
+{
+    std::fill(_r, _r + 16, 0);
+    _r[Register::SP] = read(flash_base + 0);
+    _r[Register::PC] = read(flash_base + 4) & ~word_t(1);
+    _xpsr      = xPSR_T;
+    _control   = 0;
+    _halted    = false;
+    _locked_up = false;
+    _reset_seen = true;
+    std::fill(_prepared.begin(), _prepared.end(), false);
+
+    if ((_dhcsr & DCB::DHCSR_C_DEBUGEN) && (_demcr & DCB::DEMCR_VC_CORERESET))
+    {
+        halt(SCB::DFSR_VCATCH);
+    }
+}
+
+bool SimTarget::breakpoint_at(uint32_t pc) const
+{
+    if (!(_bp_ctrl & BPU::BP_CTRL_ENABLE)) return false;
+
+    for (size_t n = 0; n < breakpoint_count; ++n)
+    {
+        word_t const comp = _bp_comp[n];
+        if (!(comp & BPU::BP_COMPx_ENABLE)) continue;
+        if ((comp & BPU::BP_COMPx_COMP_mask) != (pc & BPU::BP_COMPx_COMP_mask))
+        {
+            continue;
+        }
+
+        word_t const match = comp & BPU::BP_COMPx_MATCH_BOTH;
+        if (match == BPU::BP_COMPx_MATCH_BOTH) return true;
+        if (match == BPU::BP_COMPx_MATCH_LOW  && !(pc & 2)) return true;
+        if (match == BPU::BP_COMPx_MATCH_HIGH &&  (pc & 2)) return true;
+    }
+
+    return false;
+}
+
+
+/*******************************************************************************
+ * The core
+ */
+
+void SimTarget::run_for(unsigned microseconds)
+{
+    uint64_t budget = uint64_t(microseconds) * _config.core_mhz;
+
+    while (budget-- && !_halted && !_locked_up) step();
+}
+
+bool SimTarget::condition_passed(unsigned cond) const
+{
+    bool const n = _xpsr & xPSR_N;
+    bool const z = _xpsr & xPSR_Z;
+    bool const c = _xpsr & xPSR_C;
+    bool const v = _xpsr & xPSR_V;
+
+    switch (cond)
+    {
+        case 0x0: return z;
+        case 0x1: return !z;
+        case 0x2: return c;
+        case 0x3: return !c;
+        case 0x4: return n;
+        case 0x5: return !n;
+        case 0x6: return v;
+        case 0x7: return !v;
+        case 0x8: return c && !z;
+        case 0x9: return !c || z;
+        case 0xA: return n == v;
+        case 0xB: return n != v;
+        case 0xC: return !z && n == v;
+        case 0xD: return z || n != v;
+        default:  return true;
+    }
+}
+
+void SimTarget::set_nz(word_t result)
+{
+    _xpsr &= ~(xPSR_N | xPSR_Z);
+    if (result & (1u << 31)) _xpsr |= xPSR_N;
+    if (result == 0)         _xpsr |= xPSR_Z;
+}
+
+word_t SimTarget::add_with_carry(word_t a, word_t b, bool carry_in)
+{
+    uint64_t const unsigned_sum = uint64_t(a) + b + carry_in;
+    int64_t  const signed_sum   = int64_t(int32_t(a)) + int32_t(b) + carry_in;
+    word_t   const result       = word_t(unsigned_sum);
+
+    set_nz(result);
+    _xpsr &= ~(xPSR_C | xPSR_V);
+    if (unsigned_sum >> 32)                  _xpsr |= xPSR_C;
+    if (int64_t(int32_t(result)) != signed_sum) _xpsr |= xPSR_V;
+
+    return result;
+}
+
+void SimTarget::step()
+{
+    uint32_t const pc = _r[Register::PC];
+
+    if (pc == IAP::entry.bits())
+    {
+        call_iap();
+        return;
+    }
+
+    if (breakpoint_at(pc))
+    {
+        halt(SCB::DFSR_BKPT);
+        return;
+    }
+
+    if (memory_word(pc) == 0)
+    {
+        // Nothing to fetch: a HardFault, which we don't model further.
+        if (_demcr & DCB::DEMCR_VC_HARDERR) halt(SCB::DFSR_VCATCH);
+        else                                _locked_up = true;
+        return;
+    }
+
+    ++_instructions;
+
+    uint16_t const op = read16(pc);
+    word_t const pc_value = pc + 4;  // PC as seen by the instruction.
+    word_t next_pc = pc + 2;
+
+    word_t * const r = _r;
+    unsigned const rd = op & 7;
+    unsigned const rn = (op >> 3) & 7;
+    unsigned const rm = (op >> 6) & 7;
+
+    bool undefined = false;
+
+    switch (op >> 11)
+    {
+        case 0x00:  // LSLS Rd, Rm, #imm5
+        case 0x01:  // LSRS Rd, Rm, #imm5
+        case 0x02:  // ASRS Rd, Rm, #imm5
+        {
+            unsigned const imm = (op >> 6) & 0x1F;
+            word_t const value = r[rn];
+            word_t result = value;
+            bool carry = _xpsr & xPSR_C;
+
+            if ((op >> 11) == 0x00)
+            {
+                if (imm)
+                {
+                    carry  = (value >> (32 - imm)) & 1;
+                    result = value << imm;
+                }
+            }
+            else
+            {
+                unsigned const amount = imm ? imm : 32;
+                carry = (value >> (amount - 1)) & 1;
+                if ((op >> 11) == 0x01)
+                {
+                    result = amount == 32 ? 0 : value >> amount;
+                }
+                else
+                {
+                    result = amount == 32 ? word_t(int32_t(value) >> 31)
+                                          : word_t(int32_t(value) >> amount);
+                }
+            }
+
+            r[rd] = result;
+            set_nz(result);
+            _xpsr = carry ? (_xpsr | xPSR_C) : (_xpsr & ~xPSR_C);
+            break;
+        }
+
+        case 0x03:  // ADDS/SUBS Rd, Rn, Rm or #imm3
+        {
+            word_t const operand = (op & (1 << 10)) ? rm : r[rm];
+            if (op & (1 << 9)) r[rd] = add_with_carry(r[rn], ~operand, true);
+            else               r[rd] = add_with_carry(r[rn], operand, false);
+            break;
+        }
+
+        case 0x04:  // MOVS Rd, #imm8
+            r[(op >> 8) & 7] = op & 0xFF;
+            set_nz(op & 0xFF);
+            break;
+
+        case 0x05:  // CMP Rn, #imm8
+            add_with_carry(r[(op >> 8) & 7], ~word_t(op & 0xFF), true);
+            break;
+
+        case 0x06:  // ADDS Rd, #imm8
+            r[(op >> 8) & 7] = add_with_carry(r[(op >> 8) & 7], op & 0xFF,
+                                              false);
+            break;
+
+        case 0x07:  // SUBS Rd, #imm8
+            r[(op >> 8) & 7] = add_with_carry(r[(op >> 8) & 7],
+                                              ~word_t(op & 0xFF), true);
+            break;
+
+        case 0x08:
+            if ((op & 0xFC00) == 0x4000)  // Data processing
+            {
+                word_t const a = r[rd];
+                word_t const b = r[rn];
+                bool carry = _xpsr & xPSR_C;
+                word_t result = a;
+                bool write = true;
+
+                switch ((op >> 6) & 0xF)
+                {
+                    case 0x0: result = a & b; break;           // ANDS
+                    case 0x1: result = a ^ b; break;           // EORS
+                    case 0x2:                                  // LSLS
+                    case 0x3:                                  // LSRS
+                    case 0x4:                                  // ASRS
+                    case 0x7:                                  // RORS
+                    {
+                        unsigned const kind = (op >> 6) & 0xF;
+                        unsigned const amount = b & 0xFF;
+                        if (amount == 0) break;
+
+                        if (kind == 0x2)
+                        {
+                            carry  = amount <= 32 && ((a >> (32 - amount)) & 1);
+                            result = amount < 32 ? a << amount : 0;
+                        }
+                        else if (kind == 0x3)
+                        {
+                            carry  = amount <= 32 && ((a >> (amount - 1)) & 1);
+                            result = amount < 32 ? a >> amount : 0;
+                        }
+                        else if (kind == 0x4)
+                        {
+                            unsigned const s = std::min(amount, 32u);
+                            carry  = (word_t(int32_t(a) >> (s - 1))) & 1;
+                            result = word_t(int32_t(a) >> std::min(s, 31u));
+                        }
+                        else
+                        {
+                            unsigned const s = amount & 31;
+                            result = s ? (a >> s) | (a << (32 - s)) : a;
+                            carry  = result >> 31;
+                        }
+                        break;
+                    }
+                    case 0x5:                                  // ADCS
+                        r[rd] = add_with_carry(a, b, carry);
+                        write = false;
+                        break;
+                    case 0x6:                                  // SBCS
+                        r[rd] = add_with_carry(a, ~b, carry);
+                        write = false;
+                        break;
+                    case 0x8:                                  // TST
+                        set_nz(a & b);
+                        write = false;
+                        break;
+                    case 0x9:                                  // RSBS
+                        r[rd] = add_with_carry(~b, 0, true);
+                        write = false;
+                        break;
+                    case 0xA:                                  // CMP
+                        add_with_carry(a, ~b, true);
+                        write = false;
+                        break;
+                    case 0xB:                                  // CMN
+                        add_with_carry(a, b, false);
+                        write = false;
+                        break;
+                    case 0xC: result = a | b; break;           // ORRS
+                    case 0xD: result = a * b; break;           // MULS
+                    case 0xE: result = a & ~b; break;          // BICS
+                    case 0xF: result = ~b; break;              // MVNS
+                }
+
+                if (write)
+                {
+                    r[rd] = result;
+                    set_nz(result);
+                    _xpsr = carry ? (_xpsr | xPSR_C) : (_xpsr & ~xPSR_C);
+                }
+            }
+            else  // Special data and branches
+            {
+                unsigned const d = (op & 7) | ((op >> 4) & 8);
+                unsigned const m = (op >> 3) & 0xF;
+                word_t const value = m == Register::PC ? pc_value : r[m];
+
+                switch ((op >> 8) & 3)
+                {
+                    case 0:  // ADD Rd, Rm
+                        if (d == Register::PC)
+                        {
+                            next_pc = (pc_value + value) & ~word_t(1);
+                        }
+                        else
+                        {
+                            r[d] += value;
+                        }
+                        break;
+                    case 1:  // CMP Rn, Rm
+                        add_with_carry(r[d], ~value, true);
+                        break;
+                    case 2:  // MOV Rd, Rm
+                        if (d == Register::PC) next_pc = value & ~word_t(1);
+                        else                   r[d] = value;
+                        break;
+                    case 3:  // BX/BLX Rm
+                        if (op & (1 << 7)) r[Register::LR] = (pc + 2) | 1;
+                        next_pc = value & ~word_t(1);
+                        break;
+                }
+            }
+            break;
+
+        case 0x09:  // LDR Rt, [PC, #imm8]
+        {
+            uint32_t const base = pc_value & ~uint32_t(3);
+            r[(op >> 8) & 7] = read(base + (op & 0xFF) * 4);
+            break;
+        }
+
+        case 0x0A:
+        case 0x0B:  // Load/store with register offset
+        {
+            uint32_t const address = r[rn] + r[rm];
+            switch ((op >> 9) & 7)
+            {
+                case 0: write(address, r[rd]); break;          // STR
+                case 1: write16(address, r[rd]); break;        // STRH
+                case 2: write8(address, r[rd]); break;         // STRB
+                case 3: r[rd] = int8_t(read8(address)); break;    // LDRSB
+                case 4: r[rd] = read(address); break;          // LDR
+                case 5: r[rd] = read16(address); break;        // LDRH
+                case 6: r[rd] = read8(address); break;         // LDRB
+                case 7: r[rd] = int16_t(read16(address)); break;  // LDRSH
+            }
+            break;
+        }
+
+        case 0x0C:  // STR Rt, [Rn, #imm5]
+            write(r[rn] + ((op >> 6) & 0x1F) * 4, r[rd]);
+            break;
+
+        case 0x0D:  // LDR Rt, [Rn, #imm5]
+            r[rd] = read(r[rn] + ((op >> 6) & 0x1F) * 4);
+            break;
+
+        case 0x0E:  // STRB Rt, [Rn, #imm5]
+            write8(r[rn] + ((op >> 6) & 0x1F), r[rd]);
+            break;
+
+        case 0x0F:  // LDRB Rt, [Rn, #imm5]
+            r[rd] = read8(r[rn] + ((op >> 6) & 0x1F));
+            break;
+
+        case 0x10:  // STRH Rt, [Rn, #imm5]
+            write16(r[rn] + ((op >> 6) & 0x1F) * 2, r[rd]);
+            break;
+
+        case 0x11:  // LDRH Rt, [Rn, #imm5]
+            r[rd] = read16(r[rn] + ((op >> 6) & 0x1F) * 2);
+            break;
+
+        case 0x12:  // STR Rt, [SP, #imm8]
+            write(r[Register::SP] + (op & 0xFF) * 4, r[(op >> 8) & 7]);
+            break;
+
+        case 0x13:  // LDR Rt, [SP, #imm8]
+            r[(op >> 8) & 7] = read(r[Register::SP] + (op & 0xFF) * 4);
+            break;
+
+        case 0x14:  // ADR Rd, label
+            r[(op >> 8) & 7] = (pc_value & ~word_t(3)) + (op & 0xFF) * 4;
+            break;
+
+        case 0x15:  // ADD Rd, SP, #imm8
+            r[(op >> 8) & 7] = r[Register::SP] + (op & 0xFF) * 4;
+            break;
+
+        case 0x16:
+        case 0x17:  // Miscellaneous
+            if ((op & 0xFF00) == 0xB000)  // ADD/SUB SP, #imm7
+            {
+                word_t const offset = (op & 0x7F) * 4;
+                if (op & 0x80) r[Register::SP] -= offset;
+                else           r[Register::SP] += offset;
+            }
+            else if ((op & 0xF500) == 0xB100
+                     && _config.core == cortex_m3)  // CBZ/CBNZ
+            {
+                bool const nonzero = op & (1 << 11);
+                word_t const offset = (((op >> 9) & 1) << 6)
+                                    | (((op >> 3) & 0x1F) << 1);
+                if ((r[rd] != 0) == nonzero) next_pc = pc_value + offset;
+            }
+            else if ((op & 0xFF00) == 0xB200)  // Extends
+            {
+                word_t const value = r[rn];
+                switch ((op >> 6) & 3)
+                {
+                    case 0: r[rd] = word_t(int16_t(value)); break;  // SXTH
+                    case 1: r[rd] = word_t(int8_t(value)); break;   // SXTB
+                    case 2: r[rd] = value & 0xFFFF; break;          // UXTH
+                    case 3: r[rd] = value & 0xFF; break;            // UXTB
+                }
+            }
+            else if ((op & 0xFE00) == 0xB400)  // PUSH
+            {
+                uint32_t const mask = (op & 0xFF)
+                                    | ((op & 0x100) << (Register::LR - 8));
+                unsigned count = 0;
+                for (unsigned n = 0; n < 16; ++n) count += (mask >> n) & 1;
+
+                uint32_t address = r[Register::SP] - 4 * count;
+                r[Register::SP] = address;
+                for (unsigned n = 0; n < 16; ++n)
+                {
+                    if (mask & (1 << n))
+                    {
+                        write(address, r[n]);
+                        address += 4;
+                    }
+                }
+            }
+            else if ((op & 0xFFEF) == 0xB662)  // CPSIE/CPSID i
+            {
+                if (op & 0x10) _control |= 1;
+                else           _control &= ~word_t(1);
+            }
+            else if ((op & 0xFF00) == 0xBA00 && ((op >> 6) & 3) != 2)
+            {
+                word_t const v = r[rn];
+                switch ((op >> 6) & 3)
+                {
+                    case 0:  // REV
+                        r[rd] = (v >> 24) | ((v >> 8) & 0xFF00)
+                              | ((v << 8) & 0xFF0000) | (v << 24);
+                        break;
+                    case 1:  // REV16
+                        r[rd] = ((v >> 8) & 0x00FF00FF)
+                              | ((v << 8) & 0xFF00FF00);
+                        break;
+                    case 3:  // REVSH
+                        r[rd] = word_t(int16_t(((v >> 8) & 0xFF)
+                                               | ((v & 0xFF) << 8)));
+                        break;
+                }
+            }
+            else if ((op & 0xFE00) == 0xBC00)  // POP
+            {
+                uint32_t address = r[Register::SP];
+                for (unsigned n = 0; n < 8; ++n)
+                {
+                    if (op & (1 << n))
+                    {
+                        r[n] = read(address);
+                        address += 4;
+                    }
+                }
+                if (op & 0x100)
+                {
+                    next_pc = read(address) & ~word_t(1);
+                    address += 4;
+                }
+                r[Register::SP] = address;
+            }
+            else if ((op & 0xFF00) == 0xBE00)  // BKPT
+            {
+                --_instructions;
+                halt(SCB::DFSR_BKPT);
+                return;  // PC stays on the BKPT.
+            }
+            else if ((op & 0xFF0F) == 0xBF00)  // NOP, YIELD, WFE, WFI, SEV
+            {
+            }
+            else
+            {
+                undefined = true;
+            }
+            break;
+
+        case 0x18:  // STM Rn!, {list}
+        {
+            unsigned const n_reg = (op >> 8) & 7;
+            uint32_t address = r[n_reg];
+            for (unsigned n = 0; n < 8; ++n)
+            {
+                if (op & (1 << n))
+                {
+                    write(address, r[n]);
+                    address += 4;
+                }
+            }
+            r[n_reg] = address;
+            break;
+        }
+
+        case 0x19:  // LDM Rn!, {list}
+        {
+            unsigned const n_reg = (op >> 8) & 7;
+            uint32_t address = r[n_reg];
+            for (unsigned n = 0; n < 8; ++n)
+            {
+                if (op & (1 << n))
+                {
+                    r[n] = read(address);
+                    address += 4;
+                }
+            }
+            // Writeback only if the base isn't in the list.
+            if (!(op & (1 << n_reg))) r[n_reg] = address;
+            break;
+        }
+
+        case 0x1A:
+        case 0x1B:  // B<cond>, UDF, SVC
+        {
+            unsigned const cond = (op >> 8) & 0xF;
+            if (cond >= 0xE)
+            {
+                undefined = true;  // No exception model for SVC.
+                break;
+            }
+            if (condition_passed(cond))
+            {
+                next_pc = pc_value + word_t(int32_t(int8_t(op & 0xFF)) * 2);
+            }
+            break;
+        }
+
+        case 0x1C:  // B label
+        {
+            int32_t offset = (op & 0x7FF) << 1;
+            if (offset & 0x800) offset -= 0x1000;
+            next_pc = pc_value + offset;
+            break;
+        }
+
+        case 0x1E:  // BL, the only 32-bit instruction we know.
+        {
+            uint16_t const op2 = read16(pc + 2);
+            if ((op2 & 0xD000) != 0xD000)
+            {
+                undefined = true;
+                break;
+            }
+
+            word_t const s  = (op >> 10) & 1;
+            word_t const j1 = (op2 >> 13) & 1;
+            word_t const j2 = (op2 >> 11) & 1;
+            word_t const i1 = !(j1 ^ s);
+            word_t const i2 = !(j2 ^ s);
+
+            word_t offset = (s << 24) | (i1 << 23) | (i2 << 22)
+                          | ((op & 0x3FF) << 12) | ((op2 & 0x7FF) << 1);
+            if (s) offset |= 0xFE000000;
+
+            r[Register::LR] = (pc + 4) | 1;
+            next_pc = pc + 4 + offset;
+            break;
+        }
+
+        default:
+            undefined = true;
+            break;
+    }
+
+    if (undefined)
+    {
+        --_instructions;
+        if (_demcr & DCB::DEMCR_VC_HARDERR) halt(SCB::DFSR_VCATCH);
+        else                                _locked_up = true;
+        return;
+    }
+
+    r[Register::PC] = next_pc;
+}
+
+
+/*******************************************************************************
+ * IAP
+ */
+
+void SimTarget::call_iap()
+{
+    uint32_t const command_addr = _r[Register::R0];
+    uint32_t const result_addr  = _r[Register::R1];
+
+    word_t command[IAP::max_command_words];
+    for (size_t i = 0; i < IAP::max_command_words; ++i)
+    {
+        command[i] = read(command_addr + i * sizeof(word_t));
+    }
+
+    word_t result[IAP::max_response_words] = { 0 };
+    result[0] = iap(command, result + 1);
+
+    for (size_t i = 0; i < IAP::max_response_words; ++i)
+    {
+        write(result_addr + i * sizeof(word_t), result[i]);
+    }
+
+    ++_instructions;
+    _r[Register::PC] = _r[Register::LR] & ~word_t(1);
+}
+
+word_t SimTarget::iap(word_t const * command, word_t * result)
+{
+    size_t const sectors = sector_count();
+    size_t const flash_size = _flash.size() * sizeof(word_t);
+
+    switch (command[0])
+    {
+        case IAP::Command::unprotect_sectors:
+        case IAP::Command::erase_sectors:
+        case IAP::Command::blank_check_sectors:
+        {
+            word_t const first = command[1];
+            word_t const last  = command[2];
+            if (first > last || last >= sectors)
+            {
+                return IAPStatus::invalid_sector;
+            }
+
+            size_t const words_per_sector = sector_bytes / sizeof(word_t);
+            std::vector<word_t>::iterator const begin =
+                _flash.begin() + first * words_per_sector;
+            std::vector<word_t>::iterator const end =
+                _flash.begin() + (last + 1) * words_per_sector;
+
+            if (command[0] == IAP::Command::unprotect_sectors)
+            {
+                std::fill(_prepared.begin() + first,
+                          _prepared.begin() + last + 1,
+                          true);
+            }
+            else if (command[0] == IAP::Command::erase_sectors)
+            {
+                for (word_t s = first; s <= last; ++s)
+                {
+                    if (!_prepared[s]) return IAPStatus::sector_not_prepared;
+                }
+                std::fill(begin, end, 0xFFFFFFFF);
+                std::fill(_prepared.begin() + first,
+                          _prepared.begin() + last + 1,
+                          false);
+            }
+            else
+            {
+                for (std::vector<word_t>::iterator i = begin; i != end; ++i)
+                {
+                    if (*i == 0xFFFFFFFF) continue;
+
+                    result[0] = (i - _flash.begin()) * sizeof(word_t);
+                    result[1] = *i;
+                    return IAPStatus::sector_not_blank;
+                }
+            }
+
+            return IAPStatus::success;
+        }
+
+        case IAP::Command::copy_ram_to_flash:
+        {
+            word_t const dst   = command[1];
+            word_t const src   = command[2];
+            word_t const bytes = command[3];
+
+            if (dst % 256)            return IAPStatus::dst_addr_error;
+            if (src % sizeof(word_t)) return IAPStatus::src_addr_error;
+            if (bytes != 256 && bytes != 512 && bytes != 1024 && bytes != 4096)
+            {
+                return IAPStatus::count_error;
+            }
+            if (dst + bytes > flash_size)
+            {
+                return IAPStatus::dst_addr_not_mapped;
+            }
+            if (src - ram_base >= _ram.size() * sizeof(word_t)
+                || src - ram_base + bytes > _ram.size() * sizeof(word_t))
+            {
+                return IAPStatus::src_addr_not_mapped;
+            }
+
+            for (word_t s = dst / sector_bytes;
+                 s <= (dst + bytes - 1) / sector_bytes;
+                 ++s)
+            {
+                if (!_prepared[s]) return IAPStatus::sector_not_prepared;
+            }
+
+            // Programming can only clear bits.
+            for (word_t i = 0; i < bytes / sizeof(word_t); ++i)
+            {
+                _flash[dst / sizeof(word_t) + i] &=
+                    _ram[(src - ram_base) / sizeof(word_t) + i];
+            }
+
+            for (word_t s = dst / sector_bytes;
+                 s <= (dst + bytes - 1) / sector_bytes;
+                 ++s)
+            {
+                _prepared[s] = false;
+            }
+
+            return IAPStatus::success;
+        }
+
+        case IAP::Command::read_part_id:
+            result[0] = _config.core == cortex_m0 ? part_id_lpc1114
+                                                  : part_id_lpc1343;
+            return IAPStatus::success;
+
+        case IAP::Command::read_boot_code_version:
+            result[0] = boot_code_version;
+            return IAPStatus::success;
+
+        case IAP::Command::compare:
+        {
+            word_t const dst   = command[1];
+            word_t const src   = command[2];
+            word_t const bytes = command[3];
+
+            if (dst % sizeof(word_t))   return IAPStatus::dst_addr_error;
+            if (src % sizeof(word_t))   return IAPStatus::src_addr_error;
+            if (bytes % sizeof(word_t)) return IAPStatus::count_error;
+
+            for (word_t i = 0; i < bytes; i += sizeof(word_t))
+            {
+                if (read(dst + i) != read(src + i))
+                {
+                    result[0] = i;
+                    return IAPStatus::compare_error;
+                }
+            }
+
+            return IAPStatus::success;
+        }
+
+        case IAP::Command::read_uid:
+            result[0] = 0x53494D00;  // "SIM"
+            result[1] = 0x00000001;
+            result[2] = 0x00000002;
+            result[3] = _config.core == cortex_m0 ? 0 : 3;
+            return IAPStatus::success;
+
+        default:
+            return IAPStatus::invalid_command;
+    }
+}
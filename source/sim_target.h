@@ -0,0 +1,133 @@
+#ifndef SIM_TARGET_H
+#define SIM_TARGET_H
+
+/*
+ * A simulated NXP LPC11xx/13xx microcontroller, as seen from a MEM-AP: Flash,
+ * RAM, the debug registers of the System Control Space, and a core that runs
+ * Thumb-1 code -- enough for the Flash loader, the CRC stub, and semihosting
+ * firmware to run unchanged.  SimSWDDriver puts it behind a SWD interface.
+ *
+ * The core implements the ARMv6-M instruction set, which the Cortex-M3 also
+ * runs; Thumb-2 instructions other than BL halt it, as a fault would.  IAP
+ * calls are serviced the moment the core reaches the ROM entry point, without
+ * modelling how long Flash takes: that is the same whatever the host does, and
+ * leaving it out keeps benchmarks measuring the host side.
+ */
+
+#include "arm.h"
+
+#include <map>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+class SimTarget
+{
+public:
+    enum Core
+    {
+        cortex_m0,
+        cortex_m3,
+    };
+
+    struct Config
+    {
+        Core     core;
+        size_t   flash_bytes;
+        size_t   ram_bytes;
+        unsigned core_mhz;  // Instructions run per microsecond, roughly.
+
+        Config();
+    };
+
+    static uint32_t const flash_base = 0x00000000;
+    static uint32_t const ram_base   = 0x10000000;
+    static size_t   const sector_bytes = 4096;
+
+    explicit SimTarget(Config const &);
+
+    Config const & config() const;
+
+    /*
+     * Word-sized bus access, as a MEM-AP or the core would make it.  Narrow
+     * writes pass the byte lanes to change in lanes (bit n for byte n).
+     * Addresses nothing answers read as zero and ignore writes.
+     */
+    ARM::word_t read(uint32_t address);
+    void write(uint32_t address, ARM::word_t data, unsigned lanes = 0xF);
+
+    /*
+     * Lets the core run for the given time, if it isn't halted.
+     */
+    void run_for(unsigned microseconds);
+
+    bool is_halted() const;
+
+    // Instructions executed since construction.
+    uint64_t instructions() const;
+
+    /*
+     * Direct access to Flash, bypassing the bus, for setting up and checking
+     * benchmarks.
+     */
+    std::vector<ARM::word_t> & flash();
+
+private:
+    Config _config;
+
+    std::vector<ARM::word_t> _flash;
+    std::vector<ARM::word_t> _ram;
+    std::map<uint32_t, ARM::word_t> _other;  // Peripherals and such.
+
+    // Core state.
+    ARM::word_t _r[16];
+    ARM::word_t _xpsr;
+    ARM::word_t _psp;
+    ARM::word_t _control;
+    bool        _halted;
+    bool        _locked_up;
+    uint64_t    _instructions;
+
+    // Debug state.
+    ARM::word_t _dhcsr;   // Control bits only.
+    ARM::word_t _dcrdr;
+    ARM::word_t _demcr;
+    ARM::word_t _dfsr;
+    bool        _reset_seen;  // DHCSR.S_RESET_ST, until read.
+    ARM::word_t _bp_ctrl;
+    ARM::word_t _bp_comp[4];
+
+    // IAP state.
+    std::vector<bool> _prepared;
+
+    ARM::word_t read_scs(uint32_t address);
+    void write_scs(uint32_t address, ARM::word_t data);
+
+    ARM::word_t * memory_word(uint32_t address);
+
+    uint8_t  read8(uint32_t address);
+    uint16_t read16(uint32_t address);
+    void write8(uint32_t address, uint8_t);
+    void write16(uint32_t address, uint16_t);
+
+    void halt(ARM::word_t reason);
+    void reset();
+
+    // Executes one instruction; halts the core on BKPT and breakpoints.
+    void step();
+
+    bool breakpoint_at(uint32_t pc) const;
+    bool condition_passed(unsigned cond) const;
+    void set_nz(ARM::word_t result);
+    ARM::word_t add_with_carry(ARM::word_t a, ARM::word_t b, bool carry_in);
+
+    // Services an IAP call and returns to the caller.
+    void call_iap();
+    ARM::word_t iap(ARM::word_t const * command, ARM::word_t * result);
+
+    size_t sector_count() const;
+};
+
+#endif  // SIM_TARGET_H
@@ -142,6 +142,86 @@ public:
     virtual Err::Error write(unsigned address,
                              bool     debug_port,
                              uint32_t data) = 0;
+
+    /*
+     * Queued equivalent of read.  Instead of performing the read immediately,
+     * adds it to a batch of transfers held by the driver.  The batch is sent
+     * to the target by flush (below), which lets drivers behind a high-latency
+     * link (such as USB) pay that latency once for many transfers.
+     *
+     * When the batch completes, the data read is written through the data
+     * pointer, and the outcome of this particular transfer is written through
+     * the status pointer.  Either pointer may be zero if the caller doesn't
+     * care.  As with read, a zero data pointer is the way to start an Access
+     * Port read without collecting the result of the previous one.  Neither
+     * pointer is written before flush, so they must remain valid until then
+     * -- even for a driver that performs the transfer as it's queued (see
+     * flush), which holds on to the results.
+     *
+     * Drivers may flush early if their buffers fill up.  Any error from such
+     * an early flush is returned here, and this transfer is not queued.
+     *
+     * Return values:
+     *  Err::success - transfer queued.
+     *  Other values - an early flush failed; see flush.
+     */
+    virtual Err::Error queue_read(unsigned     address,
+                                  bool         debug_port,
+                                  uint32_t *   data,
+                                  Err::Error * status = 0) = 0;
+
+    /*
+     * Queued equivalent of write.  See queue_read for how queueing works.
+     */
+    virtual Err::Error queue_write(unsigned     address,
+                                   bool         debug_port,
+                                   uint32_t     data,
+                                   Err::Error * status = 0) = 0;
+
+    /*
+     * Performs all queued transfers, in order, and delivers their results.
+     *
+     * The driver cannot know a transfer's response before the whole batch is
+     * sent, so it doesn't stop at the first WAIT or FAULT.  Transfers after the
+     * first one that fails have no defined effect on the target, and the
+     * driver returns the SWD line to a known state before returning.  Their
+     * status is reported as Err::try_again and their data is not written: the
+     * caller should treat the whole batch as not performed, clear any sticky
+     * errors, and queue it again.
+     *
+     * Sending on past a refused transfer is only safe with Overrun Detection,
+     * which keeps the target in step (see set_overrun_detection).  Without it,
+     * a driver must see each transfer's ACK before its data phase -- in effect
+     * performing transfers one at a time as they're queued.  Once one fails,
+     * the rest are skipped and reported as Err::try_again, just as they would
+     * be in a batch, until flush delivers the results and starts afresh.
+     *
+     * Flushing an empty queue does nothing and succeeds.
+     *
+     * Return values:
+     *  Err::success   - all transfers completed.
+     *  Err::try_again - a transfer received a SWD WAIT response.
+     *  Err::failure   - a transfer received a SWD FAULT response, or the
+     *                   interface failed.
+     */
+    virtual Err::Error flush() = 0;
+
+    /*
+     * Tells the driver whether the DAP has Overrun Detection enabled
+     * (CTRL/STAT.ORUNDETECT); see DebugAccessPort::enable_overrun_detection,
+     * which calls this after changing it.
+     *
+     * With Overrun Detection, every transfer has a data phase, whatever its
+     * ACK, and a WAIT or FAULT sets a sticky flag in CTRL/STAT that makes the
+     * DAP refuse everything after it until cleared.  That keeps the line in
+     * step through a failed batch, so a driver may skip checking each
+     * transfer's ACK and check the sticky flags once per batch instead.  To
+     * read CTRL/STAT, it needs SELECT.CTRLSEL clear whenever it flushes.
+     *
+     * read and write must keep their meaning either way: in particular, after
+     * a WAIT they clear the sticky overrun flag, so that retrying works.
+     */
+    virtual void set_overrun_detection(bool enabled) = 0;
 };
 
 #endif  // SWD_H
@@ -4,6 +4,19 @@
 
 using Err::Error;
 
+/*
+ * Every AP has its Identification Register at the same address.
+ */
+static uint8_t const ap_idr = 0xFC;
+
+static uint32_t const ap_idr_class_mem_ap = 1 << 16;
+static uint32_t const ap_idr_type_mask = 0xF;
+
+/*
+ * How many AP IDRs enumerate_aps reads per flush.
+ */
+static unsigned const aps_per_batch = 16;
+
 /*******************************************************************************
  * DebugAccessPort private implementation
  */
@@ -19,6 +32,58 @@ Error DebugAccessPort::select_ap_bank(uint8_t ap, uint8_t address)
     return Err::success;
 }
 
+Error DebugAccessPort::queue_clear_ctrlsel()
+{
+    if (_overrun_detection && (_SELECT & 1))
+    {
+        // If forget_select left only CTRLSEL known, start afresh from zero.
+        ARM::word_t sel = (_SELECT & 0xE) ? 0 : (_SELECT & ~1);
+
+        Check(queued(_swd.queue_write(kRegSELECT, true, sel)));
+        _SELECT = sel;
+    }
+
+    return Err::success;
+}
+
+Error DebugAccessPort::queue_select_ap_bank(uint8_t ap, uint8_t address)
+{
+    Check(queue_clear_ctrlsel());
+
+    ARM::word_t sel = (ap << 24) | (address & 0xF0) | (_SELECT & 1);
+
+    if (sel != _SELECT) {
+        Check(queued(_swd.queue_write(kRegSELECT, true, sel)));
+        _SELECT = sel;
+    }
+
+    return Err::success;
+}
+
+void DebugAccessPort::forget_select()
+{
+    // No value produced by select_ap_bank has bits 1-3 set.
+    _SELECT |= ~1;
+}
+
+Error DebugAccessPort::queued(Error result)
+{
+    if (result != Err::success)
+    {
+        forget_select();
+        _ap_cache.clear();
+    }
+
+    return result;
+}
+
+void DebugAccessPort::remember_ap(uint8_t ap,
+                                  uint8_t address,
+                                  ARM::word_t data)
+{
+    if (_caching) _ap_cache[(ap << 8) | address] = data;
+}
+
 
 /*******************************************************************************
  * DebugAccessPort public implementation
@@ -26,18 +91,31 @@ Error DebugAccessPort::select_ap_bank(uint8_t ap, uint8_t address)
 
 DebugAccessPort::DebugAccessPort(SWDDriver & swd) :
     _swd(swd),
-    _SELECT(-1) {}
+    _SELECT(-1),
+    _overrun_detection(false),
+    _caching(false) {}
 
 Error DebugAccessPort::reset_state()
 {
     Check(write_select(0));  // Reset SELECT and cache.
-    Check(write_abort((1 << 1)  // Clear STKCMP
-                    | (1 << 2)  // Clear STKERR
-                    | (1 << 3)  // Clear WDERR
-                    | (1 << 4)  // Clear ORUNERR
-                    ));
-    Check(write_ctrlstat((1 << 30)     // CSYSPWRUPREQ
-                       | (1 << 28)));  // CDBGPWRUPREQ
+    Check(write_abort(kABORT_STKCMPCLR
+                    | kABORT_STKERRCLR
+                    | kABORT_WDERRCLR
+                    | kABORT_ORUNERRCLR));
+    Check(write_ctrlstat(kCTRLSTAT_CSYSPWRUPREQ
+                       | kCTRLSTAT_CDBGPWRUPREQ
+                       | (_overrun_detection ? kCTRLSTAT_ORUNDETECT : 0)));
+    return Err::success;
+}
+
+Error DebugAccessPort::enable_overrun_detection(bool enabled)
+{
+    Check(write_ctrlstat(kCTRLSTAT_CSYSPWRUPREQ
+                       | kCTRLSTAT_CDBGPWRUPREQ
+                       | (enabled ? kCTRLSTAT_ORUNDETECT : 0)));
+
+    _overrun_detection = enabled;
+    _swd.set_overrun_detection(enabled);
     return Err::success;
 }
 
@@ -111,7 +189,178 @@ Error DebugAccessPort::write_ap(uint8_t ap_index,
 
     Check(select_ap_bank(ap_index, address));
 
-    return _swd.write((address >> 2) & 3, false, data);
+    Error result = _swd.write((address >> 2) & 3, false, data);
+
+    if (result == Err::success)
+        remember_ap(ap_index, address, data);
+    else
+        _ap_cache.erase((ap_index << 8) | address);
+
+    return result;
+}
+
+void DebugAccessPort::enable_cache(bool enabled)
+{
+    _caching = enabled;
+    _ap_cache.clear();
+}
+
+void DebugAccessPort::invalidate_cache()
+{
+    _ap_cache.clear();
+}
+
+Error DebugAccessPort::read_ap(uint8_t ap_index,
+                               uint8_t address,
+                               ARM::word_t * data)
+{
+    if (address & 3) return Err::argument_error;
+
+    std::map<uint16_t, ARM::word_t>::const_iterator cached =
+        _ap_cache.find((ap_index << 8) | address);
+
+    if (cached != _ap_cache.end())
+    {
+        *data = cached->second;
+        return Err::success;
+    }
+
+    Check(start_read_ap(ap_index, address));
+    Check(read_rdbuff(data));
+
+    remember_ap(ap_index, address, *data);
+    return Err::success;
+}
+
+Error DebugAccessPort::update_ap(uint8_t ap_index,
+                                 uint8_t address,
+                                 ARM::word_t data)
+{
+    std::map<uint16_t, ARM::word_t>::const_iterator cached =
+        _ap_cache.find((ap_index << 8) | address);
+
+    if (cached != _ap_cache.end() && cached->second == data)
+    {
+        return Err::success;
+    }
+
+    return write_ap(ap_index, address, data);
+}
+
+Error DebugAccessPort::queue_read_rdbuff(ARM::word_t * data)
+{
+    Check(queue_clear_ctrlsel());
+
+    return queued(_swd.queue_read(kRegRDBUFF, true, data));
+}
+
+Error DebugAccessPort::queue_start_read_ap(uint8_t ap_index, uint8_t address)
+{
+    if (address & 3) return Err::argument_error;
+
+    Check(queue_select_ap_bank(ap_index, address));
+
+    return queued(_swd.queue_read((address >> 2) & 3, false, 0));
+}
+
+Error DebugAccessPort::queue_step_read_ap(uint8_t ap_index,
+                                          uint8_t address,
+                                          ARM::word_t * last)
+{
+    if (address & 3) return Err::argument_error;
+
+    Check(queue_select_ap_bank(ap_index, address));
+
+    return queued(_swd.queue_read((address >> 2) & 3, false, last));
+}
+
+Error DebugAccessPort::queue_write_ap(uint8_t ap_index,
+                                      uint8_t address,
+                                      ARM::word_t data)
+{
+    if (address & 3) return Err::argument_error;
+
+    Check(queue_select_ap_bank(ap_index, address));
+
+    // If the batch fails, queued empties the cache again.
+    remember_ap(ap_index, address, data);
+
+    return queued(_swd.queue_write((address >> 2) & 3, false, data));
+}
+
+Error DebugAccessPort::flush()
+{
+    Check(queue_clear_ctrlsel());
+
+    return queued(_swd.flush());
+}
+
+
+/*******************************************************************************
+ * Access Port enumeration
+ */
+
+bool DebugAccessPort::AccessPort::is_mem_ap() const
+{
+    return idr & ap_idr_class_mem_ap;
+}
+
+char const * DebugAccessPort::AccessPort::type_name() const
+{
+    if (!is_mem_ap())
+    {
+        return (idr & ap_idr_type_mask) == 0 ? "JTAG-AP" : "AP";
+    }
+
+    switch (idr & ap_idr_type_mask)
+    {
+        case 0x1: return "AHB-AP";
+        case 0x2: return "APB-AP";
+        case 0x4: return "AXI-AP";
+        default:  return "MEM-AP";
+    }
 }
 
+Error DebugAccessPort::enumerate_aps(std::vector<AccessPort> * aps,
+                                     unsigned empty_run)
+{
+    aps->clear();
+
+    unsigned empty = 0;
+
+    for (unsigned first = 0; first < 256 && empty < empty_run;
+         first += aps_per_batch)
+    {
+        ARM::word_t idr[aps_per_batch];
 
+        /*
+         * Only APSEL changes between the reads, and the SELECT writes that
+         * change it don't disturb the posted result of the read before.
+         */
+        Check(queue_start_read_ap(first, ap_idr));
+        for (unsigned i = 1; i < aps_per_batch; ++i)
+        {
+            Check(queue_step_read_ap(first + i, ap_idr, &idr[i - 1]));
+        }
+        Check(queue_read_rdbuff(&idr[aps_per_batch - 1]));
+        Check(flush());
+
+        for (unsigned i = 0; i < aps_per_batch && empty < empty_run; ++i)
+        {
+            if (idr[i] == 0)
+            {
+                ++empty;
+                continue;
+            }
+
+            AccessPort ap;
+            ap.index = first + i;
+            ap.idr   = idr[i];
+            aps->push_back(ap);
+
+            empty = 0;
+        }
+    }
+
+    return Err::success;
+}
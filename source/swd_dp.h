@@ -5,6 +5,9 @@
 
 #include "arm.h"
 
+#include <map>
+#include <vector>
+
 #include <stdint.h>
 
 class SWDDriver;
@@ -33,6 +36,40 @@ class DebugAccessPort
     // Selects the given AP, and the bank to expose the given address.
     Err::Error select_ap_bank(uint8_t ap, uint8_t address);
 
+    // Queued equivalent of select_ap_bank.
+    Err::Error queue_select_ap_bank(uint8_t ap, uint8_t address);
+
+    /*
+     * With Overrun Detection, the driver reads CTRL/STAT at the end of every
+     * batch -- including the ones it sends early, when its queue fills, which
+     * never pass through flush.  So CTRLSEL is cleared before anything else is
+     * queued; queued operations never set it again.
+     */
+    Err::Error queue_clear_ctrlsel();
+
+    /*
+     * Marks the cached SELECT as stale after a failed batch, which may or may
+     * not have changed it.  CTRLSEL is never changed by queued operations, so
+     * its cached value survives.
+     */
+    void forget_select();
+
+    // Passes through the result of a queued operation, calling forget_select
+    // (and emptying the AP cache) if it failed.
+    Err::Error queued(Err::Error);
+
+    // Whether CTRL/STAT.ORUNDETECT is set; see enable_overrun_detection.
+    bool _overrun_detection;
+
+    // Whether the AP register cache is in use; see enable_cache.
+    bool _caching;
+
+    // Last known contents of AP registers, keyed by AP index and address.
+    std::map<uint16_t, ARM::word_t> _ap_cache;
+
+    // Records a value written to an AP register, if caching.
+    void remember_ap(uint8_t ap, uint8_t address, ARM::word_t data);
+
 public:
     DebugAccessPort(SWDDriver & swd);
 
@@ -55,6 +92,24 @@ public:
         kRegRDBUFF = 0x03,  // Read-only     
     };
 
+    /*
+     * Bits in the ABORT and CTRL/STAT registers.
+     */
+    enum
+    {
+        kABORT_STKCMPCLR = 1 << 1,
+        kABORT_STKERRCLR = 1 << 2,
+        kABORT_WDERRCLR  = 1 << 3,
+        kABORT_ORUNERRCLR = 1 << 4,
+
+        kCTRLSTAT_ORUNDETECT = 1 << 0,
+        kCTRLSTAT_STICKYORUN = 1 << 1,
+        kCTRLSTAT_STICKYERR  = 1 << 5,
+        kCTRLSTAT_WDATAERR   = 1 << 7,
+        kCTRLSTAT_CDBGPWRUPREQ = 1 << 28,
+        kCTRLSTAT_CSYSPWRUPREQ = 1 << 30,
+    };
+
 
     /***************************************************************************
      * Utilities
@@ -71,6 +126,17 @@ public:
      */
     Err::Error reset_state();
 
+    /*
+     * Turns Overrun Detection (CTRL/STAT.ORUNDETECT) on or off, and tells the
+     * SWDDriver, which can then check batches of queued transfers for WAIT
+     * and FAULT once each rather than transfer by transfer; see
+     * SWDDriver::set_overrun_detection.  It starts off.  reset_state leaves it
+     * as it was.
+     *
+     * Return values are as for write_ctrlstat.
+     */
+    Err::Error enable_overrun_detection(bool);
+
 
     /***************************************************************************
      * Direct DP register access.
@@ -247,6 +313,123 @@ public:
      *      interface.
      */
     Err::Error write_ap(uint8_t ap_index, uint8_t address, ARM::word_t data);
+
+
+    /***************************************************************************
+     * Cached AP register access.
+     *
+     * Debug loops tend to re-read and re-write AP configuration that hasn't
+     * changed.  When the cache is enabled, the DebugAccessPort remembers the
+     * last value written to each AP register (by any of the functions here),
+     * or read from it with read_ap, and read_ap and update_ap (below) use it to
+     * skip accesses whose outcome is already known.  Any failure empties the
+     * cache, since it may have left the registers in an unknown state.
+     *
+     * The DebugAccessPort can't know which registers change on their own, so
+     * only read_ap and update_ap consult the cache, and they should only be
+     * used with registers that hold their value: identification registers,
+     * and configuration registers like MEM-AP CSW -- not data registers, and
+     * not MEM-AP TAR, which moves on DRW accesses.
+     */
+
+    /*
+     * Turns the cache on or off.  It starts off.  Turning it off empties it.
+     */
+    void enable_cache(bool);
+
+    /*
+     * Empties the cache.  Call this after anything that may have changed AP
+     * registers behind the DebugAccessPort's back, such as a power cycle.
+     */
+    void invalidate_cache();
+
+    /*
+     * Reads an AP register to completion (starting the read and collecting it
+     * from RDBUFF), unless its value is cached.  Clobbers any Access Port read
+     * in progress.  Return values are as for step_read_ap.
+     */
+    Err::Error read_ap(uint8_t ap_index, uint8_t address, ARM::word_t * data);
+
+    /*
+     * Writes an AP register, unless the cache shows it already holding data.
+     * Return values are as for write_ap.
+     */
+    Err::Error update_ap(uint8_t ap_index, uint8_t address, ARM::word_t data);
+
+
+    /***************************************************************************
+     * Queued access.
+     *
+     * These correspond to the operations of the same names above, but add
+     * transfers to the SWDDriver's queue (see SWDDriver::queue_read) instead of
+     * performing them, so that a long run of accesses -- such as a block of
+     * memory -- costs only a few round trips to the interface.  Any SELECT
+     * changes needed along the way are queued too.
+     *
+     * Data pointers passed to the queue_* functions are written when the queue
+     * is flushed, and must stay valid until then.  Because a WAIT or FAULT
+     * response part-way through a batch leaves the rest of the batch with no
+     * defined effect, callers should be prepared to queue the whole batch
+     * again when flush returns Err::try_again.
+     *
+     * The queue_* functions return errors only for bad arguments or when the
+     * driver had to flush early; see SWDDriver::queue_read.
+     */
+
+    Err::Error queue_read_rdbuff(ARM::word_t *);
+
+    Err::Error queue_start_read_ap(uint8_t ap_index, uint8_t address);
+
+    Err::Error queue_step_read_ap(uint8_t ap_index,
+                                  uint8_t address,
+                                  ARM::word_t * data);
+
+    Err::Error queue_write_ap(uint8_t ap_index,
+                              uint8_t address,
+                              ARM::word_t data);
+
+    /*
+     * Performs all queued transfers.  Return values are as for
+     * SWDDriver::flush.  With Overrun Detection on, SELECT.CTRLSEL is cleared
+     * first if need be.
+     */
+    Err::Error flush();
+
+
+    /***************************************************************************
+     * Access Port enumeration.
+     */
+
+    /*
+     * An implemented Access Port, as described by its Identification Register.
+     */
+    struct AccessPort
+    {
+        uint8_t     index;
+        ARM::word_t idr;
+
+        // Whether the AP describes itself as a MEM-AP.
+        bool is_mem_ap() const;
+
+        // Short name for the kind of AP, e.g. "AHB-AP" or "JTAG-AP".
+        char const * type_name() const;
+    };
+
+    /*
+     * Finds the implemented Access Ports, in index order, replacing the
+     * contents of aps.  Unimplemented APs read as zero.
+     *
+     * The IDRs are read in batches of posted reads, each AP's read returning
+     * the IDR of the one before, so a scan costs a round trip to the interface
+     * per batch rather than two per AP.  APs are normally numbered from zero
+     * with few gaps, so the scan stops once empty_run consecutive APs have
+     * read as zero; pass 256 to read every IDR.
+     *
+     * Return values are as for flush.  On Err::try_again the scan may simply
+     * be repeated.
+     */
+    Err::Error enumerate_aps(std::vector<AccessPort> * aps,
+                             unsigned empty_run = 16);
 };
 
 #endif  // SWD_DP_H
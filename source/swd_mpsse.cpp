@@ -27,12 +27,17 @@
 
 #include "source/swd_mpsse.h"
 #include "source/swd_dp.h"
+#include "source/poll.h"
+#include "source/metrics.h"
 
 #include "libs/error/error_stack.h"
 #include "libs/log/log_default.h"
 
 #include <ftdi.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 using namespace Log;
 
@@ -58,6 +63,93 @@ uint8_t const swd_header_parity = 1 << 5;
 
 uint8_t const swd_header_park   = 1 << 7;
 
+/*
+ * Where read and write patch their command templates.  The request templates
+ * put the header after the leading turnaround and the MPSSE write command;
+ * the write data template has the data word after its write command, and the
+ * parity byte last.
+ */
+size_t const request_header_offset = 10;
+size_t const write_data_offset     = 3;
+size_t const write_parity_offset   = 9;
+
+// Index into the header table: address, then AP/DP, then read/write.
+unsigned header_index(unsigned address, bool debug_port, bool write)
+{
+    return (address & 0x03) | (debug_port ? 4 : 0) | (write ? 8 : 0);
+}
+
+/*
+ * Limit on the number of response bytes a single batch of queued transfers may
+ * produce.  The MPSSE stops executing commands when its transmit buffer (1KiB
+ * on the FT232H) fills, and we don't start reading until the whole batch has
+ * been written, so a batch that produced more than this could deadlock.
+ */
+size_t const max_queued_response_bytes = 512;
+
+/*
+ * Bytes of response produced by each kind of queued transfer: reads return the
+ * ACK, four data bytes, and a byte holding parity and turnaround; writes return
+ * only the ACK.
+ */
+size_t const queued_read_response_bytes  = 6;
+size_t const queued_write_response_bytes = 1;
+
+/*
+ * Clock auto-tuning starts from a rate that any target we've seen can manage,
+ * and tries each faster divisor with this many test reads.
+ */
+int const    auto_clock_start_hz = 1000000;
+size_t const clock_test_reads    = 32;
+
+/*
+ * Transport statistics, for -stats.  The USB figures show how much of a
+ * session is spent in round trips to the programmer; the SWD figures, how
+ * often the target made us wait or retry.  Each Err::try_again returned here
+ * is one retry for the caller's CheckWait.
+ */
+static Metrics::Counter usb_writes("usb.writes");
+static Metrics::Counter usb_bytes_written("usb.bytes_written");
+static Metrics::Counter usb_reads("usb.reads");
+static Metrics::Counter usb_read_submissions("usb.read_submissions");
+static Metrics::Counter usb_bytes_read("usb.bytes_read");
+static Metrics::Counter usb_read_timeouts("usb.read_timeouts");
+
+static Metrics::Counter swd_ack_ok("swd.ack_ok");
+static Metrics::Counter swd_ack_wait("swd.ack_wait");
+static Metrics::Counter swd_ack_fault("swd.ack_fault");
+static Metrics::Counter swd_ack_invalid("swd.ack_invalid");
+static Metrics::Counter swd_parity_errors("swd.parity_errors");
+static Metrics::Counter swd_batches("swd.batches");
+static Metrics::Counter swd_batch_transfers("swd.batch_transfers");
+static Metrics::Counter swd_resyncs("swd.resyncs");
+static Metrics::Counter swd_retries("swd.retries");
+
+static Metrics::Histogram usb_write_time("usb.write");
+static Metrics::Histogram usb_read_time("usb.read");
+
+static Metrics::Histogram initialize_time("SWDDriver::initialize");
+static Metrics::Histogram read_time("SWDDriver::read");
+static Metrics::Histogram write_time("SWDDriver::write");
+static Metrics::Histogram flush_time("SWDDriver::flush");
+
+static void count_ack(uint8_t ack)
+{
+    switch (ack)
+    {
+        case 1:  swd_ack_ok.add();      break;
+        case 2:  swd_ack_wait.add();    break;
+        case 4:  swd_ack_fault.add();   break;
+        default: swd_ack_invalid.add(); break;
+    }
+}
+
+static Error count_retry(Error error)
+{
+    if (error == Err::try_again) swd_retries.add();
+    return error;
+}
+
 /******************************************************************************/
 uint8_t swd_request(int address, bool debug_port, bool write)
 {
@@ -118,44 +210,116 @@ Error mpsse_setup_buffers(ftdi_context * ftdi)
 /******************************************************************************/
 Error mpsse_write(ftdi_context * ftdi, uint8_t * buffer, size_t count)
 {
+    Metrics::Timer timer(usb_write_time);
+
+    usb_writes.add();
+    usb_bytes_written.add(count);
+
     CheckEQ(ftdi_write_data(ftdi, buffer, count), (int) count);
 
     return Err::success;
 }
 /******************************************************************************/
+/*
+ * Milliseconds on a clock that only goes forward, for deadlines that a change
+ * to the time of day mustn't stretch or cut short.
+ */
+static int64_t monotonic_ms()
+{
+    timespec    now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return int64_t(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+/******************************************************************************/
 Error mpsse_read(ftdi_context * ftdi,
                  uint8_t * buffer,
                  size_t count,
                  int timeout)
 {
-    size_t      received = 0;
+    size_t          received    = 0;
+    int             submissions = 0;
+    int64_t const   deadline    = monotonic_ms() + timeout;
+
+    Metrics::Timer timer(usb_read_time);
+    usb_reads.add();
 
     /*
-     * This is a crude timeout mechanism.  The time that we wait will never
-     * be less than the requested number of milliseconds.  But it can certainly
-     * be more.
+     * Rather than polling, submit an asynchronous read and block in libusb
+     * until it completes.  libftdi strips the FTDI status bytes and resubmits
+     * as each packet arrives, so the transfer completes as soon as the last
+     * byte does.  But the chip sends a status packet every latency timer tick
+     * whether there's data or not, and each resubmission restarts libusb's own
+     * timeout -- so the deadline is kept here, and a read that misses it is
+     * cancelled.
      */
-    for (int i = 1; i < timeout + 1; ++i)
+    while (received < count)
     {
-        received += CheckP(ftdi_read_data(ftdi,
-                                          buffer + received,
-                                          count - received));
+        ++submissions;
+        usb_read_submissions.add();
 
-        if (received >= count)
+        ftdi_transfer_control * transfer =
+            ftdi_read_data_submit(ftdi, buffer + received, count - received);
+
+        if (transfer == 0)
         {
-            debug(5, "MPSSE read took %d attempt%s.", i, i == 1 ? "" : "s");
-            return Err::success;
+            warning("MPSSE read submission failed: %s",
+                    ftdi_get_error_string(ftdi));
+            return Err::failure;
         }
 
-        /*
-         * The latency timer is set to 1ms, so we wait that long before trying
-         * again.
-         */
-        usleep(1000);
+        int     events = 0;
+
+        while (!transfer->completed && events == 0)
+        {
+            int64_t const remaining = deadline - monotonic_ms();
+
+            if (remaining <= 0) break;
+
+            timeval     wait = {time_t(remaining / 1000),
+                                suseconds_t(remaining % 1000 * 1000)};
+
+            events = libusb_handle_events_timeout_completed(
+                         ftdi->usb_ctx, &wait, &transfer->completed);
+        }
+
+        if (!transfer->completed)
+        {
+            timeval     wait = {0, 100000};
+
+            received += transfer->offset;
+            usb_bytes_read.add(transfer->offset);
+            ftdi_transfer_data_cancel(transfer, &wait);
+
+            CheckStringB(events == 0,
+                         "MPSSE read failed: %s", libusb_error_name(events));
+            break;
+        }
+
+        int     result = ftdi_transfer_data_done(transfer);
+
+        if (result < 0)
+        {
+            warning("MPSSE read failed: %s", ftdi_get_error_string(ftdi));
+            return Err::failure;
+        }
+
+        received += result;
+        usb_bytes_read.add(result);
+    }
+
+    if (received >= count)
+    {
+        debug(5, "MPSSE read took %d submission%s.",
+              submissions, submissions == 1 ? "" : "s");
+        return Err::success;
     }
 
-    debug(5, "MPSSE read failed after %d attempt%s.",
-          timeout, timeout == 1 ? "" : "s");
+    usb_read_timeouts.add();
+
+    debug(5, "MPSSE read timed out after %dms with %d of %d bytes.",
+          timeout, int(received), int(count));
 
     return Err::timeout;
 }
@@ -174,11 +338,42 @@ Error mpsse_synchronize(ftdi_context * ftdi)
     return Err::success;
 }
 /******************************************************************************/
+/*
+ * With the divide-by-5 prescaler disabled, the MPSSE runs from 60MHz, and TCK
+ * is 60MHz / (2 * divisor).  Three-phase clocking, which we use so that data
+ * is stable on both edges, stretches each bit by half again.
+ */
+int const mpsse_base_clock_hz = 20000000;
+int const mpsse_max_divisor   = 65536;
+
+int mpsse_divisor_for(int clock_frequency_hz)
+{
+    // Round so that we never run faster than requested.
+    int         divisor = (mpsse_base_clock_hz + clock_frequency_hz - 1)
+                        / clock_frequency_hz;
+
+    if (divisor < 1)                 divisor = 1;
+    if (divisor > mpsse_max_divisor) divisor = mpsse_max_divisor;
+
+    return divisor;
+}
+/******************************************************************************/
+Error mpsse_set_divisor(ftdi_context * ftdi, int divisor)
+{
+    uint8_t     commands[] =
+    {
+        TCK_DIVISOR,   FTL(divisor), FTH(divisor),
+    };
+
+    Check(mpsse_write(ftdi, commands, sizeof(commands)));
+
+    return Err::success;
+}
+/******************************************************************************/
 Error mpsse_setup(MPSSEConfig const & config,
                   ftdi_context * ftdi,
-                  int clock_frequency_hz)
+                  int divisor)
 {
-    int         divisor    = 30000000 / clock_frequency_hz;
     uint8_t     commands[] =
     {
         DIS_DIV_5,
@@ -262,19 +457,245 @@ Error swd_response_to_error(uint8_t response)
     }
 }
 /******************************************************************************/
+/*
+ * Decodes one transfer's share of a batch's response: its ACK and, for reads,
+ * its data and parity.  As swd_response_to_error, but quietly; the caller
+ * reports.  garbled is set on a parity error or a nonsense ACK, either of
+ * which suggests that the line is out of step.
+ */
+Error decode_response(uint8_t const * bytes,
+                      bool            read,
+                      uint32_t *      data,
+                      uint8_t *       ack_out,
+                      bool *          garbled)
+{
+    uint8_t     ack = bytes[0] >> 5;
+    Error       status;
+
+    count_ack(ack);
+    *ack_out = ack;
+
+    switch (ack)
+    {
+        case 1:  status = Err::success;   break;
+        case 2:  status = Err::try_again; break;
+        case 4:  status = Err::failure;   break;
+
+        default:
+            *garbled = true;
+            status = Err::failure;
+            break;
+    }
+
+    if (status == Err::success && read)
+    {
+        uint32_t        temp = (bytes[1] <<  0 |
+                                bytes[2] <<  8 |
+                                bytes[3] << 16 |
+                                bytes[4] << 24);
+
+        if (((bytes[5] >> 6) & 1) != swd_parity(temp))
+        {
+            debug(4, "SWD parity error in queued read");
+            swd_parity_errors.add();
+            *garbled = true;
+            status = Err::failure;
+        }
+        else if (data)
+        {
+            *data = temp;
+        }
+    }
+
+    return status;
+}
+/******************************************************************************/
 MPSSESWDDriver::MPSSESWDDriver(MPSSEConfig const & config,
-                               MPSSE * mpsse) :
+                               MPSSE * mpsse,
+                               int clock_hz) :
     _config(config),
-    _mpsse(mpsse)
+    _mpsse(mpsse),
+    _requested_clock_hz(clock_hz),
+    _divisor(0),
+    _set_up(false),
+    _overrun_detection(false),
+    _queue_response_bytes(0),
+    _unbatched_result(Err::success),
+    _turnaround_pending(false)
+{
+    build_templates();
+}
+/******************************************************************************/
+size_t const MPSSESWDDriver::turnaround_bytes;
+size_t const MPSSESWDDriver::read_request_bytes;
+size_t const MPSSESWDDriver::read_data_bytes;
+size_t const MPSSESWDDriver::write_request_bytes;
+size_t const MPSSESWDDriver::write_data_bytes;
+/******************************************************************************/
+void MPSSESWDDriver::build_templates()
+{
+    for (unsigned i = 0; i < 16; ++i)
+        _headers[i] = swd_request(i & 0x03, i & 4, i & 8);
+
+    uint8_t     turnaround[turnaround_bytes] =
+    {
+        // Turn the bidirectional data line back to an output
+        SET_BITS_LOW,
+        _config.idle_write.low_state,
+        _config.idle_write.low_direction,
+        SET_BITS_HIGH,
+        _config.idle_write.high_state,
+        _config.idle_write.high_direction,
+        // And clock out one bit
+        CLK_BITS, FTL(1),
+    };
+
+    uint8_t     read_request[read_request_bytes] =
+    {
+        // Turn the data line back around after a previous read, if need be
+        SET_BITS_LOW,
+        _config.idle_write.low_state,
+        _config.idle_write.low_direction,
+        SET_BITS_HIGH,
+        _config.idle_write.high_state,
+        _config.idle_write.high_direction,
+        CLK_BITS, FTL(1),
+        // Write SWD header
+        MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_BITMODE, FTL(8), 0,
+        // Turn the bidirectional data line around
+        SET_BITS_LOW,
+        _config.idle_read.low_state,
+        _config.idle_read.low_direction,
+        SET_BITS_HIGH,
+        _config.idle_read.high_state,
+        _config.idle_read.high_direction,
+        // And clock out one bit
+        CLK_BITS, FTL(1),
+        // Now read in the target response
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(3),
+        // And send it back without waiting for the latency timer
+        SEND_IMMEDIATE,
+    };
+
+    uint8_t     read_data[read_data_bytes] =
+    {
+        // Then read in the target data
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB, FTL(4), FTH(4),
+        // And finally read in the target parity and turnaround
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(2),
+        SEND_IMMEDIATE,
+    };
+
+    uint8_t     write_request[write_request_bytes] =
+    {
+        // Turn the data line back around after a previous read, if need be
+        SET_BITS_LOW,
+        _config.idle_write.low_state,
+        _config.idle_write.low_direction,
+        SET_BITS_HIGH,
+        _config.idle_write.high_state,
+        _config.idle_write.high_direction,
+        CLK_BITS, FTL(1),
+        // Write SWD header
+        MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_BITMODE, FTL(8), 0,
+        // Turn the bidirectional data line around
+        SET_BITS_LOW,
+        _config.idle_read.low_state,
+        _config.idle_read.low_direction,
+        SET_BITS_HIGH,
+        _config.idle_read.high_state,
+        _config.idle_read.high_direction,
+        // And clock out one bit
+        CLK_BITS, FTL(1),
+        // Now read in the target response
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(3),
+        // Turn the bidirectional data line back to an output
+        SET_BITS_LOW,
+        _config.idle_write.low_state,
+        _config.idle_write.low_direction,
+        SET_BITS_HIGH,
+        _config.idle_write.high_state,
+        _config.idle_write.high_direction,
+        // And clock out one bit
+        CLK_BITS, FTL(1),
+        // Send the response back without waiting for the latency timer
+        SEND_IMMEDIATE,
+    };
+
+    uint8_t     write_data[write_data_bytes] =
+    {
+        // Write the data
+        MPSSE_DO_WRITE | MPSSE_LSB, FTL(4), FTH(4),
+        0, 0, 0, 0,
+        // And finally write the parity bit
+        MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_BITMODE, FTL(1),
+        0,
+    };
+
+    memcpy(_turnaround,    turnaround,    sizeof(_turnaround));
+    memcpy(_read_request,  read_request,  sizeof(_read_request));
+    memcpy(_read_data,     read_data,     sizeof(_read_data));
+    memcpy(_write_request, write_request, sizeof(_write_request));
+    memcpy(_write_data,    write_data,    sizeof(_write_data));
+}
+/******************************************************************************/
+Error MPSSESWDDriver::write_commands(uint8_t * commands, size_t count)
+{
+    if (!_turnaround_pending)
+        return mpsse_write(_mpsse->ftdi(), commands, count);
+
+    std::vector<uint8_t>        buffer(_turnaround,
+                                       _turnaround + turnaround_bytes);
+
+    buffer.insert(buffer.end(), commands, commands + count);
+
+    Check(mpsse_write(_mpsse->ftdi(), &buffer[0], buffer.size()));
+
+    _turnaround_pending = false;
+
+    return Err::success;
+}
+/******************************************************************************/
+Error MPSSESWDDriver::line_reset()
 {
+    Check(swd_reset(_config, _mpsse->ftdi()));
+
+    _turnaround_pending = false;
+
+    return Err::success;
 }
 /******************************************************************************/
 Error MPSSESWDDriver::initialize(uint32_t * idcode_out)
 {
+    Metrics::Timer timer(initialize_time);
+
     debug(4, "MPSSESWDDriver::initialize");
 
-    Check(mpsse_setup(_config, _mpsse->ftdi(), 10000000));
-    Check(swd_reset(_config, _mpsse->ftdi()));
+    /*
+     * Once the MPSSE is set up and the clock chosen, they stay that way:
+     * initializing again only repeats the line reset and IDCODE read below.
+     */
+    if (!_set_up)
+    {
+        build_templates();
+        _turnaround_pending = false;
+
+        if (_requested_clock_hz == auto_clock)
+        {
+            Check(tune_clock());
+            notice("SWD clock auto-tuned to %d kHz", clock_hz() / 1000);
+        }
+        else
+        {
+            _divisor = mpsse_divisor_for(_requested_clock_hz);
+            Check(mpsse_setup(_config, _mpsse->ftdi(), _divisor));
+            debug(4, "SWD clock is %d kHz", clock_hz() / 1000);
+        }
+
+        _set_up = true;
+    }
+
+    Check(line_reset());
 
     /*
      * Check the ADIv5 spec before altering the code below.  This may seem out
@@ -295,6 +716,95 @@ Error MPSSESWDDriver::initialize(uint32_t * idcode_out)
     return Err::success;
 }
 /******************************************************************************/
+int MPSSESWDDriver::clock_hz() const
+{
+    return _divisor ? mpsse_base_clock_hz / _divisor : 0;
+}
+/******************************************************************************/
+Error MPSSESWDDriver::clock_test(uint32_t idcode, bool * passed)
+{
+    uint32_t    values[clock_test_reads];
+    Error       status[clock_test_reads];
+
+    /*
+     * Alternate IDCODE, which we know, with RDBUFF, which we don't know but
+     * which shouldn't change while no AP reads are happening.  The first read
+     * after a line reset must be IDCODE.
+     *
+     * These are batched even without Overrun Detection: we never drive the
+     * line in a read's data phase, so one the target misses can't be taken
+     * for a request, and each test starts from a line reset anyway.
+     */
+    Check(line_reset());
+
+    for (size_t i = 0; i < clock_test_reads; ++i)
+    {
+        unsigned address = (i & 1) ? DebugAccessPort::kRegRDBUFF
+                                   : DebugAccessPort::kRegIDCODE;
+
+        append_transfer(true, address, true, 0, &values[i], &status[i]);
+    }
+
+    bool        line_in_step;
+
+    *passed = (execute_queue(&line_in_step) == Err::success);
+
+    for (size_t i = 0; *passed && i < clock_test_reads; ++i)
+    {
+        uint32_t expected = (i & 1) ? values[1] : idcode;
+
+        if (values[i] != expected) *passed = false;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+Error MPSSESWDDriver::tune_clock()
+{
+    uint32_t    idcode;
+    bool        passed;
+    int         slowest = mpsse_divisor_for(auto_clock_start_hz);
+
+    // Get a reference IDCODE at a rate we trust.
+    _divisor = slowest;
+    Check(mpsse_setup(_config, _mpsse->ftdi(), _divisor));
+    Check(line_reset());
+    Check(read(DebugAccessPort::kRegIDCODE, true, &idcode));
+
+    /*
+     * Step the divisor up from the fastest rate until the link is reliable,
+     * then back off by about a quarter for margin, provided that rate passes
+     * too.  If nothing faster works, we stay where we started.
+     */
+    for (int divisor = 1; divisor < slowest; ++divisor)
+    {
+        Check(mpsse_set_divisor(_mpsse->ftdi(), divisor));
+        Check(clock_test(idcode, &passed));
+
+        debug(3, "SWD clock test at %d kHz: %s",
+              mpsse_base_clock_hz / divisor / 1000,
+              passed ? "passed" : "failed");
+
+        if (!passed) continue;
+
+        int margin = divisor + (divisor + 3) / 4;
+        if (margin >= slowest) break;
+
+        Check(mpsse_set_divisor(_mpsse->ftdi(), margin));
+        Check(clock_test(idcode, &passed));
+
+        if (passed)
+        {
+            _divisor = margin;
+            break;
+        }
+    }
+
+    Check(mpsse_set_divisor(_mpsse->ftdi(), _divisor));
+
+    return Err::success;
+}
+/******************************************************************************/
 Error MPSSESWDDriver::enter_reset()
 {
     uint8_t     commands[] =
@@ -309,7 +819,7 @@ Error MPSSESWDDriver::enter_reset()
 
     debug(4, "MPSSESWDDriver::enter_reset");
 
-    Check(mpsse_write(_mpsse->ftdi(), commands, sizeof(commands)));
+    Check(write_commands(commands, sizeof(commands)));
 
     return Err::success;
 }
@@ -328,62 +838,42 @@ Error MPSSESWDDriver::leave_reset()
 
     debug(4, "MPSSESWDDriver::leave_reset");
 
-    Check(mpsse_write(_mpsse->ftdi(), commands, sizeof(commands)));
+    Check(write_commands(commands, sizeof(commands)));
 
     return Err::success;
 }
 /******************************************************************************/
 Error MPSSESWDDriver::read(unsigned address, bool debug_port, uint32_t * data)
 {
+    Metrics::Timer timer(read_time);
+
     debug(4, "MPSSESWDDriver::read(%08X, %d)", address, debug_port);
 
-    uint8_t     request[] =
-    {
-        // Write SWD header
-        MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_BITMODE, FTL(8),
-        swd_request(address, debug_port, false),
-        // Turn the bidirectional data line around
-        SET_BITS_LOW,
-        _config.idle_read.low_state,
-        _config.idle_read.low_direction,
-        SET_BITS_HIGH,
-        _config.idle_read.high_state,
-        _config.idle_read.high_direction,
-        // And clock out one bit
-        CLK_BITS, FTL(1),
-        // Now read in the target response
-        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(3),
-    };
+    uint8_t *   request = _read_request;
+    size_t      count   = read_request_bytes;
 
-    uint8_t     data_commands[] =
-    {
-        // Then read in the target data
-        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB, FTL(4), FTH(4),
-        // And finally read in the target parity and turn around
-        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(2),
-    };
+    request[request_header_offset] =
+        _headers[header_index(address, debug_port, false)];
 
-    uint8_t     cleanup[] =
+    if (!_turnaround_pending)
     {
-        // Turn the bidirectional data line back to an output
-        SET_BITS_LOW,
-        _config.idle_write.low_state,
-        _config.idle_write.low_direction,
-        SET_BITS_HIGH,
-        _config.idle_write.high_state,
-        _config.idle_write.high_direction,
-        // And clock out one bit
-        CLK_BITS, FTL(1),
-    };
+        request += turnaround_bytes;
+        count   -= turnaround_bytes;
+    }
 
     uint8_t     response[6] = {0};
 
     // response[0]: the three-bit response, MSB-justified.
-    Check(mpsse_write(_mpsse->ftdi(), request, sizeof(request)));
+    Check(mpsse_write(_mpsse->ftdi(), request, count));
+
+    // The line is ours to turn back, whatever happens from here.
+    _turnaround_pending = true;
+
     Check(mpsse_read(_mpsse->ftdi(), response, 1, 1000));
 
     uint8_t     ack = response[0] >> 5;
 
+    count_ack(ack);
     debug(5, "SWD read got response %u", ack);
 
     if (ack == 0x01)
@@ -394,9 +884,7 @@ Error MPSSESWDDriver::read(unsigned address, bool debug_port, uint32_t * data)
         // Read the data phase.
         // response[4:1]: the 32-bit response word.
         // response[5]: the parity bit in bit 6, turnaround (ignored) in bit 7.
-        Check(mpsse_write(_mpsse->ftdi(),
-                          data_commands,
-                          sizeof(data_commands)));
+        Check(mpsse_write(_mpsse->ftdi(), _read_data, read_data_bytes));
         Check(mpsse_read(_mpsse->ftdi(),
                          response + 1,
                          sizeof(response) - 1,
@@ -408,6 +896,9 @@ Error MPSSESWDDriver::read(unsigned address, bool debug_port, uint32_t * data)
                 response[4] << 24);
 
         // Check for parity error.
+        if (((response[5] >> 6) & 1) != swd_parity(temp))
+            swd_parity_errors.add();
+
         CheckEQ((response[5] >> 6) & 1, swd_parity(temp));
 
         if (data)
@@ -416,20 +907,144 @@ Error MPSSESWDDriver::read(unsigned address, bool debug_port, uint32_t * data)
         debug(5, "SWD read (%X, %d) = %08X complete with status %d",
               address, debug_port, temp, ack);
     }
+    else if (_overrun_detection)
+    {
+        // With Overrun Detection the data phase happens anyway; discard it.
+        Check(mpsse_write(_mpsse->ftdi(), _read_data, read_data_bytes));
+        Check(mpsse_read(_mpsse->ftdi(),
+                         response + 1,
+                         sizeof(response) - 1,
+                         1000));
+    }
 
-    Check(mpsse_write(_mpsse->ftdi(), cleanup, sizeof(cleanup)));
+    if (ack == 0x02 && _overrun_detection) Check(clear_overrun());
 
-    return swd_response_to_error(ack);
+    return count_retry(swd_response_to_error(ack));
 }
 /******************************************************************************/
 Error MPSSESWDDriver::write(unsigned address, bool debug_port, uint32_t data)
 {
-    bool        parity    = swd_parity(data);
+    Metrics::Timer timer(write_time);
+
+    debug(4, "MPSSESWDDriver::write(%08X, %d, %08X)",
+          address, debug_port, data);
+
+    uint8_t *   request = _write_request;
+    size_t      count   = write_request_bytes;
+
+    request[request_header_offset] =
+        _headers[header_index(address, debug_port, true)];
+
+    if (!_turnaround_pending)
+    {
+        request += turnaround_bytes;
+        count   -= turnaround_bytes;
+    }
+
+    uint8_t     response[1] = {0};
+
+    Check(mpsse_write(_mpsse->ftdi(), request, count));
+
+    _turnaround_pending = false;
+
+    Check(mpsse_read (_mpsse->ftdi(), response, sizeof(response), 1000));
+
+    uint8_t     ack = response[0] >> 5;
+
+    count_ack(ack);
+    debug(5, "SWD write got response %u", ack);
+
+    // With Overrun Detection the data phase happens whatever the response.
+    if (ack == 0x01 || _overrun_detection)
+    {
+        _write_data[write_data_offset + 0] = (data >>  0) & 0xff;
+        _write_data[write_data_offset + 1] = (data >>  8) & 0xff;
+        _write_data[write_data_offset + 2] = (data >> 16) & 0xff;
+        _write_data[write_data_offset + 3] = (data >> 24) & 0xff;
+        _write_data[write_parity_offset]   = swd_parity(data) ? 0xff : 0x00;
+
+        Check(mpsse_write(_mpsse->ftdi(), _write_data, write_data_bytes));
+    }
+
+    if (ack == 0x02 && _overrun_detection) Check(clear_overrun());
+
+    return count_retry(swd_response_to_error(ack));
+}
+/******************************************************************************/
+Error MPSSESWDDriver::queue_transfer(bool         read,
+                                     unsigned     address,
+                                     bool         debug_port,
+                                     uint32_t     write_data,
+                                     uint32_t *   read_data,
+                                     Err::Error * status)
+{
+    /*
+     * Without Overrun Detection, a refused transfer has no data phase, and a
+     * write's data clocked out regardless could be taken for new requests --
+     * so each ACK must be seen before the data goes, and nothing can be
+     * batched.  Transfers are performed as they are queued instead, and once
+     * one fails the rest are skipped, as a failed batch's would be.  Their
+     * results are delivered by flush, like a batch's.
+     */
+    if (!_overrun_detection)
+    {
+        if (!_queue.empty()) Check(flush());
+
+        PerformedTransfer   performed = {read_data, 0, status, Err::try_again};
+
+        if (_unbatched_result == Err::success)
+        {
+            performed.result = read ? this->read(address,
+                                                 debug_port,
+                                                 &performed.value)
+                                    : write(address, debug_port, write_data);
+            _unbatched_result = performed.result;
+        }
+
+        _performed.push_back(performed);
+
+        return Err::success;
+    }
+
+    // Leave room for execute_queue's read of CTRL/STAT.
+    size_t      needed = response_bytes_for(read) +
+                         (_overrun_detection ? queued_read_response_bytes : 0);
+
+    if (_queue_response_bytes + needed > max_queued_response_bytes)
+        Check(flush());
+
+    append_transfer(read, address, debug_port, write_data, read_data, status);
+
+    return Err::success;
+}
+/******************************************************************************/
+size_t MPSSESWDDriver::response_bytes_for(bool read) const
+{
+    /*
+     * With Overrun Detection, a write's ACK is clocked past rather than
+     * collected, and execute_queue adds a read of CTRL/STAT to each batch.
+     */
+    if (read)                return queued_read_response_bytes;
+    if (!_overrun_detection) return queued_write_response_bytes;
+
+    return 0;
+}
+/******************************************************************************/
+void MPSSESWDDriver::append_transfer(bool         read,
+                                     unsigned     address,
+                                     bool         debug_port,
+                                     uint32_t     write_data,
+                                     uint32_t *   read_data,
+                                     Err::Error * status)
+{
+    size_t      response_bytes = response_bytes_for(read);
+    bool const  checked        = response_bytes != 0;
+
     uint8_t     request[] =
     {
         // Write SWD header
         MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_BITMODE, FTL(8),
-        swd_request(address, debug_port, true),
+        _headers[header_index(address, debug_port, !read)],
         // Turn the bidirectional data line around
         SET_BITS_LOW,
         _config.idle_read.low_state,
@@ -441,6 +1056,17 @@ Error MPSSESWDDriver::write(unsigned address, bool debug_port, uint32_t data)
         CLK_BITS, FTL(1),
         // Now read in the target response
         MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(3),
+    };
+
+    // Or just clock the response past, if nobody will look at it.
+    if (!checked) request[sizeof(request) - 2] = CLK_BITS;
+
+    uint8_t     read_commands[] =
+    {
+        // Read in the target data, whatever the response turns out to be
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB, FTL(4), FTH(4),
+        // Then the target parity and turnaround
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(2),
         // Turn the bidirectional data line back to an output
         SET_BITS_LOW,
         _config.idle_write.low_state,
@@ -452,36 +1078,264 @@ Error MPSSESWDDriver::write(unsigned address, bool debug_port, uint32_t data)
         CLK_BITS, FTL(1),
     };
 
-    uint8_t     data_commands[] =
+    uint8_t     write_commands[] =
     {
-        // Write the data
+        // Turn the bidirectional data line back to an output
+        SET_BITS_LOW,
+        _config.idle_write.low_state,
+        _config.idle_write.low_direction,
+        SET_BITS_HIGH,
+        _config.idle_write.high_state,
+        _config.idle_write.high_direction,
+        // And clock out one bit
+        CLK_BITS, FTL(1),
+        // Write the data, whatever the response turns out to be
         MPSSE_DO_WRITE | MPSSE_LSB, FTL(4), FTH(4),
-        (data >>  0) & 0xff,
-        (data >>  8) & 0xff,
-        (data >> 16) & 0xff,
-        (data >> 24) & 0xff,
+        (write_data >>  0) & 0xff,
+        (write_data >>  8) & 0xff,
+        (write_data >> 16) & 0xff,
+        (write_data >> 24) & 0xff,
         // And finally write the parity bit
         MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_BITMODE, FTL(1),
-        parity ? 0xff : 0x00,
+        swd_parity(write_data) ? 0xff : 0x00,
     };
 
-    debug(4, "MPSSESWDDriver::write(%08X, %d, %08X)",
+    _queue_commands.insert(_queue_commands.end(),
+                           request,
+                           request + sizeof(request));
+
+    if (read)
+        _queue_commands.insert(_queue_commands.end(),
+                               read_commands,
+                               read_commands + sizeof(read_commands));
+    else
+        _queue_commands.insert(_queue_commands.end(),
+                               write_commands,
+                               write_commands + sizeof(write_commands));
+
+    QueuedTransfer      transfer = {read,
+                                    checked,
+                                    read_data,
+                                    status,
+                                    _queue_response_bytes};
+
+    _queue.push_back(transfer);
+    _queue_response_bytes += response_bytes;
+}
+/******************************************************************************/
+Error MPSSESWDDriver::resynchronize()
+{
+    uint32_t    idcode;
+
+    debug(4, "MPSSESWDDriver::resynchronize");
+
+    swd_resyncs.add();
+
+    Check(line_reset());
+    Check(read(DebugAccessPort::kRegIDCODE, true, &idcode));
+
+    return Err::success;
+}
+/******************************************************************************/
+Error MPSSESWDDriver::clear_overrun()
+{
+    // Writes to ABORT are always accepted, even with the sticky flag set.
+    return write(DebugAccessPort::kRegABORT,
+                 true,
+                 DebugAccessPort::kABORT_ORUNERRCLR);
+}
+/******************************************************************************/
+void MPSSESWDDriver::set_overrun_detection(bool enabled)
+{
+    debug(4, "MPSSESWDDriver::set_overrun_detection(%d)", enabled);
+
+    _overrun_detection = enabled;
+}
+/******************************************************************************/
+Error MPSSESWDDriver::queue_read(unsigned     address,
+                                 bool         debug_port,
+                                 uint32_t *   data,
+                                 Err::Error * status)
+{
+    debug(4, "MPSSESWDDriver::queue_read(%08X, %d)", address, debug_port);
+
+    return queue_transfer(true, address, debug_port, 0, data, status);
+}
+/******************************************************************************/
+Error MPSSESWDDriver::queue_write(unsigned     address,
+                                  bool         debug_port,
+                                  uint32_t     data,
+                                  Err::Error * status)
+{
+    debug(4, "MPSSESWDDriver::queue_write(%08X, %d, %08X)",
           address, debug_port, data);
 
-    uint8_t     response[1] = {0};
+    return queue_transfer(false, address, debug_port, data, 0, status);
+}
+/******************************************************************************/
+Error MPSSESWDDriver::execute_queue(bool * line_in_step)
+{
+    *line_in_step = false;
 
-    Check(mpsse_write(_mpsse->ftdi(), request, sizeof(request)));
-    Check(mpsse_read (_mpsse->ftdi(), response, sizeof(response), 1000));
+    if (_queue.empty()) return Err::success;
 
-    uint8_t     ack = response[0] >> 5;
+    /*
+     * With Overrun Detection, one read of CTRL/STAT at the end shows whether
+     * anything in the batch was refused -- including the writes, whose ACKs
+     * we don't collect.  queue_transfer leaves room for it.
+     */
+    bool const  check_sticky = _overrun_detection;
 
-    debug(5, "SWD write got response %u", ack);
+    if (check_sticky)
+        append_transfer(true, DebugAccessPort::kRegCTRLSTAT, true, 0, 0, 0);
 
-    if (ack == 0x01)
-        Check(mpsse_write(_mpsse->ftdi(),
-                          data_commands,
-                          sizeof(data_commands)));
+    debug(4, "MPSSESWDDriver::execute_queue: %zu transfers, %zu command bytes",
+          _queue.size(), _queue_commands.size());
+
+    /*
+     * Take the batch out of the queue before doing anything that can fail, so
+     * that a failed flush never leaves stale transfers behind.
+     */
+    std::vector<uint8_t>        commands;
+    std::vector<QueuedTransfer> transfers;
+    std::vector<uint8_t>        response(_queue_response_bytes);
+
+    commands.swap(_queue_commands);
+    transfers.swap(_queue);
+    _queue_response_bytes = 0;
+
+    size_t      ctrlstat_offset = 0;
+
+    if (check_sticky)
+    {
+        ctrlstat_offset = transfers.back().response_offset;
+        transfers.pop_back();
+    }
+
+    swd_batches.add();
+    swd_batch_transfers.add(transfers.size());
+
+    // Ask the MPSSE to return the results now, rather than at the next tick
+    // of the latency timer.
+    commands.push_back(SEND_IMMEDIATE);
+
+    Check(write_commands(&commands[0], commands.size()));
+    Check(mpsse_read(_mpsse->ftdi(), &response[0], response.size(), 1000));
+
+    Error       result = Err::success;
+    bool        garbled = false;  // Parity error or nonsense ACK.
+    std::vector<Error> statuses(transfers.size(), Err::try_again);
+
+    for (size_t i = 0; i < transfers.size() && result == Err::success; ++i)
+    {
+        QueuedTransfer const &  transfer = transfers[i];
+
+        // Unchecked writes are vouched for by CTRL/STAT, below.
+        if (!transfer.checked)
+        {
+            statuses[i] = Err::success;
+            continue;
+        }
+
+        uint8_t     ack;
+
+        statuses[i] = decode_response(&response[transfer.response_offset],
+                                      transfer.read,
+                                      transfer.data,
+                                      &ack,
+                                      &garbled);
+
+        if (statuses[i] != Err::success)
+        {
+            debug(4, "Queued transfer %zu of %zu failed (response %u)",
+                  i, transfers.size(), ack);
+            result = statuses[i];
+        }
+    }
+
+    if (check_sticky)
+    {
+        uint32_t    ctrlstat = 0;
+        uint8_t     ack;
+        Error       read = decode_response(&response[ctrlstat_offset],
+                                           true,
+                                           &ctrlstat,
+                                           &ack,
+                                           &garbled);
+
+        if (read != Err::success)
+        {
+            debug(4, "Batch CTRL/STAT read failed (response %u)", ack);
+            if (result == Err::success) result = Err::failure;
+        }
+        else
+        {
+            Error   sticky = Err::success;
+
+            if (ctrlstat & (DebugAccessPort::kCTRLSTAT_STICKYERR |
+                            DebugAccessPort::kCTRLSTAT_WDATAERR))
+                sticky = Err::failure;
+            else if (ctrlstat & DebugAccessPort::kCTRLSTAT_STICKYORUN)
+                sticky = Err::try_again;
+
+            if (sticky != Err::success && result == Err::success)
+            {
+                // We can't tell which transfer was refused, so none count.
+                debug(4, "Batch of %zu transfers refused (CTRL/STAT %08X)",
+                      transfers.size(), ctrlstat);
+                result = sticky;
+                statuses.assign(transfers.size(), Err::try_again);
+            }
+
+            // Let the caller retry without first clearing it themselves.
+            if (ctrlstat & DebugAccessPort::kCTRLSTAT_STICKYORUN)
+                Check(clear_overrun());
+
+            *line_in_step = !garbled;
+        }
+    }
+
+    for (size_t i = 0; i < transfers.size(); ++i)
+    {
+        if (transfers[i].status) *transfers[i].status = statuses[i];
+    }
+
+    return result;
+}
+/******************************************************************************/
+Error MPSSESWDDriver::flush()
+{
+    Metrics::Timer timer(flush_time);
+
+    // Anything queued without Overrun Detection has been performed already,
+    // and read or write has counted its retry; deliver what it found.
+    Error const unbatched = _unbatched_result;
+    _unbatched_result = Err::success;
+
+    for (size_t i = 0; i < _performed.size(); ++i)
+    {
+        PerformedTransfer const & performed = _performed[i];
+
+        if (performed.result == Err::success && performed.data)
+            *performed.data = performed.value;
+        if (performed.status) *performed.status = performed.result;
+    }
+
+    _performed.clear();
+
+    bool        line_in_step;
+    Error       result = execute_queue(&line_in_step);
+
+    /*
+     * Batches are only sent with Overrun Detection, which keeps the target in
+     * step through a refused transfer while the sticky flags show what went
+     * wrong.  If the line was garbled, or CTRL/STAT couldn't be read, get it
+     * back into a known state before anyone tries to use it again.
+     */
+    if (result != Err::success && !line_in_step) Check(resynchronize());
+
+    if (unbatched != Err::success) return unbatched;
 
-    return swd_response_to_error(ack);
+    return count_retry(result);
 }
 /******************************************************************************/
@@ -14,22 +14,165 @@
 
 #include <stdint.h>
 
+#include <vector>
+
 class MPSSESWDDriver : public SWDDriver
 {
+    /*
+     * A transfer waiting in the queue for the next flush.  response_offset
+     * locates its ACK (and, for reads, data and parity) in the bytes that the
+     * MPSSE sends back for the whole batch.  Writes queued with Overrun
+     * Detection on aren't checked, and have no response.
+     */
+    struct QueuedTransfer
+    {
+        bool         read;
+        bool         checked;
+        uint32_t *   data;
+        Err::Error * status;
+        size_t       response_offset;
+    };
+
     MPSSEConfig const & _config;
     MPSSE *             _mpsse;
+    int                 _requested_clock_hz;
+    int                 _divisor;  // TCK divisor in use; 0 until initialized.
+    bool                _set_up;   // Whether initialize has set up the MPSSE.
+    bool                _overrun_detection;
+
+    std::vector<uint8_t>        _queue_commands;
+    std::vector<QueuedTransfer> _queue;
+    size_t                      _queue_response_bytes;
+
+    /*
+     * Without Overrun Detection transfers aren't batched but performed as
+     * they're queued.  Their results wait here until the next flush, as a
+     * batch's would, and _unbatched_result holds the first failure among
+     * them.
+     */
+    struct PerformedTransfer
+    {
+        uint32_t *   data;
+        uint32_t     value;
+        Err::Error * status;
+        Err::Error   result;
+    };
+
+    std::vector<PerformedTransfer>  _performed;
+    Err::Error                      _unbatched_result;
+
+    /*
+     * Command templates for read and write, built by build_templates from the
+     * pin states in _config.  read and write patch the header, and the data
+     * and parity, in place and send them as they are.  Each request template
+     * starts with a copy of _turnaround, and is sent from just past it when
+     * no turnaround is owed.
+     */
+    static size_t const turnaround_bytes    = 8;
+    static size_t const read_request_bytes  = 22;
+    static size_t const read_data_bytes     = 6;
+    static size_t const write_request_bytes = 30;
+    static size_t const write_data_bytes    = 10;
+
+    uint8_t _headers[16];  // Indexed by header_index.
+    uint8_t _turnaround[turnaround_bytes];
+    uint8_t _read_request[read_request_bytes];
+    uint8_t _read_data[read_data_bytes];
+    uint8_t _write_request[write_request_bytes];
+    uint8_t _write_data[write_data_bytes];
+
+    /*
+     * A read leaves the data line turned around to an input.  Rather than
+     * spend a USB write turning it back, we leave that to the front of
+     * whatever is sent next; this is set while it is owed.
+     */
+    bool _turnaround_pending;
+
+    void build_templates();
+
+    // Sends commands, preceded by any turnaround owed, in one USB write.
+    Err::Error write_commands(uint8_t * commands, size_t count);
+
+    // Line reset, which leaves the data line an output.
+    Err::Error line_reset();
+
+    Err::Error queue_transfer(bool         read,
+                              unsigned     address,
+                              bool         debug_port,
+                              uint32_t     write_data,
+                              uint32_t *   read_data,
+                              Err::Error * status);
+
+    // As queue_transfer, but never flushes: the caller has made room.
+    void append_transfer(bool         read,
+                         unsigned     address,
+                         bool         debug_port,
+                         uint32_t     write_data,
+                         uint32_t *   read_data,
+                         Err::Error * status);
+
+    // Bytes of response a queued transfer will produce.
+    size_t response_bytes_for(bool read) const;
+
+    // Line reset and IDCODE read, to recover after a failed batch.
+    Err::Error resynchronize();
+
+    // Clears the sticky overrun flag after a WAIT with Overrun Detection on.
+    Err::Error clear_overrun();
+
+    /*
+     * Performs the queued batch and reports the results, without recovery.
+     * line_in_step reports whether, after a failure, the target is known to
+     * still be in step with us.
+     */
+    Err::Error execute_queue(bool * line_in_step);
+
+    // Checks for reliable reads at the current clock rate.
+    Err::Error clock_test(uint32_t idcode, bool * passed);
+
+    // Finds the fastest reliable TCK divisor, less a safety margin.
+    Err::Error tune_clock();
 
 public:
-    MPSSESWDDriver(MPSSEConfig const & config, MPSSE * mpsse);
+    /*
+     * Passing auto_clock as the clock rate asks initialize to find the fastest
+     * rate at which the target reliably answers.
+     */
+    static int const auto_clock = 0;
+    static int const default_clock_hz = 6667000;
+
+    MPSSESWDDriver(MPSSEConfig const & config,
+                   MPSSE * mpsse,
+                   int clock_hz = default_clock_hz);
 
     /*
-     * See SWDDriver for documentation of these functions.
+     * Returns the SWD clock rate actually in use, which may be slower than the
+     * one requested because of the MPSSE's clock divider.  Only valid after
+     * initialize.
+     */
+    int clock_hz() const;
+
+    /*
+     * See SWDDriver for documentation of these functions.  The first
+     * successful initialize sets up the MPSSE and picks the clock rate; later
+     * ones only reset the line and read IDCODE again.
      */
     virtual Err::Error initialize(uint32_t *);
     virtual Err::Error enter_reset();
     virtual Err::Error leave_reset();
     virtual Err::Error read(unsigned address, bool debug_port, uint32_t *data);
     virtual Err::Error write(unsigned address, bool debug_port, uint32_t data);
+
+    virtual Err::Error queue_read(unsigned     address,
+                                  bool         debug_port,
+                                  uint32_t *   data,
+                                  Err::Error * status = 0);
+    virtual Err::Error queue_write(unsigned     address,
+                                   bool         debug_port,
+                                   uint32_t     data,
+                                   Err::Error * status = 0);
+    virtual Err::Error flush();
+    virtual void set_overrun_detection(bool enabled);
 };
 
 #endif  // SWD_MPSSE_H
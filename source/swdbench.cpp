@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2012, Anton Staaf, Cliff L. Biffle.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Times the common debug loops -- programming Flash, dumping memory, taking
+ * register snapshots, servicing semihosting calls, and sampling the PC --
+ * against a simulated target, counting the SWD transfers and USB round trips
+ * each takes and the time they would take on a real probe.  No hardware is needed, so changes
+ * that cost round trips show up before they reach a programming station.
+ */
+
+#include "target.h"
+#include "swd_dp.h"
+#include "sim_swd.h"
+#include "sim_target.h"
+#include "flash_loader.h"
+#include "crc32.h"
+#include "metrics.h"
+#include "retry.h"
+#include "armv6m_v7m.h"
+#include "arm.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+#include "libs/command_line/command_line.h"
+
+#include <vector>
+
+#define __STDC_FORMAT_MACROS
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+using Err::Error;
+
+using namespace Log;
+using namespace ARM;
+using namespace ARMv6M_v7M;
+
+using std::vector;
+
+/******************************************************************************/
+namespace CommandLine
+{
+    static Scalar<int>
+    debug ("debug",  true,  0,
+           "What level of debug logging to use.");
+
+    static Scalar<String>
+    core("core", true, "m0",
+         "Simulated core: m0 (as on the LPC11xx) or m3 (as on the LPC13xx)");
+
+    static Scalar<int>
+    flash_kb("flash_kb", true, 32,
+             "Simulated Flash size in KB, a multiple of 4");
+
+    static Scalar<int>
+    usb_latency_us("usb_latency_us", true, 250,
+                   "Modelled cost of each USB round trip, in microseconds");
+
+    static Scalar<int>
+    clock("clock", true, 6667,
+          "Modelled SWD clock rate in kHz");
+
+    static Scalar<int>
+    wait_every("wait_every", true, 0,
+               "Put a WAIT in every Nth exchange with the probe (at least "
+               "2), or 0 for none");
+
+    static Scalar<int>
+    iterations("iterations", true, 100,
+               "Repetitions of the register, semihosting and sampling "
+               "loops");
+
+    static Scalar<String>
+    json("json", true, "",
+         "File to save the results to as JSON, or - for standard output");
+
+
+    static Scalar<bool>
+    stats("stats", true, false,
+          "Whether to log transport and per-call latency statistics at exit");
+
+    static Scalar<String>
+    stats_json("stats_json", true, "",
+               "File to save the statistics to as JSON at exit, or - for "
+               "standard output");
+
+
+    static Scalar<bool>
+    overrun_detection("overrun_detection", true, true,
+                      "Whether to turn on the DAP's Overrun Detection, so "
+                      "batches are checked for WAIT once.  When false, each "
+                      "transfer costs its own USB exchanges");
+
+    static Scalar<int>
+    wait_retries("wait_retries", true, RetryPolicy::default_attempts,
+                 "How many times to try an access the target answers with "
+                 "WAIT");
+
+    static Scalar<int>
+    wait_backoff_us("wait_backoff_us", true,
+                    RetryPolicy::default_max_backoff_us,
+                    "Longest sleep between retries after WAIT, in "
+                    "microseconds");
+
+    static Argument * arguments[] =
+    {
+        &debug,
+        &core,
+        &flash_kb,
+        &usb_latency_us,
+        &clock,
+        &wait_every,
+        &iterations,
+        &json,
+        &overrun_detection,
+        &wait_retries,
+        &wait_backoff_us,
+        &stats,
+        &stats_json,
+        NULL
+    };
+}
+/******************************************************************************/
+/*
+ * The core clock passed to IAP.  The simulated IAP ignores it.
+ */
+static unsigned const cclk_khz = 12000;
+
+static rptr<word_t> const ram_base(SimTarget::ram_base);
+
+static uint32_t const semihosting_writec = 0x03;
+static halfword_t const semihosting_bkpt = 0xBEAB;
+
+/*
+ * Firmware for the semihosting loop, run from the start of RAM with a
+ * character to print in the word at r4:
+ *
+ *   loop: movs r0, #3    ; SYS_WRITEC
+ *         mov  r1, r4
+ *         bkpt 0xAB
+ *         b    loop
+ */
+static thumb_code_t const semihosting_code[] =
+{
+    0x2003,
+    0x4621,
+    0xBEAB,
+    0xE7FB,
+};
+
+/*
+ * Firmware for the register loop: an endless loop, with registers that change
+ * as it runs.
+ *
+ *   loop: adds r0, #1
+ *         b    loop
+ */
+static thumb_code_t const spin_code[] =
+{
+    0x3001,
+    0xE7FD,
+};
+
+/*
+ * PC samples taken per iteration of the sampling loop.
+ */
+static size_t const samples_per_iteration = 256;
+
+struct Result
+{
+    char const * name;
+    unsigned     operations;
+    SimSWDDriver::Stats cost;
+    uint64_t     host_us;
+};
+/******************************************************************************/
+static uint64_t microseconds_since(timeval const & start)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+
+    return uint64_t(now.tv_sec - start.tv_sec) * 1000000
+         + now.tv_usec - start.tv_usec;
+}
+/******************************************************************************/
+/*
+ * Fills a buffer with a pattern that doesn't compress into anything special.
+ */
+static void fill_pattern(vector<word_t> * words, uint32_t seed)
+{
+    uint32_t x = seed | 1;
+    for (size_t i = 0; i < words->size(); ++i)
+    {
+        // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        (*words)[i] = x;
+    }
+}
+/******************************************************************************/
+static Error load_code(Target & target,
+                       thumb_code_t const * code,
+                       size_t halfwords)
+{
+    vector<word_t> words((halfwords + 1) / 2, 0);
+    for (size_t i = 0; i < halfwords; ++i)
+    {
+        words[i / 2] |= word_t(code[i]) << (16 * (i % 2));
+    }
+
+    Check(target.write_words(&words[0], ram_base, words.size()));
+
+    return target.write_register(Register::PC, ram_base.bits());
+}
+/******************************************************************************/
+/*
+ * Programs all of Flash with the resident loader, as swddude does, then checks
+ * it with the CRC stub.
+ */
+static Error bench_flash(Target & target, SimTarget & sim, unsigned * ops)
+{
+    vector<word_t> image(sim.flash().size());
+    fill_pattern(&image, 0x5EED);
+
+    size_t const words_per_sector = SimTarget::sector_bytes / sizeof(word_t);
+
+    // The largest blocks the simulated RAM allows, as swddude would choose.
+    FlashLoader loader(target,
+                       ram_base,
+                       FlashLoader::largest_block(sim.config().ram_bytes,
+                                                  SimTarget::sector_bytes));
+    Check(loader.start(cclk_khz));
+
+    size_t const words_per_block = loader.words_per_block();
+
+    for (size_t i = 0; i < image.size(); i += words_per_block)
+    {
+        Check(loader.program_block(&image[i],
+                                   words_per_block,
+                                   rptr<word_t>(i * sizeof(word_t)),
+                                   i / words_per_sector));
+    }
+
+    Check(loader.finish());
+
+    uint32_t crc;
+    Check(CRC32::compute_on_target(target,
+                                   ram_base,
+                                   rptr_const<byte_t>(0),
+                                   image.size() * sizeof(word_t),
+                                   &crc));
+
+    uint32_t const expected = CRC32::update(0,
+                                            &image[0],
+                                            image.size() * sizeof(word_t));
+    CheckStringB(crc == expected,
+                 "Flash CRC %08"PRIX32" should be %08"PRIX32,
+                 crc, expected);
+    CheckStringB(sim.flash() == image, "Flash contents don't match");
+
+    *ops = image.size() / words_per_block;
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Reads all of Flash back, as swddump does.
+ */
+static Error bench_dump(Target & target, SimTarget & sim, unsigned * ops)
+{
+    fill_pattern(&sim.flash(), 0xD00D);
+
+    vector<word_t> buffer(sim.flash().size());
+    Check(target.read_words(rptr_const<word_t>(0), &buffer[0], buffer.size()));
+
+    CheckStringB(buffer == sim.flash(), "Dumped Flash doesn't match");
+
+    *ops = buffer.size();
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Halts the running processor, reads all its registers, and lets it go again,
+ * as a debugger sampling the processor would.
+ */
+static Error bench_registers(Target & target, SimTarget & sim, unsigned * ops)
+{
+    Check(load_code(target, spin_code, sizeof(spin_code) / sizeof(spin_code[0])));
+    Check(target.resume());
+
+    uint32_t mask = 0;
+    for (unsigned n = 0; n < Target::register_count; ++n)
+    {
+        if (Register::is_index_valid(n)) mask |= 1 << n;
+    }
+
+    word_t last_r0 = 0;
+    unsigned const count = CommandLine::iterations.get();
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        Check(target.halt());
+
+        word_t registers[Target::register_count];
+        Check(target.read_registers(mask, registers));
+
+        CheckStringB(registers[Register::PC] - ram_base.bits()
+                         < sizeof(spin_code),
+                     "Processor escaped its loop, to %08X",
+                     registers[Register::PC]);
+        CheckStringB(i == 0 || registers[Register::R0] != last_r0,
+                     "Processor didn't run between snapshots");
+        last_r0 = registers[Register::R0];
+
+        Check(target.resume());
+    }
+
+    *ops = count;
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Samples the running processor's PC through DWT_PCSR, as swdprof does.
+ */
+static Error bench_pc_sampling(Target & target, SimTarget & sim, unsigned * ops)
+{
+    Check(load_code(target,
+                    spin_code,
+                    sizeof(spin_code) / sizeof(spin_code[0])));
+    Check(target.resume());
+
+    vector<word_t> samples(CommandLine::iterations.get()
+                           * samples_per_iteration);
+    Check(target.sample_word(DWT::DWT_PCSR, &samples[0], samples.size()));
+
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        CheckStringB(samples[i] - ram_base.bits() < sizeof(spin_code),
+                     "Sample %zu is outside the loop, at %08X",
+                     i, samples[i]);
+    }
+
+    *ops = samples.size();
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Services SYS_WRITEC calls from firmware that makes nothing else, the way
+ * swdhost does: poll for the halt, fetch the registers and instruction, read
+ * the character, step past the breakpoint, and resume.
+ */
+static Error bench_semihosting(Target & target, SimTarget & sim, unsigned * ops)
+{
+    rptr<word_t> const character(ram_base + 16);
+    Check(target.write_word(character, 'x'));
+
+    Check(load_code(target,
+                    semihosting_code,
+                    sizeof(semihosting_code) / sizeof(semihosting_code[0])));
+
+    word_t four[Target::register_count];
+    four[Register::R4] = character.bits();
+    Check(target.write_registers(1 << Register::R4, four));
+
+    Check(target.reset_halt_state());
+    Check(target.resume());
+
+    unsigned const count = CommandLine::iterations.get();
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        bool halted = false;
+        for (unsigned polls = 0; !halted; ++polls)
+        {
+            CheckStringB(polls < 1000, "Firmware never reached its BKPT");
+            Check(target.is_halted(&halted));
+        }
+
+        word_t registers[Target::register_count];
+        Check(target.read_registers((1 << Register::PC)
+                                  | (1 << Register::R0)
+                                  | (1 << Register::R1),
+                                    registers));
+
+        word_t const pc = registers[Register::PC];
+
+        word_t instr_word;
+        CheckWait(target.read_word(rptr<word_t>(pc & ~0x3), &instr_word));
+        halfword_t instr = pc & 2 ? instr_word >> 16 : instr_word & 0xFFFF;
+
+        CheckStringB(instr == semihosting_bkpt
+                         && registers[Register::R0] == semihosting_writec,
+                     "Unexpected halt at %08X", pc);
+
+        byte_t c;
+        Check(target.read_bytes(rptr_const<byte_t>(registers[Register::R1]),
+                                &c,
+                                1));
+        CheckEQ(c, 'x');
+
+        CheckWait(target.write_register(Register::PC, pc + 2));
+        Check(target.resume());
+    }
+
+    *ops = count;
+    return Err::success;
+}
+/******************************************************************************/
+typedef Error (*BenchFunction)(Target &, SimTarget &, unsigned *);
+
+struct Bench
+{
+    char const *  name;
+    BenchFunction run;
+};
+
+static Bench const benches[] =
+{
+    { "flash",       bench_flash },
+    { "dump",        bench_dump },
+    { "registers",   bench_registers },
+    { "semihosting", bench_semihosting },
+    { "pc_sampling", bench_pc_sampling },
+};
+
+static size_t const bench_count = sizeof(benches) / sizeof(benches[0]);
+/******************************************************************************/
+/*
+ * Runs one benchmark against a fresh target, halted out of reset, and
+ * measures what it cost beyond that setup.
+ */
+static Error run_bench(Bench const & bench,
+                       SimTarget::Config const & target_config,
+                       SimSWDDriver::Config const & swd_config,
+                       Result * result)
+{
+    debug(1, "Running %s benchmark", bench.name);
+
+    SimTarget    sim(target_config);
+    SimSWDDriver swd(sim, swd_config);
+
+    Check(swd.initialize(NULL));
+
+    DebugAccessPort dap(swd);
+    Check(dap.reset_state());
+
+    if (CommandLine::overrun_detection.get())
+        Check(dap.enable_overrun_detection(true));
+
+    Target target(swd, dap, 0);
+    Check(target.initialize());
+    Check(target.reset_and_halt());
+
+    SimSWDDriver::Stats const before = swd.stats();
+    timeval began;
+    gettimeofday(&began, 0);
+
+    Check(bench.run(target, sim, &result->operations));
+
+    result->host_us = microseconds_since(began);
+
+    SimSWDDriver::Stats const & after = swd.stats();
+    result->name              = bench.name;
+    result->cost.transfers    = after.transfers   - before.transfers;
+    result->cost.round_trips  = after.round_trips - before.round_trips;
+    result->cost.waits        = after.waits       - before.waits;
+    result->cost.modelled_us  = after.modelled_us - before.modelled_us;
+
+    return Err::success;
+}
+/******************************************************************************/
+static void print_results(vector<Result> const & results)
+{
+    notice("%-12s %8s %10s %10s %8s %12s %10s",
+           "benchmark", "ops", "transfers", "trips", "waits",
+           "modelled_ms", "host_ms");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        Result const & r = results[i];
+        notice("%-12s %8u %10"PRIu64" %10"PRIu64" %8"PRIu64" %8"PRIu64
+               ".%03u %6"PRIu64".%03u",
+               r.name,
+               r.operations,
+               r.cost.transfers,
+               r.cost.round_trips,
+               r.cost.waits,
+               r.cost.modelled_us / 1000,
+               unsigned(r.cost.modelled_us % 1000),
+               r.host_us / 1000,
+               unsigned(r.host_us % 1000));
+    }
+}
+/******************************************************************************/
+static Error save_results(vector<Result> const & results, char const * path)
+{
+    bool const to_stdout = strcmp(path, "-") == 0;
+    FILE * out = to_stdout ? stdout : fopen(path, "w");
+
+    CheckStringB(out, "Could not write results to %s: %s",
+                 path, strerror(errno));
+
+    fprintf(out, "{\n  \"benchmarks\": [");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        Result const & r = results[i];
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"operations\": %u, "
+                "\"transfers\": %"PRIu64", \"round_trips\": %"PRIu64", "
+                "\"waits\": %"PRIu64", \"modelled_us\": %"PRIu64", "
+                "\"host_us\": %"PRIu64"}",
+                i ? "," : "",
+                r.name,
+                r.operations,
+                r.cost.transfers,
+                r.cost.round_trips,
+                r.cost.waits,
+                r.cost.modelled_us,
+                r.host_us);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    CheckStringB(to_stdout ? fflush(out) == 0 : fclose(out) == 0,
+                 "Could not write results to %s: %s",
+                 path, strerror(errno));
+
+    return Err::success;
+}
+/******************************************************************************/
+static Error error_main(int argc, char const ** argv)
+{
+    CheckStringB(CommandLine::wait_retries.get() > 0,
+                 "-wait_retries must be at least 1");
+    CheckStringB(CommandLine::wait_backoff_us.get() >= 0,
+                 "-wait_backoff_us can't be negative");
+
+    SimTarget::Config target_config;
+    char const *      core = CommandLine::core.get();
+
+    if (strcmp(core, "m3") == 0)
+    {
+        target_config.core = SimTarget::cortex_m3;
+    }
+    else
+    {
+        CheckStringB(strcmp(core, "m0") == 0,
+                     "-core must be m0 or m3, not '%s'",
+                     core);
+        target_config.core = SimTarget::cortex_m0;
+    }
+
+    CheckStringB(CommandLine::flash_kb.get() > 0
+                 && CommandLine::flash_kb.get() % 4 == 0,
+                 "-flash_kb must be a positive multiple of 4");
+    target_config.flash_bytes = CommandLine::flash_kb.get() * 1024;
+
+    SimSWDDriver::Config swd_config;
+    swd_config.usb_latency_us = CommandLine::usb_latency_us.get();
+    swd_config.clock_hz       = CommandLine::clock.get() * 1000;
+    swd_config.wait_every     = CommandLine::wait_every.get();
+
+    CheckStringB(swd_config.clock_hz > 0, "-clock must be positive");
+    CheckStringB(swd_config.wait_every != 1,
+                 "-wait_every 1 would never let a batch through");
+
+    vector<Result> results(bench_count);
+
+    for (size_t i = 0; i < bench_count; ++i)
+    {
+        Check(run_bench(benches[i], target_config, swd_config, &results[i]));
+    }
+
+    print_results(results);
+
+    if (CommandLine::json.set())
+    {
+        Check(save_results(results, CommandLine::json.get()));
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+int main(int argc, char const ** argv)
+{
+    Error check_error = Err::success;
+
+    CheckCleanup(CommandLine::parse(argc, argv, CommandLine::arguments),
+                 failure);
+
+    log().set_level(CommandLine::debug.get());
+
+    RetryPolicy::standard().set_attempts(CommandLine::wait_retries.get());
+    RetryPolicy::standard().set_max_backoff_us(
+        CommandLine::wait_backoff_us.get());
+
+    check_error = error_main(argc, argv);
+
+    // Reported even after a failure, which is often when they're wanted.
+    Metrics::report(CommandLine::stats.get(), CommandLine::stats_json.get());
+
+    CheckCleanup(check_error, failure);
+    return 0;
+
+  failure:
+    Err::stack()->print();
+    return 1;
+}
+/******************************************************************************/
@@ -26,37 +26,46 @@
  */
 
 #include "target.h"
+#include "iap.h"
+#include "flash_loader.h"
+#include "part.h"
+#include "crc32.h"
+#include "image.h"
+#include "poll.h"
+#include "metrics.h"
+#include "retry.h"
 #include "swd_dp.h"
+#include "session.h"
 #include "swd_mpsse.h"
 #include "swd.h"
 #include "arm.h"
 
-#include "lpc11xx_13xx.h"
 
 #include "libs/error/error_stack.h"
 #include "libs/log/log_default.h"
 #include "libs/command_line/command_line.h"
 
 #include <vector>
-#include <iostream>
-#include <fstream>
+#include <string>
 #include <algorithm>
 
 #define __STDC_FORMAT_MACROS
 
+#include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 using Err::Error;
 
 using namespace Log;
 using namespace ARM;
-using namespace LPC11xx_13xx;
 
 using std::vector;
-using std::ifstream;
-using std::ios;
 
 /*******************************************************************************
  * Command-line definitions
@@ -70,7 +79,14 @@ namespace CommandLine
 
     static Scalar<String>
     flash("flash", true, "",
-          "Binary program to load");
+          "Program to load: an ELF, Intel HEX, or flat binary file, or - to "
+          "stream a flat binary from standard input");
+
+    static Scalar<String>
+    gang("gang", true, "",
+         "Comma-separated list of probes to program in parallel.  Each is a "
+         "USB serial number or bus path (like 1-4.2), optionally followed by "
+         ":A or :B to choose an FT2232H interface.");
 
     static Scalar<String>
     programmer("programmer", true, "um232h",
@@ -81,6 +97,26 @@ namespace CommandLine
                      "When true, the loader will write the LPC-style "
                      "checksum.");
 
+    static Scalar<bool>
+    diff("diff", true, false,
+         "When true, only erase and program the Flash sectors whose contents "
+         "differ from the program.");
+
+    static Scalar<bool>
+    mass_erase("mass_erase", true, false,
+               "When true, erase all of Flash at once before programming, "
+               "rather than only the sectors the program covers.");
+
+    static Scalar<bool>
+    direct_iap("direct_iap", true, false,
+               "When true, drive IAP from the host for every Flash block "
+               "instead of using the on-target flash loader.");
+
+    static Scalar<bool>
+    no_cache("no_cache", true, false,
+             "When true, re-read debug registers even when they can't have "
+             "changed.");
+
     static Scalar<int>
     vid("vid", true, 0,
         "FTDI VID");
@@ -93,15 +129,72 @@ namespace CommandLine
     interface("interface", true, 0,
               "FTDI interface");
 
+    static Scalar<int>
+    clock("clock", true, MPSSESWDDriver::default_clock_hz / 1000,
+          "SWD clock rate in kHz, unless -auto_clock is given");
+
+    static Scalar<bool>
+    auto_clock("auto_clock", true, false,
+               "When true, use the fastest SWD clock rate the target "
+               "reliably supports.");
+
+
+    static Scalar<String>
+    session("session", true, "",
+            "Socket of the swdsession to work through, instead of opening "
+            "the programmer.  By default, the usual one is used if a session "
+            "is running; 'none' always opens the programmer.");
+
+    static Scalar<bool>
+    stats("stats", true, false,
+          "Whether to log transport and per-call latency statistics at exit");
+
+    static Scalar<String>
+    stats_json("stats_json", true, "",
+               "File to save the statistics to as JSON at exit, or - for "
+               "standard output.  With -gang, each probe's are saved to "
+               "the file name followed by . and the probe.");
+
+
+    static Scalar<bool>
+    overrun_detection("overrun_detection", true, true,
+                      "Whether to turn on the DAP's Overrun Detection, so "
+                      "batches are checked for WAIT once.  When false, each "
+                      "transfer costs its own USB exchanges");
+
+    static Scalar<int>
+    wait_retries("wait_retries", true, RetryPolicy::default_attempts,
+                 "How many times to try an access the target answers with "
+                 "WAIT");
+
+    static Scalar<int>
+    wait_backoff_us("wait_backoff_us", true,
+                    RetryPolicy::default_max_backoff_us,
+                    "Longest sleep between retries after WAIT, in "
+                    "microseconds");
+
     static Argument     *arguments[] =
     {
         &debug,
         &flash,
+        &gang,
         &programmer,
         &fix_lpc_checksum,
+        &diff,
+        &mass_erase,
+        &direct_iap,
+        &no_cache,
         &vid,
         &pid,
         &interface,
+        &clock,
+        &auto_clock,
+        &overrun_detection,
+        &wait_retries,
+        &wait_backoff_us,
+        &session,
+        &stats,
+        &stats_json,
         NULL
     };
 }
@@ -112,323 +205,750 @@ namespace CommandLine
  */
 
 /*
- * Invokes a routine within In-Application Programming ROM of an LPC part.
+ * How Flash gets written on the target: its part's description, and the
+ * largest block IAP can copy at once that the part's Flash and RAM allow.  The
+ * loader stub needs room for two blocks; driving IAP from the host, for one,
+ * at the start of the work area.
  */
-static Error invoke_iap(Target & target,
-                        rptr<word_t> param_table,
-                        rptr<word_t> result_table,
-                        rptr<word_t> stack)
+struct FlashPlan
 {
-    debug(2, "invoke_iap: param_table=%08X, result_table=%08X, stack=%08X",
-          param_table.bits(),
-          result_table.bits(),
-          stack.bits());
+    PartDescription const & part;
+    size_t                  block_bytes;
 
-    Check(target.write_register(Register::R0, param_table));
-    Check(target.write_register(Register::R1, result_table));
-    Check(target.write_register(Register::SP, stack));
-    Check(target.write_register(Register::PC, IAP::entry));
+    explicit FlashPlan(PartDescription const & part_) :
+        part(part_),
+        block_bytes(0) {}
 
-    // Tell the CPU to return into RAM, and catch it there with a breakpoint.
-    rptr_const<thumb_code_t> trap(param_table.bits() | 1);
-    Check(target.write_register(Register::LR, trap));
-    Check(target.enable_breakpoint(0, trap));
+    size_t block_words() const { return block_bytes / sizeof(word_t); }
 
-    Check(target.reset_halt_state());
+    rptr<word_t> ram_buffer() const { return part.work_area(); }
+    rptr<word_t> work_area() const { return ram_buffer() + block_words(); }
+};
+
+static Error plan_flash(FlashPlan * plan)
+{
+    PartDescription const & part = plan->part;
 
-    Check(target.resume());
+    size_t const max_bytes = std::min(part.max_copy_bytes,
+                                      part.smallest_sector_bytes());
 
-    bool halted = false;
-    uint32_t attempts = 0;
-    do
+    if (!CommandLine::direct_iap.get())
     {
-        Check(target.is_halted(&halted));
-        usleep(10000);
+        plan->block_bytes = FlashLoader::largest_block(part.ram_bytes,
+                                                       max_bytes);
     }
-    while (++attempts < 100 && !halted);
-
-    if (!halted)
+    else
     {
-        warning("Target did not halt after IAP execution!");
-        Check(target.halt());
+        plan->block_bytes = largest_copy_size(max_bytes);
+        while (plan->block_bytes
+            && plan->block_bytes + iap_work_area_bytes > part.ram_bytes)
+        {
+            plan->block_bytes = largest_copy_size(plan->block_bytes - 1);
+        }
+    }
 
-        uint32_t pc;
-        Check(target.read_register(Register::PC, &pc));
-        warning("Target forceably halted at %08X", pc);
+    CheckStringB(plan->block_bytes,
+                 "%s has too little RAM to program its Flash",
+                 part.name);
 
-        return Err::failure;
-    }
+    debug(1, "Programming Flash in %zu-byte blocks", plan->block_bytes);
 
     return Err::success;
 }
 
 /*
- * Unmaps the bootloader ROM from address 0 in an LPC part, revealing user flash
- * sector 0 beneath.
- *
- * This operation is valid for at least the following micros:
- *  - LPC111x / LPC11Cxx
- *  - LPC13xx
- *
- * The current implementation won't work on the LPC17xx.
+ * One sector of the program, gathered from however many pieces the image
+ * hands out for it.  Words the image doesn't cover are left erased.
  */
-static Error unmap_boot_sector(Target & target)
+struct SectorImage
 {
-    return target.write_word(SYSCON::SYSMEMREMAP,
-                             SYSCON::SYSMEMREMAP_MAP_USER_FLASH);
-}
+    FlashSector    sector;
+    vector<word_t> words;
+    vector<bool>   covered;
 
-static Error unprotect_flash(Target & target,
-                             rptr<word_t> work_addr,
-                             uint32_t first_sector,
-                             uint32_t last_sector)
+    void reset(FlashSector const & new_sector)
+    {
+        sector = new_sector;
+        words.assign(sector.bytes / sizeof(word_t), 0xFFFFFFFF);
+        covered.assign(words.size(), false);
+    }
+
+    // Address of the word at offset within the sector.
+    rptr<word_t> address(size_t offset) const
+    {
+        return rptr<word_t>(sector.base + offset * sizeof(word_t));
+    }
+};
+
+/*
+ * Reads an image a sector at a time, so that only one sector of the program is
+ * ever held in memory.
+ */
+class SectorReader
 {
-    debug(1, "Unprotecting Flash sectors %"PRIu32"-%"PRIu32"...",
-          first_sector,
-          last_sector);
+public:
+    SectorReader(Image & image, PartDescription const & part) :
+        _image(image),
+        _part(part),
+        _have_piece(false),
+        _address(0),
+        _count(0),
+        _started(false),
+        _previous(0) {}
+
+    /*
+     * Gathers the next sector the image covers into sector, or sets found to
+     * false at the end of the image.
+     */
+    Error next(SectorImage * sector, bool * found)
+    {
+        if (!_have_piece) Check(read_piece());
 
-    rptr<word_t> const cmd_addr (work_addr);
-    rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
-    rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
-                                          + IAP::min_stack_words);
+        *found = _count > 0;
+        if (!*found) return Err::success;
 
-    // Build command table
-    Check(target.write_word(cmd_addr + 0, IAP::Command::unprotect_sectors));
-    Check(target.write_word(cmd_addr + 1, first_sector));
-    Check(target.write_word(cmd_addr + 2, last_sector));
+        CheckStringB(!_started || _sector.index > _previous,
+                     "Program goes back to %08X; pieces must be in address "
+                     "order",
+                     _address.bits());
 
-    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top));
+        sector->reset(_sector);
+        _started  = true;
+        _previous = _sector.index;
 
-    uint32_t iap_result;
-    Check(target.read_word(resp_addr + 0, &iap_result));
-    CheckEQ(iap_result, 0);
+        do
+        {
+            size_t const offset = (_address.bits() - _sector.base)
+                                / sizeof(word_t);
 
-    return Err::success;
-}
+            std::copy(_data, _data + _count, sector->words.begin() + offset);
+            std::fill(sector->covered.begin() + offset,
+                      sector->covered.begin() + offset + _count,
+                      true);
 
-static Error erase_flash(Target & target,
-                         rptr<word_t> work_addr,
-                         uint32_t first_sector,
-                         uint32_t last_sector)
+            Check(read_piece());
+        }
+        while (_count > 0 && _sector.index == _previous);
+
+        return Err::success;
+    }
+
+private:
+    Image &                 _image;
+    PartDescription const & _part;
+
+    // The piece read, and the sector it falls in, not yet gathered.
+    bool           _have_piece;
+    rptr<word_t>   _address;
+    word_t const * _data;
+    size_t         _count;
+    FlashSector    _sector;
+
+    bool           _started;
+    unsigned       _previous;  // Index of the last sector gathered.
+
+    Error read_piece()
+    {
+        Check(_image.next(_part.smallest_sector_bytes(),
+                          &_address, &_data, &_count));
+        _have_piece = true;
+
+        if (_count == 0) return Err::success;
+
+        CheckStringB(_part.find_sector(_address.bits(), &_sector),
+                     "Program at %08X is outside the Flash of %s",
+                     _address.bits(),
+                     _part.name);
+
+        return Err::success;
+    }
+};
+
+/*
+ * What becomes of each sector of Flash.  Before programming, sectors are
+ * marked to be erased -- all of them, for -mass_erase, or those the program
+ * covers, less any -diff finds unchanged -- and erased together.  A streamed
+ * image can't be looked through first, so its sectors are left untouched
+ * until they arrive, and then compared and erased one at a time.
+ */
+enum SectorState
 {
-    debug(1, "Erasing Flash sectors %"PRIu32"-%"PRIu32"...",
-          first_sector,
-          last_sector);
+    state_untouched,
+    state_unchanged,
+    state_to_erase,
+    state_erased
+};
 
-    rptr<word_t> const cmd_addr (work_addr);
-    rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
-    rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
-                                          + IAP::min_stack_words);
+/*
+ * Time spent in each stage of programming, summed over every sector.
+ */
+static Metrics::Histogram compare_time("flash.compare");
+static Metrics::Histogram erase_time("flash.erase");
+static Metrics::Histogram program_time("flash.program");
+static Metrics::Histogram verify_time("flash.verify");
 
-    Check(target.write_word(cmd_addr + 0, IAP::Command::erase_sectors));
-    Check(target.write_word(cmd_addr + 1, first_sector));
-    Check(target.write_word(cmd_addr + 2, last_sector));
-    Check(target.write_word(cmd_addr + 3, 12000));  // TODO hard-coded clock
+/*
+ * A stretch of Flash, and the CRC of what the program puts there.
+ */
+struct Extent
+{
+    uint32_t address;
+    size_t   bytes;
+    uint32_t crc;
+};
 
-    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top));
+/*
+ * What program_flash wrote, for verify_flash: each contiguous run of the
+ * program, and the pieces of those runs that fall in each block, so that bad
+ * blocks can be found without going back to the image -- which may have been
+ * a stream.
+ */
+struct FlashRecord
+{
+    vector<Extent> runs;
+    vector<Extent> pieces;
+    size_t         bytes;
+    size_t         block_bytes;
 
-    uint32_t iap_result;
-    Check(target.read_word(resp_addr + 0, &iap_result));
-    CheckEQ(iap_result, 0);
+    FlashRecord() : bytes(0), block_bytes(0) {}
+};
 
-    return Err::success;
+/*
+ * State carried from sector to sector while programming.
+ */
+struct FlashSession
+{
+    Target &              target;
+    FlashPlan const &     plan;
+    vector<SectorState> & states;
+    FlashLoader           loader;
+    bool                  loader_running;
+
+    size_t      blocks_written;
+    size_t      blank_blocks;
+
+    FlashSession(Target & target_,
+                 FlashPlan const & plan_,
+                 vector<SectorState> & states_) :
+        target(target_),
+        plan(plan_),
+        states(states_),
+        loader(target_, plan_.ram_buffer(), plan_.block_bytes),
+        loader_running(false),
+        blocks_written(0),
+        blank_blocks(0) {}
+};
+
+/*
+ * Adds the covered parts of a sector to the record, a block at a time.
+ */
+static void record_sector(FlashRecord * record, SectorImage const & image)
+{
+    size_t const words_per_block = record->block_bytes / sizeof(word_t);
+    size_t offset = 0;
+
+    while (offset < image.words.size())
+    {
+        if (!image.covered[offset])
+        {
+            ++offset;
+            continue;
+        }
+
+        size_t end = offset + 1;
+        while (end < image.words.size()
+            && end % words_per_block != 0
+            && image.covered[end]) ++end;
+        Extent piece;
+        piece.address = image.address(offset).bits();
+        piece.bytes   = (end - offset) * sizeof(word_t);
+        piece.crc     = CRC32::update(0, &image.words[offset], piece.bytes);
+
+        record->pieces.push_back(piece);
+        record->bytes += piece.bytes;
+
+        Extent * run = record->runs.empty() ? 0 : &record->runs.back();
+
+        if (run && run->address + run->bytes == piece.address)
+        {
+            run->crc    = CRC32::update(run->crc,
+                                        &image.words[offset],
+                                        piece.bytes);
+            run->bytes += piece.bytes;
+        }
+        else
+        {
+            record->runs.push_back(piece);
+        }
+
+        offset = end;
+    }
 }
 
-static Error copy_ram_to_flash(Target & target,
-                               rptr<word_t> work_addr,
-                               rptr<word_t> src_addr,
-                               rptr<word_t> dest_addr,
-                               size_t num_bytes)
+/*
+ * Compares the words of Flash that the program covers in a sector with the
+ * program.  Words the program doesn't cover are ignored.
+ */
+static Error sector_unchanged(Target & target,
+                              SectorImage const & image,
+                              bool * unchanged)
 {
-    rptr<word_t> const cmd_addr (work_addr);
-    rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
-    rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
-                                          + IAP::min_stack_words);
+    Metrics::Timer timer(compare_time);
 
-    debug(1, "Writing Flash: %zu bytes at %"PRIx32,
-          num_bytes,
-          dest_addr.bits());
+    size_t first = 0;
+    while (!image.covered[first]) ++first;
 
-    Check(target.write_word(cmd_addr + 0, IAP::Command::copy_ram_to_flash));
-    Check(target.write_word(cmd_addr + 1, dest_addr.bits()));
-    Check(target.write_word(cmd_addr + 2, src_addr.bits()));
-    Check(target.write_word(cmd_addr + 3, num_bytes));
-    Check(target.write_word(cmd_addr + 4, 12000));  // TODO hard-coded clock
+    size_t last = image.words.size() - 1;
+    while (!image.covered[last]) --last;
 
-    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top));
+    vector<word_t> contents(last - first + 1);
+    Check(target.read_words(image.address(first),
+                            &contents[0],
+                            contents.size()));
 
-    uint32_t iap_result;
-    Check(target.read_word(resp_addr + 0, &iap_result));
-    CheckEQ(iap_result, 0);
+    *unchanged = true;
+    for (size_t i = first; i <= last && *unchanged; ++i)
+    {
+        if (image.covered[i] && contents[i - first] != image.words[i])
+        {
+            *unchanged = false;
+        }
+    }
 
     return Err::success;
 }
 
-
 /*
- * Rewrites the target's flash memory.
+ * Decides what becomes of each sector the program covers, reading the image
+ * through once -- and, with -diff, the Flash it covers.
  */
-static Error program_flash(Target & target,
-                           word_t const * program,
-                           size_t word_count)
+static Error survey_flash(Target & target,
+                          FlashPlan const & plan,
+                          Image & image,
+                          vector<SectorState> * states)
 {
-    size_t const bytes_per_block = 256;
-    size_t const words_per_block = bytes_per_block / sizeof(word_t);
+    SectorReader reader(image, plan.part);
+    SectorImage  sector;
 
-    size_t const bytes_per_sector = 4096;
-    size_t const words_per_sector = bytes_per_sector / sizeof(word_t);
+    for (;;)
+    {
+        bool found;
+        Check(reader.next(&sector, &found));
 
-    rptr<word_t> const ram_buffer(0x10000000);
-    rptr<word_t> const work_area(ram_buffer + words_per_block);
+        if (!found) break;
 
-    size_t const last_sector =
-        (word_count + words_per_sector - 1) / words_per_sector;
-    size_t const block_count =
-        (word_count + words_per_block - 1) / words_per_block;
+        SectorState & state = (*states)[sector.sector.index];
+        state = state_to_erase;
 
-    // Ensure that the boot Flash isn't visible (will mess us up).
-    Check(unmap_boot_sector(target));
+        if (CommandLine::diff.get())
+        {
+            bool unchanged;
+            Check(sector_unchanged(target, sector, &unchanged));
+
+            if (unchanged) state = state_unchanged;
+        }
+    }
 
-    // Erase the current contents of Flash.  (TODO: make optional?)
-    Check(unprotect_flash(target, work_area, 0, last_sector));
-    Check(erase_flash(target, work_area, 0, last_sector));
+    return Err::success;
+}
 
-    // Copy program to RAM, then to Flash, in 256 byte chunks.
-    for (unsigned block = 0; block < block_count; ++block)
-    {
-        size_t block_offset = block * words_per_block;
-        rptr<word_t> block_address(block_offset * sizeof(word_t));
+/*
+ * Erases sectors first to last, and marks them erased.
+ */
+static Error erase_sector_run(Target & target,
+                              FlashPlan const & plan,
+                              unsigned first,
+                              unsigned last,
+                              vector<SectorState> * states)
+{
+    Metrics::Timer timer(erase_time);
+
+    Check(unprotect_flash(target, plan.work_area(), first, last));
+    Check(erase_flash(target, plan.work_area(), first, last,
+                      plan.part.cclk_khz));
 
-        size_t current_block_words =
-            std::min(word_count - block_offset, words_per_block);
+    std::fill(states->begin() + first,
+              states->begin() + last + 1,
+              state_erased);
 
-        // Copy a block to RAM...
-        debug(1, "Copying %zu words starting with #%u to %08X",
-              current_block_words,
-              block,
-              ram_buffer.bits());
+    return Err::success;
+}
 
-        Check(target.write_words(&program[block_offset],
-                                 ram_buffer,
-                                 current_block_words));
+/*
+ * Erases the sectors marked to be erased, each run of neighbouring ones with
+ * a single IAP call, which erases them all in about the time of one.
+ */
+static Error erase_sectors(Target & target,
+                           FlashPlan const & plan,
+                           vector<SectorState> * states)
+{
+    size_t runs = 0;
 
-        // ...and write it to Flash.
-        unsigned sector = block_address.bits() / bytes_per_sector;
-        Check(unprotect_flash(target, work_area, sector, sector));
+    for (unsigned first = 0; first < states->size(); ++first)
+    {
+        if ((*states)[first] != state_to_erase) continue;
+
+        unsigned last = first;
+        while (last + 1 < states->size()
+            && (*states)[last + 1] == state_to_erase) ++last;
 
-        Check(copy_ram_to_flash(target,
-                                work_area,
-                                ram_buffer,
-                                block_address,
-                                bytes_per_block));
+        Check(erase_sector_run(target, plan, first, last, states));
+
+        ++runs;
+        first = last;
     }
 
+    if (runs) debug(1, "Erased Flash in %zu runs of sectors", runs);
+
     return Err::success;
 }
 
 /*
- * Dumps the first 256 bytes of the target's flash to the console.
+ * Writes the program's blocks into an erased sector -- except those that are
+ * entirely erased (all ones) in the program, since erasing the sector has
+ * already taken care of them.
  */
-static Error dump_flash(Target & target)
+static Error program_sector(FlashSession & session, SectorImage const & image)
 {
-    word_t buffer[256 / sizeof(word_t)];
-    size_t buffer_size = sizeof(buffer) / sizeof(buffer[0]);
+    Metrics::Timer timer(program_time);
 
-    Check(target.read_words(rptr<word_t>(0), buffer, buffer_size));
+    Target &          target = session.target;
+    FlashPlan const & plan   = session.plan;
+    size_t const      words_per_block = plan.block_words();
+    unsigned const    sector = image.sector.index;
 
-    notice("Contents of Flash:");
-    for (unsigned i = 0; i < buffer_size; ++i)
+    for (size_t block = 0;
+         block < image.words.size() / words_per_block;
+         ++block)
     {
-        notice(" [%08zX] %08"PRIX32, i * sizeof(word_t), buffer[i]);
+        size_t const offset = block * words_per_block;
+
+        vector<bool>::const_iterator covered = image.covered.begin() + offset;
+        if (std::find(covered, covered + words_per_block, true)
+            == covered + words_per_block) continue;
+
+        word_t const * data = &image.words[offset];
+        if (std::count(data, data + words_per_block, 0xFFFFFFFF)
+            == ptrdiff_t(words_per_block))
+        {
+            ++session.blank_blocks;
+            continue;
+        }
+
+        rptr<word_t> const block_address(image.address(offset));
+
+        if (!CommandLine::direct_iap.get())
+        {
+            /*
+             * Hand the block to the loader stub, which reuses the RAM that
+             * erase_flash used as its work area.
+             */
+            if (!session.loader_running)
+            {
+                Check(session.loader.start(plan.part.cclk_khz));
+                session.loader_running = true;
+            }
+
+            Check(session.loader.program_block(data,
+                                               words_per_block,
+                                               block_address,
+                                               sector));
+        }
+        else
+        {
+            // Copy the block to RAM...
+            debug(1, "Copying block at %08X to %08X",
+                  block_address.bits(),
+                  plan.ram_buffer().bits());
+
+            Check(target.write_words(data,
+                                     plan.ram_buffer(),
+                                     words_per_block));
+
+            /*
+             * ...and write it to Flash.  IAP protects a sector again after
+             * each write, so it has to be unprotected for every block.
+             */
+            Check(unprotect_flash(target, plan.work_area(), sector, sector));
+
+            Check(copy_ram_to_flash(target,
+                                    plan.work_area(),
+                                    plan.ram_buffer(),
+                                    block_address,
+                                    plan.block_bytes,
+                                    plan.part.cclk_khz));
+        }
+
+        ++session.blocks_written;
     }
 
     return Err::success;
 }
 
-
-/*******************************************************************************
- * swddude main implementation
+/*
+ * Brings a sector up to date.  Sectors of a surveyed image are unchanged or
+ * already erased; those of a stream are compared, with -diff, and erased as
+ * they arrive.
  */
+static Error write_sector(FlashSession & session, SectorImage const & image)
+{
+    SectorState & state = session.states[image.sector.index];
+
+    if (state == state_untouched && CommandLine::diff.get())
+    {
+        bool unchanged;
+        Check(sector_unchanged(session.target, image, &unchanged));
 
-static void fix_lpc_checksum(char * program, size_t program_length)
+        if (unchanged) state = state_unchanged;
+    }
+
+    if (state == state_unchanged)
+    {
+        debug(1, "Sector %u is unchanged", image.sector.index);
+        return Err::success;
+    }
+
+    if (state != state_erased)
+    {
+        /*
+         * Erasing goes through invoke_iap, which needs the core -- so stop the
+         * loader stub, if it's running, and restart it for the new sector.
+         */
+        if (session.loader_running)
+        {
+            Metrics::Timer timer(program_time);
+
+            Check(session.loader.finish());
+            session.loader_running = false;
+        }
+
+        Check(erase_sector_run(session.target, session.plan,
+                               image.sector.index, image.sector.index,
+                               &session.states));
+    }
+
+    return program_sector(session, image);
+}
+
+/*
+ * Writes the program into the target's Flash, a sector at a time.  Sectors the
+ * image doesn't touch are neither erased nor written.  Notes what was written
+ * in record, for verify_flash.
+ */
+static Error program_flash(Target & target,
+                           FlashPlan const & plan,
+                           Image & image,
+                           vector<SectorState> * states,
+                           FlashRecord * record)
 {
-    size_t const checked_vectors = 7;
+    FlashSession session(target, plan, *states);
+    SectorReader reader(image, plan.part);
+    SectorImage  sector;
+    size_t       sectors = 0;
+
+    record->block_bytes = plan.block_bytes;
+
+    for (;;)
+    {
+        bool found;
+        Check(reader.next(&sector, &found));
+
+        if (!found) break;
 
-    if (program_length < checked_vectors * sizeof(word_t)) {
-        warning("Program too short to write LPC checksum.");
-        return;
+        record_sector(record, sector);
+        Check(write_sector(session, sector));
+        ++sectors;
     }
 
-    word_t * program_words = (word_t *) program;
+    CheckStringB(sectors > 0, "Program is empty");
 
-    word_t sum = 0;
-    for (size_t i = 0; i < checked_vectors; ++i)
+    if (session.loader_running)
     {
-        sum += program_words[i];
+        Metrics::Timer timer(program_time);
+
+        Check(session.loader.finish());
     }
-    sum = 0 - sum;
 
-    debug(1, "Repairing LPC checksum: %"PRIX32, sum);
+    if (CommandLine::diff.get())
+    {
+        notice("Skipping %zu of %zu Flash sectors, which are unchanged.",
+               size_t(std::count(states->begin(), states->end(),
+                                 state_unchanged)),
+               sectors);
+    }
 
-    program_words[checked_vectors] = sum;
+    debug(1, "Wrote %zu blocks (%zu blank blocks skipped)",
+          session.blocks_written,
+          session.blank_blocks);
+
+    return Err::success;
 }
 
-static Error flash_from_file(Target & target, char const * path)
+/*
+ * Checks that the target's Flash holds what program_flash wrote, by comparing
+ * the CRC of each run of the program with one computed on the target.  If one
+ * doesn't match, reads the run back to report which blocks are wrong.
+ */
+static Error verify_flash(Target & target,
+                          FlashPlan const & plan,
+                          FlashRecord const & record)
 {
-    Error check_error = Err::success;
-    char * program = 0;
-    ifstream input;
+    Metrics::Timer timer(verify_time);
+
+    size_t bad_blocks = 0;
+    size_t piece = 0;
+
+    for (size_t i = 0; i < record.runs.size(); ++i)
+    {
+        Extent const & run = record.runs[i];
+
+        uint32_t actual;
+        Check(CRC32::compute_on_target(target,
+                                       plan.ram_buffer(),
+                                       rptr_const<byte_t>(run.address),
+                                       run.bytes,
+                                       &actual));
+
+        debug(1, "%zu bytes at %08"PRIX32": CRC32 %08"PRIX32,
+              run.bytes,
+              run.address,
+              actual);
+
+        uint32_t const run_end = run.address + run.bytes;
+
+        if (actual == run.crc)
+        {
+            while (piece < record.pieces.size()
+                && record.pieces[piece].address < run_end) ++piece;
+            continue;
+        }
+
+        warning("Flash CRC32 at %08"PRIX32" is %08"PRIX32
+                ", expected %08"PRIX32".",
+                run.address,
+                actual,
+                run.crc);
+
+        vector<word_t> contents(run.bytes / sizeof(word_t));
+        Check(target.read_words(rptr_const<word_t>(run.address),
+                                &contents[0],
+                                contents.size()));
+
+        size_t bad_in_run = 0;
+        for (; piece < record.pieces.size()
+            && record.pieces[piece].address < run_end; ++piece)
+        {
+            Extent const & p = record.pieces[piece];
+            word_t const * data = &contents[(p.address - run.address)
+                                            / sizeof(word_t)];
+
+            if (CRC32::update(0, data, p.bytes) != p.crc)
+            {
+                warning(" Block at %08"PRIX32" does not match.",
+                        p.address & ~uint32_t(record.block_bytes - 1));
+                ++bad_in_run;
+            }
+        }
+
+        if (bad_in_run == 0)
+        {
+            // The readback is authoritative; the CRC stub must have misbehaved.
+            warning("Flash matches on readback, despite the CRC.");
+        }
+
+        bad_blocks += bad_in_run;
+    }
+
+    if (bad_blocks)
+    {
+        warning("%zu Flash blocks failed verification.", bad_blocks);
+        return Err::failure;
+    }
+
+    notice("Verified %zu bytes of Flash.", record.bytes);
 
-    input.open(path);
+    return Err::success;
+}
 
-    // Do the "get length of file" dance.
-    input.seekg(0, ios::end);
-    size_t input_length = input.tellg();
-    input.seekg(0, ios::beg);
 
-    CheckCleanupEQ(input_length,
-                   (input_length / sizeof(word_t)) * sizeof(word_t),
-                   wrong_size);
+/*******************************************************************************
+ * swddude main implementation
+ */
 
-    program = new char[input_length];
+/*
+ * Logs how long a stage of programming took, if it ran.
+ */
+static void report_stage(char const * name, Metrics::Histogram const & time)
+{
+    if (time.count() == 0) return;
 
-    input.read(program, input_length);
+    notice("  %-8s %5"PRIu64".%03"PRIu64"s",
+           name,
+           time.total_us() / 1000000,
+           time.total_us() / 1000 % 1000);
+}
 
-    debug(1, "Read program of %zu bytes", input_length);
+static Error flash_program(Target & target, uint32_t idcode, Image & image)
+{
+    PartDescription const * part;
+    Check(identify_part(target, idcode, &part));
+
+    FlashPlan plan(*part);
+    Check(plan_flash(&plan));
+
+    // Ensure that the boot Flash isn't visible (will mess us up).
+    Check(unmap_boot_sector(target));
+
+    vector<SectorState> states(part->sector_count(), state_untouched);
 
-    if (CommandLine::fix_lpc_checksum.get())
+    if (CommandLine::mass_erase.get())
+    {
+        std::fill(states.begin(), states.end(), state_to_erase);
+    }
+    else if (!image.is_stream())
     {
-        fix_lpc_checksum(program, input_length);
+        Check(survey_flash(target, plan, image, &states));
+        Check(image.rewind());
     }
 
-    CheckCleanup(program_flash(target,
-                               (word_t *) program,
-                               input_length / sizeof(word_t)),
-                 comms_failure);
+    Check(erase_sectors(target, plan, &states));
 
-    CheckCleanup(dump_flash(target), comms_failure);
+    FlashRecord record;
 
-comms_failure:
-wrong_size:
-    input.close();
-    if (program) delete[] program;
-    return check_error;
+    Check(program_flash(target, plan, image, &states, &record));
+    Check(verify_flash(target, plan, record));
+
+    notice("Time spent programming Flash:");
+    report_stage("compare", compare_time);
+    report_stage("erase",   erase_time);
+    report_stage("program", program_time);
+    report_stage("verify",  verify_time);
+
+    return Err::success;
 }
 
-static Error run_experiment(SWDDriver & swd)
+static Error run_experiment(SWDDriver & swd, Image & image)
 {
     Error check_error = Err::success;
 
     DebugAccessPort dap(swd);
     Target target(swd, dap, 0);
 
-    Check(swd.initialize());
+    dap.enable_cache(!CommandLine::no_cache.get());
+    target.enable_cache(!CommandLine::no_cache.get());
+
+    uint32_t idcode;
+    Check(swd.initialize(&idcode));
 
     // Set up the initial DAP configuration while the target is in reset.
     // The STM32 wants us to do this, and the others don't seem to mind.
     Check(swd.enter_reset());
     usleep(10000);
     Check(dap.reset_state());
+
+    if (CommandLine::overrun_detection.get())
+        Check(dap.enable_overrun_detection(true));
+
     Check(target.initialize());
     Check(target.reset_halt_state());
     Check(swd.leave_reset());
@@ -452,8 +972,7 @@ static Error run_experiment(SWDDriver & swd)
     // Flash if requested.
     if (CommandLine::flash.set())
     {
-        CheckCleanup(flash_from_file(target, CommandLine::flash.get()),
-                     comms_failure);
+        CheckCleanup(flash_program(target, idcode, image), comms_failure);
     }
 
 comms_failure:
@@ -464,14 +983,232 @@ comms_failure:
     return check_error;
 }
 
+/*
+ * Opens one programmer -- the one at location, if given -- and runs the
+ * experiment through it.
+ */
+static Error probe_main(MPSSEConfig const & config,
+                        char const * location,
+                        Image & image)
+{
+    MPSSE       mpsse;
+
+    Check(mpsse.open(config, location));
+
+    MPSSESWDDriver swd(config,
+                       &mpsse,
+                       CommandLine::auto_clock.get()
+                           ? MPSSESWDDriver::auto_clock
+                           : CommandLine::clock.get() * 1000);
+
+    Check(run_experiment(swd, image));
+
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * Gang programming
+ */
+
+/*
+ * Each probe in a gang is driven by its own worker process, rather than a
+ * thread, since the error stack and log are process-wide.  The program image
+ * is mapped once before the workers are forked, and they only ever read it, so
+ * they all share the parent's mapping.  Each gets its own copy of the Image's
+ * read position.
+ */
+struct GangWorker
+{
+    std::string probe;       // As given on the command line, for the report.
+    std::string location;    // USB serial number or bus path.
+    MPSSEConfig config;      // With the interface chosen by the probe.
+    pid_t       pid;
+    timeval     start;
+    int         milliseconds;
+    bool        passed;
+};
+
+/*
+ * Splits a probe of the form location[:interface] -- where interface is A-D,
+ * as FTDI names them, or 1-4 -- into the worker's location and config.
+ */
+static Error parse_probe(GangWorker * worker)
+{
+    std::string::size_type colon = worker->probe.rfind(':');
+
+    worker->location = worker->probe.substr(0, colon);
+
+    if (colon != std::string::npos)
+    {
+        std::string suffix = worker->probe.substr(colon + 1);
+
+        CheckStringB(suffix.size() == 1,
+                     "Bad interface in probe '%s'",
+                     worker->probe.c_str());
+
+        char name = suffix[0];
+
+        if (name >= 'A' && name <= 'D')
+            worker->config.interface = INTERFACE_A + (name - 'A');
+        else if (name >= 'a' && name <= 'd')
+            worker->config.interface = INTERFACE_A + (name - 'a');
+        else if (name >= '1' && name <= '4')
+            worker->config.interface = INTERFACE_A + (name - '1');
+        else
+            CheckStringB(false,
+                         "Bad interface in probe '%s'",
+                         worker->probe.c_str());
+    }
+
+    CheckStringB(!worker->location.empty(),
+                 "No location in probe '%s'",
+                 worker->probe.c_str());
+
+    return Err::success;
+}
+
+static Error gang_main(MPSSEConfig const & config, Image & image)
+{
+    vector<GangWorker> workers;
+
+    std::string list(CommandLine::gang.get());
+    std::string::size_type start = 0;
+
+    while (start <= list.size())
+    {
+        std::string::size_type comma = list.find(',', start);
+        if (comma == std::string::npos) comma = list.size();
+
+        if (comma > start)
+        {
+            GangWorker worker;
+            worker.probe  = list.substr(start, comma - start);
+            worker.config = config;
+            worker.passed = false;
+            worker.milliseconds = 0;
+
+            Check(parse_probe(&worker));
+            workers.push_back(worker);
+        }
+
+        start = comma + 1;
+    }
+
+    CheckStringB(!workers.empty(), "No probes given to -gang");
+
+    notice("Programming %zu targets in parallel.", workers.size());
+
+    size_t running = 0;
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        GangWorker & worker = workers[i];
+
+        // Don't let the workers inherit (and repeat) buffered output.
+        fflush(stdout);
+        fflush(stderr);
+
+        gettimeofday(&worker.start, 0);
+        worker.pid = fork();
+
+        if (worker.pid == 0)
+        {
+            Error error = probe_main(worker.config,
+                                     worker.location.c_str(),
+                                     image);
+
+            if (error != Err::success) Err::stack()->print();
+
+            // Each worker has its own figures, so it saves them itself.
+            char const * json_path = CommandLine::stats_json.get();
+            std::string  worker_json;
+
+            if (json_path[0]) worker_json = json_path + ("." + worker.probe);
+
+            if (CommandLine::stats.get())
+            {
+                notice("Statistics for %s follow.", worker.probe.c_str());
+            }
+
+            Metrics::report(CommandLine::stats.get(), worker_json.c_str());
+
+            fflush(stdout);
+            fflush(stderr);
+            _exit(error == Err::success ? 0 : 1);
+        }
+
+        if (worker.pid < 0)
+        {
+            warning("Could not start worker for %s", worker.probe.c_str());
+            continue;
+        }
+
+        ++running;
+    }
+
+    while (running > 0)
+    {
+        int status;
+        pid_t pid = wait(&status);
+
+        // A signal may cut the wait short; only ECHILD means none are left.
+        if (pid < 0 && errno == EINTR) continue;
+        if (pid < 0) break;
+
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            GangWorker & worker = workers[i];
+            if (worker.pid != pid) continue;
+
+            worker.milliseconds = milliseconds_since(worker.start);
+            worker.passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            --running;
+
+            notice("%s: %s", worker.probe.c_str(),
+                   worker.passed ? "done" : "FAILED");
+        }
+    }
+
+    size_t passed = 0;
+
+    notice("Gang report:");
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        GangWorker const & worker = workers[i];
+
+        notice("  %-24s %-6s %5d.%03ds",
+               worker.probe.c_str(),
+               worker.passed ? "pass" : "FAIL",
+               worker.milliseconds / 1000,
+               worker.milliseconds % 1000);
+
+        if (worker.passed) ++passed;
+    }
+    notice("%zu of %zu targets passed.", passed, workers.size());
+
+    CheckB(passed == workers.size());
+
+    return Err::success;
+}
+
+
 /*******************************************************************************
  * Entry point (sort of -- see main below)
  */
 
 static Error error_main(int argc, char const ** argv)
 {
+    CheckStringB(CommandLine::clock.get() > 0,
+                 "-clock must be a positive rate in kHz; -auto_clock finds "
+                 "the fastest the target manages");
+    CheckStringB(CommandLine::wait_retries.get() > 0,
+                 "-wait_retries must be at least 1");
+    CheckStringB(CommandLine::wait_backoff_us.get() >= 0,
+                 "-wait_backoff_us can't be negative");
+
     MPSSEConfig config;
-    MPSSE       mpsse;
+    Image       image;
 
     Check(lookup_programmer(CommandLine::programmer.get(), &config));
 
@@ -484,11 +1221,37 @@ static Error error_main(int argc, char const ** argv)
     if (CommandLine::pid.set())
         config.pid = CommandLine::pid.get();
 
-    Check(mpsse.open(config));
+    CheckStringB(!CommandLine::mass_erase.get() || !CommandLine::diff.get(),
+                 "-mass_erase would erase the sectors -diff leaves alone");
 
-    MPSSESWDDriver swd(config, &mpsse);
+    if (CommandLine::flash.set())
+    {
+        Check(image.open(CommandLine::flash.get()));
+        image.fix_lpc_checksum(CommandLine::fix_lpc_checksum.get());
+    }
+
+    if (CommandLine::gang.set())
+    {
+        CheckStringB(!CommandLine::flash.set() || !image.is_stream(),
+                     "-gang needs a program file, not a stream");
+
+        char const * json_path = CommandLine::stats_json.get();
+        CheckStringB(strcmp(json_path, "-") != 0,
+                     "-gang saves -stats_json for each probe, so it needs a "
+                     "file name rather than -");
+
+        return gang_main(config, image);
+    }
+
+    // A gang has a probe per target, so only a single target uses a session.
+    SessionDriver session;
+    bool          attached;
 
-    Check(run_experiment(swd));
+    Check(session.attach(CommandLine::session.get(), &attached));
+
+    if (attached) return run_experiment(session, image);
+
+    Check(probe_main(config, 0, image));
 
     return Err::success;
 }
@@ -506,7 +1269,22 @@ int main(int argc, char const ** argv)
 
     log().set_level(CommandLine::debug.get());
 
-    CheckCleanup(error_main(argc, argv), failure);
+    RetryPolicy::standard().set_attempts(CommandLine::wait_retries.get());
+    RetryPolicy::standard().set_max_backoff_us(
+        CommandLine::wait_backoff_us.get());
+
+    check_error = error_main(argc, argv);
+
+    // Reported even after a failure, which is often when they're wanted.  A
+    // gang's figures are the workers', which save their own.
+    {
+        char const * json_path = CommandLine::stats_json.get();
+        if (CommandLine::gang.set()) json_path = 0;
+
+        Metrics::report(CommandLine::stats.get(), json_path);
+    }
+
+    CheckCleanup(check_error, failure);
     return 0;
 
 failure:
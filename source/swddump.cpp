@@ -27,8 +27,12 @@
 
 #include "target.h"
 #include "swd_dp.h"
+#include "session.h"
 #include "swd_mpsse.h"
 #include "swd.h"
+#include "poll.h"
+#include "metrics.h"
+#include "retry.h"
 #include "arm.h"
 #include "lpc11xx_13xx.h"
 
@@ -36,8 +40,22 @@
 #include "libs/log/log_default.h"
 #include "libs/command_line/command_line.h"
 
+#include <vector>
+#include <algorithm>
+
+#define __STDC_FORMAT_MACROS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <ftdi.h>
 
 using Err::Error;
@@ -46,6 +64,8 @@ using namespace Log;
 using namespace ARM;
 using namespace LPC11xx_13xx;
 
+using std::vector;
+
 /******************************************************************************/
 namespace CommandLine
 {
@@ -55,7 +75,19 @@ namespace CommandLine
 
     static Scalar<int>
     count("count", true, 32,
-          "Words to dump");
+          "Words to dump, unless -length is given");
+
+    static Scalar<String>
+    start("start", true, "0",
+          "Address to start dumping from");
+
+    static Scalar<String>
+    length("length", true, "",
+           "Bytes to dump");
+
+    static Scalar<String>
+    out("out", true, "",
+        "File to write a binary dump to, instead of listing words");
 
     static Scalar<String>
     programmer("programmer", true, "um232h",
@@ -73,14 +105,68 @@ namespace CommandLine
     interface("interface", true, 0,
               "FTDI interface");
 
+    static Scalar<int>
+    clock("clock", true, MPSSESWDDriver::default_clock_hz / 1000,
+          "SWD clock rate in kHz, unless -auto_clock is given");
+
+    static Scalar<bool>
+    auto_clock("auto_clock", true, false,
+               "When true, use the fastest SWD clock rate the target "
+               "reliably supports.");
+
+
+    static Scalar<String>
+    session("session", true, "",
+            "Socket of the swdsession to work through, instead of opening "
+            "the programmer.  By default, the usual one is used if a session "
+            "is running; 'none' always opens the programmer.");
+
+    static Scalar<bool>
+    stats("stats", true, false,
+          "Whether to log transport and per-call latency statistics at exit");
+
+    static Scalar<String>
+    stats_json("stats_json", true, "",
+               "File to save the statistics to as JSON at exit, or - for "
+               "standard output");
+
+
+    static Scalar<bool>
+    overrun_detection("overrun_detection", true, true,
+                      "Whether to turn on the DAP's Overrun Detection, so "
+                      "batches are checked for WAIT once.  When false, each "
+                      "transfer costs its own USB exchanges");
+
+    static Scalar<int>
+    wait_retries("wait_retries", true, RetryPolicy::default_attempts,
+                 "How many times to try an access the target answers with "
+                 "WAIT");
+
+    static Scalar<int>
+    wait_backoff_us("wait_backoff_us", true,
+                    RetryPolicy::default_max_backoff_us,
+                    "Longest sleep between retries after WAIT, in "
+                    "microseconds");
+
     static Argument * arguments[] =
     {
         &debug,
         &count,
+        &start,
+        &length,
+        &out,
         &programmer,
         &vid,
         &pid,
         &interface,
+        &clock,
+        &auto_clock,
+        &overrun_detection,
+        &wait_retries,
+        &wait_backoff_us,
+        &session,
+        &stats,
+        &stats_json,
         NULL
     };
 }
@@ -91,23 +177,196 @@ static Error unmap_boot_sector(Target & target)
                              SYSCON::SYSMEMREMAP_MAP_USER_FLASH);
 }
 /******************************************************************************/
-static Error dump_flash(Target & target, unsigned n)
+/*
+ * Memory is read in chunks this big, which keeps the SWD pipeline full without
+ * holding a whole dump in memory.
+ */
+static size_t const chunk_bytes = 64 * 1024;
+static size_t const chunk_words = chunk_bytes / sizeof(word_t);
+/******************************************************************************/
+static Error parse_number(char const * name, char const * text, uint32_t * value)
+{
+    char * end;
+
+    errno = 0;
+    unsigned long result = strtoul(text, &end, 0);
+
+    CheckStringB(*text && !*end && errno == 0 && result <= 0xFFFFFFFFul,
+                 "Bad number for -%s: '%s'", name, text);
+
+    *value = result;
+    return Err::success;
+}
+/******************************************************************************/
+static Error write_all(int fd, void const * data, size_t bytes)
 {
-    word_t buffer;
+    uint8_t const * cursor = static_cast<uint8_t const *>(data);
+
+    while (bytes)
+    {
+        ssize_t written = write(fd, cursor, bytes);
+
+        if (written < 0 && errno == EINTR) continue;
 
-    notice("First %u words of Flash:", n);
+        CheckStringB(written > 0, "Write failed: %s", strerror(errno));
+
+        cursor += written;
+        bytes  -= written;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+static Error dump_text(Target & target, uint32_t start, uint32_t length)
+{
+    vector<word_t> buffer(std::min<size_t>(length / sizeof(word_t),
+                                           chunk_words));
 
-    rptr_const<word_t> const top(n * sizeof(word_t));
+    notice("%"PRIu32" bytes from %08"PRIX32":", length, start);
 
-    for (rptr_const<word_t> i(0); i < top; ++i)
+    for (uint32_t offset = 0; offset < length; )
     {
-        Check(target.read_word(i, &buffer));
-        notice(" [%08X] %08X", i.bits(), buffer);
+        size_t words = std::min<size_t>((length - offset) / sizeof(word_t),
+                                        chunk_words);
+
+        Check(target.read_words(rptr_const<word_t>(start + offset),
+                                &buffer[0],
+                                words));
+
+        for (size_t i = 0; i < words; ++i)
+        {
+            notice(" [%08"PRIX32"] %08X",
+                   start + offset + uint32_t(i * sizeof(word_t)),
+                   buffer[i]);
+        }
+
+        offset += words * sizeof(word_t);
     }
 
     return Err::success;
 }
 /******************************************************************************/
+/*
+ * Copies everything that arrives on input to output, until input closes.  This
+ * runs in its own process, so the disk is written while the next chunk is read
+ * over SWD; the pipe between them holds the chunk in flight.
+ */
+static int run_writer(int input, int output)
+{
+    vector<uint8_t> buffer(chunk_bytes);
+
+    for (;;)
+    {
+        ssize_t got = read(input, &buffer[0], buffer.size());
+
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) return 1;
+        if (got == 0) return 0;
+
+        if (write_all(output, &buffer[0], got) != Err::success) return 1;
+    }
+}
+/******************************************************************************/
+static Error copy_range(Target & target,
+                        uint32_t start,
+                        uint32_t length,
+                        int output)
+{
+    vector<word_t> buffer(chunk_words);
+
+    for (uint32_t offset = 0; offset < length; )
+    {
+        size_t words = std::min<size_t>((length - offset) / sizeof(word_t),
+                                        chunk_words);
+
+        Check(target.read_words(rptr_const<word_t>(start + offset),
+                                &buffer[0],
+                                words));
+
+        Check(write_all(output, &buffer[0], words * sizeof(word_t)));
+
+        offset += words * sizeof(word_t);
+        debug(1, "Dumped %"PRIu32" of %"PRIu32" bytes", offset, length);
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+static Error dump_binary(Target & target,
+                         uint32_t start,
+                         uint32_t length,
+                         char const * path)
+{
+    Error   check_error = Err::success;
+    pid_t   writer = -1;
+    int     pipe_fds[2] = { -1, -1 };
+    timeval began;
+
+    int output = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    CheckStringB(output >= 0, "Can't create %s: %s", path, strerror(errno));
+
+    CheckCleanupStringB(pipe(pipe_fds) == 0, done,
+                        "Can't create pipe: %s", strerror(errno));
+
+    // If the writer dies, we want EPIPE rather than to die with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Don't let the writer inherit (and repeat) buffered output.
+    fflush(stdout);
+    fflush(stderr);
+
+    writer = fork();
+
+    if (writer == 0)
+    {
+        close(pipe_fds[1]);
+        _exit(run_writer(pipe_fds[0], output));
+    }
+
+    close(pipe_fds[0]);
+
+    CheckCleanupStringB(writer > 0, done,
+                        "Can't start writer: %s", strerror(errno));
+
+    gettimeofday(&began, 0);
+
+    CheckCleanup(copy_range(target, start, length, pipe_fds[1]), done);
+
+  done:
+    // Closing our end lets the writer finish.
+    if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+
+    if (writer > 0)
+    {
+        int status;
+        while (waitpid(writer, &status, 0) < 0 && errno == EINTR) {}
+
+        if (check_error == Err::success
+            && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+        {
+            warning("Writing %s failed.", path);
+            check_error = Err::failure;
+        }
+    }
+
+    close(output);
+
+    if (check_error == Err::success)
+    {
+        int ms = milliseconds_since(began);
+        notice("Dumped %"PRIu32" bytes from %08"PRIX32" to %s in "
+               "%d.%03ds (%d KB/s).",
+               length,
+               start,
+               path,
+               ms / 1000,
+               ms % 1000,
+               ms ? int(uint64_t(length) * 1000 / 1024 / ms) : 0);
+    }
+
+    return check_error;
+}
+/******************************************************************************/
 static Error run_experiment(SWDDriver & swd)
 {
     Check(swd.initialize(NULL));
@@ -118,18 +377,60 @@ static Error run_experiment(SWDDriver & swd)
     DebugAccessPort dap(swd);
     Check(dap.reset_state());
 
+    if (CommandLine::overrun_detection.get())
+        Check(dap.enable_overrun_detection(true));
+
     Target target(swd, dap, 0);
     Check(target.initialize());
     Check(target.halt());
 
     Check(unmap_boot_sector(target));
-    Check(dump_flash(target, CommandLine::count.get()));
+
+    uint32_t start;
+    Check(parse_number("start", CommandLine::start.get(), &start));
+
+    uint32_t length = CommandLine::count.get() * sizeof(word_t);
+    if (CommandLine::length.set())
+    {
+        Check(parse_number("length", CommandLine::length.get(), &length));
+    }
+
+    CheckStringB(start % sizeof(word_t) == 0 && length % sizeof(word_t) == 0,
+                 "-start and -length must be multiples of %zu",
+                 sizeof(word_t));
+
+    CheckStringB(length <= 0x100000000ull - start,
+                 "-start and -length run past the end of memory");
+
+    if (CommandLine::out.set())
+    {
+        Check(dump_binary(target, start, length, CommandLine::out.get()));
+    }
+    else
+    {
+        Check(dump_text(target, start, length));
+    }
 
     return Err::success;
 }
 /******************************************************************************/
 static Error error_main(int argc, char const ** argv)
 {
+    CheckStringB(CommandLine::clock.get() > 0,
+                 "-clock must be a positive rate in kHz; -auto_clock finds "
+                 "the fastest the target manages");
+    CheckStringB(CommandLine::wait_retries.get() > 0,
+                 "-wait_retries must be at least 1");
+    CheckStringB(CommandLine::wait_backoff_us.get() >= 0,
+                 "-wait_backoff_us can't be negative");
+
+    SessionDriver session;
+    bool          attached;
+
+    Check(session.attach(CommandLine::session.get(), &attached));
+
+    if (attached) return run_experiment(session);
+
     MPSSEConfig config;
     MPSSE       mpsse;
 
@@ -146,7 +447,11 @@ static Error error_main(int argc, char const ** argv)
 
     Check(mpsse.open(config));
 
-    MPSSESWDDriver swd(config, &mpsse);
+    MPSSESWDDriver swd(config,
+                       &mpsse,
+                       CommandLine::auto_clock.get()
+                           ? MPSSESWDDriver::auto_clock
+                           : CommandLine::clock.get() * 1000);
 
     Check(run_experiment(swd));
 
@@ -162,7 +467,16 @@ int main(int argc, char const ** argv)
 
     log().set_level(CommandLine::debug.get());
 
-    CheckCleanup(error_main(argc, argv), failure);
+    RetryPolicy::standard().set_attempts(CommandLine::wait_retries.get());
+    RetryPolicy::standard().set_max_backoff_us(
+        CommandLine::wait_backoff_us.get());
+
+    check_error = error_main(argc, argv);
+
+    // Reported even after a failure, which is often when they're wanted.
+    Metrics::report(CommandLine::stats.get(), CommandLine::stats_json.get());
+
+    CheckCleanup(check_error, failure);
     return 0;
 
   failure:
@@ -0,0 +1,1772 @@
+/*
+ * Copyright (c) 2012, Anton Staaf, Cliff L. Biffle.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * swdgdb serves a Target to GDB over its remote serial protocol, so that GDB
+ * can debug the target through a programmer the other tools drive:
+ *
+ *     swdgdb -port 3333 &
+ *     arm-none-eabi-gdb firmware.elf -ex "target extended-remote :3333"
+ *
+ * Registers, memory, hardware breakpoints and DWT watchpoints, stepping, and
+ * "load" into Flash all work.  Every USB round trip counts on an FTDI link,
+ * so GDB's requests are answered in as few as possible: "g" takes every
+ * register in one batch, memory moves in bulk through read_words and
+ * write_words, and, with the caches on, whatever GDB asks again while the
+ * processor is halted comes from the host.
+ *
+ * GDB connects to localhost only.  swdgdb serves one GDB at a time, and runs
+ * until interrupted.
+ */
+
+#include "target.h"
+#include "iap.h"
+#include "flash_loader.h"
+#include "part.h"
+#include "poll.h"
+#include "metrics.h"
+#include "retry.h"
+#include "swd_dp.h"
+#include "session.h"
+#include "swd_mpsse.h"
+#include "swd.h"
+
+#include "rptr.h"
+
+#include "armv6m_v7m.h"
+#include "arm.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+#include "libs/command_line/command_line.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+
+using namespace Log;
+using Err::Error;
+
+using namespace ARM;
+using namespace ARMv6M_v7M;
+
+using std::string;
+using std::vector;
+
+
+/*******************************************************************************
+ * Command line flags
+ */
+namespace CommandLine
+{
+    static Scalar<int>
+    debug("debug", true, 0, "What level of debug logging to use.");
+
+    static Scalar<String>
+    programmer("programmer", true, "um232h", "FTDI-based programmer to use");
+
+    static Scalar<int> vid("vid", true, 0, "FTDI VID");
+    static Scalar<int> pid("pid", true, 0, "FTDI PID");
+
+    static Scalar<int>
+    interface("interface", true, 0, "Interface on FTDI chip");
+
+    static Scalar<int>
+    clock("clock", true, MPSSESWDDriver::default_clock_hz / 1000,
+          "SWD clock rate in kHz, unless -auto_clock is given");
+
+    static Scalar<bool>
+    auto_clock("auto_clock", true, false,
+               "Whether to find the fastest reliable SWD clock rate");
+
+    static Scalar<int>
+    port("port", true, 3333, "TCP port on localhost to serve GDB on");
+
+    static Scalar<bool>
+    no_cache("no_cache", true, false,
+             "Whether to re-read debug registers even when they can't have "
+             "changed");
+
+
+    static Scalar<String>
+    session("session", true, "",
+            "Socket of the swdsession to work through, instead of opening "
+            "the programmer.  By default, the usual one is used if a session "
+            "is running; 'none' always opens the programmer.");
+
+    static Scalar<bool>
+    stats("stats", true, false,
+          "Whether to log transport and per-call latency statistics at exit");
+
+    static Scalar<String>
+    stats_json("stats_json", true, "",
+               "File to save the statistics to as JSON at exit, or - for "
+               "standard output");
+
+
+    static Scalar<bool>
+    overrun_detection("overrun_detection", true, true,
+                      "Whether to turn on the DAP's Overrun Detection, so "
+                      "batches are checked for WAIT once.  When false, each "
+                      "transfer costs its own USB exchanges");
+
+    static Scalar<int>
+    wait_retries("wait_retries", true, RetryPolicy::default_attempts,
+                 "How many times to try an access the target answers with "
+                 "WAIT");
+
+    static Scalar<int>
+    wait_backoff_us("wait_backoff_us", true,
+                    RetryPolicy::default_max_backoff_us,
+                    "Longest sleep between retries after WAIT, in "
+                    "microseconds");
+
+    static Argument * arguments[] =
+    {
+        &debug,
+        &programmer,
+        &vid,
+        &pid,
+        &interface,
+        &clock,
+        &auto_clock,
+        &port,
+        &no_cache,
+        &overrun_detection,
+        &wait_retries,
+        &wait_backoff_us,
+        &session,
+        &stats,
+        &stats_json,
+        NULL
+    };
+}
+
+
+/*******************************************************************************
+ * Register numbering
+ */
+
+/*
+ * GDB's numbering of the registers we describe in target.xml.  The first 19
+ * match Target's; the rest are the fields of CONTROL_and_masks.
+ */
+static unsigned const gdb_primask      = 19;
+static unsigned const gdb_basepri      = 20;
+static unsigned const gdb_faultmask    = 21;
+static unsigned const gdb_control      = 22;
+static unsigned const gdb_register_count = 23;
+
+// Registers read for "g", in one batch.
+static uint32_t const snapshot_mask = 0xFFFF
+                                    | (1 << Register::xPSR)
+                                    | (1 << Register::MSP)
+                                    | (1 << Register::PSP)
+                                    | (1 << Register::CONTROL_and_masks);
+
+/*
+ * Largest packet we take, and the most any reply of ours carries.  A memory
+ * read reply takes two characters per byte.
+ */
+static size_t const packet_size = 4096;
+static size_t const max_read_bytes = packet_size / 2;
+
+
+/*******************************************************************************
+ * Encoding
+ */
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Parses a big-endian hex number at cursor, advancing past it.  Fails if
+ * there are no digits.
+ */
+static bool parse_number(char const * & cursor, uint32_t * value)
+{
+    char const * start = cursor;
+
+    *value = 0;
+    while (hex_digit(*cursor) >= 0)
+    {
+        *value = (*value << 4) | hex_digit(*cursor);
+        ++cursor;
+    }
+
+    return cursor != start;
+}
+
+/*
+ * Parses count bytes' worth of hex pairs at cursor, advancing past them.
+ */
+static bool parse_bytes(char const * & cursor, byte_t * out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        int high = hex_digit(cursor[0]);
+        if (high < 0) return false;
+        int low  = hex_digit(cursor[1]);
+        if (low < 0) return false;
+
+        out[i] = (high << 4) | low;
+        cursor += 2;
+    }
+
+    return true;
+}
+
+// A register's value, as GDB has it: eight hex digits in target byte order.
+static bool parse_word(char const * & cursor, word_t * value)
+{
+    byte_t bytes[4];
+    if (!parse_bytes(cursor, bytes, 4)) return false;
+
+    *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16)
+           | (word_t(bytes[3]) << 24);
+    return true;
+}
+
+static void append_bytes(string * out, byte_t const * data, size_t count)
+{
+    static char const digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        *out += digits[data[i] >> 4];
+        *out += digits[data[i] & 0xF];
+    }
+}
+
+static void append_word(string * out, word_t value)
+{
+    byte_t const bytes[4] = {
+        byte_t(value),
+        byte_t(value >> 8),
+        byte_t(value >> 16),
+        byte_t(value >> 24),
+    };
+
+    append_bytes(out, bytes, 4);
+}
+
+/*
+ * Escapes binary data for a reply: the framing characters go as '}' and the
+ * character XOR 0x20.
+ */
+static void append_binary(string * out, char const * data, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        char c = data[i];
+        if (c == '#' || c == '$' || c == '}' || c == '*')
+        {
+            *out += '}';
+            c ^= 0x20;
+        }
+        *out += c;
+    }
+}
+
+static void unescape_binary(char const * data,
+                            size_t count,
+                            vector<byte_t> * out)
+{
+    out->clear();
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (data[i] == '}' && i + 1 < count) out->push_back(data[++i] ^ 0x20);
+        else                                 out->push_back(data[i]);
+    }
+}
+
+static string format(char const * pattern, uint32_t value)
+{
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), pattern, unsigned(value));
+    return buffer;
+}
+
+
+/*******************************************************************************
+ * The connection to GDB, and the packets on it
+ */
+class Connection
+{
+public:
+    explicit Connection(int fd) :
+        _fd(fd),
+        _ack(true),
+        _next(0),
+        _end(0) {}
+
+    ~Connection() { close(_fd); }
+
+    /*
+     * Waits for the next packet.  An interrupt (^C) outside a packet is
+     * returned as a packet holding just that character.  closed reports GDB
+     * going away, or a signal telling us to stop.
+     */
+    Error receive(string * packet, bool * closed);
+
+    Error send(string const & payload);
+
+    /*
+     * Checks, without waiting, whether GDB has sent an interrupt.
+     */
+    Error check_interrupt(bool * interrupted, bool * closed);
+
+    // After QStartNoAckMode, packets are no longer acknowledged.
+    void disable_acks() { _ack = false; }
+
+private:
+    int    _fd;
+    bool   _ack;
+    char   _buffer[packet_size];
+    size_t _next;
+    size_t _end;
+
+    // Reads whatever has arrived, waiting for something if wait is set.
+    Error fill(bool wait, bool * closed);
+
+    Error next_char(char * c, bool * closed);
+
+    Error send_all(char const * data, size_t bytes);
+};
+
+/******************************************************************************/
+Error Connection::fill(bool wait, bool * closed)
+{
+    *closed = false;
+
+    if (!wait)
+    {
+        pollfd readable = { _fd, POLLIN, 0 };
+        int ready = ::poll(&readable, 1, 0);
+
+        if (ready < 0 && errno == EINTR)
+        {
+            *closed = true;
+            return Err::success;
+        }
+
+        CheckStringB(ready >= 0, "Can't poll GDB: %s", strerror(errno));
+        if (ready == 0) return Err::success;
+    }
+
+    ssize_t got = recv(_fd, _buffer, sizeof(_buffer), 0);
+
+    if (got <= 0)
+    {
+        // A signal stops us just as GDB leaving does.
+        CheckStringB(got == 0 || errno == EINTR || errno == ECONNRESET,
+                     "Can't read from GDB: %s", strerror(errno));
+        *closed = true;
+        return Err::success;
+    }
+
+    _next = 0;
+    _end  = got;
+    return Err::success;
+}
+/******************************************************************************/
+Error Connection::next_char(char * c, bool * closed)
+{
+    *closed = false;
+
+    if (_next == _end)
+    {
+        Check(fill(true, closed));
+        if (*closed) return Err::success;
+    }
+
+    *c = _buffer[_next++];
+    return Err::success;
+}
+/******************************************************************************/
+Error Connection::receive(string * packet, bool * closed)
+{
+    for (;;)
+    {
+        char c;
+
+        Check(next_char(&c, closed));
+        if (*closed) return Err::success;
+
+        if (c == '\x03')
+        {
+            *packet = c;
+            return Err::success;
+        }
+
+        // Anything else outside a packet is a stray acknowledgement.
+        if (c != '$') continue;
+
+        packet->clear();
+        uint8_t sum = 0;
+
+        for (;;)
+        {
+            Check(next_char(&c, closed));
+            if (*closed) return Err::success;
+
+            if (c == '#') break;
+
+            CheckStringB(packet->size() < packet_size,
+                         "Packet from GDB is longer than the %u bytes we take",
+                         unsigned(packet_size));
+
+            *packet += c;
+            sum += c;
+        }
+
+        char digits[2];
+        Check(next_char(&digits[0], closed));
+        if (*closed) return Err::success;
+        Check(next_char(&digits[1], closed));
+        if (*closed) return Err::success;
+
+        int const expected = (hex_digit(digits[0]) << 4) | hex_digit(digits[1]);
+
+        if (expected != sum)
+        {
+            warning("Packet from GDB failed its checksum");
+            if (_ack) Check(send_all("-", 1));
+            continue;
+        }
+
+        if (_ack) Check(send_all("+", 1));
+
+        debug(3, "<- %.*s", int(packet->size() > 80 ? 80 : packet->size()),
+              packet->data());
+        return Err::success;
+    }
+}
+/******************************************************************************/
+Error Connection::send(string const & payload)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < payload.size(); ++i) sum += payload[i];
+
+    string frame = "$" + payload + "#";
+    append_bytes(&frame, &sum, 1);
+
+    debug(3, "-> %.*s", int(payload.size() > 80 ? 80 : payload.size()),
+          payload.data());
+
+    for (;;)
+    {
+        Check(send_all(frame.data(), frame.size()));
+
+        if (!_ack) return Err::success;
+
+        char c = 0;
+        while (c != '+' && c != '-')
+        {
+            bool closed;
+            Check(next_char(&c, &closed));
+            if (closed) return Err::success;
+        }
+
+        if (c == '+') return Err::success;
+    }
+}
+/******************************************************************************/
+Error Connection::check_interrupt(bool * interrupted, bool * closed)
+{
+    *interrupted = false;
+    *closed      = false;
+
+    if (_next == _end)
+    {
+        Check(fill(false, closed));
+        if (*closed) return Err::success;
+    }
+
+    // Acknowledgements left over from before GDB saw the reply.
+    while (_next < _end && (_buffer[_next] == '+' || _buffer[_next] == '-'))
+    {
+        ++_next;
+    }
+
+    if (_next < _end && _buffer[_next] == '\x03')
+    {
+        ++_next;
+        *interrupted = true;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+Error Connection::send_all(char const * data, size_t bytes)
+{
+    while (bytes)
+    {
+        ssize_t sent = ::send(_fd, data, bytes, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) continue;
+
+        CheckStringB(sent > 0, "Can't write to GDB: %s", strerror(errno));
+
+        data  += sent;
+        bytes -= sent;
+    }
+
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * The debugger proper
+ */
+class Debugger
+{
+public:
+    /*
+     * part describes the target's memory, for GDB's memory map and for
+     * programming Flash.
+     */
+    Debugger(DebugAccessPort &, Target &, PartDescription const & part);
+
+    /*
+     * Halts the processor for a new GDB, and clears out any breakpoints and
+     * watchpoints the last one left behind.
+     */
+    Error attach();
+
+    /*
+     * Answers GDB until it detaches or goes away.
+     */
+    Error serve(Connection &);
+
+private:
+    struct Watchpoint
+    {
+        bool              used;
+        uint32_t          address;  // As GDB asked for it, to report back.
+        uint32_t          length;
+        uint32_t          type;     // GDB's Z type, 2 to 4.
+    };
+
+    DebugAccessPort &       _dap;
+    Target &                _target;
+    PartDescription const & _part;
+    size_t                  _block_bytes;  // Of the Flash loader.
+
+    vector<bool>       _breakpoint_used;
+    vector<uint32_t>   _breakpoint_address;
+    vector<Watchpoint> _watchpoints;
+
+    string             _stop_reply;
+
+    // Flash blocks written by vFlashWrite, by address, waiting for vFlashDone.
+    std::map<uint32_t, vector<word_t> > _flash_blocks;
+
+    /*
+     * Handles one packet, leaving the reply to send.  done is set when GDB
+     * has detached or killed us, and closed when it went away while the
+     * processor was running.
+     */
+    Error handle(Connection &,
+                 string const & packet,
+                 string * reply,
+                 bool * done,
+                 bool * closed);
+
+    // Clears the DAP's sticky errors after an access fails.
+    Error recover();
+
+    Error read_all_registers(string * reply);
+    Error write_all_registers(char const * cursor);
+    Error read_one_register(uint32_t n, word_t * value);
+    Error write_one_register(uint32_t n, word_t value);
+
+    Error read_memory(uint32_t address, size_t count, string * reply);
+    Error write_memory(uint32_t address, byte_t const * data, size_t count);
+
+    Error insert_point(uint32_t type, uint32_t address, uint32_t kind);
+    Error remove_point(uint32_t type, uint32_t address, uint32_t kind);
+    Error clear_points();
+
+    /*
+     * Resumes or steps the processor, and waits for it to halt or for GDB to
+     * interrupt it.  reply gets the stop reply.
+     */
+    Error run(Connection &, bool step, string * reply, bool * closed);
+
+    // Builds the stop reply for a halt, reporting the given signal.
+    Error make_stop_reply(unsigned signal, string * reply);
+
+    Error query(string const & packet, string * reply);
+    Error monitor(string const & command, string * reply);
+
+    Error flash_erase(uint32_t address, uint32_t length);
+    void flash_write(uint32_t address, byte_t const * data, size_t count);
+    Error flash_done();
+
+    string target_xml() const;
+    string memory_map() const;
+};
+
+/******************************************************************************/
+Debugger::Debugger(DebugAccessPort & dap,
+                   Target & target,
+                   PartDescription const & part) :
+    _dap(dap),
+    _target(target),
+    _part(part),
+    _block_bytes(FlashLoader::largest_block(
+        part.ram_bytes,
+        std::min(part.max_copy_bytes, part.smallest_sector_bytes()))) {}
+/******************************************************************************/
+Error Debugger::attach()
+{
+    Check(_target.halt());
+    Check(unmap_boot_sector(_target));
+    Check(_target.enable_breakpoints());
+
+    size_t breakpoints;
+    Check(_target.get_breakpoint_count(&breakpoints));
+
+    size_t watchpoints;
+    Check(_target.get_watchpoint_count(&watchpoints));
+
+    _breakpoint_used.assign(breakpoints, true);
+    _breakpoint_address.assign(breakpoints, 0);
+
+    Watchpoint unused = { true, 0, 0, 0 };
+    _watchpoints.assign(watchpoints, unused);
+
+    Check(clear_points());
+
+    debug(1, "Target has %zu breakpoints and %zu watchpoints",
+          breakpoints, watchpoints);
+
+    _flash_blocks.clear();
+    return make_stop_reply(5, &_stop_reply);
+}
+/******************************************************************************/
+Error Debugger::recover()
+{
+    return _dap.write_abort(DebugAccessPort::kABORT_STKCMPCLR
+                          | DebugAccessPort::kABORT_STKERRCLR
+                          | DebugAccessPort::kABORT_WDERRCLR
+                          | DebugAccessPort::kABORT_ORUNERRCLR);
+}
+/******************************************************************************/
+Error Debugger::serve(Connection & gdb)
+{
+    for (;;)
+    {
+        string packet;
+        bool   closed;
+
+        Check(gdb.receive(&packet, &closed));
+        if (closed) return Err::success;
+
+        string reply;
+        bool   done = false;
+
+        /*
+         * A request the target refuses -- GDB looking at memory that isn't
+         * there, say -- gets an error reply, and the session carries on.
+         */
+        if (handle(gdb, packet, &reply, &done, &closed) != Err::success)
+        {
+            debug(1, "Request failed: %.*s",
+                  int(packet.size() > 40 ? 40 : packet.size()),
+                  packet.data());
+            Check(recover());
+            reply = "E01";
+        }
+
+        if (closed) return Err::success;
+
+        if (packet == "k") return Err::success;
+
+        Check(gdb.send(reply));
+
+        if (packet == "QStartNoAckMode") gdb.disable_acks();
+
+        if (done) return Err::success;
+    }
+}
+/******************************************************************************/
+Error Debugger::handle(Connection & gdb,
+                       string const & packet,
+                       string * reply,
+                       bool * done,
+                       bool * closed)
+{
+    char const * cursor = packet.c_str() + 1;
+    uint32_t     address;
+    uint32_t     length;
+
+    *closed = false;
+
+    switch (packet.empty() ? 0 : packet[0])
+    {
+        case '\x03':
+            // An interrupt that crossed paths with a halt.
+            *reply = _stop_reply;
+            return Err::success;
+
+        case '?':
+            *reply = _stop_reply;
+            return Err::success;
+
+        case 'g':
+            return read_all_registers(reply);
+
+        case 'G':
+            Check(write_all_registers(cursor));
+            *reply = "OK";
+            return Err::success;
+
+        case 'p':
+        {
+            word_t value;
+            CheckB(parse_number(cursor, &address));
+            Check(read_one_register(address, &value));
+            append_word(reply, value);
+            return Err::success;
+        }
+
+        case 'P':
+        {
+            word_t value;
+            CheckB(parse_number(cursor, &address) && *cursor++ == '=');
+            CheckB(parse_word(cursor, &value));
+            Check(write_one_register(address, value));
+            *reply = "OK";
+            return Err::success;
+        }
+
+        case 'm':
+            CheckB(parse_number(cursor, &address) && *cursor++ == ',');
+            CheckB(parse_number(cursor, &length));
+            return read_memory(address, length, reply);
+
+        case 'M':
+        {
+            CheckB(parse_number(cursor, &address) && *cursor++ == ',');
+            CheckB(parse_number(cursor, &length) && *cursor++ == ':');
+            CheckB(length <= max_read_bytes);
+
+            if (length)
+            {
+                vector<byte_t> data(length);
+                CheckB(parse_bytes(cursor, &data[0], length));
+                Check(write_memory(address, &data[0], length));
+            }
+            *reply = "OK";
+            return Err::success;
+        }
+
+        case 'X':
+        {
+            CheckB(parse_number(cursor, &address) && *cursor++ == ',');
+            CheckB(parse_number(cursor, &length) && *cursor++ == ':');
+            CheckB(length <= packet_size);
+
+            vector<byte_t> data;
+            size_t const offset = cursor - packet.c_str();
+            unescape_binary(cursor, packet.size() - offset, &data);
+            CheckB(data.size() == length);
+
+            if (length) Check(write_memory(address, &data[0], length));
+            *reply = "OK";
+            return Err::success;
+        }
+
+        case 'c':
+        case 's':
+            // An address, if given, is where to resume.
+            if (parse_number(cursor, &address))
+            {
+                Check(_target.write_register(Register::PC, address));
+            }
+            return run(gdb, packet[0] == 's', reply, closed);
+
+        case 'C':
+        case 'S':
+            // Signals mean nothing to the processor; just carry on.
+            return run(gdb, packet[0] == 'S', reply, closed);
+
+        case 'Z':
+        case 'z':
+        {
+            uint32_t type;
+            uint32_t kind;
+            CheckB(parse_number(cursor, &type) && *cursor++ == ',');
+            CheckB(parse_number(cursor, &address) && *cursor++ == ',');
+            CheckB(parse_number(cursor, &kind));
+
+            if (type > 4) return Err::success;  // Unsupported: empty reply.
+
+            if (packet[0] == 'Z') Check(insert_point(type, address, kind));
+            else                  Check(remove_point(type, address, kind));
+
+            *reply = "OK";
+            return Err::success;
+        }
+
+        case '!':
+        case 'H':
+        case 'T':
+            // Extended mode is fine; there is one thread, and it's alive.
+            *reply = "OK";
+            return Err::success;
+
+        case 'D':
+            Check(clear_points());
+            Check(_target.resume());
+            *reply = "OK";
+            *done  = true;
+            return Err::success;
+
+        case 'k':
+            *done = true;
+            return Err::success;
+
+        case 'q':
+        case 'Q':
+            return query(packet, reply);
+
+        case 'v':
+            if (packet == "vCont?")
+            {
+                *reply = "vCont;c;C;s;S";
+                return Err::success;
+            }
+
+            if (packet.compare(0, 6, "vCont;") == 0)
+            {
+                // One thread, so the first action is the one for it.
+                char const action = packet[6];
+                return run(gdb, action == 's' || action == 'S', reply, closed);
+            }
+
+            if (packet.compare(0, 12, "vFlashErase:") == 0)
+            {
+                cursor = packet.c_str() + 12;
+                CheckB(parse_number(cursor, &address) && *cursor++ == ',');
+                CheckB(parse_number(cursor, &length));
+                Check(flash_erase(address, length));
+                *reply = "OK";
+                return Err::success;
+            }
+
+            if (packet.compare(0, 12, "vFlashWrite:") == 0)
+            {
+                cursor = packet.c_str() + 12;
+                CheckB(parse_number(cursor, &address) && *cursor++ == ':');
+
+                vector<byte_t> data;
+                size_t const offset = cursor - packet.c_str();
+                unescape_binary(cursor, packet.size() - offset, &data);
+
+                if (!data.empty()) flash_write(address, &data[0], data.size());
+                *reply = "OK";
+                return Err::success;
+            }
+
+            if (packet == "vFlashDone")
+            {
+                Check(flash_done());
+                *reply = "OK";
+                return Err::success;
+            }
+
+            if (packet.compare(0, 5, "vKill") == 0)
+            {
+                *reply = "OK";
+                *done  = true;
+                return Err::success;
+            }
+
+            return Err::success;
+
+        default:
+            return Err::success;
+    }
+}
+/******************************************************************************/
+Error Debugger::read_all_registers(string * reply)
+{
+    word_t registers[Target::register_count];
+    Check(_target.read_registers(snapshot_mask, registers));
+
+    for (unsigned n = 0; n <= Register::PSP; ++n)
+    {
+        append_word(reply, registers[n]);
+    }
+
+    for (unsigned n = gdb_primask; n <= gdb_control; ++n)
+    {
+        unsigned const shift = (n - gdb_primask) * 8;
+        append_word(reply,
+                    (registers[Register::CONTROL_and_masks] >> shift) & 0xFF);
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::write_all_registers(char const * cursor)
+{
+    word_t   registers[Target::register_count];
+    uint32_t mask = 0;
+
+    for (unsigned n = 0; n <= Register::PSP; ++n)
+    {
+        if (!parse_word(cursor, &registers[n])) break;
+        mask |= 1 << n;
+    }
+
+    // The masks and CONTROL go back together, or not at all.
+    word_t packed = 0;
+    unsigned n;
+    for (n = gdb_primask; n <= gdb_control; ++n)
+    {
+        word_t field;
+        if (!parse_word(cursor, &field)) break;
+        packed |= (field & 0xFF) << ((n - gdb_primask) * 8);
+    }
+
+    if (n > gdb_control)
+    {
+        registers[Register::CONTROL_and_masks] = packed;
+        mask |= 1 << Register::CONTROL_and_masks;
+    }
+
+    return _target.write_registers(mask, registers);
+}
+/******************************************************************************/
+Error Debugger::read_one_register(uint32_t n, word_t * value)
+{
+    if (n <= Register::PSP)
+    {
+        return _target.read_register(Register::Number(n), value);
+    }
+
+    CheckB(n < gdb_register_count);
+
+    word_t packed;
+    Check(_target.read_register(Register::CONTROL_and_masks, &packed));
+
+    *value = (packed >> ((n - gdb_primask) * 8)) & 0xFF;
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::write_one_register(uint32_t n, word_t value)
+{
+    if (n <= Register::PSP)
+    {
+        return _target.write_register(Register::Number(n), value);
+    }
+
+    CheckB(n < gdb_register_count);
+
+    unsigned const shift = (n - gdb_primask) * 8;
+
+    word_t packed;
+    Check(_target.read_register(Register::CONTROL_and_masks, &packed));
+
+    packed = (packed & ~(0xFF << shift)) | ((value & 0xFF) << shift);
+    return _target.write_register(Register::CONTROL_and_masks, packed);
+}
+/******************************************************************************/
+Error Debugger::read_memory(uint32_t address, size_t count, string * reply)
+{
+    if (count > max_read_bytes) count = max_read_bytes;
+
+    vector<byte_t> data(count);
+    if (count == 0) return Err::success;
+
+    if ((address | count) % sizeof(word_t) == 0)
+    {
+        // Whole words, which peripherals want, in one streamed batch.
+        vector<word_t> words(count / sizeof(word_t));
+        Check(_target.read_words(rptr_const<word_t>(address),
+                                 &words[0],
+                                 words.size()));
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            data[i] = words[i / 4] >> ((i % 4) * 8);
+        }
+    }
+    else
+    {
+        Check(_target.read_bytes(rptr_const<byte_t>(address), &data[0], count));
+    }
+
+    append_bytes(reply, &data[0], count);
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::write_memory(uint32_t address,
+                             byte_t const * data,
+                             size_t count)
+{
+    // Bytes up to the first word boundary...
+    size_t head = (sizeof(word_t) - address % sizeof(word_t)) % sizeof(word_t);
+    if (head > count) head = count;
+
+    if (head)
+    {
+        Check(_target.write_bytes(data, rptr<byte_t>(address), head));
+        address += head;
+        data    += head;
+        count   -= head;
+    }
+
+    // ...then whole words, in one streamed batch...
+    size_t const words = count / sizeof(word_t);
+
+    if (words)
+    {
+        vector<word_t> buffer(words);
+        for (size_t i = 0; i < words; ++i)
+        {
+            buffer[i] = data[4 * i]
+                      | (data[4 * i + 1] << 8)
+                      | (data[4 * i + 2] << 16)
+                      | (word_t(data[4 * i + 3]) << 24);
+        }
+
+        Check(_target.write_words(&buffer[0], rptr<word_t>(address), words));
+        address += words * sizeof(word_t);
+        data    += words * sizeof(word_t);
+        count   -= words * sizeof(word_t);
+    }
+
+    // ...and whatever is left.
+    if (count) Check(_target.write_bytes(data, rptr<byte_t>(address), count));
+
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::insert_point(uint32_t type, uint32_t address, uint32_t kind)
+{
+    /*
+     * Flash can't take a BKPT instruction, so software breakpoints become
+     * hardware ones as well.
+     */
+    if (type < 2)
+    {
+        size_t free = _breakpoint_used.size();
+
+        for (size_t n = 0; n < _breakpoint_used.size(); ++n)
+        {
+            if (!_breakpoint_used[n])
+            {
+                if (free == _breakpoint_used.size()) free = n;
+            }
+            else if (_breakpoint_address[n] == address)
+            {
+                return Err::success;
+            }
+        }
+
+        CheckStringB(free < _breakpoint_used.size(),
+                     "No breakpoints left for %08X", address);
+
+        Check(_target.enable_breakpoint(free,
+                  rptr_const<thumb_code_t>(address)));
+
+        _breakpoint_used[free]    = true;
+        _breakpoint_address[free] = address;
+        return Err::success;
+    }
+
+    for (size_t n = 0; n < _watchpoints.size(); ++n)
+    {
+        Watchpoint & watchpoint = _watchpoints[n];
+        if (watchpoint.used) continue;
+
+        // A comparator covers an aligned power of two; take the least one
+        // that covers what GDB asked for.
+        uint32_t size = 1;
+        while (((address & ~(size - 1)) + size) < address + kind) size <<= 1;
+
+        Target::WatchKind const watch_kind =
+            type == 2 ? Target::watch_write
+          : type == 3 ? Target::watch_read
+          :             Target::watch_access;
+
+        Check(_target.enable_watchpoint(n,
+                                        address & ~(size - 1),
+                                        size,
+                                        watch_kind));
+
+        watchpoint.used    = true;
+        watchpoint.address = address;
+        watchpoint.length  = kind;
+        watchpoint.type    = type;
+        return Err::success;
+    }
+
+    warning("No watchpoints left for %08X", address);
+    return Err::failure;
+}
+/******************************************************************************/
+Error Debugger::remove_point(uint32_t type, uint32_t address, uint32_t kind)
+{
+    if (type < 2)
+    {
+        for (size_t n = 0; n < _breakpoint_used.size(); ++n)
+        {
+            if (!_breakpoint_used[n] || _breakpoint_address[n] != address)
+            {
+                continue;
+            }
+
+            Check(_target.disable_breakpoint(n));
+            _breakpoint_used[n] = false;
+        }
+
+        return Err::success;
+    }
+
+    for (size_t n = 0; n < _watchpoints.size(); ++n)
+    {
+        Watchpoint & watchpoint = _watchpoints[n];
+
+        if (!watchpoint.used
+            || watchpoint.type    != type
+            || watchpoint.address != address
+            || watchpoint.length  != kind) continue;
+
+        Check(_target.disable_watchpoint(n));
+        watchpoint.used = false;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::clear_points()
+{
+    for (size_t n = 0; n < _breakpoint_used.size(); ++n)
+    {
+        if (!_breakpoint_used[n]) continue;
+
+        Check(_target.disable_breakpoint(n));
+        _breakpoint_used[n] = false;
+    }
+
+    for (size_t n = 0; n < _watchpoints.size(); ++n)
+    {
+        if (!_watchpoints[n].used) continue;
+
+        Check(_target.disable_watchpoint(n));
+        _watchpoints[n].used = false;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::run(Connection & gdb, bool step, string * reply, bool * closed)
+{
+    Check(_target.reset_halt_state());
+
+    if (step) Check(_target.step());
+    else      Check(_target.resume());
+
+    /*
+     * Each poll of the processor is a USB round trip, and so is nothing to
+     * GDB's socket; check for an interrupt alongside each one, and back off
+     * while nothing happens.
+     */
+    PollScheduler poll;
+    unsigned      signal = 5;  // SIGTRAP
+
+    for (;;)
+    {
+        bool halted;
+        Check(_target.is_halted(&halted));
+        if (halted) break;
+
+        bool interrupted;
+        Check(gdb.check_interrupt(&interrupted, closed));
+
+        // GDB has gone; leave the processor running.
+        if (*closed) return Err::success;
+
+        if (interrupted)
+        {
+            Check(_target.halt());
+            signal = 2;  // SIGINT
+            break;
+        }
+
+        poll.wait();
+    }
+
+    poll.activity();
+
+    Check(make_stop_reply(signal, &_stop_reply));
+    *reply = _stop_reply;
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::make_stop_reply(unsigned signal, string * reply)
+{
+    word_t reason;
+    Check(_target.read_halt_state(&reason));
+
+    *reply = format("T%02x", signal);
+
+    if (reason & SCB::DFSR_DWTTRAP)
+    {
+        for (size_t n = 0; n < _watchpoints.size(); ++n)
+        {
+            if (!_watchpoints[n].used) continue;
+
+            bool matched;
+            Check(_target.watchpoint_matched(n, &matched));
+            if (!matched) continue;
+
+            static char const * const names[] = { "watch", "rwatch", "awatch" };
+
+            *reply += names[_watchpoints[n].type - 2];
+            *reply += format(":%x;", _watchpoints[n].address);
+            break;
+        }
+    }
+
+    // GDB looks at these first thing, so send them along.
+    word_t registers[Target::register_count];
+    Check(_target.read_registers((1 << Register::SP) | (1 << Register::PC),
+                                 registers));
+
+    *reply += format("%02x:", Register::SP);
+    append_word(reply, registers[Register::SP]);
+    *reply += format(";%02x:", Register::PC);
+    append_word(reply, registers[Register::PC]);
+    *reply += ';';
+
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::query(string const & packet, string * reply)
+{
+    if (packet.compare(0, 10, "qSupported") == 0)
+    {
+        *reply = format("PacketSize=%x", packet_size)
+               + ";qXfer:features:read+;qXfer:memory-map:read+"
+               + ";QStartNoAckMode+;vContSupported+";
+        return Err::success;
+    }
+
+    if (packet == "QStartNoAckMode")
+    {
+        *reply = "OK";
+        return Err::success;
+    }
+
+    if (packet == "qAttached")
+    {
+        *reply = "1";
+        return Err::success;
+    }
+
+    if (packet == "qC")
+    {
+        *reply = "QC1";
+        return Err::success;
+    }
+
+    if (packet == "qfThreadInfo")
+    {
+        *reply = "m1";
+        return Err::success;
+    }
+
+    if (packet == "qsThreadInfo")
+    {
+        *reply = "l";
+        return Err::success;
+    }
+
+    if (packet.compare(0, 6, "qRcmd,") == 0)
+    {
+        string      command;
+        char const * cursor = packet.c_str() + 6;
+
+        byte_t c;
+        while (parse_bytes(cursor, &c, 1)) command += char(c);
+
+        return monitor(command, reply);
+    }
+
+    /*
+     * The two documents GDB reads, in pieces: qXfer:object:read:annex:
+     * offset,length, answered with "m" and more to come, or "l" for the last.
+     */
+    string document;
+
+    if (packet.compare(0, 31, "qXfer:features:read:target.xml:") == 0)
+    {
+        document = target_xml();
+    }
+    else if (packet.compare(0, 23, "qXfer:memory-map:read::") == 0)
+    {
+        document = memory_map();
+    }
+    else
+    {
+        return Err::success;  // Unsupported: empty reply.
+    }
+
+    uint32_t offset;
+    uint32_t length;
+
+    char const * cursor = packet.c_str() + packet.rfind(':') + 1;
+    CheckB(parse_number(cursor, &offset) && *cursor++ == ',');
+    CheckB(parse_number(cursor, &length));
+
+    if (offset >= document.size())
+    {
+        *reply = "l";
+        return Err::success;
+    }
+
+    size_t const count = std::min<size_t>(length, document.size() - offset);
+
+    *reply = (offset + count < document.size()) ? "m" : "l";
+    append_binary(reply, document.data() + offset, count);
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::monitor(string const & command, string * reply)
+{
+    if (command == "reset" || command == "reset halt")
+    {
+        Check(_target.reset_and_halt());
+        Check(unmap_boot_sector(_target));
+        Check(_target.enable_breakpoints());
+        *reply = "OK";
+        return Err::success;
+    }
+
+    if (command == "halt")
+    {
+        Check(_target.halt());
+        *reply = "OK";
+        return Err::success;
+    }
+
+    // Anything else, GDB reports as unsupported.
+    return Err::success;
+}
+/******************************************************************************/
+Error Debugger::flash_erase(uint32_t address, uint32_t length)
+{
+    CheckB(length > 0);
+
+    FlashSector first, last;
+    CheckB(_part.find_sector(address, &first));
+    CheckB(_part.find_sector(address + length - 1, &last));
+
+    Check(unprotect_flash(_target, _part.work_area(),
+                          first.index, last.index));
+    Check(erase_flash(_target, _part.work_area(),
+                      first.index, last.index, _part.cclk_khz));
+
+    return Err::success;
+}
+/******************************************************************************/
+void Debugger::flash_write(uint32_t address, byte_t const * data, size_t count)
+{
+    for (size_t i = 0; i < count; ++i, ++address)
+    {
+        uint32_t const block  = address - address % _block_bytes;
+        uint32_t const offset = address - block;
+
+        vector<word_t> & words = _flash_blocks[block];
+        if (words.empty())
+        {
+            words.assign(_block_bytes / sizeof(word_t), 0xFFFFFFFF);
+        }
+
+        unsigned const shift = (offset % 4) * 8;
+        words[offset / 4] = (words[offset / 4] & ~(0xFF << shift))
+                          | (word_t(data[i]) << shift);
+    }
+}
+/******************************************************************************/
+Error Debugger::flash_done()
+{
+    if (_flash_blocks.empty()) return Err::success;
+
+    CheckStringB(_block_bytes,
+                 "%s has too little RAM for the Flash loader", _part.name);
+
+    /*
+     * GDB has erased the sectors already; the loader programs the blocks
+     * while the next goes over the wire.
+     */
+    FlashLoader loader(_target, _part.work_area(), _block_bytes);
+    Check(loader.start(_part.cclk_khz));
+
+    std::map<uint32_t, vector<word_t> >::const_iterator it;
+    for (it = _flash_blocks.begin(); it != _flash_blocks.end(); ++it)
+    {
+        FlashSector sector;
+        CheckStringB(_part.find_sector(it->first, &sector),
+                     "GDB wrote outside Flash, at %08X", it->first);
+
+        Check(loader.program_block(&it->second[0],
+                                   it->second.size(),
+                                   rptr<word_t>(it->first),
+                                   sector.index));
+    }
+
+    Check(loader.finish());
+
+    notice("Programmed %zu blocks of Flash", _flash_blocks.size());
+    _flash_blocks.clear();
+
+    return Err::success;
+}
+/******************************************************************************/
+string Debugger::target_xml() const
+{
+    static char const * const core_names[] = {
+        "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+        "r8", "r9", "r10", "r11", "r12", "sp", "lr", "pc",
+    };
+
+    static char const * const system_names[] = {
+        "msp", "psp", "primask", "basepri", "faultmask", "control",
+    };
+
+    string xml =
+        "<?xml version=\"1.0\"?>"
+        "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+        "<target version=\"1.0\">"
+        "<architecture>arm</architecture>"
+        "<feature name=\"org.gnu.gdb.arm.m-profile\">";
+
+    for (unsigned n = 0; n <= Register::PC; ++n)
+    {
+        xml += string("<reg name=\"") + core_names[n]
+             + "\" bitsize=\"32\" regnum=\"" + format("%u", n) + "\""
+             + (n == Register::SP ? " type=\"data_ptr\"" : "")
+             + (n == Register::PC ? " type=\"code_ptr\"" : "")
+             + "/>";
+    }
+
+    xml += "<reg name=\"xpsr\" bitsize=\"32\" regnum=\"16\"/>"
+           "</feature>"
+           "<feature name=\"org.gnu.gdb.arm.m-system\">";
+
+    for (unsigned n = Register::MSP; n < gdb_register_count; ++n)
+    {
+        xml += string("<reg name=\"") + system_names[n - Register::MSP]
+             + "\" bitsize=\"32\" regnum=\"" + format("%u", n) + "\""
+             + " group=\"system\"/>";
+    }
+
+    xml += "</feature></target>";
+    return xml;
+}
+/******************************************************************************/
+string Debugger::memory_map() const
+{
+    string map =
+        "<?xml version=\"1.0\"?>"
+        "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map "
+        "V1.0//EN\" \"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+        "<memory-map>";
+
+    // A region for each run of sectors, since each has its own block size.
+    uint32_t flash_end = _part.flash_base;
+    for (size_t i = 0;
+         i < PartDescription::max_sector_runs && _part.sectors[i].count;
+         ++i)
+    {
+        SectorRun const & run = _part.sectors[i];
+
+        map += "<memory type=\"flash\" start=\"" + format("0x%x", flash_end)
+             + "\" length=\"" + format("0x%x", run.bytes * run.count) + "\">"
+               "<property name=\"blocksize\">"
+             + format("0x%x", run.bytes) + "</property>"
+               "</memory>";
+
+        flash_end += run.bytes * run.count;
+    }
+
+    uint32_t const ram_base = _part.ram_base;
+    uint32_t const ram_end  = _part.ram_base + _part.ram_bytes;
+
+    /*
+     * GDB won't touch memory outside the map, so the peripherals and the
+     * rest are covered too, as plain RAM.
+     */
+    map += "<memory type=\"ram\" start=\"" + format("0x%x", flash_end)
+         + "\" length=\"" + format("0x%x", ram_base - flash_end) + "\"/>"
+           "<memory type=\"ram\" start=\"" + format("0x%x", ram_base)
+         + "\" length=\"" + format("0x%x", ram_end - ram_base) + "\"/>"
+           "<memory type=\"ram\" start=\"" + format("0x%x", ram_end)
+         + "\" length=\"" + format("0x%x", 0u - ram_end) + "\"/>"
+           "</memory-map>";
+
+    return map;
+}
+
+
+/*******************************************************************************
+ * Serving
+ */
+
+/*
+ * Signals end the server.  The handler does nothing itself; it's there so
+ * that SIGINT and SIGTERM interrupt accept and recv, rather than killing us
+ * before the statistics are out.
+ */
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_handler(int signal)
+{
+    stopping = 1;
+}
+
+static Error catch_stop_signals()
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_handler;
+    action.sa_flags   = 0;  // No SA_RESTART: we want the interruption.
+
+    CheckP(sigemptyset(&action.sa_mask));
+    CheckP(sigaction(SIGINT,  &action, 0));
+    CheckP(sigaction(SIGTERM, &action, 0));
+
+    return Err::success;
+}
+
+static Error listen_tcp(int port, int * fd_out)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    CheckStringB(fd >= 0, "Can't create socket: %s", strerror(errno));
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(fd, 1) != 0)
+    {
+        int error = errno;
+
+        close(fd);
+        CheckStringB(false, "Can't listen on port %d: %s",
+                     port, strerror(error));
+    }
+
+    *fd_out = fd;
+    return Err::success;
+}
+
+Error gdb_main(SWDDriver & swd)
+{
+    DebugAccessPort dap(swd);
+    Target target(swd, dap, 0);
+
+    dap.enable_cache(!CommandLine::no_cache.get());
+    target.enable_cache(!CommandLine::no_cache.get());
+
+    uint32_t idcode;
+    Check(swd.initialize(&idcode));
+
+    Check(swd.enter_reset());
+    usleep(10000);
+    Check(dap.reset_state());
+
+    if (CommandLine::overrun_detection.get())
+        Check(dap.enable_overrun_detection(true));
+
+    Check(target.initialize());
+    Check(target.reset_halt_state());
+
+    Check(swd.leave_reset());
+
+    /*
+     * Find out what the part is -- which borrows the core to ask IAP -- then
+     * start it afresh, as GDB would otherwise have found it.
+     */
+    Check(target.halt());
+    Check(target.enable_breakpoints());
+
+    PartDescription const * part;
+    Check(identify_part(target, idcode, &part));
+
+    Check(target.reset_and_halt());
+    Check(target.resume());
+
+    Debugger debugger(dap, target, *part);
+
+    int listener;
+    Check(catch_stop_signals());
+    Check(listen_tcp(CommandLine::port.get(), &listener));
+
+    notice("Serving target %08X to GDB on port %d",
+           idcode, CommandLine::port.get());
+
+    Error check_error = Err::success;
+
+    while (!stopping)
+    {
+        int client = accept(listener, 0, 0);
+
+        if (client < 0)
+        {
+            if (errno == EINTR) continue;
+
+            CheckCleanupStringB(false, cleanup,
+                                "Can't accept: %s", strerror(errno));
+        }
+
+        // Packets are small and come one at a time; don't hold them back.
+        int one = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        notice("GDB connected");
+
+        Connection gdb(client);
+
+        CheckCleanup(debugger.attach(), cleanup);
+        CheckCleanup(debugger.serve(gdb), cleanup);
+
+        notice("GDB disconnected");
+    }
+
+cleanup:
+    close(listener);
+    return check_error;
+}
+
+/*******************************************************************************
+ * Entry point (sort of -- see main below)
+ */
+
+static Error error_main(int argc, char const * * argv)
+{
+    CheckStringB(CommandLine::clock.get() > 0,
+                 "-clock must be a positive rate in kHz; -auto_clock finds "
+                 "the fastest the target manages");
+    CheckStringB(CommandLine::wait_retries.get() > 0,
+                 "-wait_retries must be at least 1");
+    CheckStringB(CommandLine::wait_backoff_us.get() >= 0,
+                 "-wait_backoff_us can't be negative");
+
+    SessionDriver session;
+    bool          attached;
+
+    Check(session.attach(CommandLine::session.get(), &attached));
+
+    if (attached) return gdb_main(session);
+
+    MPSSEConfig config;
+    MPSSE       mpsse;
+
+    Check(lookup_programmer(CommandLine::programmer.get(), &config));
+
+    if (CommandLine::interface.set())
+        config.interface = CommandLine::interface.get();
+
+    if (CommandLine::vid.set())
+        config.vid = CommandLine::vid.get();
+
+    if (CommandLine::pid.set())
+        config.pid = CommandLine::pid.get();
+
+    Check(mpsse.open(config));
+
+    MPSSESWDDriver swd(config,
+                       &mpsse,
+                       CommandLine::auto_clock.get()
+                           ? MPSSESWDDriver::auto_clock
+                           : CommandLine::clock.get() * 1000);
+
+    Check(gdb_main(swd));
+
+    return Err::success;
+}
+
+/******************************************************************************/
+int main(int argc, char const * * argv)
+{
+    Error check_error = Err::success;
+
+    CheckCleanup(CommandLine::parse(argc, argv, CommandLine::arguments),
+                 failure);
+
+    log().set_level(CommandLine::debug.get());
+
+    RetryPolicy::standard().set_attempts(CommandLine::wait_retries.get());
+    RetryPolicy::standard().set_max_backoff_us(
+        CommandLine::wait_backoff_us.get());
+
+    check_error = error_main(argc, argv);
+
+    // Reported even after a failure, which is often when they're wanted.
+    Metrics::report(CommandLine::stats.get(), CommandLine::stats_json.get());
+
+    CheckCleanup(check_error, failure);
+    return 0;
+
+failure:
+    Err::stack()->print();
+    return 1;
+}
+/******************************************************************************/
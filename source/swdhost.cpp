@@ -26,7 +26,13 @@
  */
 
 #include "target.h"
+#include "rtt.h"
+#include "part.h"
+#include "poll.h"
+#include "metrics.h"
+#include "retry.h"
 #include "swd_dp.h"
+#include "session.h"
 #include "swd_mpsse.h"
 #include "swd.h"
 
@@ -40,12 +46,21 @@
 #include "libs/command_line/command_line.h"
 
 #include <vector>
-
+#include <map>
+#include <string>
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <ftdi.h>
 #include <termios.h>
 #include <signal.h>
+#include <sys/time.h>
 
 using namespace Log;
 using Err::Error;
@@ -73,9 +88,74 @@ namespace CommandLine
     static Scalar<int>
     interface("interface", true, 0, "Interface on FTDI chip");
 
+    static Scalar<int>
+    clock("clock", true, MPSSESWDDriver::default_clock_hz / 1000,
+          "SWD clock rate in kHz, unless -auto_clock is given");
+
+    static Scalar<bool>
+    auto_clock("auto_clock", true, false,
+               "Whether to find the fastest reliable SWD clock rate");
+
+    static Scalar<bool>
+    no_cache("no_cache", true, false,
+             "Whether to re-read debug registers even when they can't have "
+             "changed");
+
     static Scalar<bool>
     local_echo("local-echo", true, false, "Whether to echo keystrokes");
 
+    static Scalar<int>
+    poll_idle_us("poll_idle_us", true, PollScheduler::default_idle_us,
+                 "Longest time to wait between polls of an idle target, in "
+                 "microseconds");
+
+    static Scalar<bool>
+    rtt("rtt", true, false,
+        "Whether to also read output from an RTT control block in target RAM");
+
+    static Scalar<String>
+    rtt_start("rtt_start", true, "0x10000000",
+              "Where to start searching for the RTT control block");
+
+    static Scalar<String>
+    rtt_length("rtt_length", true, "0x2000",
+               "How many bytes to search for the RTT control block; by "
+               "default, no further than the end of the part's RAM");
+
+
+    static Scalar<String>
+    session("session", true, "",
+            "Socket of the swdsession to work through, instead of opening "
+            "the programmer.  By default, the usual one is used if a session "
+            "is running; 'none' always opens the programmer.");
+
+    static Scalar<bool>
+    stats("stats", true, false,
+          "Whether to log transport and per-call latency statistics at exit");
+
+    static Scalar<String>
+    stats_json("stats_json", true, "",
+               "File to save the statistics to as JSON at exit, or - for "
+               "standard output");
+
+
+    static Scalar<bool>
+    overrun_detection("overrun_detection", true, true,
+                      "Whether to turn on the DAP's Overrun Detection, so "
+                      "batches are checked for WAIT once.  When false, each "
+                      "transfer costs its own USB exchanges");
+
+    static Scalar<int>
+    wait_retries("wait_retries", true, RetryPolicy::default_attempts,
+                 "How many times to try an access the target answers with "
+                 "WAIT");
+
+    static Scalar<int>
+    wait_backoff_us("wait_backoff_us", true,
+                    RetryPolicy::default_max_backoff_us,
+                    "Longest sleep between retries after WAIT, in "
+                    "microseconds");
+
     static Argument * arguments[] =
     {
         &debug,
@@ -83,11 +163,32 @@ namespace CommandLine
         &vid,
         &pid,
         &interface,
+        &clock,
+        &auto_clock,
         &local_echo,
+        &no_cache,
+        &poll_idle_us,
+        &rtt,
+        &rtt_start,
+        &rtt_length,
+        &overrun_detection,
+        &wait_retries,
+        &wait_backoff_us,
+        &session,
+        &stats,
+        &stats_json,
         NULL
     };
 }
 
+/*
+ * Set by ^C, which is the usual way to end a session.  host_main notices and
+ * returns, so that the terminal is restored and the statistics reported
+ * outside the handler.  Host file reads and writes that it interrupts give up
+ * rather than try again.  A second ^C ends the tool at once.
+ */
+static volatile sig_atomic_t interrupted = 0;
+
 /*******************************************************************************
  * Implements the semihosting SYS_WRITEC operation.
  */
@@ -105,34 +206,30 @@ Error write_char(Target & target, word_t parameter)
 Error write_str(Target & target, word_t parameter)
 {
     debug(2, "SYS_WRITE0 %08X", parameter);
+
     /*
-     * This is a byte string, but the target only supports 32-bit accesses.
-     * So, we have to jump through some hoops to transfer it.
+     * We don't know how long the string is, so read it a modest chunk at a
+     * time until we find the NUL.  Chunks end on aligned boundaries, so we
+     * never read past the end of the memory holding the string.
      */
+    size_t const chunk = 64;
+    byte_t buffer[chunk];
 
-    rptr_const<word_t> str_word_addr(parameter & ~0x3);
-    word_t str_word;
-    Check(target.read_word(str_word_addr, &str_word));
-
-    unsigned bytes_left_in_word = 4 - (parameter & 0x3);
+    word_t address = parameter;
 
-    while (true)
+    for (;;)
     {
-        while (bytes_left_in_word)
-        {
-            char c = str_word & 0xFF;
-            str_word >>= 8;
-            --bytes_left_in_word;
+        size_t const count = chunk - address % chunk;
+        Check(target.read_bytes(rptr_const<byte_t>(address), buffer, count));
 
-            if (c) putchar(c);
-            else goto end_of_string;
-        }
+        byte_t const * end = std::find(buffer, buffer + count, 0);
+        fwrite(buffer, 1, end - buffer, stdout);
+
+        if (end != buffer + count) break;
 
-        Check(target.read_word(++str_word_addr, &str_word));
-        bytes_left_in_word = 4;
+        address += count;
     }
 
-end_of_string:
     fflush(stdout);
     return Err::success;
 }
@@ -155,6 +252,287 @@ Error read_char(Target & target, word_t parameter)
 }
 
 
+/*******************************************************************************
+ * Semihosting file operations
+ */
+
+namespace Semihosting
+{
+    static word_t const SYS_OPEN   = 0x01;
+    static word_t const SYS_CLOSE  = 0x02;
+    static word_t const SYS_WRITEC = 0x03;
+    static word_t const SYS_WRITE0 = 0x04;
+    static word_t const SYS_WRITE  = 0x05;
+    static word_t const SYS_READ   = 0x06;
+    static word_t const SYS_READC  = 0x07;
+    static word_t const SYS_FLEN   = 0x0C;
+
+    // Returned in R0 by calls that fail.
+    static word_t const failed = word_t(-1);
+}
+
+/*
+ * Files the target has opened, by the handle we gave it.  Handles start at 1,
+ * so that none is zero.  Files opened as ":tt" are the host's own standard
+ * streams, which we don't close.
+ */
+struct HostFile
+{
+    int  fd;
+    bool owned;
+};
+
+static std::map<word_t, HostFile> open_files;
+static word_t next_handle = 1;
+
+/*
+ * SYS_READ and SYS_WRITE move the target's buffer through host memory this
+ * much at a time, so a large transfer needs no large host buffer.
+ */
+static size_t const transfer_chunk = 4096;
+
+static HostFile const * find_file(word_t handle)
+{
+    std::map<word_t, HostFile>::const_iterator it = open_files.find(handle);
+    return it == open_files.end() ? 0 : &it->second;
+}
+
+/*
+ * Copies bytes to any address in target memory: the unaligned ends a byte at
+ * a time, everything between as words.
+ */
+static Error copy_to_target(Target & target,
+                            word_t address,
+                            byte_t const * bytes,
+                            size_t count)
+{
+    size_t const head = std::min(count,
+                                 size_t((sizeof(word_t) - address
+                                                         % sizeof(word_t))
+                                        % sizeof(word_t)));
+    if (head)
+    {
+        Check(target.write_bytes(bytes, rptr<byte_t>(address), head));
+    }
+
+    size_t const words = (count - head) / sizeof(word_t);
+    if (words)
+    {
+        vector<word_t> aligned(words);
+        memcpy(&aligned[0], bytes + head, words * sizeof(word_t));
+
+        Check(target.write_words(&aligned[0],
+                                 rptr<word_t>(address + head),
+                                 words));
+    }
+
+    size_t const done = head + words * sizeof(word_t);
+    if (done < count)
+    {
+        Check(target.write_bytes(bytes + done,
+                                 rptr<byte_t>(address + done),
+                                 count - done));
+    }
+
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_OPEN operation.
+ */
+Error open_file(Target & target, word_t parameter)
+{
+    word_t block[3];  // Name, mode, name length.
+    Check(target.read_words(rptr_const<word_t>(parameter), block, 3));
+
+    word_t const mode = block[1];
+
+    vector<byte_t> name_bytes(block[2]);
+    if (!name_bytes.empty())
+    {
+        Check(target.read_bytes(rptr_const<byte_t>(block[0]),
+                                &name_bytes[0],
+                                name_bytes.size()));
+    }
+    std::string name(name_bytes.begin(), name_bytes.end());
+
+    debug(2, "SYS_OPEN %s mode %u", name.c_str(), mode);
+
+    /*
+     * The mode is an index into the fopen modes: r, rb, r+, r+b, w, wb, w+,
+     * w+b, a, ab, a+, a+b.  Binary and text are the same to us.
+     */
+    static int const flags[] =
+    {
+        O_RDONLY,
+        O_RDWR,
+        O_WRONLY | O_CREAT | O_TRUNC,
+        O_RDWR   | O_CREAT | O_TRUNC,
+        O_WRONLY | O_CREAT | O_APPEND,
+        O_RDWR   | O_CREAT | O_APPEND,
+    };
+
+    word_t result = Semihosting::failed;
+
+    if (mode < 2 * sizeof(flags) / sizeof(flags[0]))
+    {
+        HostFile file;
+
+        if (name == ":tt")
+        {
+            // Reading gets stdin, writing stdout, and appending stderr.
+            file.fd    = mode < 4 ? 0 : mode < 8 ? 1 : 2;
+            file.owned = false;
+        }
+        else
+        {
+            file.fd    = open(name.c_str(), flags[mode / 2], 0666);
+            file.owned = true;
+        }
+
+        if (file.fd >= 0)
+        {
+            result = next_handle++;
+            open_files[result] = file;
+        }
+        else
+        {
+            warning("Target can't open %s: %s", name.c_str(), strerror(errno));
+        }
+    }
+
+    return target.write_register(Register::R0, result);
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_CLOSE operation.
+ */
+Error close_file(Target & target, word_t parameter)
+{
+    word_t handle;
+    Check(target.read_word(rptr_const<word_t>(parameter), &handle));
+
+    debug(2, "SYS_CLOSE %u", handle);
+
+    word_t result = Semihosting::failed;
+
+    HostFile const * file = find_file(handle);
+    if (file)
+    {
+        result = (file->owned && close(file->fd) != 0) ? Semihosting::failed
+                                                       : 0;
+        open_files.erase(handle);
+    }
+
+    return target.write_register(Register::R0, result);
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_WRITE operation.  Returns the number of
+ * bytes not written, as the ABI asks.
+ */
+Error write_file(Target & target, word_t parameter)
+{
+    word_t block[3];  // Handle, buffer, length.
+    Check(target.read_words(rptr_const<word_t>(parameter), block, 3));
+
+    word_t const length = block[2];
+
+    debug(2, "SYS_WRITE %u: %u bytes from %08X", block[0], length, block[1]);
+
+    HostFile const * file = find_file(block[0]);
+    if (!file) return target.write_register(Register::R0, length);
+
+    // Keep our own buffered output in order with the target's.
+    if (file->fd == 1) fflush(stdout);
+
+    vector<byte_t> buffer(std::min<size_t>(length, transfer_chunk));
+    word_t done = 0;
+
+    while (done < length)
+    {
+        size_t const count = std::min<size_t>(length - done, transfer_chunk);
+
+        Check(target.read_bytes(rptr_const<byte_t>(block[1] + done),
+                                &buffer[0],
+                                count));
+
+        size_t written = 0;
+        while (written < count)
+        {
+            ssize_t n = write(file->fd, &buffer[written], count - written);
+
+            if (n < 0 && errno == EINTR && !interrupted) continue;
+            if (n <= 0) break;
+
+            written += n;
+        }
+
+        done += written;
+        if (written < count) break;
+    }
+
+    return target.write_register(Register::R0, length - done);
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_READ operation.  Returns the number of bytes
+ * not read, as the ABI asks -- so all of them at end of file.
+ */
+Error read_file(Target & target, word_t parameter)
+{
+    word_t block[3];  // Handle, buffer, length.
+    Check(target.read_words(rptr_const<word_t>(parameter), block, 3));
+
+    word_t const length = block[2];
+
+    debug(2, "SYS_READ %u: %u bytes to %08X", block[0], length, block[1]);
+
+    HostFile const * file = find_file(block[0]);
+    if (!file) return target.write_register(Register::R0, length);
+
+    vector<byte_t> buffer(std::min<size_t>(length, transfer_chunk));
+    word_t done = 0;
+
+    while (done < length)
+    {
+        size_t const count = std::min<size_t>(length - done, transfer_chunk);
+
+        ssize_t n = read(file->fd, &buffer[0], count);
+
+        if (n < 0 && errno == EINTR && !interrupted) continue;
+        if (n <= 0) break;
+
+        Check(copy_to_target(target, block[1] + done, &buffer[0], n));
+        done += n;
+
+        // A short read means nothing more is ready, as from a terminal.
+        if (size_t(n) < count) break;
+    }
+
+    return target.write_register(Register::R0, length - done);
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_FLEN operation.
+ */
+Error file_length(Target & target, word_t parameter)
+{
+    word_t handle;
+    Check(target.read_word(rptr_const<word_t>(parameter), &handle));
+
+    debug(2, "SYS_FLEN %u", handle);
+
+    word_t result = Semihosting::failed;
+
+    struct stat info;
+    HostFile const * file = find_file(handle);
+    if (file && fstat(file->fd, &info) == 0) result = info.st_size;
+
+    return target.write_register(Register::R0, result);
+}
+
+
 /*******************************************************************************
  * Inspects the CPU's halt conditions to see whether semihosting has been
  * invoked.
@@ -162,12 +540,21 @@ Error read_char(Target & target, word_t parameter)
 Error handle_halt(Target & target)
 {
     word_t dfsr;
-    CheckRetry(target.read_word(SCB::DFSR, &dfsr), 100);
+    CheckWait(target.read_word(SCB::DFSR, &dfsr));
 
     if ((dfsr & SCB::DFSR_reason_mask) == SCB::DFSR_BKPT)
     {
-        word_t pc;
-        CheckRetry(target.read_register(Register::PC, &pc), 100);
+        /*
+         * Fetch everything a semihosting call needs in one go, in case this
+         * is one.
+         */
+        word_t registers[Target::register_count];
+        Check(target.read_registers((1 << Register::PC)
+                                  | (1 << Register::R0)
+                                  | (1 << Register::R1),
+                                    registers));
+
+        word_t pc = registers[Register::PC];
 
         /*
          * Targets may only support 32-bit accesses, but the PC is 16-bit
@@ -176,7 +563,7 @@ Error handle_halt(Target & target)
          */
         rptr<word_t> instr_word_address(pc & ~0x3);
         word_t instr_word;
-        CheckRetry(target.read_word(instr_word_address, &instr_word), 100);
+        CheckWait(target.read_word(instr_word_address, &instr_word));
 
         /*
          * Extract the instruction halfword from the word we've read.
@@ -192,26 +579,43 @@ Error handle_halt(Target & target)
              *    more parameters, in R1.
              *  - Return value in R0 (either 32-bit value or pointer).
              */
-            word_t operation;
-            CheckRetry(target.read_register(Register::R0, &operation), 100);
-
-            word_t parameter;
-            CheckRetry(target.read_register(Register::R1, &parameter), 100);
+            word_t operation = registers[Register::R0];
+            word_t parameter = registers[Register::R1];
 
             switch (operation)
             {
-                case 0x3:
+                case Semihosting::SYS_OPEN:
+                    Check(open_file(target, parameter));
+                    break;
+
+                case Semihosting::SYS_CLOSE:
+                    Check(close_file(target, parameter));
+                    break;
+
+                case Semihosting::SYS_WRITEC:
                     Check(write_char(target, parameter));
                     break;
 
-                case 0x4:
+                case Semihosting::SYS_WRITE0:
                     Check(write_str(target, parameter));
                     break;
 
-                case 0x7:
+                case Semihosting::SYS_WRITE:
+                    Check(write_file(target, parameter));
+                    break;
+
+                case Semihosting::SYS_READ:
+                    Check(read_file(target, parameter));
+                    break;
+
+                case Semihosting::SYS_READC:
                     Check(read_char(target, parameter));
                     break;
 
+                case Semihosting::SYS_FLEN:
+                    Check(file_length(target, parameter));
+                    break;
+
                 default:
                     warning("Unsupported semihosting operation 0x%X",
                             operation);
@@ -222,7 +626,7 @@ Error handle_halt(Target & target)
              * Success!  Advance target PC past the breakpoint and resume.
              */
             pc += 2;
-            CheckRetry(target.write_register(Register::PC, pc), 100);
+            CheckWait(target.write_register(Register::PC, pc));
             Check(target.resume());
 
             return Err::success;
@@ -242,6 +646,131 @@ Error handle_halt(Target & target)
     }
 }
 
+/*******************************************************************************
+ * Where to look for the RTT control block, from -rtt_start and -rtt_length,
+ * which take any base strtoul does, so they can reach the whole address space.
+ */
+
+static Error parse_number(char const * name,
+                          char const * text,
+                          uint32_t * value)
+{
+    char * end;
+
+    errno = 0;
+    unsigned long result = strtoul(text, &end, 0);
+
+    CheckStringB(*text && !*end && errno == 0 && result <= 0xFFFFFFFFul,
+                 "Bad number for -%s: '%s'", name, text);
+
+    *value = result;
+    return Err::success;
+}
+
+struct RTTSearch
+{
+    uint32_t start;
+    uint32_t length;
+};
+
+static Error parse_rtt_search(RTTSearch * search)
+{
+    Check(parse_number("rtt_start", CommandLine::rtt_start.get(),
+                       &search->start));
+    Check(parse_number("rtt_length", CommandLine::rtt_length.get(),
+                       &search->length));
+
+    CheckStringB(search->length <= 0x100000000ull - search->start,
+                 "-rtt_start and -rtt_length run past the end of memory");
+
+    return Err::success;
+}
+
+/*
+ * The default search covers the most RAM the parts we know have; on one with
+ * less, it would fault past the end.  So unless -rtt_length is given, a part
+ * we know the family of is asked what it is -- which borrows the core, so it
+ * is started afresh after -- and the search stops at the end of its RAM.
+ */
+static Error fit_rtt_search(Target & target,
+                            uint32_t idcode,
+                            RTTSearch * search)
+{
+    if (CommandLine::rtt_length.set() || find_family(idcode) == 0)
+        return Err::success;
+
+    Check(target.halt());
+    Check(target.enable_breakpoints());
+
+    PartDescription const * part;
+    Check(identify_part(target, idcode, &part));
+
+    Check(target.reset_and_halt());
+    Check(target.resume());
+
+    uint32_t const ram_end = part->ram_base + part->ram_bytes;
+
+    if (search->start >= part->ram_base && search->start < ram_end)
+    {
+        search->length = std::min(search->length, ram_end - search->start);
+    }
+
+    debug(1, "Searching %u bytes from %08X for RTT",
+          search->length, search->start);
+
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Copies any output waiting in the RTT log channel to stdout.  Until the
+ * firmware has set up its control block, looks for it every so often.
+ */
+static unsigned const rtt_search_interval_ms = 500;
+
+/*
+ * How often to log polling statistics, at debug level 1.
+ */
+static unsigned const stats_interval_ms = 10000;
+
+static Error poll_rtt(RTT & rtt,
+                      RTTSearch const & search,
+                      timeval * last_search,
+                      bool * active)
+{
+    *active = false;
+
+    if (!rtt.is_found())
+    {
+        if (milliseconds_since(*last_search) < int(rtt_search_interval_ms))
+        {
+            return Err::success;
+        }
+
+        gettimeofday(last_search, 0);
+
+        bool found;
+        Check(rtt.find(rptr_const<word_t>(search.start),
+                       search.length,
+                       &found));
+
+        if (!found) return Err::success;
+
+        notice("Found RTT control block; reading its output.");
+    }
+
+    vector<byte_t> output;
+    Check(rtt.read(0, &output));
+
+    if (!output.empty())
+    {
+        fwrite(&output[0], 1, output.size(), stdout);
+        fflush(stdout);
+        *active = true;
+    }
+
+    return Err::success;
+}
+
 /*******************************************************************************
  * Semihosting tool entry point.
  */
@@ -255,13 +784,14 @@ static void restore_terminal()
 
 static void int_handler(int signal)
 {
-    restore_terminal();
-    fflush(stdout);
-    exit(1);
+    interrupted = 1;
 }
 
 Error host_main(SWDDriver & swd)
 {
+    RTTSearch rtt_search;
+    Check(parse_rtt_search(&rtt_search));
+
     /*
      * Hook SIGINT to ensure that we can restore terminal settings on ^C.
      */
@@ -289,28 +819,84 @@ Error host_main(SWDDriver & swd)
     DebugAccessPort dap(swd);
     Target target(swd, dap, 0);
 
+    dap.enable_cache(!CommandLine::no_cache.get());
+    target.enable_cache(!CommandLine::no_cache.get());
+
     uint32_t idcode;
     Check(swd.initialize(&idcode));
 
     Check(swd.enter_reset());
     usleep(10000);
     Check(dap.reset_state());
+
+    if (CommandLine::overrun_detection.get())
+        Check(dap.enable_overrun_detection(true));
+
     Check(target.initialize());
     Check(target.reset_halt_state());
 
     Check(swd.leave_reset());
 
-    while (true)
+    if (CommandLine::rtt.get())
+        Check(fit_rtt_search(target, idcode, &rtt_search));
+
+    /*
+     * RTT output is read while the processor runs; semihosting, which needs
+     * it to halt, still works alongside.
+     */
+    RTT rtt(target);
+    timeval last_rtt_search = { 0, 0 };
+
+    /*
+     * Firmware that uses semihosting or RTT at all tends to do so in bursts,
+     * so poll tightly after each event, then back off until the next.
+     */
+    PollScheduler poll(CommandLine::poll_idle_us.get());
+
+    timeval last_stats;
+    gettimeofday(&last_stats, 0);
+
+    while (!interrupted)
     {
+        bool active = false;
+
         word_t dhcsr;
-        CheckRetry(target.read_word(DCB::DHCSR, &dhcsr), 100);
+        CheckWait(target.read_word(DCB::DHCSR, &dhcsr));
 
         if (dhcsr & DCB::DHCSR_S_HALT)
         {
             Check(handle_halt(target));
+            active = true;
+        }
+
+        if (CommandLine::rtt.get())
+        {
+            bool rtt_active;
+            Check(poll_rtt(rtt, rtt_search, &last_rtt_search, &rtt_active));
+            active = active || rtt_active;
+        }
+
+        if (active) poll.activity();
+        else        poll.wait();
+
+        if (milliseconds_since(last_stats) >= int(stats_interval_ms))
+        {
+            PollScheduler::Stats stats = poll.stats();
+            debug(1, "Polling at %u Hz (interval %u us); %lu events, "
+                     "latency mean %u us, max %u us",
+                  stats.poll_rate_hz,
+                  stats.interval_us,
+                  stats.events,
+                  stats.mean_latency_us,
+                  stats.max_latency_us);
+
+            poll.reset_stats();
+            gettimeofday(&last_stats, 0);
         }
     }
-     
+
+    restore_terminal();
+    fflush(stdout);
 
     return Err::success;
 }
@@ -322,6 +908,21 @@ Error host_main(SWDDriver & swd)
 
 static Error error_main(int argc, char const * * argv)
 {
+    CheckStringB(CommandLine::clock.get() > 0,
+                 "-clock must be a positive rate in kHz; -auto_clock finds "
+                 "the fastest the target manages");
+    CheckStringB(CommandLine::wait_retries.get() > 0,
+                 "-wait_retries must be at least 1");
+    CheckStringB(CommandLine::wait_backoff_us.get() >= 0,
+                 "-wait_backoff_us can't be negative");
+
+    SessionDriver session;
+    bool          attached;
+
+    Check(session.attach(CommandLine::session.get(), &attached));
+
+    if (attached) return host_main(session);
+
     MPSSEConfig config;
     MPSSE       mpsse;
 
@@ -338,7 +939,11 @@ static Error error_main(int argc, char const * * argv)
 
     Check(mpsse.open(config));
 
-    MPSSESWDDriver swd(config, &mpsse);
+    MPSSESWDDriver swd(config,
+                       &mpsse,
+                       CommandLine::auto_clock.get()
+                           ? MPSSESWDDriver::auto_clock
+                           : CommandLine::clock.get() * 1000);
 
     Check(host_main(swd));
 
@@ -355,7 +960,16 @@ int main(int argc, char const * * argv)
 
     log().set_level(CommandLine::debug.get());
 
-    CheckCleanup(error_main(argc, argv), failure);
+    RetryPolicy::standard().set_attempts(CommandLine::wait_retries.get());
+    RetryPolicy::standard().set_max_backoff_us(
+        CommandLine::wait_backoff_us.get());
+
+    check_error = error_main(argc, argv);
+
+    // Reported even after a failure, which is often when they're wanted.
+    Metrics::report(CommandLine::stats.get(), CommandLine::stats_json.get());
+
+    CheckCleanup(check_error, failure);
     return 0;
 
 failure:
@@ -26,7 +26,11 @@
  */
 
 #include "target.h"
+#include "topology.h"
+#include "metrics.h"
+#include "retry.h"
 #include "swd_dp.h"
+#include "session.h"
 #include "swd_mpsse.h"
 #include "swd.h"
 
@@ -40,7 +44,11 @@
 #include "libs/command_line/command_line.h"
 
 #include <vector>
+#include <algorithm>
 
+#define __STDC_FORMAT_MACROS
+
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <ftdi.h>
@@ -71,6 +79,53 @@ namespace CommandLine
     static Scalar<int>
     interface("interface", true, 0, "Interface on FTDI chip");
 
+    static Scalar<int>
+    clock("clock", true, MPSSESWDDriver::default_clock_hz / 1000,
+          "SWD clock rate in kHz, unless -auto_clock is given");
+
+    static Scalar<bool>
+    auto_clock("auto_clock", true, false,
+               "Whether to find the fastest reliable SWD clock rate");
+
+    static Scalar<String>
+    topology_cache("topology_cache", true, "",
+                   "File to cache discovered CoreSight topologies in, keyed "
+                   "by IDCODE and MEM-AP BASE");
+
+
+    static Scalar<String>
+    session("session", true, "",
+            "Socket of the swdsession to work through, instead of opening "
+            "the programmer.  By default, the usual one is used if a session "
+            "is running; 'none' always opens the programmer.");
+
+    static Scalar<bool>
+    stats("stats", true, false,
+          "Whether to log transport and per-call latency statistics at exit");
+
+    static Scalar<String>
+    stats_json("stats_json", true, "",
+               "File to save the statistics to as JSON at exit, or - for "
+               "standard output");
+
+
+    static Scalar<bool>
+    overrun_detection("overrun_detection", true, true,
+                      "Whether to turn on the DAP's Overrun Detection, so "
+                      "batches are checked for WAIT once.  When false, each "
+                      "transfer costs its own USB exchanges");
+
+    static Scalar<int>
+    wait_retries("wait_retries", true, RetryPolicy::default_attempts,
+                 "How many times to try an access the target answers with "
+                 "WAIT");
+
+    static Scalar<int>
+    wait_backoff_us("wait_backoff_us", true,
+                    RetryPolicy::default_max_backoff_us,
+                    "Longest sleep between retries after WAIT, in "
+                    "microseconds");
+
     static Argument * arguments[] =
     {
         &debug,
@@ -78,6 +133,15 @@ namespace CommandLine
         &vid,
         &pid,
         &interface,
+        &clock,
+        &auto_clock,
+        &topology_cache,
+        &overrun_detection,
+        &wait_retries,
+        &wait_backoff_us,
+        &session,
+        &stats,
+        &stats_json,
         NULL
     };
 }
@@ -106,9 +170,15 @@ struct TargetInfo
     unsigned major_revision;
     unsigned minor_revision;
 
+    uint32_t idcode;
+    Topology topology;  // Components found so far.
+    unsigned depth;     // Of ROM tables being walked.
+
     TargetInfo() :
         mem_ap_found(false),
-        mem_ap_index(0) {}
+        mem_ap_index(0),
+        idcode(0),
+        depth(0) {}
 };
 
 Error probe_unknown_device(Target &           target,
@@ -129,7 +199,7 @@ Error identify_cpu(Target & target, TargetInfo *info)
     rptr_const<word_t> cpuid_addr(0xE000ED00);
 
     word_t cpuid;
-    CheckRetry(target.read_word(cpuid_addr, &cpuid), 100);
+    CheckWait(target.read_word(cpuid_addr, &cpuid));
 
     uint8_t  implementer = (cpuid >> 24) & 0x0FF;
     uint8_t  variant     = (cpuid >> 20) & 0x00F;
@@ -419,7 +489,7 @@ Error probe_rom_table(Target &           target,
 
     unsigned const memtype_index = 0xFCC / sizeof(word_t);
     word_t         memtype;
-    CheckRetry(target.read_word(base + memtype_index, &memtype), 100);
+    CheckWait(target.read_word(base + memtype_index, &memtype));
 
     if ((memtype & 1) != 1)
     {
@@ -433,10 +503,26 @@ Error probe_rom_table(Target &           target,
     unsigned const max_rom_table_entries = 0xFCB / sizeof(word_t);
     vector<int32_t> entry_offsets;
 
+    /*
+     * Tables are usually short, so read a few entries at a time -- each batch
+     * is a single pipelined transfer -- rather than one by one.
+     */
+    unsigned const entries_per_read = 16;
+    word_t entries[entries_per_read];
+
     for (unsigned i = 0; i < max_rom_table_entries; ++i)
     {
-        word_t entry;
-        CheckRetry(target.read_word(base + i, &entry), 100);
+        unsigned const slot = i % entries_per_read;
+
+        if (slot == 0)
+        {
+            CheckWait(target.read_words(base + i,
+                                        entries,
+                                        std::min(entries_per_read,
+                                                 max_rom_table_entries - i)));
+        }
+
+        word_t const entry = entries[slot];
 
         if (entry == 0) break;
 
@@ -453,6 +539,8 @@ Error probe_rom_table(Target &           target,
         }
     }
 
+    ++info->depth;
+
     for (vector<int32_t>::iterator it = entry_offsets.begin();
          it != entry_offsets.end();
          ++it)
@@ -461,6 +549,8 @@ Error probe_rom_table(Target &           target,
         Check(probe_unknown_device(target, child_regfile, info));
     }
 
+    --info->depth;
+
     return Err::success;
 }
 
@@ -474,14 +564,19 @@ Error probe_unknown_device(Target &           target,
 {
     notice("Device @%08X", regfile.bits());
 
-    word_t component_id[4];
+    /*
+     * The identification registers -- PID4-PID7, PID0-PID3, then CID0-CID3 --
+     * fill the last twelve words of the register file, so fetch them all as
+     * one pipelined read.
+     */
+    unsigned const id_index = 0xFD0 / sizeof(word_t);
+    word_t ids[12];
 
-    unsigned const component_id_index = 0xFF0 / sizeof(word_t);
+    CheckWait(target.read_words(regfile + id_index, ids, 12));
 
-    CheckRetry(target.read_words(regfile + component_id_index,
-                                 component_id,
-                                 4),
-               100);
+    word_t const * peripheral_id_high = &ids[0];
+    word_t const * peripheral_id_low  = &ids[4];
+    word_t const * component_id       = &ids[8];
 
     if (component_id[0] != 0x0D
         || component_id[2] != 0x05
@@ -492,12 +587,7 @@ Error probe_unknown_device(Target &           target,
         return Err::success;
     }
 
-    unsigned const peripheral_id4_index = 0xFD0 / sizeof(word_t);
-
-    word_t peripheral_id4;
-    CheckRetry(target.read_word(regfile + peripheral_id4_index,
-                                &peripheral_id4),
-               100);
+    word_t const peripheral_id4 = peripheral_id_high[0];
 
     unsigned log2_size_in_blocks = (peripheral_id4 >> 4) & 0xF;
     unsigned size_in_blocks = 1 << log2_size_in_blocks;
@@ -507,6 +597,24 @@ Error probe_unknown_device(Target &           target,
                                     + (4096 / sizeof(word_t)));
 
     uint8_t component_class = (component_id[1] >> 4) & 0xF;
+
+    Component component;
+    component.address         = regfile.bits();
+    component.depth           = info->depth;
+    component.component_class = component_class;
+    component.size_bytes      = size_in_bytes;
+    component.peripheral_id   = 0;
+
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        component.peripheral_id |= uint64_t(peripheral_id_low[i]  & 0xFF)
+                                   << (8 * i);
+        component.peripheral_id |= uint64_t(peripheral_id_high[i] & 0xFF)
+                                   << (8 * (i + 4));
+    }
+
+    info->topology.components.push_back(component);
+
     switch (component_class)
     {
         case 0x1:
@@ -537,6 +645,27 @@ Error probe_unknown_device(Target &           target,
     return Err::success;
 }
 
+/*******************************************************************************
+ * Lists a topology loaded from the cache, in place of walking it.
+ */
+static void print_cached_topology(Topology const & topology)
+{
+    notice("Using cached topology (%zu components):",
+           topology.components.size());
+
+    for (size_t i = 0; i < topology.components.size(); ++i)
+    {
+        Component const & c = topology.components[i];
+
+        notice("  %*sDevice @%08X: class %X, PID %016"PRIX64", %u bytes",
+               int(2 * c.depth), "",
+               c.address,
+               unsigned(c.component_class),
+               c.peripheral_id,
+               c.size_bytes);
+    }
+}
+
 /*******************************************************************************
  * Explores a MEM-AP.
  */
@@ -546,19 +675,19 @@ Error probe_mem_ap(SWDDriver &       swd,
                    uint8_t           ap_index,
                    TargetInfo *      info)
 {
-    word_t csw;
-    Check(dap.start_read_ap(ap_index, 0x00));
-    Check(dap.read_rdbuff(&csw));
-    debug(1, "CSW = %08X", csw);
+    /*
+     * CSW is in a different bank from CFG and BASE, but the reads can still be
+     * posted back to back; the SELECT change is queued between them.
+     */
+    word_t csw, cfg, base;
+    Check(dap.queue_start_read_ap(ap_index, 0x00));
+    Check(dap.queue_step_read_ap(ap_index, 0xF4, &csw));
+    Check(dap.queue_step_read_ap(ap_index, 0xF8, &cfg));
+    Check(dap.queue_read_rdbuff(&base));
+    Check(dap.flush());
 
-    word_t cfg;
-    Check(dap.start_read_ap(ap_index, 0xF4));
-    Check(dap.read_rdbuff(&cfg));
+    debug(1, "CSW = %08X", csw);
     debug(1, "CFG = %08X", cfg);
-
-    word_t base;
-    Check(dap.start_read_ap(ap_index, 0xF8));
-    Check(dap.read_rdbuff(&base));
     debug(1, "BASE = %08X", base);
 
     if ((base & 0x3) != 0x3)
@@ -568,6 +697,24 @@ Error probe_mem_ap(SWDDriver &       swd,
     }
     else
     {
+        char const * cache = CommandLine::topology_cache.get();
+
+        info->topology.idcode = info->idcode;
+        info->topology.base   = base;
+        info->topology.components.clear();
+
+        if (CommandLine::topology_cache.set())
+        {
+            bool found;
+            Check(info->topology.load(cache, &found));
+
+            if (found)
+            {
+                print_cached_topology(info->topology);
+                return Err::success;
+            }
+        }
+
         // Invasively reconfigure this MEM-AP.
         Target target(swd, dap, ap_index);
         rptr_const<word_t> regfile(base & ~0xFFF);
@@ -578,6 +725,11 @@ Error probe_mem_ap(SWDDriver &       swd,
 
         // Treat this peripheral as "unknown" to use type dispatching.
         Check(probe_unknown_device(target, regfile, info));
+
+        if (CommandLine::topology_cache.set())
+        {
+            Check(info->topology.save(cache));
+        }
     }
 
     return Err::success;
@@ -591,38 +743,38 @@ Error early_probe_dap(SWDDriver & swd, DebugAccessPort & dap, TargetInfo * info)
 {
     notice("Scanning for connected Access Ports...");
 
-    for (unsigned i = 0; i < 1/*256*/; ++i)
+    std::vector<DebugAccessPort::AccessPort> aps;
+    CheckWait(dap.enumerate_aps(&aps));
+
+    if (aps.empty())
     {
-        debug(2, "Trying Access Port #%u", i);
+        warning("No Access Ports found.");
+    }
 
-        uint32_t ap_idr;
-        CheckRetry(dap.start_read_ap(i, 0xFC), 100);
-        Check(dap.read_rdbuff(&ap_idr));
+    for (size_t i = 0; i < aps.size(); ++i)
+    {
+        notice("Access Port #%u: IDR = %08X (%s)",
+               unsigned(aps[i].index),
+               aps[i].idr,
+               aps[i].type_name());
+    }
 
-        if (ap_idr)
-        {
-            notice("Access Port #%u: IDR = %08X", i, ap_idr);
-            if (ap_idr & (1 << 16))  // Describes itself as a MEM-AP
-            {
-                if (info->mem_ap_found)
-                {
-                    warning("This system has two MEM-APs.  swdprobe doesn't "
-                            "handle this well.  Ignoring it!");
-                }
-                else
-                {
-                    notice("  Found MEM-AP.");
-                    info->mem_ap_found = true;
-                    info->mem_ap_index = i;
-                }
-
-                Check(probe_mem_ap(swd, dap, i, info));
-            }
-        }
-        else
+    for (size_t i = 0; i < aps.size(); ++i)
+    {
+        if (!aps[i].is_mem_ap()) continue;
+
+        uint8_t const index = aps[i].index;
+
+        notice("Exploring MEM-AP #%u.", unsigned(index));
+
+        // The first MEM-AP is the one the other tools use by default.
+        if (!info->mem_ap_found)
         {
-            debug(2, "Access Port #%u not implemented (IDR=0)", i);
+            info->mem_ap_found = true;
+            info->mem_ap_index = index;
         }
+
+        Check(probe_mem_ap(swd, dap, index, info));
     }
 
     return Err::success;
@@ -639,6 +791,7 @@ Error probe_main(SWDDriver & swd)
 
     uint32_t idcode;
     Check(swd.initialize(&idcode));
+    info.idcode = idcode;
 
     notice("SWD communications initialized successfully.");
     notice("SWD-DP IDCODE = %08X", idcode);
@@ -650,6 +803,9 @@ Error probe_main(SWDDriver & swd)
     usleep(10000);
     Check(dap.reset_state());
 
+    if (CommandLine::overrun_detection.get())
+        Check(dap.enable_overrun_detection(true));
+
     Check(early_probe_dap(swd, dap, &info));
 
     Check(swd.leave_reset());
@@ -664,6 +820,21 @@ Error probe_main(SWDDriver & swd)
 
 static Error error_main(int argc, char const * * argv)
 {
+    CheckStringB(CommandLine::clock.get() > 0,
+                 "-clock must be a positive rate in kHz; -auto_clock finds "
+                 "the fastest the target manages");
+    CheckStringB(CommandLine::wait_retries.get() > 0,
+                 "-wait_retries must be at least 1");
+    CheckStringB(CommandLine::wait_backoff_us.get() >= 0,
+                 "-wait_backoff_us can't be negative");
+
+    SessionDriver session;
+    bool          attached;
+
+    Check(session.attach(CommandLine::session.get(), &attached));
+
+    if (attached) return probe_main(session);
+
     MPSSEConfig config;
     MPSSE       mpsse;
 
@@ -680,7 +851,11 @@ static Error error_main(int argc, char const * * argv)
 
     Check(mpsse.open(config));
 
-    MPSSESWDDriver swd(config, &mpsse);
+    MPSSESWDDriver swd(config,
+                       &mpsse,
+                       CommandLine::auto_clock.get()
+                           ? MPSSESWDDriver::auto_clock
+                           : CommandLine::clock.get() * 1000);
 
     Check(probe_main(swd));
 
@@ -697,7 +872,16 @@ int main(int argc, char const * * argv)
 
     log().set_level(CommandLine::debug.get());
 
-    CheckCleanup(error_main(argc, argv), failure);
+    RetryPolicy::standard().set_attempts(CommandLine::wait_retries.get());
+    RetryPolicy::standard().set_max_backoff_us(
+        CommandLine::wait_backoff_us.get());
+
+    check_error = error_main(argc, argv);
+
+    // Reported even after a failure, which is often when they're wanted.
+    Metrics::report(CommandLine::stats.get(), CommandLine::stats_json.get());
+
+    CheckCleanup(check_error, failure);
     return 0;
 
 failure:
@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2012, Anton Staaf, Cliff L. Biffle.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * swdprof profiles running firmware without stopping it or changing it.  It
+ * reads the DWT's PC Sample Register over and over -- which the processor
+ * doesn't notice -- and reports where the samples fell, by function if given
+ * the firmware's ELF file:
+ *
+ *     swdprof -elf firmware.elf -seconds 10
+ *
+ * The samples are taken in batches, one SWD read each, so the sample rate is
+ * set by the SWD clock and by how often a batch has to wait for a USB round
+ * trip; -stats shows both.  The target isn't reset.
+ *
+ * Parts without a PCSR can be profiled with -halting instead, which briefly
+ * halts the processor to read its PC for each sample -- and so is neither
+ * free nor invisible to the firmware.
+ */
+
+#include "target.h"
+#include "symbols.h"
+#include "poll.h"
+#include "metrics.h"
+#include "retry.h"
+#include "swd_dp.h"
+#include "session.h"
+#include "swd_mpsse.h"
+#include "swd.h"
+
+#include "rptr.h"
+
+#include "armv6m_v7m.h"
+#include "arm.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+#include "libs/command_line/command_line.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#define __STDC_FORMAT_MACROS
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+using namespace Log;
+using Err::Error;
+
+using namespace ARM;
+using namespace ARMv6M_v7M;
+
+using std::string;
+using std::vector;
+
+
+/*******************************************************************************
+ * Command line flags
+ */
+namespace CommandLine
+{
+    static Scalar<int>
+    debug("debug", true, 0, "What level of debug logging to use.");
+
+    static Scalar<String>
+    programmer("programmer", true, "um232h", "FTDI-based programmer to use");
+
+    static Scalar<int> vid("vid", true, 0, "FTDI VID");
+    static Scalar<int> pid("pid", true, 0, "FTDI PID");
+
+    static Scalar<int>
+    interface("interface", true, 0, "Interface on FTDI chip");
+
+    static Scalar<int>
+    clock("clock", true, MPSSESWDDriver::default_clock_hz / 1000,
+          "SWD clock rate in kHz, unless -auto_clock is given");
+
+    static Scalar<bool>
+    auto_clock("auto_clock", true, false,
+               "Whether to find the fastest reliable SWD clock rate");
+
+    static Scalar<String>
+    elf("elf", true, "",
+        "ELF file of the running firmware, to name the functions samples "
+        "fall in");
+
+    static Scalar<int>
+    seconds("seconds", true, 5, "How long to sample for");
+
+    static Scalar<int>
+    top("top", true, 20, "How many of the busiest entries to list");
+
+    static Scalar<bool>
+    by_address("by_address", true, false,
+               "Whether to list addresses rather than functions");
+
+    static Scalar<int>
+    granularity("granularity", true, 4,
+                "Bytes of code per entry with -by_address, a power of two");
+
+    static Scalar<String>
+    output("output", true, "",
+           "File to save every sampled address to, as CSV");
+
+    static Scalar<bool>
+    halting("halting", true, false,
+            "Whether to sample by halting the processor and reading its PC, "
+            "for parts without DWT_PCSR");
+
+
+    static Scalar<String>
+    session("session", true, "",
+            "Socket of the swdsession to work through, instead of opening "
+            "the programmer.  By default, the usual one is used if a session "
+            "is running; 'none' always opens the programmer.");
+
+    static Scalar<bool>
+    stats("stats", true, false,
+          "Whether to log transport and per-call latency statistics at exit");
+
+    static Scalar<String>
+    stats_json("stats_json", true, "",
+               "File to save the statistics to as JSON at exit, or - for "
+               "standard output");
+
+
+    static Scalar<bool>
+    overrun_detection("overrun_detection", true, true,
+                      "Whether to turn on the DAP's Overrun Detection, so "
+                      "batches are checked for WAIT once.  When false, each "
+                      "transfer costs its own USB exchanges");
+
+    static Scalar<int>
+    wait_retries("wait_retries", true, RetryPolicy::default_attempts,
+                 "How many times to try an access the target answers with "
+                 "WAIT");
+
+    static Scalar<int>
+    wait_backoff_us("wait_backoff_us", true,
+                    RetryPolicy::default_max_backoff_us,
+                    "Longest sleep between retries after WAIT, in "
+                    "microseconds");
+
+    static Argument * arguments[] =
+    {
+        &debug,
+        &programmer,
+        &vid,
+        &pid,
+        &interface,
+        &clock,
+        &auto_clock,
+        &elf,
+        &seconds,
+        &top,
+        &by_address,
+        &granularity,
+        &output,
+        &halting,
+        &overrun_detection,
+        &wait_retries,
+        &wait_backoff_us,
+        &session,
+        &stats,
+        &stats_json,
+        NULL
+    };
+}
+
+
+/*******************************************************************************
+ * Sampling
+ */
+
+/*
+ * Samples taken per call to Target::sample_word.  Target splits them into
+ * batches itself; this just sets how often we look at the clock.
+ */
+static size_t const samples_per_read = 4096;
+
+/*
+ * ^C ends sampling early, and the profile so far is still reported.
+ */
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_handler(int signal)
+{
+    stopping = 1;
+}
+
+static Error catch_stop_signals()
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_handler;
+    action.sa_flags   = SA_RESTART;  // Let the transfer in progress finish.
+
+    CheckP(sigemptyset(&action.sa_mask));
+    CheckP(sigaction(SIGINT,  &action, 0));
+    CheckP(sigaction(SIGTERM, &action, 0));
+
+    return Err::success;
+}
+
+/*
+ * Samples by halting the processor, reading its PC, and letting it go, for
+ * each sample.
+ */
+static Error sample_halting(Target & target, word_t * samples, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        Check(target.halt());
+        Check(target.read_register(Register::PC, &samples[i]));
+        Check(target.resume());
+    }
+
+    return Err::success;
+}
+
+struct Profile
+{
+    std::map<uint32_t, uint64_t> addresses;  // Samples at each address.
+    uint64_t                     samples;
+    uint64_t                     halted;     // Samples with no PC.
+    int                          milliseconds;
+
+    Profile() : samples(0), halted(0), milliseconds(0) {}
+};
+
+static Error take_profile(Target & target, Profile * profile)
+{
+    vector<word_t> samples(samples_per_read);
+
+    timeval start;
+    gettimeofday(&start, 0);
+
+    int const limit_ms = CommandLine::seconds.get() * 1000;
+
+    while (!stopping && milliseconds_since(start) < limit_ms)
+    {
+        if (CommandLine::halting.get())
+        {
+            Check(sample_halting(target, &samples[0], samples.size()));
+        }
+        else
+        {
+            Check(target.sample_word(DWT::DWT_PCSR,
+                                     &samples[0],
+                                     samples.size()));
+
+            /*
+             * An ARMv6-M part may leave PCSR out, and then it reads as zero
+             * -- which no running processor is ever at.
+             */
+            CheckStringB(profile->samples != 0
+                         || std::count(samples.begin(), samples.end(), 0)
+                            != ptrdiff_t(samples.size()),
+                         "This target doesn't seem to have DWT_PCSR; "
+                         "try -halting");
+        }
+
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            if (samples[i] == DWT::DWT_PCSR_no_sample)
+            {
+                ++profile->halted;
+                continue;
+            }
+
+            ++profile->addresses[samples[i] & ~1u];
+        }
+
+        profile->samples += samples.size();
+    }
+
+    profile->milliseconds = milliseconds_since(start);
+
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * Reporting
+ */
+
+struct Entry
+{
+    string   name;
+    uint64_t samples;
+
+    bool operator<(Entry const & other) const
+    {
+        return samples > other.samples;  // Busiest first.
+    }
+};
+
+static string address_name(SymbolTable const & symbols, uint32_t address)
+{
+    char buffer[32];
+
+    uint32_t     offset;
+    char const * function = symbols.lookup(address, &offset);
+
+    if (CommandLine::by_address.get())
+    {
+        snprintf(buffer, sizeof(buffer), "%08"PRIX32, address);
+        string name = buffer;
+
+        if (function)
+        {
+            snprintf(buffer, sizeof(buffer), "+0x%"PRIX32, offset);
+            name = name + "  " + function + buffer;
+        }
+
+        return name;
+    }
+
+    if (function) return function;
+
+    snprintf(buffer, sizeof(buffer), "%08"PRIX32" (unknown)", address);
+    return buffer;
+}
+
+static void report(Profile const & profile, SymbolTable const & symbols)
+{
+    uint64_t const running = profile.samples - profile.halted;
+    int const      ms      = std::max(profile.milliseconds, 1);
+
+    notice("%"PRIu64" samples in %d ms (%"PRIu64" per second)",
+           profile.samples, profile.milliseconds,
+           profile.samples * 1000 / ms);
+
+    if (profile.halted)
+    {
+        notice("%"PRIu64" samples found the processor halted",
+               profile.halted);
+    }
+
+    if (running == 0) return;
+
+    /*
+     * Gather the addresses into entries: functions, or by_address, runs of
+     * granularity bytes.  Addresses outside any function get one each.
+     */
+    uint32_t const mask = ~uint32_t(std::max(CommandLine::granularity.get(),
+                                             1) - 1);
+
+    std::map<string, uint64_t> totals;
+    std::map<uint32_t, uint64_t>::const_iterator it;
+
+    for (it = profile.addresses.begin(); it != profile.addresses.end(); ++it)
+    {
+        uint32_t const address = CommandLine::by_address.get()
+                               ? it->first & mask
+                               : it->first;
+
+        totals[address_name(symbols, address)] += it->second;
+    }
+
+    vector<Entry> entries;
+    for (std::map<string, uint64_t>::const_iterator total = totals.begin();
+         total != totals.end();
+         ++total)
+    {
+        Entry entry = { total->first, total->second };
+        entries.push_back(entry);
+    }
+
+    std::stable_sort(entries.begin(), entries.end());
+
+    size_t const shown = std::min(entries.size(),
+                                  size_t(std::max(CommandLine::top.get(), 0)));
+
+    notice("%7s %10s  %s", "%", "samples",
+           CommandLine::by_address.get() ? "address" : "function");
+
+    for (size_t i = 0; i < shown; ++i)
+    {
+        notice("%6.2f%% %10"PRIu64"  %s",
+               100.0 * entries[i].samples / running,
+               entries[i].samples,
+               entries[i].name.c_str());
+    }
+
+    if (shown < entries.size())
+    {
+        notice("(%zu more)", entries.size() - shown);
+    }
+}
+
+static Error save_profile(Profile const & profile,
+                          SymbolTable const & symbols,
+                          char const * path)
+{
+    FILE * out = fopen(path, "w");
+    CheckStringB(out, "Can't write %s: %s", path, strerror(errno));
+
+    fprintf(out, "address,samples,function,offset\n");
+
+    std::map<uint32_t, uint64_t>::const_iterator it;
+    for (it = profile.addresses.begin(); it != profile.addresses.end(); ++it)
+    {
+        uint32_t     offset   = 0;
+        char const * function = symbols.lookup(it->first, &offset);
+
+        fprintf(out, "0x%08"PRIX32",%"PRIu64",%s,%"PRIu32"\n",
+                it->first, it->second, function ? function : "", offset);
+    }
+
+    CheckStringB(fclose(out) == 0,
+                 "Can't write %s: %s", path, strerror(errno));
+
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * Outermost profiling logic.
+ */
+Error profile_main(SWDDriver & swd)
+{
+    SymbolTable symbols;
+
+    if (CommandLine::elf.set())
+    {
+        Check(symbols.open(CommandLine::elf.get()));
+    }
+
+    DebugAccessPort dap(swd);
+    Target target(swd, dap, 0);
+
+    // Nothing here can be cached: the processor runs throughout.
+    uint32_t idcode;
+    Check(swd.initialize(&idcode));
+
+    /*
+     * Unlike the other tools, leave the target out of reset: the point is to
+     * watch the firmware as it is.
+     */
+    Check(dap.reset_state());
+
+    if (CommandLine::overrun_detection.get())
+        Check(dap.enable_overrun_detection(true));
+
+    // Halting needs debugging on; sampling PCSR doesn't.
+    Check(target.initialize(CommandLine::halting.get()));
+
+    // The DWT, PCSR included, only answers with DEMCR.DWTENA set.
+    word_t demcr;
+    Check(target.read_word(DCB::DEMCR, &demcr));
+    if (!(demcr & DCB::DEMCR_DWTENA))
+    {
+        Check(target.write_word(DCB::DEMCR, demcr | DCB::DEMCR_DWTENA));
+    }
+
+    Check(catch_stop_signals());
+
+    notice("Sampling target %08X for %d seconds%s...",
+           idcode, CommandLine::seconds.get(),
+           CommandLine::halting.get() ? ", halting it for each sample" : "");
+
+    Profile profile;
+    Check(take_profile(target, &profile));
+
+    report(profile, symbols);
+
+    if (CommandLine::output.set())
+    {
+        Check(save_profile(profile, symbols, CommandLine::output.get()));
+    }
+
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * Entry point (sort of -- see main below)
+ */
+
+static Error error_main(int argc, char const * * argv)
+{
+    CheckStringB(CommandLine::clock.get() > 0,
+                 "-clock must be a positive rate in kHz; -auto_clock finds "
+                 "the fastest the target manages");
+    CheckStringB(CommandLine::wait_retries.get() > 0,
+                 "-wait_retries must be at least 1");
+    CheckStringB(CommandLine::wait_backoff_us.get() >= 0,
+                 "-wait_backoff_us can't be negative");
+
+    SessionDriver session;
+    bool          attached;
+
+    Check(session.attach(CommandLine::session.get(), &attached));
+
+    if (attached) return profile_main(session);
+
+    MPSSEConfig config;
+    MPSSE       mpsse;
+
+    Check(lookup_programmer(CommandLine::programmer.get(), &config));
+
+    if (CommandLine::interface.set())
+        config.interface = CommandLine::interface.get();
+
+    if (CommandLine::vid.set())
+        config.vid = CommandLine::vid.get();
+
+    if (CommandLine::pid.set())
+        config.pid = CommandLine::pid.get();
+
+    Check(mpsse.open(config));
+
+    MPSSESWDDriver swd(config,
+                       &mpsse,
+                       CommandLine::auto_clock.get()
+                           ? MPSSESWDDriver::auto_clock
+                           : CommandLine::clock.get() * 1000);
+
+    Check(profile_main(swd));
+
+    return Err::success;
+}
+
+/******************************************************************************/
+int main(int argc, char const * * argv)
+{
+    Error check_error = Err::success;
+
+    CheckCleanup(CommandLine::parse(argc, argv, CommandLine::arguments),
+                 failure);
+
+    log().set_level(CommandLine::debug.get());
+
+    RetryPolicy::standard().set_attempts(CommandLine::wait_retries.get());
+    RetryPolicy::standard().set_max_backoff_us(
+        CommandLine::wait_backoff_us.get());
+
+    check_error = error_main(argc, argv);
+
+    // Reported even after a failure, which is often when they're wanted.
+    Metrics::report(CommandLine::stats.get(), CommandLine::stats_json.get());
+
+    CheckCleanup(check_error, failure);
+    return 0;
+
+failure:
+    Err::stack()->print();
+    return 1;
+}
+/******************************************************************************/
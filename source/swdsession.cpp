@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2012, Anton Staaf, Cliff L. Biffle.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * swdsession opens a programmer once and keeps it open, serving it to the
+ * other tools over a UNIX socket; see session.h.  Run it in the background
+ * and the tools find it by themselves:
+ *
+ *     swdsession &
+ *     swddump -count 16
+ *     swddude -flash firmware.bin
+ *
+ * It runs until interrupted.
+ */
+
+#include "session.h"
+#include "swd_mpsse.h"
+#include "mpsse.h"
+#include "metrics.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+#include "libs/command_line/command_line.h"
+
+#include <signal.h>
+#include <string.h>
+
+using namespace Log;
+using Err::Error;
+
+
+/*******************************************************************************
+ * Command line flags
+ */
+namespace CommandLine
+{
+    static Scalar<int>
+    debug("debug", true, 0, "What level of debug logging to use.");
+
+    static Scalar<String>
+    programmer("programmer", true, "um232h", "FTDI-based programmer to use");
+
+    static Scalar<int> vid("vid", true, 0, "FTDI VID");
+    static Scalar<int> pid("pid", true, 0, "FTDI PID");
+
+    static Scalar<int>
+    interface("interface", true, 0, "Interface on FTDI chip");
+
+    static Scalar<String>
+    location("location", true, "",
+             "USB serial number or bus path of the programmer, if there is "
+             "more than one");
+
+    static Scalar<int>
+    clock("clock", true, MPSSESWDDriver::default_clock_hz / 1000,
+          "SWD clock rate in kHz, unless -auto_clock is given");
+
+    static Scalar<bool>
+    auto_clock("auto_clock", true, false,
+               "Whether to find the fastest reliable SWD clock rate");
+
+    static Scalar<String>
+    socket("socket", true, "",
+           "Path to serve the session on, if not the default ($SWD_SESSION, "
+           "$XDG_RUNTIME_DIR/swdsession, or one per user in /tmp)");
+
+
+    static Scalar<bool>
+    stats("stats", true, false,
+          "Whether to log transport and per-call latency statistics at exit");
+
+    static Scalar<String>
+    stats_json("stats_json", true, "",
+               "File to save the statistics to as JSON at exit, or - for "
+               "standard output");
+
+    static Argument * arguments[] =
+    {
+        &debug,
+        &programmer,
+        &vid,
+        &pid,
+        &interface,
+        &location,
+        &clock,
+        &auto_clock,
+        &socket,
+        &stats,
+        &stats_json,
+        NULL
+    };
+}
+
+/*******************************************************************************
+ * Signals end the session.  The handler does nothing itself; it's there so
+ * that SIGINT and SIGTERM interrupt accept and friends, which ends serve
+ * cleanly, rather than killing us with the socket still on disk.
+ */
+static void stop_handler(int signal)
+{
+}
+
+static Error catch_stop_signals()
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_handler;
+    action.sa_flags   = 0;  // No SA_RESTART: we want the interruption.
+
+    CheckP(sigemptyset(&action.sa_mask));
+    CheckP(sigaction(SIGINT,  &action, 0));
+    CheckP(sigaction(SIGTERM, &action, 0));
+
+    return Err::success;
+}
+
+/******************************************************************************/
+static Error error_main(int argc, char const * * argv)
+{
+    CheckStringB(CommandLine::clock.get() > 0,
+                 "-clock must be a positive rate in kHz; -auto_clock finds "
+                 "the fastest the target manages");
+
+    MPSSEConfig config;
+    MPSSE       mpsse;
+
+    Check(lookup_programmer(CommandLine::programmer.get(), &config));
+
+    if (CommandLine::interface.set())
+        config.interface = CommandLine::interface.get();
+
+    if (CommandLine::vid.set())
+        config.vid = CommandLine::vid.get();
+
+    if (CommandLine::pid.set())
+        config.pid = CommandLine::pid.get();
+
+    Check(mpsse.open(config,
+                     CommandLine::location.set()
+                         ? CommandLine::location.get()
+                         : 0));
+
+    MPSSESWDDriver swd(config,
+                       &mpsse,
+                       CommandLine::auto_clock.get()
+                           ? MPSSESWDDriver::auto_clock
+                           : CommandLine::clock.get() * 1000);
+
+    /*
+     * Set up the link now, so that a programmer or target that isn't there
+     * shows up here rather than in the first tool.  The tools' own
+     * initialize then only resets the line.
+     */
+    uint32_t    idcode;
+    Check(swd.initialize(&idcode));
+
+    std::string path = CommandLine::socket.set()
+                           ? std::string(CommandLine::socket.get())
+                           : Session::default_path();
+
+    SessionServer server(swd);
+
+    Check(catch_stop_signals());
+    Check(server.listen(path.c_str()));
+
+    notice("Serving target %08X at %d kHz on %s",
+           idcode, swd.clock_hz() / 1000, path.c_str());
+
+    Check(server.serve());
+
+    notice("Session ended.");
+
+    return Err::success;
+}
+
+/******************************************************************************/
+int main(int argc, char const * * argv)
+{
+    Error check_error = Err::success;
+
+    CheckCleanup(CommandLine::parse(argc, argv, CommandLine::arguments),
+                 failure);
+
+    log().set_level(CommandLine::debug.get());
+
+    check_error = error_main(argc, argv);
+
+    // Reported even after a failure, which is often when they're wanted.
+    Metrics::report(CommandLine::stats.get(), CommandLine::stats_json.get());
+
+    CheckCleanup(check_error, failure);
+    return 0;
+
+failure:
+    Err::stack()->print();
+    return 1;
+}
+/******************************************************************************/
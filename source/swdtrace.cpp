@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2012, Anton Staaf, Cliff L. Biffle.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the project nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * swdtrace shows what firmware writes to the ITM's stimulus ports, as it runs.
+ * It sets up the ITM and TPIU over SWD to send their packets out of the SWO
+ * pin, and captures them on the programmer's second channel -- which must be
+ * wired to SWO -- without ever halting the processor:
+ *
+ *     swdtrace -programmer bus_blaster -trace_clock_khz 72000
+ *
+ * Port 0 goes to standard output.  With -output_prefix, each port goes to its
+ * own file instead.  The target isn't reset.
+ *
+ * Only ARMv7-M parts have an ITM; only two-channel programmers have a channel
+ * to spare.
+ */
+
+#include "target.h"
+#include "itm.h"
+#include "swo.h"
+#include "poll.h"
+#include "metrics.h"
+#include "retry.h"
+#include "swd_dp.h"
+#include "session.h"
+#include "swd_mpsse.h"
+#include "swd.h"
+
+#include "armv6m_v7m.h"
+#include "arm.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+#include "libs/command_line/command_line.h"
+
+#include <string>
+#include <vector>
+
+#define __STDC_FORMAT_MACROS
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace Log;
+using Err::Error;
+
+using namespace ARM;
+using namespace ARMv6M_v7M;
+
+using std::string;
+using std::vector;
+
+
+/*******************************************************************************
+ * Command line flags
+ */
+namespace CommandLine
+{
+    static Scalar<int>
+    debug("debug", true, 0, "What level of debug logging to use.");
+
+    static Scalar<String>
+    programmer("programmer", true, "bus_blaster",
+               "FTDI-based programmer to use");
+
+    static Scalar<int> vid("vid", true, 0, "FTDI VID");
+    static Scalar<int> pid("pid", true, 0, "FTDI PID");
+
+    static Scalar<int>
+    interface("interface", true, 0, "Interface on FTDI chip");
+
+    static Scalar<int>
+    clock("clock", true, MPSSESWDDriver::default_clock_hz / 1000,
+          "SWD clock rate in kHz, unless -auto_clock is given");
+
+    static Scalar<bool>
+    auto_clock("auto_clock", true, false,
+               "Whether to find the fastest reliable SWD clock rate");
+
+    static Scalar<int>
+    swo_interface("swo_interface", true, INTERFACE_B,
+                  "Interface on FTDI chip wired to SWO");
+
+    static Scalar<int>
+    baud("baud", true, 6000000, "SWO bit rate");
+
+    static Scalar<int>
+    trace_clock_khz("trace_clock_khz", true, 12000,
+                    "Clock the target's TPIU runs from, usually the processor "
+                    "clock, in kHz");
+
+    static Scalar<int>
+    ports("ports", true, 1,
+          "Mask of stimulus ports to enable, bit n for port n; -1 for all");
+
+    static Scalar<String>
+    output_prefix("output_prefix", true, "",
+                  "Write each port n to its own file, named by this and n");
+
+    static Scalar<int>
+    seconds("seconds", true, 0,
+            "How long to trace for; by default, until interrupted");
+
+
+    static Scalar<String>
+    session("session", true, "",
+            "Socket of the swdsession to work through, instead of opening "
+            "the programmer.  By default, the usual one is used if a session "
+            "is running; 'none' always opens the programmer.");
+
+    static Scalar<bool>
+    stats("stats", true, false,
+          "Whether to log transport and per-call latency statistics at exit");
+
+    static Scalar<String>
+    stats_json("stats_json", true, "",
+               "File to save the statistics to as JSON at exit, or - for "
+               "standard output");
+
+
+    static Scalar<bool>
+    overrun_detection("overrun_detection", true, true,
+                      "Whether to turn on the DAP's Overrun Detection, so "
+                      "batches are checked for WAIT once.  When false, each "
+                      "transfer costs its own USB exchanges");
+
+    static Scalar<int>
+    wait_retries("wait_retries", true, RetryPolicy::default_attempts,
+                 "How many times to try an access the target answers with "
+                 "WAIT");
+
+    static Scalar<int>
+    wait_backoff_us("wait_backoff_us", true,
+                    RetryPolicy::default_max_backoff_us,
+                    "Longest sleep between retries after WAIT, in "
+                    "microseconds");
+
+    static Argument * arguments[] =
+    {
+        &debug,
+        &programmer,
+        &vid,
+        &pid,
+        &interface,
+        &clock,
+        &auto_clock,
+        &swo_interface,
+        &baud,
+        &trace_clock_khz,
+        &ports,
+        &output_prefix,
+        &seconds,
+        &overrun_detection,
+        &wait_retries,
+        &wait_backoff_us,
+        &session,
+        &stats,
+        &stats_json,
+        NULL
+    };
+}
+
+
+/*******************************************************************************
+ * Output
+ */
+
+/*
+ * Sends each stimulus port's bytes where they belong: everything to its own
+ * file given -output_prefix, and otherwise port 0 to standard output and the
+ * rest nowhere.  Counts them either way.
+ */
+class PortOutput : public ITMDecoder::Sink
+{
+public:
+    PortOutput() : _files(ITM::ITM_port_count, (FILE *) 0),
+                   _bytes(ITM::ITM_port_count, 0) {}
+
+    ~PortOutput()
+    {
+        for (size_t i = 0; i < _files.size(); ++i)
+        {
+            if (_files[i] && _files[i] != stdout) fclose(_files[i]);
+        }
+    }
+
+    Error open(char const * prefix)
+    {
+        if (prefix[0] == '\0')
+        {
+            _files[0] = stdout;
+            return Err::success;
+        }
+
+        for (size_t i = 0; i < _files.size(); ++i)
+        {
+            char name[1024];
+            snprintf(name, sizeof(name), "%s%u", prefix, unsigned(i));
+
+            _files[i] = fopen(name, "wb");
+            CheckStringB(_files[i], "Unable to open %s: %s",
+                         name, strerror(errno));
+        }
+
+        return Err::success;
+    }
+
+    virtual void stimulus(unsigned port, uint8_t const * data, size_t size)
+    {
+        _bytes[port] += size;
+        if (_files[port]) fwrite(data, 1, size, _files[port]);
+    }
+
+    void flush()
+    {
+        for (size_t i = 0; i < _files.size(); ++i)
+        {
+            if (_files[i]) fflush(_files[i]);
+        }
+    }
+
+    uint64_t bytes(unsigned port) const { return _bytes[port]; }
+    bool is_kept(unsigned port) const { return _files[port] != 0; }
+
+private:
+    vector<FILE *>   _files;
+    vector<uint64_t> _bytes;
+};
+
+
+/*******************************************************************************
+ * Tracing
+ */
+
+/*
+ * Bytes taken from the capture ring at a time, and how long to sleep when it
+ * has none.  The ring holds seconds' worth, so sleeping is safe.
+ */
+static size_t const drain_bytes = 64 * 1024;
+static unsigned const idle_sleep_us = 2000;
+
+/*
+ * ^C ends tracing, and what's been captured is still written out.
+ */
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_handler(int signal)
+{
+    stopping = 1;
+}
+
+static Error catch_stop_signals()
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_handler;
+    action.sa_flags   = SA_RESTART;  // Let the transfer in progress finish.
+
+    CheckP(sigemptyset(&action.sa_mask));
+    CheckP(sigaction(SIGINT,  &action, 0));
+    CheckP(sigaction(SIGTERM, &action, 0));
+
+    return Err::success;
+}
+
+/*
+ * Decodes what the capture has received until told to stop, or until reading
+ * fails.
+ */
+static void drain(SWOCapture & capture, ITMDecoder & decoder, PortOutput & out)
+{
+    vector<uint8_t> buffer(drain_bytes);
+
+    timeval start;
+    gettimeofday(&start, 0);
+
+    int const limit_ms = CommandLine::seconds.get() * 1000;
+
+    while (!stopping && (limit_ms == 0 || milliseconds_since(start) < limit_ms))
+    {
+        size_t const count = capture.read(&buffer[0], buffer.size());
+
+        if (count)
+        {
+            decoder.decode(&buffer[0], count);
+            continue;
+        }
+
+        if (!capture.is_reading()) break;
+
+        out.flush();
+        usleep(idle_sleep_us);
+    }
+
+    // Whatever arrived before the end.
+    while (size_t const count = capture.read(&buffer[0], buffer.size()))
+    {
+        decoder.decode(&buffer[0], count);
+    }
+
+    out.flush();
+}
+
+static void report(SWOCapture const & capture,
+                   ITMDecoder const & decoder,
+                   PortOutput const & out)
+{
+    ITMDecoder::Stats const & stats = decoder.stats();
+
+    notice("%"PRIu64" bytes of SWO received, %"PRIu64" packets from software",
+           capture.received(), stats.software);
+
+    for (unsigned port = 0; port < ITM::ITM_port_count; ++port)
+    {
+        if (out.bytes(port) == 0) continue;
+
+        notice("  port %2u: %"PRIu64" bytes%s",
+               port, out.bytes(port),
+               out.is_kept(port) ? "" : " (discarded)");
+    }
+
+    if (capture.dropped())
+    {
+        warning("%"PRIu64" bytes were lost because they weren't read in time",
+                capture.dropped());
+    }
+
+    if (stats.overflows)
+    {
+        warning("The ITM overflowed %"PRIu64" times; try a higher -baud",
+                stats.overflows);
+    }
+
+    if (stats.reserved)
+    {
+        warning("%"PRIu64" bytes weren't ITM packets; check -baud and "
+                "-trace_clock_khz", stats.reserved);
+    }
+
+    debug(1, "%"PRIu64" hardware packets, %"PRIu64" timestamps, "
+             "%"PRIu64" syncs",
+          stats.hardware, stats.timestamps, stats.syncs);
+}
+
+
+/*******************************************************************************
+ * Outermost tracing logic.
+ */
+static Error trace_main(SWDDriver & swd, MPSSEConfig const & config)
+{
+    PortOutput out;
+    Check(out.open(CommandLine::output_prefix.get()));
+
+    // Listen before the target starts talking.
+    SWOCapture capture;
+    Check(capture.start(config,
+                        CommandLine::swo_interface.get(),
+                        CommandLine::baud.get()));
+
+    DebugAccessPort dap(swd);
+    Target target(swd, dap, 0);
+
+    uint32_t idcode;
+    Check(swd.initialize(&idcode));
+
+    // As with swdprof, the target is left running as it is.
+    Check(dap.reset_state());
+
+    if (CommandLine::overrun_detection.get())
+        Check(dap.enable_overrun_detection(true));
+
+    Check(target.initialize(false));
+
+    Error const enabled = target.enable_swo(
+        CommandLine::trace_clock_khz.get() * 1000,
+        CommandLine::baud.get(),
+        word_t(CommandLine::ports.get()));
+
+    CheckStringB(enabled != Err::argument_error,
+                 "A %d kHz trace clock can't be divided down to %d baud",
+                 CommandLine::trace_clock_khz.get(), CommandLine::baud.get());
+    CheckStringB(enabled != Err::failure,
+                 "Target %08X has no ITM", idcode);
+    Check(enabled);
+
+    Check(catch_stop_signals());
+
+    notice("Tracing target %08X at %d baud...",
+           idcode, CommandLine::baud.get());
+
+    ITMDecoder decoder(out);
+    drain(capture, decoder, out);
+
+    Check(target.disable_swo());
+    Check(capture.stop());
+
+    report(capture, decoder, out);
+
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * Entry point (sort of -- see main below)
+ */
+
+static Error error_main(int argc, char const * * argv)
+{
+    CheckStringB(CommandLine::clock.get() > 0,
+                 "-clock must be a positive rate in kHz; -auto_clock finds "
+                 "the fastest the target manages");
+    CheckStringB(CommandLine::wait_retries.get() > 0,
+                 "-wait_retries must be at least 1");
+    CheckStringB(CommandLine::wait_backoff_us.get() >= 0,
+                 "-wait_backoff_us can't be negative");
+
+    MPSSEConfig config;
+
+    Check(lookup_programmer(CommandLine::programmer.get(), &config));
+
+    if (CommandLine::interface.set())
+        config.interface = CommandLine::interface.get();
+
+    if (CommandLine::vid.set())
+        config.vid = CommandLine::vid.get();
+
+    if (CommandLine::pid.set())
+        config.pid = CommandLine::pid.get();
+
+    /*
+     * A session has the SWD channel, but not the SWO one; that's always
+     * opened here, which is why the programmer flags matter either way.
+     */
+    SessionDriver session;
+    bool          attached;
+
+    Check(session.attach(CommandLine::session.get(), &attached));
+
+    if (attached) return trace_main(session, config);
+
+    MPSSE mpsse;
+
+    Check(mpsse.open(config));
+
+    MPSSESWDDriver swd(config,
+                       &mpsse,
+                       CommandLine::auto_clock.get()
+                           ? MPSSESWDDriver::auto_clock
+                           : CommandLine::clock.get() * 1000);
+
+    Check(trace_main(swd, config));
+
+    return Err::success;
+}
+
+/******************************************************************************/
+int main(int argc, char const * * argv)
+{
+    Error check_error = Err::success;
+
+    CheckCleanup(CommandLine::parse(argc, argv, CommandLine::arguments),
+                 failure);
+
+    log().set_level(CommandLine::debug.get());
+
+    RetryPolicy::standard().set_attempts(CommandLine::wait_retries.get());
+    RetryPolicy::standard().set_max_backoff_us(
+        CommandLine::wait_backoff_us.get());
+
+    check_error = error_main(argc, argv);
+
+    // Reported even after a failure, which is often when they're wanted.
+    Metrics::report(CommandLine::stats.get(), CommandLine::stats_json.get());
+
+    CheckCleanup(check_error, failure);
+    return 0;
+
+failure:
+    Err::stack()->print();
+    return 1;
+}
+/******************************************************************************/
@@ -0,0 +1,202 @@
+#include "swo.h"
+
+#include "libs/error/error.h"
+#include "libs/log/log_default.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+using namespace Err;
+using namespace Log;
+
+/*
+ * 4 MiB: over three seconds of SWO at 12 Mbaud.
+ */
+static unsigned const ring_capacity_log2 = 22;
+
+/*
+ * Bytes asked of libftdi per read.  Large reads let it keep several USB
+ * transfers in flight; the latency timer keeps small amounts from waiting.
+ */
+static int const read_chunk_bytes = 64 * 1024;
+static unsigned char const latency_ms = 1;
+
+/******************************************************************************/
+ByteRing::ByteRing(unsigned capacity_log2) :
+    _buffer(size_t(1) << capacity_log2),
+    _mask((size_t(1) << capacity_log2) - 1),
+    _head(0),
+    _tail(0) {}
+
+size_t ByteRing::write(uint8_t const * data, size_t count)
+{
+    size_t const head = _head;
+    size_t const free = _buffer.size() - (head - _tail);
+
+    // The room must be seen freed before it's written over.
+    __sync_synchronize();
+
+    count = std::min(count, free);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        _buffer[(head + i) & _mask] = data[i];
+    }
+
+    // The bytes must land before the reader can see them counted.
+    __sync_synchronize();
+    _head = head + count;
+
+    return count;
+}
+
+size_t ByteRing::read(uint8_t * data, size_t count)
+{
+    size_t const tail = _tail;
+    size_t const head = _head;
+
+    // The bytes must be seen counted before they're read.
+    __sync_synchronize();
+
+    count = std::min(count, head - tail);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        data[i] = _buffer[(tail + i) & _mask];
+    }
+
+    // And must be read before the writer can see their room freed.
+    __sync_synchronize();
+    _tail = tail + count;
+
+    return count;
+}
+
+/******************************************************************************/
+SWOCapture::SWOCapture() :
+    _ring(ring_capacity_log2),
+    _running(false),
+    _stopping(false),
+    _read_result(0),
+    _received(0),
+    _dropped(0) {}
+
+SWOCapture::~SWOCapture()
+{
+    if (_running)
+    {
+        _stopping = true;
+        pthread_join(_thread, 0);
+    }
+}
+
+Error SWOCapture::start(MPSSEConfig const & config,
+                        int interface,
+                        unsigned baud)
+{
+    MPSSEConfig uart_config = config;
+    uart_config.interface = interface;
+
+    Check(_uart.open(uart_config));
+
+    ftdi_context * ftdi = _uart.ftdi();
+
+    CheckStringP(ftdi_set_bitmode(ftdi, 0, BITMODE_RESET),
+                 "Unable to put SWO channel in UART mode: %s",
+                 ftdi_get_error_string(ftdi));
+
+    CheckStringP(ftdi_set_baudrate(ftdi, baud),
+                 "Unable to set SWO channel to %u baud: %s",
+                 baud, ftdi_get_error_string(ftdi));
+
+    CheckStringP(ftdi_set_line_property(ftdi, BITS_8, STOP_BIT_1, NONE),
+                 "Unable to set SWO line properties: %s",
+                 ftdi_get_error_string(ftdi));
+
+    CheckStringP(ftdi_set_latency_timer(ftdi, latency_ms),
+                 "Unable to set SWO latency timer: %s",
+                 ftdi_get_error_string(ftdi));
+
+    CheckStringP(ftdi_read_data_set_chunksize(ftdi, read_chunk_bytes),
+                 "Unable to set SWO read chunk size: %s",
+                 ftdi_get_error_string(ftdi));
+
+    CheckStringP(ftdi_usb_purge_rx_buffer(ftdi),
+                 "Unable to purge SWO receive buffer: %s",
+                 ftdi_get_error_string(ftdi));
+
+    debug(2, "Capturing SWO on interface %d at %u baud", interface, baud);
+
+    int const result = pthread_create(&_thread, 0, run, this);
+    CheckStringB(result == 0,
+                 "Unable to start SWO reader: %s", strerror(result));
+
+    _running = true;
+    return success;
+}
+
+size_t SWOCapture::read(uint8_t * buffer, size_t size)
+{
+    return _ring.read(buffer, size);
+}
+
+Error SWOCapture::stop()
+{
+    if (!_running) return success;
+
+    _stopping = true;
+    pthread_join(_thread, 0);
+    _running = false;
+
+    CheckStringB(_read_result >= 0,
+                 "SWO capture failed: %s",
+                 ftdi_get_error_string(_uart.ftdi()));
+
+    return success;
+}
+
+bool SWOCapture::is_reading() const
+{
+    return _running && _read_result >= 0;
+}
+
+uint64_t SWOCapture::received() const
+{
+    return _received;
+}
+
+uint64_t SWOCapture::dropped() const
+{
+    return _dropped;
+}
+
+void * SWOCapture::run(void * argument)
+{
+    SWOCapture &            capture = *static_cast<SWOCapture *>(argument);
+    std::vector<uint8_t>    chunk(read_chunk_bytes);
+
+    /*
+     * With nothing arriving, each read returns empty after the latency timer
+     * runs out, which is how this notices being stopped.
+     */
+    while (!capture._stopping)
+    {
+        int const count = ftdi_read_data(capture._uart.ftdi(),
+                                         &chunk[0],
+                                         chunk.size());
+        if (count < 0)
+        {
+            capture._read_result = count;
+            break;
+        }
+
+        size_t const kept = capture._ring.write(&chunk[0], count);
+
+        capture._received += count;
+        capture._dropped  += count - kept;
+    }
+
+    return 0;
+}
+/******************************************************************************/
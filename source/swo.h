@@ -0,0 +1,121 @@
+#ifndef SWO_H
+#define SWO_H
+
+/*
+ * Capturing the target's Serial Wire Output on a second FTDI channel.
+ *
+ * On a two-channel programmer (an FT2232H, like the Bus Blaster's), one
+ * channel does SWD and the other is free.  Wired to the target's SWO pin and
+ * run as a UART, it receives whatever the TPIU sends -- the ITM's packets, see
+ * itm.h -- at up to 12 Mbaud, while the processor runs undisturbed.
+ *
+ * The FTDI chip only buffers a few milliseconds of that, so SWOCapture keeps
+ * a thread doing nothing but reading it, into a ByteRing the rest of the
+ * program drains at its own pace.  Only the UART, not Manchester, can be
+ * received this way.
+ */
+
+#include "source/mpsse.h"
+#include "source/mpsse_config.h"
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+
+/*
+ * A fixed-size queue of bytes between one thread that writes and one that
+ * reads, without a lock.  Each index is written by only one side, and the
+ * bytes it covers are in place before it moves.  When the ring is full, write
+ * takes what fits.
+ */
+class ByteRing
+{
+public:
+    /*
+     * Holds 1 << capacity_log2 bytes.
+     */
+    explicit ByteRing(unsigned capacity_log2);
+
+    /*
+     * Called only by the writing thread.  Returns how many bytes fit.
+     */
+    size_t write(uint8_t const * data, size_t count);
+
+    /*
+     * Called only by the reading thread.  Moves up to count bytes into data,
+     * returning how many there were.
+     */
+    size_t read(uint8_t * data, size_t count);
+
+private:
+    std::vector<uint8_t> _buffer;
+    size_t               _mask;
+
+    // Free-running counts of bytes written and read; the difference is the
+    // number waiting.
+    size_t volatile _head;
+    size_t volatile _tail;
+};
+
+
+class SWOCapture
+{
+public:
+    SWOCapture();
+    ~SWOCapture();
+
+    /*
+     * Opens channel interface of the programmer described by config as a UART
+     * at baud, and starts reading it.  The chip must be able to make baud to
+     * within a few percent.
+     */
+    Err::Error start(MPSSEConfig const & config, int interface, unsigned baud);
+
+    /*
+     * Moves up to size captured bytes into buffer, returning how many there
+     * were.  Doesn't wait for more.
+     */
+    size_t read(uint8_t * buffer, size_t size);
+
+    /*
+     * Whether reading is still going: false once it has failed, though bytes
+     * read before may still be waiting.
+     */
+    bool is_reading() const;
+
+    /*
+     * Stops reading, and reports whether reading had stopped on an error.
+     */
+    Err::Error stop();
+
+    /*
+     * Bytes received, and bytes lost because the ring was full.  Up to date
+     * once stop has returned.
+     */
+    uint64_t received() const;
+    uint64_t dropped() const;
+
+private:
+    MPSSE           _uart;
+    ByteRing        _ring;
+    pthread_t       _thread;
+    bool            _running;
+    bool volatile   _stopping;
+    int volatile    _read_result;  // What ended reading, if it failed.
+    uint64_t        _received;
+    uint64_t        _dropped;
+
+    /*
+     * The reading thread.  It mustn't touch the error stack or the log, which
+     * belong to the main thread; it leaves a failure in _read_result for stop
+     * to report.
+     */
+    static void * run(void * capture);
+};
+
+#endif  // SWO_H
@@ -0,0 +1,134 @@
+#include "symbols.h"
+#include "elf_format.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+using Err::Error;
+using namespace Log;
+
+/******************************************************************************/
+Error SymbolTable::open(char const * path)
+{
+    _symbols.clear();
+
+    FILE * file = fopen(path, "rb");
+    CheckStringB(file, "Can't open %s: %s", path, strerror(errno));
+
+    std::vector<uint8_t> elf;
+    uint8_t              chunk[4096];
+    size_t               got;
+
+    while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        elf.insert(elf.end(), chunk, chunk + got);
+    }
+
+    fclose(file);
+
+    CheckStringB(elf.size() >= ELF::header_bytes
+              && std::equal(ELF::magic, ELF::magic + sizeof(ELF::magic),
+                            elf.begin()),
+                 "%s is not an ELF file", path);
+
+    CheckStringB(elf[ELF::ident_class] == ELF::class_32
+              && elf[ELF::ident_data]  == ELF::data_lsb,
+                 "%s is not a 32-bit little-endian ELF file", path);
+
+    uint8_t const * const base = &elf[0];
+
+    uint32_t const shoff     = read_le32(base + ELF::e_shoff);
+    uint32_t const shentsize = read_le16(base + ELF::e_shentsize);
+    uint32_t const shnum     = read_le16(base + ELF::e_shnum);
+
+    CheckStringB(shnum == 0
+              || (shentsize >= ELF::shdr_bytes
+               && shoff <= elf.size()
+               && shnum <= (elf.size() - shoff) / shentsize),
+                 "Bad ELF section header table in %s", path);
+
+    for (uint32_t i = 0; i < shnum; ++i)
+    {
+        uint8_t const * shdr = base + shoff + i * shentsize;
+
+        if (read_le32(shdr + ELF::sh_type) != ELF::type_symtab) continue;
+
+        uint32_t const offset  = read_le32(shdr + ELF::sh_offset);
+        uint32_t const bytes   = read_le32(shdr + ELF::sh_size);
+        uint32_t const entsize = read_le32(shdr + ELF::sh_entsize);
+        uint32_t const link    = read_le32(shdr + ELF::sh_link);
+
+        CheckStringB(entsize >= ELF::sym_bytes
+                  && offset <= elf.size() && bytes <= elf.size() - offset
+                  && link < shnum,
+                     "Bad ELF symbol table in %s", path);
+
+        // The names are in the string table the symbol table links to.
+        uint8_t const * strtab_shdr = base + shoff + link * shentsize;
+        uint32_t const strings      = read_le32(strtab_shdr + ELF::sh_offset);
+        uint32_t const strings_size = read_le32(strtab_shdr + ELF::sh_size);
+
+        CheckStringB(strings <= elf.size()
+                  && strings_size <= elf.size() - strings,
+                     "Bad ELF string table in %s", path);
+
+        for (uint32_t at = 0; at + entsize <= bytes; at += entsize)
+        {
+            uint8_t const * sym = base + offset + at;
+
+            if ((sym[ELF::st_info] & ELF::stt_mask) != ELF::stt_func) continue;
+
+            uint32_t const name = read_le32(sym + ELF::st_name);
+            if (name >= strings_size) continue;
+
+            char const * const first =
+                reinterpret_cast<char const *>(base + strings + name);
+
+            Symbol symbol;
+            // Thumb function symbols have bit 0 set; the code doesn't.
+            symbol.address = read_le32(sym + ELF::st_value) & ~1u;
+            symbol.size    = read_le32(sym + ELF::st_size);
+            symbol.name.assign(first,
+                               strnlen(first, strings_size - name));
+
+            _symbols.push_back(symbol);
+        }
+    }
+
+    std::sort(_symbols.begin(), _symbols.end());
+
+    debug(1, "Loaded %zu function symbols from %s", _symbols.size(), path);
+
+    return Err::success;
+}
+/******************************************************************************/
+size_t SymbolTable::size() const
+{
+    return _symbols.size();
+}
+/******************************************************************************/
+char const * SymbolTable::lookup(uint32_t address, uint32_t * offset) const
+{
+    Symbol key;
+    key.address = address;
+
+    // The last symbol starting at or before address.
+    std::vector<Symbol>::const_iterator it =
+        std::upper_bound(_symbols.begin(), _symbols.end(), key);
+
+    if (it == _symbols.begin()) return 0;
+    --it;
+
+    uint32_t const into = address - it->address;
+
+    if (it->size && into >= it->size) return 0;
+
+    if (offset) *offset = into;
+    return it->name.c_str();
+}
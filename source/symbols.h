@@ -0,0 +1,52 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+/*
+ * The function symbols of an ELF executable, for turning addresses back into
+ * names.
+ */
+
+#include "libs/error/error_stack.h"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+class SymbolTable
+{
+public:
+    /*
+     * Loads the function symbols from the ELF file at path.  A file with no
+     * symbol table loads, but names nothing.
+     */
+    Err::Error open(char const * path);
+
+    size_t size() const;
+
+    /*
+     * Finds the function containing address, returning its name and setting
+     * offset to how far into it address is; or returns 0 if none does.
+     * Functions without a size are taken to run up to the next one.
+     */
+    char const * lookup(uint32_t address, uint32_t * offset = 0) const;
+
+private:
+    struct Symbol
+    {
+        uint32_t    address;
+        uint32_t    size;
+        std::string name;
+
+        bool operator<(Symbol const & other) const
+        {
+            return address < other.address;
+        }
+    };
+
+    std::vector<Symbol> _symbols;  // By address.
+};
+
+#endif  // SYMBOLS_H
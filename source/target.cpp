@@ -3,10 +3,15 @@
 #include "swd_dp.h"
 #include "swd.h"
 #include "armv6m_v7m.h"
+#include "poll.h"
+#include "metrics.h"
+#include "retry.h"
 
 #include "libs/error/error_stack.h"
 #include "libs/log/log_default.h"
 
+#include <algorithm>
+
 using Err::Error;
 using namespace Log;
 using namespace ARM;
@@ -30,6 +35,51 @@ using namespace ARMv6M_v7M;
  */
 static bool const use_careful_memory_writes = false;
 
+/*
+ * read_words and write_words move memory in batches of up to this many words.
+ * A batch is the unit of retry when the target responds with WAIT, so this
+ * trades round trips to the interface against the work repeated on a retry.
+ */
+static size_t const words_per_batch = 256;
+
+/*
+ * Reads shorter than this go through the banked data registers, which is
+ * cheaper for a word or two when TAR already points at the right bank.  Longer
+ * reads stream through DRW with TAR auto-increment, at one SWD read per word.
+ */
+static size_t const min_streaming_words = 4;
+
+/*
+ * How long reset_and_halt waits for the processor to reach its reset vector.
+ */
+static unsigned const reset_timeout_ms = 1000;
+
+
+/*******************************************************************************
+ * Latency of each Target call, for -stats.
+ */
+static Metrics::Histogram initialize_time("Target::initialize");
+static Metrics::Histogram read_words_time("Target::read_words");
+static Metrics::Histogram read_word_time("Target::read_word");
+static Metrics::Histogram read_bytes_time("Target::read_bytes");
+static Metrics::Histogram sample_word_time("Target::sample_word");
+static Metrics::Histogram write_words_time("Target::write_words");
+static Metrics::Histogram write_word_time("Target::write_word");
+static Metrics::Histogram write_halfwords_time("Target::write_halfwords");
+static Metrics::Histogram write_bytes_time("Target::write_bytes");
+static Metrics::Histogram read_register_time("Target::read_register");
+static Metrics::Histogram write_register_time("Target::write_register");
+static Metrics::Histogram read_registers_time("Target::read_registers");
+static Metrics::Histogram write_registers_time("Target::write_registers");
+static Metrics::Histogram reset_and_halt_time("Target::reset_and_halt");
+static Metrics::Histogram halt_time("Target::halt");
+static Metrics::Histogram poll_for_halt_time("Target::poll_for_halt");
+static Metrics::Histogram resume_time("Target::resume");
+static Metrics::Histogram step_time("Target::step");
+static Metrics::Histogram is_halted_time("Target::is_halted");
+static Metrics::Histogram read_halt_state_time("Target::read_halt_state");
+static Metrics::Histogram reset_halt_state_time("Target::reset_halt_state");
+
 
 /*******************************************************************************
  * AP registers in the MEM-AP.
@@ -46,6 +96,7 @@ namespace MEM_AP
     static uint32_t const CSW_ADDRINC_SINGLE = 1 << 4;
     static uint32_t const CSW_ADDRINC_PACKED = 2 << 4;
 
+    static uint32_t const CSW_SIZE_mask = 7 << 0;
     static uint32_t const CSW_SIZE_1 = 0 << 0;
     static uint32_t const CSW_SIZE_2 = 1 << 0;
     static uint32_t const CSW_SIZE_4 = 2 << 0;
@@ -56,6 +107,13 @@ namespace MEM_AP
     static uint32_t const BD1 = 0x14;
     static uint32_t const BD2 = 0x18;
     static uint32_t const BD3 = 0x1C;
+
+    /*
+     * ADIv5 only guarantees that TAR auto-increment works within the bottom
+     * ten bits of the address; beyond that, behavior is implementation
+     * defined.  Streaming transfers write TAR again at each such boundary.
+     */
+    static uint32_t const autoincrement_boundary = 1024;
 }
 
 /*******************************************************************************
@@ -89,13 +147,312 @@ Error Target::set_memory_bank(rptr_const<word_t> address)
 
     if (_bank_base != base)
     {
-        CheckRetry(write_ap(MEM_AP::TAR, base.bits()), 100);
+        CheckWait(write_ap(MEM_AP::TAR, base.bits()));
         _bank_base = base;
     }
 
     return Err::success;
 }
 
+void Target::forget_core_state()
+{
+    _registers_valid = 0;
+    _known_halted = false;
+}
+
+Error Target::forget_on_failure(Error error)
+{
+    if (error != Err::success) forget_core_state();
+
+    return error;
+}
+
+Error Target::queue_write_ap(uint8_t address, word_t data)
+{
+    return _dap.queue_write_ap(_mem_ap_index, address, data);
+}
+
+Error Target::queue_start_read_ap(uint8_t address)
+{
+    return _dap.queue_start_read_ap(_mem_ap_index, address);
+}
+
+Error Target::queue_step_read_ap(uint8_t next_address, word_t * last_data)
+{
+    return _dap.queue_step_read_ap(_mem_ap_index, next_address, last_data);
+}
+
+Error Target::queue_final_read_ap(word_t * data)
+{
+    return _dap.queue_read_rdbuff(data);
+}
+
+Error Target::queue_set_memory_bank(rptr_const<word_t> address)
+{
+    rptr<word_t> base(address.bits() & ~0xF);
+
+    if (_bank_base != base)
+    {
+        Error result = queue_write_ap(MEM_AP::TAR, base.bits());
+
+        // If the write was lost in an early flush, TAR is unknown.
+        _bank_base = (result == Err::success) ? base : rptr<word_t>(-1);
+        Check(result);
+    }
+
+    return Err::success;
+}
+
+Error Target::flush()
+{
+    Error result = _dap.flush();
+
+    // A failed batch may or may not have updated TAR.
+    if (result != Err::success) _bank_base = rptr<word_t>(-1);
+
+    return result;
+}
+
+Error Target::read_block(rptr_const<word_t> target_addr,
+                         word_t * host_buffer,
+                         size_t count)
+{
+    if (target_addr.bits() & 3) return Err::argument_error;
+
+    if (count >= min_streaming_words)
+        return stream_read_block(target_addr, host_buffer, count);
+
+    /*
+     * AP reads are posted: each read returns the result of the one before.
+     * We chain reads through the banked data registers, and collect the last
+     * result from RDBUFF before each change of bank.
+     */
+    word_t * pending = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        rptr_const<word_t> address = target_addr + i;
+        rptr_const<word_t> base(address.bits() & ~0xF);
+
+        if (pending && base != _bank_base)
+        {
+            Check(queue_final_read_ap(pending));
+            pending = 0;
+        }
+
+        Check(queue_set_memory_bank(address));
+
+        unsigned offset = address.bits() - _bank_base.bits();
+
+        if (pending)
+            Check(queue_step_read_ap(MEM_AP::BD0 + offset, pending));
+        else
+            Check(queue_start_read_ap(MEM_AP::BD0 + offset));
+
+        pending = &host_buffer[i];
+    }
+
+    if (pending) Check(queue_final_read_ap(pending));
+
+    return flush();
+}
+
+Error Target::stream_read_block(rptr_const<word_t> target_addr,
+                                word_t * host_buffer,
+                                size_t count)
+{
+    /*
+     * CSW is configured for single auto-increment, so each read of DRW moves
+     * TAR along by a word.  Within each auto-increment region, we write TAR
+     * once and then chain posted DRW reads, collecting the last result from
+     * RDBUFF rather than reading past the end of the region.
+     */
+    size_t i = 0;
+    while (i < count)
+    {
+        rptr_const<word_t> address = target_addr + i;
+        uint32_t boundary = (address.bits() | (MEM_AP::autoincrement_boundary
+                                               - 1)) + 1;
+        size_t n = std::min(count - i,
+                            size_t(boundary - address.bits()) / sizeof(word_t));
+
+        // TAR is about to stop pointing at a bank; don't let anyone rely on it.
+        _bank_base = rptr<word_t>(-1);
+        Check(queue_write_ap(MEM_AP::TAR, address.bits()));
+
+        Check(queue_start_read_ap(MEM_AP::DRW));
+        for (size_t j = 1; j < n; ++j)
+        {
+            Check(queue_step_read_ap(MEM_AP::DRW, &host_buffer[i + j - 1]));
+        }
+        Check(queue_final_read_ap(&host_buffer[i + n - 1]));
+
+        i += n;
+    }
+
+    return flush();
+}
+
+Error Target::sample_block(rptr_const<word_t> target_addr,
+                           word_t * samples,
+                           size_t count)
+{
+    /*
+     * The banked data registers don't move TAR, so every read of the same one
+     * reads the same word afresh.
+     */
+    Check(queue_set_memory_bank(target_addr));
+
+    uint8_t const reg = MEM_AP::BD0 + (target_addr.bits() - _bank_base.bits());
+
+    Check(queue_start_read_ap(reg));
+    for (size_t i = 1; i < count; ++i)
+    {
+        Check(queue_step_read_ap(reg, &samples[i - 1]));
+    }
+    Check(queue_final_read_ap(&samples[count - 1]));
+
+    return flush();
+}
+
+Error Target::write_block(word_t const * host_buffer,
+                          rptr<word_t> target_addr,
+                          size_t count)
+{
+    if (target_addr.bits() & 3) return Err::argument_error;
+
+    if (count >= min_streaming_words)
+        return stream_write_block(host_buffer, target_addr, count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        rptr<word_t> address = target_addr + i;
+
+        Check(queue_set_memory_bank(address));
+
+        unsigned offset = address.bits() - _bank_base.bits();
+        Check(queue_write_ap(MEM_AP::BD0 + offset, host_buffer[i]));
+    }
+
+    return flush();
+}
+
+Error Target::stream_write_block(word_t const * host_buffer,
+                                 rptr<word_t> target_addr,
+                                 size_t count)
+{
+    // As stream_read_block: TAR once per auto-increment region, then DRW.
+    size_t i = 0;
+    while (i < count)
+    {
+        rptr<word_t> address = target_addr + i;
+        uint32_t boundary = (address.bits() | (MEM_AP::autoincrement_boundary
+                                               - 1)) + 1;
+        size_t n = std::min(count - i,
+                            size_t(boundary - address.bits()) / sizeof(word_t));
+
+        _bank_base = rptr<word_t>(-1);
+        Check(queue_write_ap(MEM_AP::TAR, address.bits()));
+
+        for (size_t j = 0; j < n; ++j)
+        {
+            Check(queue_write_ap(MEM_AP::DRW, host_buffer[i + j]));
+        }
+
+        i += n;
+    }
+
+    return flush();
+}
+
+Error Target::narrow_write_block(void const * host_buffer,
+                                 uint32_t target_addr,
+                                 size_t size,
+                                 size_t count)
+{
+    if (target_addr & (size - 1)) return Err::argument_error;
+
+    byte_t const * bytes = (byte_t const *) host_buffer;
+    halfword_t const * halfwords = (halfword_t const *) host_buffer;
+
+    word_t const base = (_csw & ~(MEM_AP::CSW_SIZE_mask
+                                  | MEM_AP::CSW_ADDRINC_mask))
+                      | (size == 1 ? MEM_AP::CSW_SIZE_1 : MEM_AP::CSW_SIZE_2);
+    word_t const single = base | MEM_AP::CSW_ADDRINC_SINGLE;
+    word_t const packed = base | MEM_AP::CSW_ADDRINC_PACKED;
+    size_t const units_per_word = sizeof(word_t) / size;
+
+    word_t csw = _csw;
+    uint32_t address = target_addr;
+    size_t i = 0;
+
+    _bank_base = rptr<word_t>(-1);
+
+    while (i < count)
+    {
+        /*
+         * A packed transfer always makes a full word's worth of accesses, so
+         * we use them only for whole words.  The unaligned head and the short
+         * tail, if any, are written with one access per transfer.
+         */
+        size_t remaining = count - i;
+        bool use_packed = _packed_transfers
+                       && (address & 3) == 0
+                       && remaining >= units_per_word;
+
+        uint32_t boundary = (address | (MEM_AP::autoincrement_boundary - 1))
+                          + 1;
+        size_t n = std::min(remaining, size_t(boundary - address) / size);
+
+        if (use_packed)
+            n -= n % units_per_word;
+        else if (_packed_transfers && remaining >= units_per_word)
+            n = std::min(n, size_t((4 - (address & 3)) & 3) / size);
+
+        if (csw != (use_packed ? packed : single))
+        {
+            csw = use_packed ? packed : single;
+            Check(queue_write_ap(MEM_AP::CSW, csw));
+        }
+
+        Check(queue_write_ap(MEM_AP::TAR, address));
+
+        size_t per_transfer = use_packed ? units_per_word : 1;
+        for (size_t j = 0; j < n; j += per_transfer)
+        {
+            // Data goes in the byte lanes selected by each access's address.
+            word_t data = 0;
+            for (size_t k = 0; k < per_transfer; ++k)
+            {
+                uint32_t lane = (address + (j + k) * size) & 3;
+                word_t unit = (size == 1) ? bytes[i + j + k]
+                                          : halfwords[i + j + k];
+                data |= unit << (lane * 8);
+            }
+
+            Check(queue_write_ap(MEM_AP::DRW, data));
+        }
+
+        address += n * size;
+        i += n;
+    }
+
+    if (csw != _csw) Check(queue_write_ap(MEM_AP::CSW, _csw));
+
+    Error result = flush();
+
+    /*
+     * The other memory access paths rely on CSW being in its usual state, so
+     * if the batch failed, put it back directly before reporting the error.
+     */
+    if (result != Err::success)
+    {
+        CheckWait(write_ap(MEM_AP::CSW, _csw));
+    }
+
+    return result;
+}
+
 /*******************************************************************************
  * Target public methods: construction/initialization
  */
@@ -104,21 +461,41 @@ Target::Target(SWDDriver & swd, DebugAccessPort & dap, uint8_t mem_ap_index) :
     _swd(swd),
     _dap(dap),
     _mem_ap_index(mem_ap_index),
-    _bank_base(-1) {}
+    _csw(0),
+    _packed_transfers(false),
+    _bank_base(-1),
+    _caching(false),
+    _registers_valid(0),
+    _known_halted(false) {}
+
+void Target::enable_cache(bool enabled)
+{
+    _caching = enabled;
+    invalidate_cache();
+}
+
+void Target::invalidate_cache()
+{
+    forget_core_state();
+    _csw = 0;
+    _bank_base = rptr<word_t>(-1);
+}
 
 Error Target::initialize(bool enable_debugging)
 {
-    debug(3, "Target::initialize(%d)", enable_debugging);
+    Metrics::Timer timer(initialize_time);
 
-    // We only use one AP.  Go ahead and select it and configure CSW.
-    Check(start_read_ap(MEM_AP::CSW));  // Load previous value.
-    word_t csw;
-    Check(final_read_ap(&csw));
-    csw = (csw & MEM_AP::CSW_RESERVED_mask) | MEM_AP::CSW_SIZE_4;
-    csw &= ~MEM_AP::CSW_ADDRINC_mask;
-    Check(write_ap(MEM_AP::CSW, csw));  // Write it back.
+    debug(3, "Target::initialize(%d)", enable_debugging);
 
-    Check(set_memory_bank(rptr_const<word_t>(0)));
+    if (_caching && _csw != 0)
+    {
+        // We already know how the MEM-AP is set up; just make sure.
+        Check(_dap.update_ap(_mem_ap_index, MEM_AP::CSW, _csw));
+    }
+    else
+    {
+        Check(configure_mem_ap());
+    }
 
     if (enable_debugging)
     {
@@ -135,6 +512,45 @@ Error Target::initialize(bool enable_debugging)
     return Err::success;
 }
 
+Error Target::configure_mem_ap()
+{
+    /*
+     * We only use one AP.  Go ahead and select it and configure CSW for 32-bit
+     * transfers with single auto-increment.  Auto-increment only applies to
+     * DRW, so the banked data registers behave the same either way.
+     */
+    Check(start_read_ap(MEM_AP::CSW));  // Load previous value.
+    word_t csw;
+    Check(final_read_ap(&csw));
+    csw = (csw & MEM_AP::CSW_RESERVED_mask) | MEM_AP::CSW_SIZE_4
+                                            | MEM_AP::CSW_ADDRINC_SINGLE;
+
+    /*
+     * Support for packed transfers is implementation defined.  Find out by
+     * asking for them, and seeing whether the request sticks.
+     */
+    word_t const packed = (csw & ~(MEM_AP::CSW_SIZE_mask
+                                   | MEM_AP::CSW_ADDRINC_mask))
+                        | MEM_AP::CSW_SIZE_2
+                        | MEM_AP::CSW_ADDRINC_PACKED;
+    word_t const packed_fields = MEM_AP::CSW_SIZE_mask
+                               | MEM_AP::CSW_ADDRINC_mask;
+    word_t readback;
+    Check(write_ap(MEM_AP::CSW, packed));
+    Check(start_read_ap(MEM_AP::CSW));
+    Check(final_read_ap(&readback));
+    _packed_transfers = (readback & packed_fields) == (packed & packed_fields);
+    debug(3, "MEM-AP %s packed transfers",
+          _packed_transfers ? "supports" : "does not support");
+
+    Check(write_ap(MEM_AP::CSW, csw));  // Write it back.
+    _csw = csw;
+
+    Check(set_memory_bank(rptr_const<word_t>(0)));
+
+    return Err::success;
+}
+
 
 /*******************************************************************************
  * Target public methods: memory access
@@ -144,14 +560,18 @@ Error Target::read_words(rptr_const<word_t> target_addr,
                          word_t * host_buffer,
                          size_t count)
 {
+    Metrics::Timer timer(read_words_time);
+
     debug(3, "Target::read_words(%08X, %p, %zu)",
           target_addr.bits(),
           host_buffer,
           count);
 
-    for (size_t i = 0; i < count; ++i)
+    for (size_t i = 0; i < count; i += words_per_batch)
     {
-        Check(read_word(target_addr + i, &host_buffer[i]));
+        size_t n = std::min(count - i, words_per_batch);
+
+        CheckWait(read_block(target_addr + i, &host_buffer[i], n));
     }
 
     return Err::success;
@@ -159,14 +579,80 @@ Error Target::read_words(rptr_const<word_t> target_addr,
 
 Error Target::read_word(rptr_const<word_t> address, word_t * data)
 {
+    Metrics::Timer timer(read_word_time);
+
     debug(3, "Target::read_word(%08X, %p)", address.bits(), data);
     Check(set_memory_bank(address));
 
     unsigned offset = address.bits() - _bank_base.bits();
     debug(4, "Will read from BD offset %u", offset);
 
-    CheckRetry(start_read_ap(MEM_AP::BD0 + offset), 100);
-    CheckRetry(final_read_ap(data), 100);
+    CheckWait(start_read_ap(MEM_AP::BD0 + offset));
+    CheckWait(final_read_ap(data));
+
+    return Err::success;
+}
+
+Error Target::read_bytes(rptr_const<byte_t> target_addr,
+                         byte_t * host_buffer,
+                         size_t count)
+{
+    Metrics::Timer timer(read_bytes_time);
+
+    debug(3, "Target::read_bytes(%08X, %p, %zu)",
+          target_addr.bits(),
+          host_buffer,
+          count);
+
+    word_t words[words_per_batch];
+    size_t const per_batch = words_per_batch * sizeof(word_t);
+
+    uint32_t address = target_addr.bits();
+
+    while (count)
+    {
+        uint32_t const first = address & ~uint32_t(sizeof(word_t) - 1);
+        size_t   const skip  = address - first;
+        size_t   const n     = std::min(count, per_batch - skip);
+        size_t   const words_needed = (skip + n + sizeof(word_t) - 1)
+                                    / sizeof(word_t);
+
+        CheckWait(read_block(rptr_const<word_t>(first), words, words_needed));
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            size_t const at = skip + i;
+            host_buffer[i] = words[at / sizeof(word_t)]
+                           >> (8 * (at % sizeof(word_t)));
+        }
+
+        host_buffer += n;
+        address     += n;
+        count       -= n;
+    }
+
+    return Err::success;
+}
+
+Error Target::sample_word(rptr_const<word_t> target_addr,
+                          word_t * samples,
+                          size_t count)
+{
+    Metrics::Timer timer(sample_word_time);
+
+    debug(3, "Target::sample_word(%08X, %p, %zu)",
+          target_addr.bits(),
+          samples,
+          count);
+
+    if (target_addr.bits() & 3) return Err::argument_error;
+
+    for (size_t i = 0; i < count; i += words_per_batch)
+    {
+        size_t n = std::min(count - i, words_per_batch);
+
+        CheckWait(sample_block(target_addr, &samples[i], n));
+    }
 
     return Err::success;
 }
@@ -175,14 +661,29 @@ Error Target::write_words(word_t const * host_buffer,
                           rptr<word_t> target_addr,
                           size_t count)
 {
+    Metrics::Timer timer(write_words_time);
+
     debug(3, "Target::write_words(%p, %08X, %zu)",
           host_buffer,
           target_addr.bits(),
           count);
 
-    for (size_t i = 0; i < count; ++i)
+    if (use_careful_memory_writes)
     {
-        Check(write_word(target_addr + i, host_buffer[i]));
+        // Each write has to be followed by a TrInProg poll; no batching.
+        for (size_t i = 0; i < count; ++i)
+        {
+            Check(write_word(target_addr + i, host_buffer[i]));
+        }
+
+        return Err::success;
+    }
+
+    for (size_t i = 0; i < count; i += words_per_batch)
+    {
+        size_t n = std::min(count - i, words_per_batch);
+
+        CheckWait(write_block(&host_buffer[i], target_addr + i, n));
     }
 
     return Err::success;
@@ -190,24 +691,26 @@ Error Target::write_words(word_t const * host_buffer,
 
 Error Target::write_word(rptr<word_t> address, word_t data)
 {
+    Metrics::Timer timer(write_word_time);
+
     debug(3, "Target::write_word(%08X, %08X)", address.bits(), data);
     Check(set_memory_bank(address));
 
     unsigned offset = address.bits() - _bank_base.bits();
     debug(4, "Will write to BD offset %u", offset);
 
-    CheckRetry(write_ap(MEM_AP::BD0 + offset, data), 100);
+    CheckWait(write_ap(MEM_AP::BD0 + offset, data));
 
     if (use_careful_memory_writes)
     {
       // Kick off a pipelined read.
-      CheckRetry(start_read_ap(MEM_AP::CSW), 100);
+      CheckWait(start_read_ap(MEM_AP::CSW));
 
       // Block waiting for write to complete.
       word_t csw = MEM_AP::CSW_TRINPROG;
       while (csw & MEM_AP::CSW_TRINPROG)
       {
-          CheckRetry(step_read_ap(MEM_AP::CSW, &csw), 100);
+          CheckWait(step_read_ap(MEM_AP::CSW, &csw));
       }
     }
 
@@ -215,40 +718,287 @@ Error Target::write_word(rptr<word_t> address, word_t data)
 }
 
 
+Error Target::write_halfwords(halfword_t const * host_buffer,
+                              rptr<halfword_t> target_addr,
+                              size_t count)
+{
+    Metrics::Timer timer(write_halfwords_time);
+
+    debug(3, "Target::write_halfwords(%p, %08X, %zu)",
+          host_buffer,
+          target_addr.bits(),
+          count);
+
+    size_t const per_batch = words_per_batch * 2;
+
+    for (size_t i = 0; i < count; i += per_batch)
+    {
+        size_t n = std::min(count - i, per_batch);
+
+        CheckWait(narrow_write_block(&host_buffer[i],
+                                     (target_addr + i).bits(),
+                                     sizeof(halfword_t),
+                                     n));
+    }
+
+    return Err::success;
+}
+
+Error Target::write_bytes(byte_t const * host_buffer,
+                          rptr<byte_t> target_addr,
+                          size_t count)
+{
+    Metrics::Timer timer(write_bytes_time);
+
+    debug(3, "Target::write_bytes(%p, %08X, %zu)",
+          host_buffer,
+          target_addr.bits(),
+          count);
+
+    size_t const per_batch = words_per_batch * 4;
+
+    for (size_t i = 0; i < count; i += per_batch)
+    {
+        size_t n = std::min(count - i, per_batch);
+
+        CheckWait(narrow_write_block(&host_buffer[i],
+                                     (target_addr + i).bits(),
+                                     sizeof(byte_t),
+                                     n));
+    }
+
+    return Err::success;
+}
+
+
 /*******************************************************************************
  * Target public methods: register access
  */
 
 Error Target::read_register(Register::Number reg, word_t * out)
 {
+    Metrics::Timer timer(read_register_time);
+
     debug(3, "Target::read_register(%u, %p)", reg, out);
 
-    Check(write_word(DCB::DCRSR, DCB::DCRSR_READ | (reg & 0x1F)));
+    uint32_t const bit = 1 << reg;
+
+    if (_caching && (_registers_valid & bit))
+    {
+        *out = _registers[reg];
+        return Err::success;
+    }
+
+    Check(forget_on_failure(
+        write_word(DCB::DCRSR, DCB::DCRSR_READ | (reg & 0x1F))));
 
     word_t dhcsr;
     do
     {
-        Check(read_word(DCB::DHCSR, &dhcsr));
+        Check(forget_on_failure(read_word(DCB::DHCSR, &dhcsr)));
     }
     while ((dhcsr & DCB::DHCSR_S_REGRDY) == 0);
 
-    return read_word(DCB::DCRDR, out);
+    Check(forget_on_failure(read_word(DCB::DCRDR, out)));
+
+    if (_caching && (dhcsr & DCB::DHCSR_S_HALT))
+    {
+        _registers[reg] = *out;
+        _registers_valid |= bit;
+    }
+
+    return Err::success;
 }
 
 Error Target::write_register(Register::Number reg, word_t data)
 {
+    Metrics::Timer timer(write_register_time);
+
     debug(3, "Target::write_register(%u, %08X)", reg, data);
 
-    Check(write_word(DCB::DCRDR, data));
-    Check(write_word(DCB::DCRSR, DCB::DCRSR_WRITE | (reg & 0x1F)));
+    uint32_t const bit = 1 << reg;
+
+    // If this fails part-way, we don't know what the register holds.
+    _registers_valid &= ~bit;
+
+    Check(forget_on_failure(write_word(DCB::DCRDR, data)));
+    Check(forget_on_failure(
+        write_word(DCB::DCRSR, DCB::DCRSR_WRITE | (reg & 0x1F))));
 
     word_t dhcsr;
     do
     {
-        Check(read_word(DCB::DHCSR, &dhcsr));
+        Check(forget_on_failure(read_word(DCB::DHCSR, &dhcsr)));
     }
     while ((dhcsr & DCB::DHCSR_S_REGRDY) == 0);
 
+    if (_caching && (dhcsr & DCB::DHCSR_S_HALT))
+    {
+        _registers[reg] = data;
+        _registers_valid |= bit;
+    }
+
+    return Err::success;
+}
+
+
+/*
+ * DHCSR, DCRSR, and DCRDR share a MEM-AP bank, so a batch of register
+ * transfers needs only one write to TAR.
+ */
+static uint8_t bank_register(rptr<word_t> address)
+{
+    return MEM_AP::BD0 + (address.bits() & 0xF);
+}
+
+// Register numbers that exist, as a mask.
+static uint32_t valid_register_mask()
+{
+    uint32_t mask = 0;
+
+    for (unsigned n = 0; n < Target::register_count; ++n)
+    {
+        if (Register::is_index_valid(n)) mask |= 1 << n;
+    }
+
+    return mask;
+}
+
+Error Target::read_register_block(uint32_t mask, word_t * out, word_t * dhcsr)
+{
+    Check(queue_set_memory_bank(DCB::DHCSR));
+
+    for (unsigned n = 0; n < register_count; ++n)
+    {
+        if ((mask & (1 << n)) == 0) continue;
+
+        Check(queue_write_ap(bank_register(DCB::DCRSR), DCB::DCRSR_READ | n));
+        Check(queue_start_read_ap(bank_register(DCB::DHCSR)));
+        Check(queue_step_read_ap(bank_register(DCB::DCRDR), &dhcsr[n]));
+        Check(queue_final_read_ap(&out[n]));
+    }
+
+    return flush();
+}
+
+Error Target::write_register_block(uint32_t mask,
+                                   word_t const * in,
+                                   word_t * dhcsr)
+{
+    Check(queue_set_memory_bank(DCB::DHCSR));
+
+    for (unsigned n = 0; n < register_count; ++n)
+    {
+        if ((mask & (1 << n)) == 0) continue;
+
+        Check(queue_write_ap(bank_register(DCB::DCRDR), in[n]));
+        Check(queue_write_ap(bank_register(DCB::DCRSR), DCB::DCRSR_WRITE | n));
+        Check(queue_start_read_ap(bank_register(DCB::DHCSR)));
+        Check(queue_final_read_ap(&dhcsr[n]));
+    }
+
+    return flush();
+}
+
+Error Target::read_registers(uint32_t mask, word_t * out)
+{
+    Metrics::Timer timer(read_registers_time);
+
+    debug(3, "Target::read_registers(%08X, %p)", mask, out);
+
+    if (mask & ~valid_register_mask()) return Err::argument_error;
+
+    uint32_t wanted = mask;
+
+    if (_caching)
+    {
+        for (unsigned n = 0; n < register_count; ++n)
+        {
+            if (wanted & _registers_valid & (1 << n)) out[n] = _registers[n];
+        }
+        wanted &= ~_registers_valid;
+    }
+
+    if (wanted == 0) return Err::success;
+
+    word_t dhcsr[register_count];
+    CheckWait(forget_on_failure(read_register_block(wanted, out, dhcsr)));
+
+    /*
+     * The batch doesn't wait for S_REGRDY before starting the next transfer,
+     * and DCRSR mustn't be written while one is in progress -- so from the
+     * first register that wasn't ready, none of the results can be trusted.
+     */
+    bool retrying = false;
+
+    for (unsigned n = 0; n < register_count; ++n)
+    {
+        if ((wanted & (1 << n)) == 0) continue;
+
+        if (!retrying && (dhcsr[n] & DCB::DHCSR_S_REGRDY) == 0)
+        {
+            debug(3, "Register %u wasn't ready in time; reading it and the "
+                     "rest again", n);
+            retrying = true;
+        }
+
+        if (retrying)
+        {
+            Check(read_register(Register::Number(n), &out[n]));
+        }
+        else if (_caching && (dhcsr[n] & DCB::DHCSR_S_HALT))
+        {
+            _registers[n] = out[n];
+            _registers_valid |= 1 << n;
+        }
+    }
+
+    return Err::success;
+}
+
+Error Target::write_registers(uint32_t mask, word_t const * in)
+{
+    Metrics::Timer timer(write_registers_time);
+
+    debug(3, "Target::write_registers(%08X, %p)", mask, in);
+
+    if (mask & ~valid_register_mask()) return Err::argument_error;
+
+    // If this fails part-way, we don't know what the registers hold.
+    _registers_valid &= ~mask;
+
+    word_t dhcsr[register_count];
+    CheckWait(forget_on_failure(write_register_block(mask, in, dhcsr)));
+
+    /*
+     * As for read_registers: once a register wasn't ready, the DCRDR and
+     * DCRSR writes after it may have landed mid-transfer, so it and every
+     * register after it are written again, one at a time.
+     */
+    bool retrying = false;
+
+    for (unsigned n = 0; n < register_count; ++n)
+    {
+        if ((mask & (1 << n)) == 0) continue;
+
+        if (!retrying && (dhcsr[n] & DCB::DHCSR_S_REGRDY) == 0)
+        {
+            debug(3, "Register %u wasn't ready in time; writing it and the "
+                     "rest again", n);
+            retrying = true;
+        }
+
+        if (retrying)
+        {
+            Check(write_register(Register::Number(n), in[n]));
+        }
+        else if (_caching && (dhcsr[n] & DCB::DHCSR_S_HALT))
+        {
+            _registers[n] = in[n];
+            _registers_valid |= 1 << n;
+        }
+    }
+
     return Err::success;
 }
 
@@ -259,8 +1009,12 @@ Error Target::write_register(Register::Number reg, word_t data)
 
 Error Target::reset_and_halt()
 {
+    Metrics::Timer timer(reset_and_halt_time);
+
     debug(3, "Target::reset_and_halt()");
 
+    forget_core_state();
+
     // Save old DEMCR just in case.
     word_t demcr;
     Check(read_word(DCB::DEMCR, &demcr));
@@ -274,18 +1028,34 @@ Error Target::reset_and_halt()
     Check(write_word(SCB::AIRCR, SCB::AIRCR_VECTKEY | SCB::AIRCR_SYSRESETREQ));
 
     // Wait for the processor to halt.
-    CheckRetry(poll_for_halt(SCB::DFSR_VCATCH), 1000);
+    PollScheduler poll;
+    poll.set_timeout_ms(reset_timeout_ms);
+
+    Error error;
+    while ((error = poll_for_halt(SCB::DFSR_VCATCH)) == Err::try_again
+           && poll.wait()) {}
+
+    Check(error);
 
     // Restore DEMCR.
     Check(write_word(DCB::DEMCR, demcr));
 
+    _known_halted = _caching;
+
     return Err::success;
 }
 
 Error Target::halt()
 {
+    Metrics::Timer timer(halt_time);
+
     debug(3, "Target::halt()");
 
+    if (_caching && _known_halted) return Err::success;
+
+    // If it was running, its registers have changed.
+    forget_core_state();
+
     return write_word(DCB::DHCSR, DCB::DHCSR_DBGKEY
                             | DCB::DHCSR_C_HALT
                             | DCB::DHCSR_C_DEBUGEN);
@@ -293,40 +1063,83 @@ Error Target::halt()
 
 Error Target::poll_for_halt(unsigned dfsr_mask)
 {
+    Metrics::Timer timer(poll_for_halt_time);
+
     word_t dhcsr;
-    Check(read_word(DCB::DHCSR, &dhcsr));
+    Check(forget_on_failure(read_word(DCB::DHCSR, &dhcsr)));
     word_t dfsr;
-    Check(read_word(SCB::DFSR, &dfsr));
+    Check(forget_on_failure(read_word(SCB::DFSR, &dfsr)));
 
     debug(3, "Target::poll_for_halt(%u): DHCSR=%08X DFSR=%08X",
           dfsr_mask, dhcsr, dfsr);
 
-    if ((dhcsr & DCB::DHCSR_S_HALT) && (dfsr & dfsr_mask)) return Err::success;
+    if ((dhcsr & DCB::DHCSR_S_HALT) && (dfsr & dfsr_mask))
+    {
+        _known_halted = _caching;
+        return Err::success;
+    }
 
     return Err::try_again;
 }
 
 Error Target::resume()
 {
+    Metrics::Timer timer(resume_time);
+
     debug(3, "Target::resume()");
+
+    forget_core_state();
+
     return write_word(DCB::DHCSR, DCB::DHCSR_DBGKEY
                                 | 0  // Do not set C_HALT
                                 | DCB::DHCSR_C_DEBUGEN);
 }
 
+Error Target::step()
+{
+    Metrics::Timer timer(step_time);
+
+    debug(3, "Target::step()");
+
+    forget_core_state();
+
+    // C_MASKINTS may only be changed while halted, so it goes in first, on
+    // its own, and C_HALT comes out with C_STEP going in.
+    Check(write_word(DCB::DHCSR, DCB::DHCSR_DBGKEY
+                               | DCB::DHCSR_C_MASKINTS
+                               | DCB::DHCSR_C_HALT
+                               | DCB::DHCSR_C_DEBUGEN));
+    return write_word(DCB::DHCSR, DCB::DHCSR_DBGKEY
+                                | DCB::DHCSR_C_MASKINTS
+                                | DCB::DHCSR_C_STEP
+                                | DCB::DHCSR_C_DEBUGEN);
+}
+
 Error Target::is_halted(bool * flag)
 {
+    Metrics::Timer timer(is_halted_time);
+
     debug(3, "Target::is_halted");
+
+    if (_caching && _known_halted)
+    {
+        *flag = true;
+        return Err::success;
+    }
+
     word_t dhcsr;
-    Check(read_word(DCB::DHCSR, &dhcsr));
+    Check(forget_on_failure(read_word(DCB::DHCSR, &dhcsr)));
 
     *flag = dhcsr & DCB::DHCSR_S_HALT;
+    _known_halted = _caching && *flag;
 
     return Err::success;
 }
 
 Error Target::read_halt_state(word_t * out)
 {
+    Metrics::Timer timer(read_halt_state_time);
+
     debug(3, "Target::read_halt_state(%p)", out);
 
     word_t dfsr;
@@ -339,6 +1152,8 @@ Error Target::read_halt_state(word_t * out)
 
 Error Target::reset_halt_state()
 {
+    Metrics::Timer timer(reset_halt_state_time);
+
     debug(3, "Target::reset_halt_state()");
     return write_word(SCB::DFSR, SCB::DFSR_reason_mask);
 }
@@ -400,3 +1215,123 @@ Error Target::disable_breakpoint(size_t n)
 {
     return write_word(BPU::BP_COMP0 + n, 0);
 }
+
+
+/*******************************************************************************
+ * Watchpoints
+ */
+
+Error Target::get_watchpoint_count(size_t * n)
+{
+    word_t ctrl;
+    Check(read_word(DWT::DWT_CTRL, &ctrl));
+
+    *n = DWT::DWT_CTRL_NUMCOMP.extract(ctrl);
+
+    return Err::success;
+}
+
+Error Target::enable_watchpoint(size_t n,
+                                uint32_t address,
+                                size_t length,
+                                WatchKind kind)
+{
+    if (length == 0 || (length & (length - 1)) || (address & (length - 1)))
+    {
+        return Err::argument_error;
+    }
+
+    word_t mask_bits = 0;
+    while ((size_t(1) << mask_bits) < length) ++mask_bits;
+
+    word_t function;
+    switch (kind)
+    {
+        case watch_read:  function = DWT::DWT_FUNCTION_WATCH_READ;  break;
+        case watch_write: function = DWT::DWT_FUNCTION_WATCH_WRITE; break;
+        default:          function = DWT::DWT_FUNCTION_WATCH_RW;    break;
+    }
+
+    word_t demcr;
+    Check(read_word(DCB::DEMCR, &demcr));
+    if (!(demcr & DCB::DEMCR_DWTENA))
+    {
+        Check(write_word(DCB::DEMCR, demcr | DCB::DEMCR_DWTENA));
+    }
+
+    size_t const offset = n * DWT::DWT_comparator_stride_words;
+
+    // The MASK register holds only as many bits as the part supports; read
+    // it back to find out whether it took.
+    Check(write_word(DWT::DWT_MASK0 + offset, mask_bits));
+    word_t mask_read;
+    Check(read_word(DWT::DWT_MASK0 + offset, &mask_read));
+    if (mask_read != mask_bits) return Err::argument_error;
+
+    Check(write_word(DWT::DWT_COMP0 + offset, address));
+    return write_word(DWT::DWT_FUNCTION0 + offset, function);
+}
+
+Error Target::disable_watchpoint(size_t n)
+{
+    return write_word(DWT::DWT_FUNCTION0 + n * DWT::DWT_comparator_stride_words,
+                      DWT::DWT_FUNCTION_DISABLED);
+}
+
+Error Target::watchpoint_matched(size_t n, bool * matched)
+{
+    word_t function;
+    Check(read_word(DWT::DWT_FUNCTION0 + n * DWT::DWT_comparator_stride_words,
+                    &function));
+
+    *matched = function & DWT::DWT_FUNCTION_MATCHED;
+
+    return Err::success;
+}
+
+Error Target::enable_swo(uint32_t trace_clock_hz,
+                         uint32_t baud,
+                         uint32_t port_mask)
+{
+    if (baud == 0 || trace_clock_hz % baud) return Err::argument_error;
+
+    word_t const prescaler = trace_clock_hz / baud - 1;
+    if (prescaler > TPIU::TPIU_ACPR_max) return Err::argument_error;
+
+    word_t demcr;
+    Check(read_word(DCB::DEMCR, &demcr));
+    if (!(demcr & DCB::DEMCR_DWTENA))
+    {
+        Check(write_word(DCB::DEMCR, demcr | DCB::DEMCR_DWTENA));
+    }
+
+    Check(write_word(ITM::ITM_LAR, ITM::ITM_LAR_KEY));
+
+    // Stop the ITM while the TPIU changes under it.
+    Check(write_word(ITM::ITM_TCR, 0));
+
+    Check(write_word(TPIU::TPIU_CSPSR, 1));  // A port one bit wide.
+    Check(write_word(TPIU::TPIU_ACPR, prescaler));
+    Check(write_word(TPIU::TPIU_SPPR, TPIU::TPIU_SPPR_NRZ));
+    Check(write_word(TPIU::TPIU_FFCR, TPIU::TPIU_FFCR_TRIGIN));
+
+    Check(write_word(ITM::ITM_TPR, 0));  // Unprivileged code may trace too.
+    Check(write_word(ITM::ITM_TCR, ITM::ITM_TCR_BUSID_1
+                                   | ITM::ITM_TCR_SYNCENA
+                                   | ITM::ITM_TCR_ITMENA));
+    Check(write_word(ITM::ITM_TER, port_mask));
+
+    // Without an ITM, none of that took.
+    word_t tcr;
+    Check(read_word(ITM::ITM_TCR, &tcr));
+    if (!(tcr & ITM::ITM_TCR_ITMENA)) return Err::failure;
+
+    return Err::success;
+}
+
+Error Target::disable_swo()
+{
+    Check(write_word(ITM::ITM_LAR, ITM::ITM_LAR_KEY));
+    Check(write_word(ITM::ITM_TER, 0));
+    return write_word(ITM::ITM_TCR, 0);
+}
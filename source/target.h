@@ -30,6 +30,13 @@ class Target
     DebugAccessPort &_dap;  // DAP to wrap.
     uint8_t _mem_ap_index;  // Index of the sole AP used (a MEM-AP); often 0.
 
+    /*
+     * State discovered during initialize
+     */
+
+    ARM::word_t _csw;        // Our usual CSW: 32-bit, single auto-increment.
+    bool _packed_transfers;  // Whether the MEM-AP supports packed transfers.
+
     /*
      * State updated during use
      */
@@ -37,6 +44,43 @@ class Target
     // Contents of Transfer Address Register; base of current memory bank.
     rptr<ARM::word_t> _bank_base;
 
+    /*
+     * Optional cache of core state; see enable_cache.
+     */
+
+    bool _caching;
+
+    // Core registers known since the processor last halted, and which of
+    // them (by bit number) are valid.
+    ARM::word_t _registers[ARM::Register::highest_register_index + 1];
+    uint32_t _registers_valid;
+
+    // Whether the processor is known to be halted.
+    bool _known_halted;
+
+    // Records that the processor may have run, invalidating core state.
+    void forget_core_state();
+
+    // Returns error, first forgetting core state if it's a failure.
+    Err::Error forget_on_failure(Err::Error error);
+
+    // Discovers the MEM-AP's capabilities and sets up CSW and TAR.
+    Err::Error configure_mem_ap();
+
+    /*
+     * Batched equivalents of read_register and write_register for the
+     * registers in mask, used by read_registers and write_registers.  Each
+     * register's DHCSR, read after its transfer, is left in dhcsr so the
+     * caller can check S_REGRDY -- and, from the first register that wasn't
+     * ready, redo the rest one at a time.
+     */
+    Err::Error read_register_block(uint32_t mask,
+                                   ARM::word_t * out,
+                                   ARM::word_t * dhcsr);
+    Err::Error write_register_block(uint32_t mask,
+                                    ARM::word_t const * in,
+                                    ARM::word_t * dhcsr);
+
     // Writes data to a register in AP #0.
     Err::Error write_ap(uint8_t address, ARM::word_t data);
 
@@ -52,6 +96,51 @@ class Target
     // Makes 16 bytes including the given address visible in the MEM-AP.
     Err::Error set_memory_bank(rptr_const<ARM::word_t>);
 
+    /*
+     * Queued equivalents of the above.  See the queued access section of
+     * DebugAccessPort.  flush completes all of them, and forgets _bank_base if
+     * the batch failed.
+     */
+    Err::Error queue_write_ap(uint8_t address, ARM::word_t data);
+    Err::Error queue_start_read_ap(uint8_t address);
+    Err::Error queue_step_read_ap(uint8_t next_address,
+                                  ARM::word_t * last_data);
+    Err::Error queue_final_read_ap(ARM::word_t * data);
+    Err::Error queue_set_memory_bank(rptr_const<ARM::word_t>);
+    Err::Error flush();
+
+    /*
+     * Move a run of words as a single batch.  Like a batch, these may fail
+     * part-way with Err::try_again, and should then be repeated in full.
+     */
+    Err::Error read_block(rptr_const<ARM::word_t> target_addr,
+                          ARM::word_t * host_buffer,
+                          size_t count);
+    Err::Error stream_read_block(rptr_const<ARM::word_t> target_addr,
+                                 ARM::word_t * host_buffer,
+                                 size_t count);
+    Err::Error write_block(ARM::word_t const * host_buffer,
+                           rptr<ARM::word_t> target_addr,
+                           size_t count);
+    Err::Error stream_write_block(ARM::word_t const * host_buffer,
+                                  rptr<ARM::word_t> target_addr,
+                                  size_t count);
+
+    // One batch of sample_word.
+    Err::Error sample_block(rptr_const<ARM::word_t> target_addr,
+                            ARM::word_t * samples,
+                            size_t count);
+
+    /*
+     * Writes count units of the given size (1 or 2 bytes) using accesses of
+     * that size, packing them into whole-word transfers when the MEM-AP
+     * allows.  Restores the usual CSW before returning, even on failure.
+     */
+    Err::Error narrow_write_block(void const * host_buffer,
+                                  uint32_t target_addr,
+                                  size_t size,
+                                  size_t count);
+
 public:
     Target(SWDDriver &, DebugAccessPort &, uint8_t mem_ap_index);
 
@@ -65,6 +154,30 @@ public:
      */
     Err::Error initialize(bool enable_debugging = true);
 
+    /*
+     * Turns caching of core state on or off.  It starts off.
+     *
+     * While the processor is halted nothing changes its registers but us, so
+     * a debugger that keeps asking for the same ones can be answered without
+     * going to the target.  With caching on, Target remembers registers read
+     * or written while halted, and remembers that the processor is halted
+     * once it has seen it halt.  Both are forgotten when Target resumes,
+     * halts, or resets the processor, or when a register access or a look at
+     * DHCSR fails.  The CSW and TAR settings discovered by initialize are
+     * also kept across later calls to initialize.  (For the AP registers
+     * themselves, see DebugAccessPort::enable_cache.)
+     *
+     * Anything that runs or resets the processor without going through Target
+     * -- such as SWDDriver::enter_reset -- must be followed by a call to
+     * invalidate_cache.
+     */
+    void enable_cache(bool);
+
+    /*
+     * Forgets all cached state, including the CSW and TAR settings.
+     */
+    void invalidate_cache();
+
     /*
      * Reads some number of 32-bit words from the target into memory on the
      * host.
@@ -77,6 +190,9 @@ public:
      * host.
      *
      * count gives the number of words -- not bytes! -- to transfer.
+     *
+     * Longer reads stream through the MEM-AP's auto-incrementing DRW
+     * register, at a cost of about one SWD transfer per word.
      */
     Err::Error read_words(rptr_const<ARM::word_t> target_addr,
                           ARM::word_t * host_buffer,
@@ -89,6 +205,25 @@ public:
     Err::Error read_word(rptr_const<ARM::word_t> target_addr,
                          ARM::word_t * host_buffer);
 
+    /*
+     * Reads count bytes from any address, using whole-word reads of the words
+     * that contain them.  Suits RAM, not peripherals that mind being read.
+     */
+    Err::Error read_bytes(rptr_const<ARM::byte_t> target_addr,
+                          ARM::byte_t * host_buffer,
+                          size_t count);
+
+    /*
+     * Reads the same word count times, for registers that change by
+     * themselves, like DWT_PCSR.  Each sample costs one SWD read, and a batch
+     * of them one USB round trip, so samples come as fast as the link allows
+     * -- evenly spaced within a batch, with a round trip's gap between
+     * batches.
+     */
+    Err::Error sample_word(rptr_const<ARM::word_t> target_addr,
+                           ARM::word_t * samples,
+                           size_t count);
+
     /*
      * Reads some number of 32-bit words from the target into memory on the
      * host.
@@ -101,6 +236,8 @@ public:
      * This is a byte address and must be word-aligned.
      *
      * count gives the number of words -- not bytes! -- to transfer.
+     *
+     * Like read_words, longer writes stream through DRW.
      */
     Err::Error write_words(ARM::word_t const * host_buffer,
                            rptr<ARM::word_t> target_addr,
@@ -112,6 +249,22 @@ public:
      */
     Err::Error write_word(rptr<ARM::word_t> target_addr, ARM::word_t data);
 
+    /*
+     * Variants of write_words that use 16- and 8-bit accesses, for memory or
+     * peripherals that insist on them.  When the MEM-AP supports packed
+     * transfers, each SWD transfer carries a full word of halfwords or bytes;
+     * otherwise each carries a single one.
+     *
+     * target_addr must be aligned to the access size.
+     */
+    Err::Error write_halfwords(ARM::halfword_t const * host_buffer,
+                               rptr<ARM::halfword_t> target_addr,
+                               size_t count);
+
+    Err::Error write_bytes(ARM::byte_t const * host_buffer,
+                           rptr<ARM::byte_t> target_addr,
+                           size_t count);
+
     /*
      * Reads the contents of one of the processor's core or special-purpose
      * registers.  This will only work when the processor is halted.
@@ -124,6 +277,31 @@ public:
      */
     Err::Error write_register(ARM::Register::Number, ARM::word_t);
 
+    /*
+     * Size of the arrays used by read_registers and write_registers: one
+     * entry for each register number, including the unused ones.
+     */
+    static size_t const register_count =
+        ARM::Register::highest_register_index + 1;
+
+    /*
+     * Reads several core or special-purpose registers at once.  Bit n of mask
+     * selects register number n, which is written to out[n]; out must have
+     * register_count entries.  Other entries are left alone.
+     *
+     * All the transfers go to the target in a single batch.  Each register's
+     * transfer is checked for completion afterwards, and any that the
+     * processor hadn't finished are repeated with read_register.  This will
+     * only work when the processor is halted.
+     */
+    Err::Error read_registers(uint32_t mask, ARM::word_t * out);
+
+    /*
+     * Writes several core or special-purpose registers at once: register n,
+     * for each bit n set in mask, gets in[n].  Works like read_registers.
+     */
+    Err::Error write_registers(uint32_t mask, ARM::word_t const * in);
+
     /*
      * Overload of write_register that allows rptrs to be used directly.
      */
@@ -170,6 +348,14 @@ public:
      */
     Err::Error resume();
 
+    /*
+     * Executes a single instruction on the halted processor, with interrupts
+     * masked, and leaves it halted again.  Use poll_for_halt or is_halted to
+     * see that the step has completed; it usually has by the time this
+     * returns.
+     */
+    Err::Error step();
+
     /*
      * Checks whether the processor is halted.
      */
@@ -219,6 +405,63 @@ public:
      * Disables a hardware breakpoint.
      */
     Err::Error disable_breakpoint(size_t bp);
+
+    /*
+     * The accesses a watchpoint can halt the processor on.
+     */
+    enum WatchKind
+    {
+        watch_read,
+        watch_write,
+        watch_access
+    };
+
+    /*
+     * Determines how many DWT comparators the target has for watchpoints.
+     */
+    Err::Error get_watchpoint_count(size_t *);
+
+    /*
+     * Enables a watchpoint on the length bytes at address, turning on the DWT
+     * if need be.  length must be a power of two, and address a multiple of
+     * it.  Some parts limit how large a range one comparator can cover;
+     * a range it can't is reported as Err::argument_error.
+     */
+    Err::Error enable_watchpoint(size_t wp,
+                                 uint32_t address,
+                                 size_t length,
+                                 WatchKind);
+
+    /*
+     * Disables a watchpoint.
+     */
+    Err::Error disable_watchpoint(size_t wp);
+
+    /*
+     * Checks whether a watchpoint has matched since this was last asked.
+     * Asking clears it.
+     */
+    Err::Error watchpoint_matched(size_t wp, bool *);
+
+    /*
+     * Sends the ITM's packets out of the SWO pin, as NRZ (UART) data at baud,
+     * and enables the stimulus ports in port_mask (bit n for port n).  The
+     * TPIU divides trace_clock_hz -- on most parts, the processor clock --
+     * down to baud; if it can't exactly, this returns Err::argument_error.
+     * Parts without an ITM, like ARMv6-M ones, return Err::failure.
+     *
+     * The processor can keep running throughout.  Some parts also need the
+     * SWO pin and the trace clock turned on in their own registers, which is
+     * left to the firmware.
+     */
+    Err::Error enable_swo(uint32_t trace_clock_hz,
+                          uint32_t baud,
+                          uint32_t port_mask);
+
+    /*
+     * Turns the ITM back off.
+     */
+    Err::Error disable_swo();
 };
 
 #endif  // TARGET_H
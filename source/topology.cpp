@@ -0,0 +1,165 @@
+#include "topology.h"
+
+#include "libs/error/error_stack.h"
+#include "libs/log/log_default.h"
+
+#include <string>
+
+#define __STDC_FORMAT_MACROS
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+using Err::Error;
+using namespace Log;
+
+/*
+ * The cache is a text file.  Each topology starts with a line
+ *   topology <idcode> <base>
+ * followed by one line per component:
+ *   component <address> <depth> <class> <peripheral id> <size>
+ * all in hex but the depth and size.
+ */
+
+static bool parse_header(char const * line, uint32_t * idcode, uint32_t * base)
+{
+    return sscanf(line, "topology %"SCNx32" %"SCNx32, idcode, base) == 2;
+}
+
+static bool parse_component(char const * line, Component * component)
+{
+    unsigned component_class;
+
+    if (sscanf(line, "component %"SCNx32" %u %x %"SCNx64" %"SCNu32,
+               &component->address,
+               &component->depth,
+               &component_class,
+               &component->peripheral_id,
+               &component->size_bytes) != 5) return false;
+
+    component->component_class = component_class;
+    return true;
+}
+
+/*
+ * Reads every line of the file at path.  A missing file has no lines.
+ */
+static Error read_lines(char const * path, std::vector<std::string> * lines)
+{
+    FILE * file = fopen(path, "r");
+
+    if (!file)
+    {
+        CheckStringB(errno == ENOENT,
+                     "Can't read %s: %s", path, strerror(errno));
+        return Err::success;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\n")] = 0;
+        lines->push_back(line);
+    }
+
+    fclose(file);
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * Topology implementation
+ */
+
+Error Topology::load(char const * path, bool * found)
+{
+    *found = false;
+
+    std::vector<std::string> lines;
+    Check(read_lines(path, &lines));
+
+    std::vector<Component> loaded;
+    bool in_section = false;
+
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        uint32_t line_idcode, line_base;
+        Component component;
+
+        if (parse_header(lines[i].c_str(), &line_idcode, &line_base))
+        {
+            if (in_section) break;
+            in_section = (line_idcode == idcode && line_base == base);
+        }
+        else if (in_section)
+        {
+            CheckStringB(parse_component(lines[i].c_str(), &component),
+                         "Bad line %zu in %s", i + 1, path);
+            loaded.push_back(component);
+        }
+    }
+
+    if (!in_section) return Err::success;
+
+    debug(1, "Loaded %zu components for IDCODE %08X, BASE %08X from %s",
+          loaded.size(),
+          idcode,
+          base,
+          path);
+
+    components.swap(loaded);
+    *found = true;
+
+    return Err::success;
+}
+
+Error Topology::save(char const * path) const
+{
+    std::vector<std::string> lines;
+    Check(read_lines(path, &lines));
+
+    std::string temp_path(path);
+    temp_path += ".tmp";
+
+    FILE * file = fopen(temp_path.c_str(), "w");
+    CheckStringB(file, "Can't write %s: %s", temp_path.c_str(), strerror(errno));
+
+    // Keep the other topologies.
+    bool skipping = false;
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        uint32_t line_idcode, line_base;
+
+        if (parse_header(lines[i].c_str(), &line_idcode, &line_base))
+        {
+            skipping = (line_idcode == idcode && line_base == base);
+        }
+
+        if (!skipping) fprintf(file, "%s\n", lines[i].c_str());
+    }
+
+    fprintf(file, "topology %08"PRIX32" %08"PRIX32"\n", idcode, base);
+
+    for (size_t i = 0; i < components.size(); ++i)
+    {
+        Component const & c = components[i];
+
+        fprintf(file, "component %08"PRIX32" %u %X %016"PRIX64" %"PRIu32"\n",
+                c.address,
+                c.depth,
+                unsigned(c.component_class),
+                c.peripheral_id,
+                c.size_bytes);
+    }
+
+    bool const written = (fclose(file) == 0);
+
+    CheckStringB(written && rename(temp_path.c_str(), path) == 0,
+                 "Can't write %s: %s", path, strerror(errno));
+
+    debug(1, "Saved %zu components to %s", components.size(), path);
+
+    return Err::success;
+}
@@ -0,0 +1,52 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+/*
+ * The CoreSight components found behind a MEM-AP by walking its ROM tables.
+ *
+ * The walk costs a few hundred SWD transfers, so a Topology can be saved to a
+ * cache file and loaded again by later runs -- of swdprobe or any other tool
+ * -- that see the same DP IDCODE and MEM-AP BASE.  One file can hold the
+ * topologies of several kinds of board.
+ */
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+struct Component
+{
+    uint32_t address;          // Of the component's last (or only) 4KB block.
+    unsigned depth;            // ROM table nesting; zero at the top.
+    uint8_t  component_class;  // From CID1: 0x1 is a ROM table.
+    uint64_t peripheral_id;    // PID0-PID7, PID0 in the low byte.
+    uint32_t size_bytes;
+};
+
+struct Topology
+{
+    uint32_t idcode;
+    uint32_t base;
+    std::vector<Component> components;
+
+    Topology() : idcode(0), base(0) {}
+
+    /*
+     * Looks in the cache file at path for a topology with our idcode and
+     * base, and if there is one, replaces our components with it.  A missing
+     * file is simply a miss.
+     */
+    Err::Error load(char const * path, bool * found);
+
+    /*
+     * Writes our components to the cache file at path, replacing any topology
+     * it held for the same idcode and base, and keeping any others.
+     */
+    Err::Error save(char const * path) const;
+};
+
+#endif  // TOPOLOGY_H